@@ -0,0 +1,158 @@
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "imbatracer/bench/bench_rays.h"
+#include "imbatracer/frontend/build_scene.h"
+
+using namespace imba;
+
+/// Compares the BVH builders on a set of scenes: every scene is built with each builder, through the CPU adapter and
+/// optionally the GPU adapter, ignoring the builders and the BVH files of the scene file. The build time, the size and
+/// the SAH cost of the trees are reported, along with the traversal performance on the ray sets of BenchRays.
+
+namespace {
+
+struct BenchSettings {
+    std::vector<std::string> scene_files;
+    int width = 1024;
+    int height = 1024;
+    float fov = 60.0f;
+    int repeat = 3;
+    int queue_size = 1 << 16;
+    bool cpu = true;
+    bool gpu = false;
+};
+
+void print_help() {
+    std::cout << "Usage: bench_bvh [options] file..." << std::endl
+              << "Available options:" << std::endl
+              << "    -w      --width       Sets the width of the camera (default: 1024)" << std::endl
+              << "    -h      --height      Sets the height of the camera (default: 1024)" << std::endl
+              << "    -f      --fov         Sets the field of view of the camera (default: 60)" << std::endl
+              << "    -r      --repeat      Number of times every set of rays is traversed (default: 3)" << std::endl
+              << "    -q      --queue-size  Size of the queues used for traversal (default: 65536)" << std::endl
+              << "            --gpu         Also builds and benchmarks the trees of the GPU adapter" << std::endl
+              << "            --gpu-only    Only builds and benchmarks the trees of the GPU adapter" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], BenchSettings& settings) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if ((arg == "-w" || arg == "--width") && has_value) {
+            settings.width = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-h" || arg == "--height") && has_value) {
+            settings.height = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-f" || arg == "--fov") && has_value) {
+            settings.fov = std::strtof(argv[++i], nullptr);
+        } else if ((arg == "-r" || arg == "--repeat") && has_value) {
+            settings.repeat = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-q" || arg == "--queue-size") && has_value) {
+            settings.queue_size = std::strtol(argv[++i], nullptr, 10);
+        } else if (arg == "--gpu") {
+            settings.gpu = true;
+        } else if (arg == "--gpu-only") {
+            settings.cpu = false;
+            settings.gpu = true;
+        } else if (arg == "--help") {
+            print_help();
+            return false;
+        } else if (arg[0] == '-') {
+            std::cout << "Invalid argument '" << arg << "'" << std::endl;
+            print_help();
+            return false;
+        } else {
+            settings.scene_files.push_back(arg);
+        }
+    }
+
+    if (settings.scene_files.empty()) {
+        std::cout << "No scene file given" << std::endl;
+        print_help();
+        return false;
+    }
+
+    if (settings.width <= 0 || settings.height <= 0 || settings.repeat <= 0 || settings.queue_size <= 0) {
+        std::cout << "The size of the camera, the number of repetitions and the queue size must be positive" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// Prints the statistics of the trees of one adapter, and the traversal performance.
+template <typename ClosestFn, typename OccludedFn>
+void report(const char* builder, const Scene& scene, const BenchRays& rays, const BenchSettings& settings, bool gpu,
+            ClosestFn closest, OccludedFn occluded) {
+    // The meshes are built concurrently, so the build time is the sum of the times of the meshes.
+    long build_time_ms = 0;
+    int nodes = 0, prims = 0;
+    double sah_cost = 0.0;
+    for (auto& stats : scene.mesh_accel_stats(gpu)) {
+        build_time_ms += stats.build_time_ms;
+        nodes += stats.node_count;
+        prims += stats.prim_count;
+        sah_cost += double(stats.sah_cost) * stats.prim_count;
+    }
+
+    const BvhStats& top = scene.top_level_accel_stats(gpu);
+
+    std::cout << std::left << std::setw(6) << builder
+              << std::setw(5) << (gpu ? "gpu" : "cpu")
+              << "build " << std::setw(8) << build_time_ms << "ms  "
+              << "nodes " << std::setw(10) << nodes
+              << std::fixed << std::setprecision(2)
+              << "sah " << std::setw(8) << (prims > 0 ? sah_cost / prims : 0.0)
+              << "top sah " << std::setw(8) << top.sah_cost
+              << "primary " << std::setw(8) << BenchRays::mrays_per_sec(rays.primary, settings.queue_size, gpu, settings.repeat, closest)
+              << "shadow " << std::setw(8) << BenchRays::mrays_per_sec(rays.shadow, settings.queue_size, gpu, settings.repeat, occluded)
+              << "incoherent " << std::setw(8) << BenchRays::mrays_per_sec(rays.incoherent, settings.queue_size, gpu, settings.repeat, closest)
+              << "Mrays/s" << std::endl;
+}
+
+bool bench_scene(const std::string& file, BvhBuilderType builder, const BenchSettings& settings) {
+    Scene scene(settings.cpu, settings.gpu);
+    float3 cam_pos, cam_dir, cam_up;
+    if (!build_scene(Path(file), scene, cam_pos, cam_dir, cam_up, builder, "", true)) {
+        std::cerr << "ERROR: Scene " << file << " could not be built" << std::endl;
+        return false;
+    }
+
+    PerspectiveCamera cam(settings.width, settings.height, settings.fov);
+    cam.move(cam_pos, cam_dir, cam_up);
+    const BenchRays rays(scene, cam, settings.width, settings.height);
+
+    const char* name = builder == BVH_BUILDER_FAST ? "fast" : "sbvh";
+    if (settings.cpu) {
+        report(name, scene, rays, settings, false,
+               [&] (BenchRays::Queue& q) { q.traverse_cpu(scene.traversal_data_cpu()); },
+               [&] (BenchRays::Queue& q) { q.traverse_occluded_cpu(scene.traversal_data_cpu()); });
+    }
+    if (settings.gpu) {
+        report(name, scene, rays, settings, true,
+               [&] (BenchRays::Queue& q) { q.traverse_gpu(scene.traversal_data_gpu()); },
+               [&] (BenchRays::Queue& q) { q.traverse_occluded_gpu(scene.traversal_data_gpu()); });
+    }
+
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchSettings settings;
+    if (!parse_args(argc, argv, settings))
+        return 1;
+
+    bool ok = true;
+    for (auto& file : settings.scene_files) {
+        std::cout << "== " << file << std::endl;
+        ok &= bench_scene(file, BVH_BUILDER_SBVH, settings);
+        ok &= bench_scene(file, BVH_BUILDER_FAST, settings);
+    }
+
+    return ok ? 0 : 1;
+}
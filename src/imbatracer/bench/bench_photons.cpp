@@ -0,0 +1,264 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "imbatracer/bench/bench_rays.h"
+#include "imbatracer/frontend/build_scene.h"
+#include "imbatracer/render/integrators/light_vertices.h"
+
+using namespace imba;
+
+/// Measures the photon range search of VCM and PPM in isolation. The light vertices are synthesized by tracing light
+/// paths from the lights of the scene, with bounces in random directions, and the queries are made at the first hits
+/// of the camera rays, like the merges of an iteration of VCM. The HashGrid and the KdTree are built for several
+/// radii, given relative to the size of a pixel at the first hits, and queried with several numbers of nearest photons.
+
+namespace {
+
+struct BenchSettings {
+    std::string scene_file;
+    int width = 512;
+    int height = 512;
+    float fov = 60.0f;
+    int repeat = 3;
+    int path_count = 0;         ///< Number of light paths, one per pixel if zero, as in VCM
+    int path_length = 4;        ///< Maximum number of vertices per light path
+    std::vector<float> radius_factors = { 1.0f, 2.0f, 4.0f };
+    std::vector<int> knn = { 0, 10, 50 };
+};
+
+void print_help() {
+    std::cout << "Usage: bench_photons [options] file" << std::endl
+              << "Available options:" << std::endl
+              << "    -w      --width       Sets the width of the camera (default: 512)" << std::endl
+              << "    -h      --height      Sets the height of the camera (default: 512)" << std::endl
+              << "    -f      --fov         Sets the field of view of the camera (default: 60)" << std::endl
+              << "    -r      --repeat      Number of times every build and set of queries is run (default: 3)" << std::endl
+              << "    -p      --paths       Number of light paths (default: one per pixel)" << std::endl
+              << "    -l      --length      Maximum number of vertices per light path (default: 4)" << std::endl
+              << "            --radius      Adds a radius, relative to the size of a pixel, replaces the defaults (1, 2, 4)" << std::endl
+              << "    -k      --nearest     Adds a number of nearest photons, 0 for all the photons in the radius," << std::endl
+              << "                          replaces the defaults (0, 10, 50)" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], BenchSettings& settings) {
+    bool radius_given = false, knn_given = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if ((arg == "-w" || arg == "--width") && has_value) {
+            settings.width = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-h" || arg == "--height") && has_value) {
+            settings.height = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-f" || arg == "--fov") && has_value) {
+            settings.fov = std::strtof(argv[++i], nullptr);
+        } else if ((arg == "-r" || arg == "--repeat") && has_value) {
+            settings.repeat = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-p" || arg == "--paths") && has_value) {
+            settings.path_count = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-l" || arg == "--length") && has_value) {
+            settings.path_length = std::strtol(argv[++i], nullptr, 10);
+        } else if (arg == "--radius" && has_value) {
+            if (!radius_given) settings.radius_factors.clear();
+            radius_given = true;
+            settings.radius_factors.push_back(std::strtof(argv[++i], nullptr));
+        } else if ((arg == "-k" || arg == "--nearest") && has_value) {
+            if (!knn_given) settings.knn.clear();
+            knn_given = true;
+            settings.knn.push_back(std::strtol(argv[++i], nullptr, 10));
+        } else if (arg == "--help") {
+            print_help();
+            return false;
+        } else if (arg[0] == '-' || !settings.scene_file.empty()) {
+            std::cout << "Invalid argument '" << arg << "'" << std::endl;
+            print_help();
+            return false;
+        } else {
+            settings.scene_file = arg;
+        }
+    }
+
+    if (settings.scene_file.empty()) {
+        std::cout << "No scene file given" << std::endl;
+        print_help();
+        return false;
+    }
+
+    if (settings.width <= 0 || settings.height <= 0 || settings.repeat <= 0 || settings.path_count < 0 || settings.path_length <= 0) {
+        std::cout << "The size of the camera, the number of repetitions and the length of the paths must be positive" << std::endl;
+        return false;
+    }
+
+    for (auto r : settings.radius_factors) {
+        if (r <= 0.0f) {
+            std::cout << "The radii must be positive" << std::endl;
+            return false;
+        }
+    }
+
+    for (auto k : settings.knn) {
+        if (k < 0) {
+            std::cout << "The numbers of nearest photons cannot be negative" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Traces light paths from the lights of the scene and returns their vertices. The lights are selected uniformly, as
+/// in VCM, and the paths bounce in random directions away from the surfaces they hit.
+std::vector<LightPathVertex> light_vertices(const Scene& scene, int path_count, int path_length) {
+    std::vector<LightPathVertex> vertices;
+    if (scene.light_count() == 0) return vertices;
+
+    std::vector<Ray> rays(path_count);
+    for (int i = 0; i < path_count; ++i) {
+        Sampler rng(SampleSequence::RANDOM, i, 0x6A09E667);
+        const int light = rng.random_int(0, scene.light_count());
+        const Light::EmitSample sample = scene.light(light)->sample_emit(rng);
+        rays[i] = Ray {
+            { sample.pos.x, sample.pos.y, sample.pos.z, 1e-3f },
+            { sample.dir.x, sample.dir.y, sample.dir.z, FLT_MAX }
+        };
+    }
+
+    RNG rng(0x3C6EF372);
+    std::vector<Hit> hits;
+    for (int bounce = 0; bounce < path_length && !rays.empty(); ++bounce) {
+        BenchRays::traverse_closest(scene, rays, hits);
+
+        std::vector<Ray> next;
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (hits[i].tri_id < 0) continue;
+
+            LightPathVertex v;
+            v.pos = BenchRays::hit_pos(rays[i], hits[i]);
+            v.out_dir = float3(-rays[i].dir.x, -rays[i].dir.y, -rays[i].dir.z);
+            v.throughput = rgb(1.0f);
+            v.path_length = bounce + 1;
+            v.dVC = v.dVCM = v.dVM = 1.0f;
+            vertices.push_back(v);
+
+            // Continue on the side of the surface the path came from.
+            float3 dir = sample_uniform_sphere(rng.random_float(), rng.random_float()).dir;
+            if (dot(dir, v.out_dir) < 0.0f) dir = -dir;
+            const float offset = 1e-3f * hits[i].tmax;
+            next.push_back(Ray {
+                { v.pos.x, v.pos.y, v.pos.z, offset },
+                { dir.x, dir.y, dir.z, FLT_MAX }
+            });
+        }
+        rays.swap(next);
+    }
+
+    return vertices;
+}
+
+template <typename F>
+double best_time(int repeat, F f) {
+    double best = DBL_MAX;
+    for (int i = 0; i < repeat; ++i) {
+        const auto start = std::chrono::high_resolution_clock::now();
+        f();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    return best;
+}
+
+/// Builds the acceleration structure for every radius and runs the queries for every number of nearest photons.
+template <typename Accel>
+void bench(const char* name, std::vector<LightPathVertex>& vertices, const std::vector<float3>& queries,
+           float pixel_size, const BenchSettings& settings) {
+    Accel accel;
+    for (auto factor : settings.radius_factors) {
+        const float radius = factor * pixel_size;
+        const double build = best_time(settings.repeat, [&] { accel.build(vertices.begin(), vertices.end(), radius); });
+
+        std::cout << std::left << std::setw(10) << name
+                  << "radius " << std::setw(6) << factor
+                  << std::fixed << std::setprecision(2)
+                  << "build " << std::setw(10) << build * 1000.0 << "ms" << std::endl;
+
+        for (auto k : settings.knn) {
+            // The queries run concurrently, like the merges of the rendering threads.
+            std::atomic<long> found(0);
+            const double query = best_time(settings.repeat, [&] {
+                found = 0;
+                tbb::parallel_for(tbb::blocked_range<int>(0, queries.size()), [&] (const tbb::blocked_range<int>& range) {
+                    long count = 0;
+                    if (k > 0) {
+                        auto photons = V_ARRAY(const VCMPhoton*, k);
+                        for (int i = range.begin(); i != range.end(); ++i)
+                            count += accel.query(queries[i], photons, k);
+                    } else {
+                        for (int i = range.begin(); i != range.end(); ++i)
+                            accel.for_each_in_radius(queries[i], [&] (const VCMPhoton&, float) { count++; });
+                    }
+                    found += count;
+                });
+            });
+
+            std::cout << "    " << (k > 0 ? "knn " + std::to_string(k) : std::string("all")) << std::setw(8) << ""
+                      << std::fixed << std::setprecision(2)
+                      << "queries " << std::setw(10) << queries.size() * 1e-6 / query << "M/s  "
+                      << "photons per query " << double(found) / queries.size() << std::endl;
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchSettings settings;
+    if (!parse_args(argc, argv, settings))
+        return 1;
+
+    Scene scene(true, false);
+    float3 cam_pos, cam_dir, cam_up;
+    if (!build_scene(Path(settings.scene_file), scene, cam_pos, cam_dir, cam_up)) {
+        std::cerr << "ERROR: Scene could not be built" << std::endl;
+        return 1;
+    }
+
+    PerspectiveCamera cam(settings.width, settings.height, settings.fov);
+    cam.move(cam_pos, cam_dir, cam_up);
+    const BenchRays rays(scene, cam, settings.width, settings.height);
+
+    // The radii are given relative to the average distance between the first hits of neighbouring pixels.
+    std::vector<float3> queries;
+    double depth_sum = 0.0;
+    for (size_t i = 0; i < rays.primary.size(); ++i) {
+        if (rays.primary_hits[i].tri_id < 0) continue;
+        queries.push_back(BenchRays::hit_pos(rays.primary[i], rays.primary_hits[i]));
+        depth_sum += rays.primary_hits[i].tmax;
+    }
+
+    if (queries.empty()) {
+        std::cout << "The camera does not see the scene" << std::endl;
+        return 1;
+    }
+
+    const float pixel_angle = 2.0f * std::tan(settings.fov * 0.5f * pi / 180.0f) / settings.height;
+    const float pixel_size = depth_sum / queries.size() * pixel_angle;
+
+    const int path_count = settings.path_count > 0 ? settings.path_count : settings.width * settings.height;
+    auto vertices = light_vertices(scene, path_count, settings.path_length);
+    if (vertices.empty()) {
+        std::cout << "No light vertices were generated, the scene must have lights" << std::endl;
+        return 1;
+    }
+
+    std::cout << vertices.size() << " light vertices from " << path_count << " paths, "
+              << queries.size() << " queries, pixel size " << pixel_size << std::endl;
+
+    bench<HashGrid<PhotonIterator, VCMPhoton>>("hashgrid", vertices, queries, pixel_size, settings);
+    bench<KdTree<PhotonIterator, VCMPhoton>>("kdtree", vertices, queries, pixel_size, settings);
+
+    return 0;
+}
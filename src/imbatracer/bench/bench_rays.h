@@ -0,0 +1,151 @@
+#ifndef IMBA_BENCH_RAYS_H
+#define IMBA_BENCH_RAYS_H
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <vector>
+
+#include "imbatracer/render/random.h"
+#include "imbatracer/render/scene.h"
+#include "imbatracer/render/scheduling/ray_queue.h"
+#include "imbatracer/render/ray_gen/camera.h"
+
+namespace imba {
+
+/// Fixed sets of rays used to measure the traversal performance, independently of the shading and the scheduling:
+/// the primary rays of a camera, shadow rays from their hits to random points in the scene, and incoherent rays in
+/// random directions from the same hits. The sets only depend on the scene and the camera.
+struct BenchRays {
+    struct State {
+        int ray_id;
+    };
+
+    typedef RayQueue<State> Queue;
+
+    std::vector<Ray> primary;
+    std::vector<Hit> primary_hits;
+    std::vector<Ray> shadow;
+    std::vector<Ray> incoherent;
+
+    /// Generates the ray sets. The primary rays are traversed on the CPU if the scene has CPU buffers, on the GPU
+    /// otherwise, to find the origins of the other sets.
+    BenchRays(const Scene& scene, const PerspectiveCamera& cam, int width, int height) {
+        primary = primary_rays(cam, width, height);
+        traverse_closest(scene, primary, primary_hits);
+        shadow = shadow_rays(primary, primary_hits, scene.bounding_sphere());
+        incoherent = incoherent_rays(primary, primary_hits);
+    }
+
+    /// Finds the closest hits of the rays, on the CPU if the scene has CPU buffers, on the GPU otherwise.
+    static void traverse_closest(const Scene& scene, const std::vector<Ray>& rays, std::vector<Hit>& hits) {
+        const int queue_size = 1 << 18;
+        if (scene.has_cpu_buffers())
+            traverse(rays, queue_size, false, [&] (Queue& q) { q.traverse_cpu(scene.traversal_data_cpu()); }, &hits);
+        else
+            traverse(rays, queue_size, true, [&] (Queue& q) { q.traverse_gpu(scene.traversal_data_gpu()); }, &hits);
+    }
+
+    /// Traverses the rays in batches of the given size, and returns the time spent in the traversal, in seconds.
+    /// The hits of the rays are stored in the given array, if any.
+    template <typename TraverseFn>
+    static double traverse(const std::vector<Ray>& rays, int queue_size, bool gpu, TraverseFn traverse_fn,
+                           std::vector<Hit>* hits = nullptr) {
+        const int count = rays.size();
+        const int batch = std::min(queue_size, count);
+        Queue queue(batch, gpu);
+        std::vector<State> states(batch);
+        for (int i = 0; i < batch; ++i) states[i].ray_id = i;
+
+        if (hits) hits->resize(count);
+
+        std::chrono::high_resolution_clock::duration time(0);
+        for (int first = 0; first < count; first += batch) {
+            const int n = std::min(batch, count - first);
+            queue.clear();
+            queue.push(rays.begin() + first, rays.begin() + first + n, states.begin(), states.begin() + n);
+
+            const auto start = std::chrono::high_resolution_clock::now();
+            traverse_fn(queue);
+            time += std::chrono::high_resolution_clock::now() - start;
+
+            if (hits) {
+                for (int i = 0; i < n; ++i)
+                    (*hits)[first + queue.state(i).ray_id] = queue.hit(i);
+            }
+        }
+
+        return std::chrono::duration<double>(time).count();
+    }
+
+    /// Returns the best number of rays traversed per second, in millions, over the given number of runs.
+    /// The first run is not measured, it warms up the caches and the device.
+    template <typename TraverseFn>
+    static double mrays_per_sec(const std::vector<Ray>& rays, int queue_size, bool gpu, int repeat, TraverseFn traverse_fn) {
+        traverse(rays, queue_size, gpu, traverse_fn);
+
+        double best = DBL_MAX;
+        for (int i = 0; i < repeat; ++i)
+            best = std::min(best, traverse(rays, queue_size, gpu, traverse_fn));
+        return rays.size() * 1e-6 / best;
+    }
+
+    /// Position of the hit of a ray, or its origin if nothing was hit.
+    static float3 hit_pos(const Ray& ray, const Hit& hit) {
+        const float t = hit.tri_id >= 0 ? hit.tmax : 0.0f;
+        return float3(ray.org.x + ray.dir.x * t, ray.org.y + ray.dir.y * t, ray.org.z + ray.dir.z * t);
+    }
+
+private:
+    static std::vector<Ray> primary_rays(const PerspectiveCamera& cam, int width, int height) {
+        const int count = width * height;
+        std::vector<float> xs(count), ys(count);
+        RNG rng(0x2545F491);
+        for (int i = 0; i < count; ++i) {
+            xs[i] = i % width + rng.random_float();
+            ys[i] = i / width + rng.random_float();
+        }
+
+        std::vector<Ray> rays(count);
+        cam.generate_rays(count, xs.data(), ys.data(), rays.data());
+        return rays;
+    }
+
+    static std::vector<Ray> shadow_rays(const std::vector<Ray>& primary, const std::vector<Hit>& hits, const BSphere& sphere) {
+        std::vector<Ray> rays(primary.size());
+        RNG rng(0x7F4A7C15);
+        for (size_t i = 0; i < primary.size(); ++i) {
+            const float3 org = hit_pos(primary[i], hits[i]);
+            const float3 target = sphere.center + sample_uniform_sphere(rng.random_float(), rng.random_float()).dir *
+                                                  (sphere.radius * rng.random_float());
+            const float3 d = target - org;
+            const float dist = length(d);
+            const float3 dir = dist > 0.0f ? d * (1.0f / dist) : float3(0.0f, 1.0f, 0.0f);
+            const float offset = 1e-3f * dist;
+            rays[i] = Ray {
+                { org.x, org.y, org.z, offset },
+                { dir.x, dir.y, dir.z, dist - offset }
+            };
+        }
+        return rays;
+    }
+
+    static std::vector<Ray> incoherent_rays(const std::vector<Ray>& primary, const std::vector<Hit>& hits) {
+        std::vector<Ray> rays(primary.size());
+        RNG rng(0x1B873593);
+        for (size_t i = 0; i < primary.size(); ++i) {
+            const float3 org = hit_pos(primary[i], hits[i]);
+            const float3 dir = sample_uniform_sphere(rng.random_float(), rng.random_float()).dir;
+            const float offset = hits[i].tri_id >= 0 ? 1e-3f * hits[i].tmax : 0.0f;
+            rays[i] = Ray {
+                { org.x, org.y, org.z, offset },
+                { dir.x, dir.y, dir.z, FLT_MAX }
+            };
+        }
+        return rays;
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_BENCH_RAYS_H
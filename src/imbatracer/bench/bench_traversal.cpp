@@ -0,0 +1,158 @@
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "imbatracer/bench/bench_rays.h"
+#include "imbatracer/frontend/build_scene.h"
+
+using namespace imba;
+
+/// Measures the traversal performance on the ray sets of BenchRays. Every set is traversed in batches of several
+/// queue sizes, on the CPU and optionally on the GPU, and the number of rays traversed per second is reported.
+
+namespace {
+
+struct BenchSettings {
+    std::string scene_file;
+    int width = 1024;
+    int height = 1024;
+    float fov = 60.0f;
+    int repeat = 5;
+    bool cpu = true;
+    bool gpu = false;
+    std::vector<int> queue_sizes = { 1 << 12, 1 << 14, 1 << 16, 1 << 18 };
+};
+
+void print_help() {
+    std::cout << "Usage: bench_traversal [options] file" << std::endl
+              << "Available options:" << std::endl
+              << "    -w      --width       Sets the width of the camera (default: 1024)" << std::endl
+              << "    -h      --height      Sets the height of the camera (default: 1024)" << std::endl
+              << "    -f      --fov         Sets the field of view of the camera (default: 60)" << std::endl
+              << "    -r      --repeat      Number of times every set of rays is traversed (default: 5)" << std::endl
+              << "    -q      --queue-size  Adds a queue size to benchmark, replaces the defaults (4096, 16384, 65536, 262144)" << std::endl
+              << "            --gpu         Also benchmarks the GPU traversal" << std::endl
+              << "            --gpu-only    Only benchmarks the GPU traversal" << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], BenchSettings& settings) {
+    bool queue_size_given = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if ((arg == "-w" || arg == "--width") && has_value) {
+            settings.width = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-h" || arg == "--height") && has_value) {
+            settings.height = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-f" || arg == "--fov") && has_value) {
+            settings.fov = std::strtof(argv[++i], nullptr);
+        } else if ((arg == "-r" || arg == "--repeat") && has_value) {
+            settings.repeat = std::strtol(argv[++i], nullptr, 10);
+        } else if ((arg == "-q" || arg == "--queue-size") && has_value) {
+            if (!queue_size_given) settings.queue_sizes.clear();
+            queue_size_given = true;
+            settings.queue_sizes.push_back(std::strtol(argv[++i], nullptr, 10));
+        } else if (arg == "--gpu") {
+            settings.gpu = true;
+        } else if (arg == "--gpu-only") {
+            settings.cpu = false;
+            settings.gpu = true;
+        } else if (arg == "--help") {
+            print_help();
+            return false;
+        } else if (arg[0] == '-' || !settings.scene_file.empty()) {
+            std::cout << "Invalid argument '" << arg << "'" << std::endl;
+            print_help();
+            return false;
+        } else {
+            settings.scene_file = arg;
+        }
+    }
+
+    if (settings.scene_file.empty()) {
+        std::cout << "No scene file given" << std::endl;
+        print_help();
+        return false;
+    }
+
+    if (settings.width <= 0 || settings.height <= 0 || settings.repeat <= 0) {
+        std::cout << "The size of the camera and the number of repetitions must be positive" << std::endl;
+        return false;
+    }
+
+    for (auto q : settings.queue_sizes) {
+        if (q <= 0) {
+            std::cout << "The queue sizes must be positive" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename TraverseFn>
+void bench(const char* name, const std::vector<Ray>& rays, const BenchSettings& settings, bool gpu, TraverseFn traverse_fn) {
+    for (auto q : settings.queue_sizes) {
+        // Warm up the caches and the device before measuring.
+        BenchRays::traverse(rays, q, gpu, traverse_fn);
+
+        double best = DBL_MAX, total = 0.0;
+        for (int i = 0; i < settings.repeat; ++i) {
+            const double t = BenchRays::traverse(rays, q, gpu, traverse_fn);
+            best = std::min(best, t);
+            total += t;
+        }
+
+        const double mrays = rays.size() * 1e-6;
+        std::cout << std::left << std::setw(12) << name
+                  << std::setw(6) << (gpu ? "gpu" : "cpu")
+                  << "queue " << std::setw(10) << std::min<size_t>(q, rays.size())
+                  << std::fixed << std::setprecision(2)
+                  << "avg " << std::setw(10) << mrays * settings.repeat / total
+                  << "best " << std::setw(10) << mrays / best
+                  << "Mrays/s" << std::endl;
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    BenchSettings settings;
+    if (!parse_args(argc, argv, settings))
+        return 1;
+
+    Scene scene(settings.cpu, settings.gpu);
+    float3 cam_pos, cam_dir, cam_up;
+    if (!build_scene(Path(settings.scene_file), scene, cam_pos, cam_dir, cam_up)) {
+        std::cerr << "ERROR: Scene could not be built" << std::endl;
+        return 1;
+    }
+
+    PerspectiveCamera cam(settings.width, settings.height, settings.fov);
+    cam.move(cam_pos, cam_dir, cam_up);
+
+    const BenchRays rays(scene, cam, settings.width, settings.height);
+    std::cout << rays.primary.size() << " rays per set, " << settings.repeat << " repetitions" << std::endl;
+
+    if (settings.cpu) {
+        auto closest  = [&] (BenchRays::Queue& q) { q.traverse_cpu(scene.traversal_data_cpu()); };
+        auto occluded = [&] (BenchRays::Queue& q) { q.traverse_occluded_cpu(scene.traversal_data_cpu()); };
+        bench("primary",    rays.primary,    settings, false, closest);
+        bench("shadow",     rays.shadow,     settings, false, occluded);
+        bench("incoherent", rays.incoherent, settings, false, closest);
+    }
+
+    if (settings.gpu) {
+        auto closest  = [&] (BenchRays::Queue& q) { q.traverse_gpu(scene.traversal_data_gpu()); };
+        auto occluded = [&] (BenchRays::Queue& q) { q.traverse_occluded_gpu(scene.traversal_data_gpu()); };
+        bench("primary",    rays.primary,    settings, true, closest);
+        bench("shadow",     rays.shadow,     settings, true, occluded);
+        bench("incoherent", rays.incoherent, settings, true, closest);
+    }
+
+    return 0;
+}
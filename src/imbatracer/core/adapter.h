@@ -3,23 +3,47 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #include "imbatracer/core/traversal_interface.h"
 #include "imbatracer/core/mesh.h"
+#include "imbatracer/core/bvh_stats.h"
 
 namespace imba {
 
+/// Algorithm used to build the acceleration structure of a mesh.
+enum BvhBuilderType {
+    BVH_BUILDER_SBVH,   ///< Spatial split BVH: best traversal performance, slow to build
+    BVH_BUILDER_FAST    ///< Binned SAH BVH: faster to build, suited for interactive rebuilds
+};
+
 class MeshAdapter {
 public:
     virtual ~MeshAdapter() {}
 
     /// Writes the acceleration structure for the given mesh
-    /// sequentially in the array of nodes.
-    virtual void build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout) = 0;
+    /// sequentially in the array of nodes, using the given builder.
+    /// Returns statistics about the quality of the tree.
+    virtual BvhStats build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout, BvhBuilderType builder) = 0;
+};
+
+/// Range [begin, end) of the elements of an array that were modified by an update.
+struct ModifiedRange {
+    int begin, end;
 
-#ifdef STATISTICS
-    virtual void print_stats() const {};
-#endif
+    ModifiedRange() : begin(0), end(0) {}
+
+    bool empty() const { return begin >= end; }
+
+    void add(int i) {
+        if (empty()) {
+            begin = i;
+            end = i + 1;
+        } else {
+            begin = std::min(begin, i);
+            end = std::max(end, i + 1);
+        }
+    }
 };
 
 class TopLevelAdapter {
@@ -28,14 +52,22 @@ public:
 
     /// Writes the acceleration structure for the given mesh
     /// sequentially in the array of nodes.
-    virtual void build_accel(const std::vector<Mesh>& meshes,
-                             const std::vector<Mesh::Instance>& instances,
-                             const std::vector<int>& layout,
-                             int root_offset) = 0;
+    /// Returns statistics about the quality of the tree.
+    virtual BvhStats build_accel(const std::vector<Mesh>& meshes,
+                                 const std::vector<Mesh::Instance>& instances,
+                                 const std::vector<Mesh::Transform>& transforms,
+                                 const std::vector<int>& layout,
+                                 int root_offset) = 0;
 
-#ifdef STATISTICS
-    virtual void print_stats() const {};
-#endif
+    /// Updates the bounding boxes of the nodes written by build_accel() and the transformations of the moved instances,
+    /// keeping the topology of the tree. Returns the ranges of nodes and instance nodes that were modified.
+    virtual void refit_accel(const std::vector<Mesh>& meshes,
+                             const std::vector<Mesh::Instance>& instances,
+                             const std::vector<Mesh::Transform>& transforms,
+                             const std::vector<int>& moved,
+                             int root_offset,
+                             ModifiedRange& modified_nodes,
+                             ModifiedRange& modified_instances) = 0;
 };
 
 /// Returns the correct mesh acceleration structure adapter for the traversal implementation.
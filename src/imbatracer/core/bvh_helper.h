@@ -3,6 +3,7 @@
 
 #include <cfloat>
 #include <algorithm>
+#include <vector>
 
 #include "imbatracer/core/bbox.h"
 
@@ -60,6 +61,35 @@ struct MultiNode {
     }
 };
 
+/// Temporary representation of a BVH that is built in parallel: either a multi-node, or a leaf (if count == 0).
+/// Once the tree is complete, it is written in depth-first order by write_build_tree().
+template <int N, typename Leaf>
+struct BuildNode {
+    BBox bbox;
+    int count;
+    const BuildNode* children[N];
+    Leaf leaf;
+};
+
+/// Calls write_node for every multi-node and write_leaf for every leaf of the tree, in depth-first order,
+/// which is the order in which a serial builder emits the nodes.
+template <int N, typename Leaf, typename NodeFn, typename LeafFn>
+void write_build_tree(const BuildNode<N, Leaf>* root, NodeFn write_node, LeafFn write_leaf) {
+    std::vector<const BuildNode<N, Leaf>*> stack(1, root);
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+
+        if (node->count == 0) {
+            write_leaf(*node);
+        } else {
+            write_node(*node);
+            for (int i = node->count - 1; i >= 0; i--)
+                stack.push_back(node->children[i]);
+        }
+    }
+}
+
 } // namespace imba
 
 #endif // BVH_HELPER_H
@@ -0,0 +1,92 @@
+#ifndef IMBA_BVH_LAYOUT_H
+#define IMBA_BVH_LAYOUT_H
+
+#include <cassert>
+#include <vector>
+#include <queue>
+#include <utility>
+
+#include "imbatracer/core/bbox.h"
+
+namespace imba {
+
+/// Reorders the nodes of a BVH so that treelets of nodes that are likely to be traversed together are contiguous in memory.
+/// Each treelet is grown from its root by adding the child with the highest weight, until it holds treelet_size nodes.
+/// The children left out become the roots of new treelets, and the treelets with the heaviest roots are placed first.
+/// Treelets that are smaller than treelet_size share their block with the next ones, so that all the blocks are full.
+/// The weights can be measured traversal frequencies, or traversal probabilities (see the overload below).
+/// The root must be the first node and the child indices of inner nodes must be relative to the array.
+/// The function for_each_child(node, f) must call f(int& child, const BBox& child_bb) for every inner child of the node.
+template <typename Node, typename ForEachChild>
+void reorder_treelets(std::vector<Node>& nodes, const std::vector<float>& weights, int treelet_size, ForEachChild for_each_child) {
+    const int node_count = nodes.size();
+    if (node_count <= 1) return;
+    assert(weights.size() == node_count);
+
+    typedef std::pair<float, int> Candidate;
+    std::priority_queue<Candidate> treelet_roots;
+    std::vector<int> new_index(node_count, -1);
+    int next = 0;
+
+    treelet_roots.emplace(weights[0], 0);
+    while (!treelet_roots.empty()) {
+        const int root = treelet_roots.top().second;
+        treelet_roots.pop();
+
+        std::priority_queue<Candidate> candidates;
+        candidates.emplace(weights[root], root);
+        for (int count = 0; count < treelet_size; count++) {
+            // Small subtrees do not fill a treelet, the remaining space goes to the next treelet.
+            if (candidates.empty()) {
+                if (treelet_roots.empty()) break;
+                candidates.push(treelet_roots.top());
+                treelet_roots.pop();
+            }
+
+            const int id = candidates.top().second;
+            candidates.pop();
+
+            new_index[id] = next++;
+            for_each_child(nodes[id], [&] (int& child, const BBox&) {
+                candidates.emplace(weights[child], child);
+            });
+        }
+
+        while (!candidates.empty()) {
+            treelet_roots.push(candidates.top());
+            candidates.pop();
+        }
+    }
+
+    assert(next == node_count);
+
+    std::vector<Node> reordered(node_count);
+    for (int i = 0; i < node_count; i++) {
+        Node node = nodes[i];
+        for_each_child(node, [&] (int& child, const BBox&) {
+            child = new_index[child];
+        });
+        reordered[new_index[i]] = node;
+    }
+
+    nodes.swap(reordered);
+}
+
+/// Reorders the nodes of a BVH into treelets, using the surface area of the nodes as the probability of traversing them.
+template <typename Node, typename ForEachChild>
+void reorder_treelets(std::vector<Node>& nodes, int treelet_size, ForEachChild for_each_child) {
+    // The area of a node is stored in its parent. The root is always traversed.
+    std::vector<float> weights(nodes.size(), 0.0f);
+    if (!weights.empty()) weights[0] = FLT_MAX;
+    for (auto& node : nodes) {
+        for_each_child(node, [&] (int& child, const BBox& bb) {
+            weights[child] = bb.half_area();
+        });
+    }
+
+    reorder_treelets(nodes, weights, treelet_size, for_each_child);
+}
+
+} // namespace imba
+
+#endif // IMBA_BVH_LAYOUT_H
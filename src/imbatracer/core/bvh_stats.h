@@ -0,0 +1,48 @@
+#ifndef IMBA_BVH_STATS_H
+#define IMBA_BVH_STATS_H
+
+#include <ostream>
+#include <vector>
+
+namespace imba {
+
+/// Statistics about the quality of a BVH, collected by the builders.
+struct BvhStats {
+    static constexpr int MAX_LEAF_SIZE = 16;
+
+    int prim_count = 0;         ///< Number of primitives given to the builder
+    int node_count = 0;         ///< Number of inner nodes
+    int leaf_count = 0;
+    int ref_count = 0;          ///< Number of primitive references in the leaves (more than the primitives with spatial splits)
+    int object_splits = 0;
+    int spatial_splits = 0;
+    float sah_cost = 0.0f;      ///< Cost of the tree according to the cost function of the builder, relative to the area of the root
+    long build_time_ms = 0;
+    std::vector<int> leaf_sizes = std::vector<int>(MAX_LEAF_SIZE + 1, 0); ///< Number of leaves per size, larger leaves are counted in the last entry
+
+    void add_leaf(int refs) {
+        leaf_count++;
+        ref_count += refs;
+        leaf_sizes[refs < MAX_LEAF_SIZE ? refs : MAX_LEAF_SIZE]++;
+    }
+
+    /// Writes the statistics as the members of a JSON object, without the enclosing braces.
+    void write_json(std::ostream& out) const {
+        out << "\"primitives\": " << prim_count
+            << ", \"nodes\": " << node_count
+            << ", \"leaves\": " << leaf_count
+            << ", \"references\": " << ref_count
+            << ", \"object_splits\": " << object_splits
+            << ", \"spatial_splits\": " << spatial_splits
+            << ", \"sah_cost\": " << sah_cost
+            << ", \"build_time_ms\": " << build_time_ms
+            << ", \"leaf_sizes\": [";
+        for (int i = 0; i < leaf_sizes.size(); ++i)
+            out << (i > 0 ? ", " : "") << leaf_sizes[i];
+        out << "]";
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_BVH_STATS_H
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstdint>
 
 namespace imba {
 
@@ -58,6 +59,20 @@ T reflect(T v, T n) {
     return v - (2 * dot(n, v)) * n;
 }
 
+/// Inserts two zero bits between each of the lower 10 bits of the given value.
+inline uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/// Computes the Morton code of a point on a grid with at most 1024 cells along each axis.
+inline uint32_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+    return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+
 #define assert_normalized(x) check_normalized(x, __FILE__, __LINE__)
 
 template <typename T>
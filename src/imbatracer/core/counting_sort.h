@@ -1,87 +1,123 @@
 #ifndef IMBA_COUNTING_SORT_H
 #define IMBA_COUNTING_SORT_H
 
-#include <tbb/tbb.h>
+#include "imbatracer/core/memory_report.h"
+
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
 #include <vector>
-#include <atomic>
 
 namespace imba {
 
-template <int N>
-struct Counter {
-    Counter(int n) {
-        assert(n <= N);
-        std::fill(counts, counts + n, 0);
-    }
-
-    Counter(Counter& c, tbb::split) {
-        std::fill(counts, counts + N, 0);
-    }
+/// Returns the number of bits required to store the given key, i.e. the number of bits to sort when no key is larger.
+inline int key_bits(uint64_t max_key) {
+    int bits = 0;
+    while (bits < 64 && (max_key >> bits) != 0) bits++;
+    return bits;
+}
 
-    template <typename Iterator>
-    void operator () (const tbb::blocked_range<Iterator>& range) {
-        for (auto it = range.begin(); it != range.end(); ++it) {
-            counts[*it]++;
+/// Stable LSD radix sort of unsigned integer keys of 32 or 64 bits, which permutes a payload along with the keys.
+/// The keys are sorted by digits of 8 bits, starting from the least significant one. Only the digits below the given
+/// number of bits are sorted, and the passes over a digit that is the same for all the keys are skipped, so that
+/// small keys, e.g. material ids, are sorted in a single counting pass.
+/// Every pass splits the keys in blocks: the digits of every block are counted, and the blocks are then scattered in
+/// parallel to the offsets computed from the counts. No atomic operation is required, and the result is deterministic.
+/// The scratch buffers are kept between the calls, so that sorting arrays of similar sizes does not allocate memory.
+template <typename Key, typename Value>
+class RadixSort {
+    static_assert(std::is_unsigned<Key>::value && sizeof(Key) >= 4, "The keys must be unsigned integers of 32 or 64 bits");
+
+public:
+    static constexpr int DIGIT_BITS = 8;
+    static constexpr int BUCKETS = 1 << DIGIT_BITS;
+    // Minimum number of keys per block. Smaller arrays are sorted as a single block.
+    static constexpr int BLOCK_SIZE = 1 << 14;
+
+    /// Sorts the first n keys and values by increasing key. All the keys must be smaller than 2^bits, see key_bits().
+    /// Runs on the calling thread only if parallel is false, e.g. when the caller is one of many sorting threads.
+    void sort(Key* keys, Value* values, int n, int bits = 8 * sizeof(Key), bool parallel = true) {
+        if (n < 2 || bits <= 0) return;
+
+        if (key_scratch_.size() < n) {
+            key_scratch_.resize(n);
+            value_scratch_.resize(n);
         }
-    }
-
-    void join(const Counter& c) {
-        for (int i = 0; i < N; i++) counts[i] += c.counts[i];
-    }
-
-    int counts[N];
-};
-
-template <>
-struct Counter<-1> {
-    Counter(int n) : counts(n, 0) {}
-
-    Counter(Counter& c, tbb::split)
-        : counts(c.counts.size(), 0)
-    {}
 
-    template <typename Iterator>
-    void operator () (const tbb::blocked_range<Iterator>& range) {
-        for (auto it = range.begin(); it != range.end(); ++it) {
-            counts[*it]++;
+        const int blocks = parallel ? (n + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+        const int block_size = (n + blocks - 1) / blocks;
+        counts_.resize(blocks * BUCKETS);
+
+        Key* src_keys = keys;
+        Value* src_values = values;
+        Key* dst_keys = key_scratch_.data();
+        Value* dst_values = value_scratch_.data();
+
+        for (int shift = 0; shift < bits; shift += DIGIT_BITS) {
+            // Count the digits of every block.
+            for_each_block(blocks, [&] (int b) {
+                int* counts = counts_.data() + b * BUCKETS;
+                std::fill(counts, counts + BUCKETS, 0);
+                for (int i = b * block_size, end = std::min(n, i + block_size); i < end; ++i)
+                    counts[(src_keys[i] >> shift) & (BUCKETS - 1)]++;
+            });
+
+            // Turn the counts into offsets, by digit first and by block second, so that the order of equal keys is kept.
+            int sum = 0;
+            bool same_digit = false;
+            for (int d = 0; d < BUCKETS; ++d) {
+                const int first = sum;
+                for (int b = 0; b < blocks; ++b) {
+                    int& c = counts_[b * BUCKETS + d];
+                    const int count = c;
+                    c = sum;
+                    sum += count;
+                }
+                if (sum - first == n) same_digit = true;
+            }
+            if (same_digit) continue;
+
+            for_each_block(blocks, [&] (int b) {
+                int* offsets = counts_.data() + b * BUCKETS;
+                for (int i = b * block_size, end = std::min(n, i + block_size); i < end; ++i) {
+                    const int dst = offsets[(src_keys[i] >> shift) & (BUCKETS - 1)]++;
+                    dst_keys[dst] = src_keys[i];
+                    dst_values[dst] = src_values[i];
+                }
+            });
+
+            std::swap(src_keys, dst_keys);
+            std::swap(src_values, dst_values);
         }
-    }
 
-    void join(const Counter& c) {
-        for (int i = 0, n = counts.size(); i < n; i++) counts[i] += c.counts[i];
+        // After an odd number of passes, the result is in the scratch buffers.
+        if (src_keys != keys) {
+            for_each_block(blocks, [&] (int b) {
+                const int begin = b * block_size, end = std::min(n, begin + block_size);
+                std::copy(src_keys + begin, src_keys + end, keys + begin);
+                std::copy(src_values + begin, src_values + end, values + begin);
+            });
+        }
     }
 
-    std::vector<int> counts;
-};
+    /// Number of bytes allocated for the scratch buffers.
+    size_t memory_bytes() const { return vector_bytes(key_scratch_) + vector_bytes(value_scratch_) + vector_bytes(counts_); }
 
-template <int N>
-struct CountingSort {
-    template <typename Iterator>
-    static void sort(Iterator begin, Iterator end, int n, std::atomic_int* offs, int* ids) {
-        Counter<N> c(n);
-        tbb::parallel_reduce(tbb::blocked_range<Iterator>(begin, end), c);
-        std::partial_sum(&c.counts[0], &c.counts[0] + n, &c.counts[0]);     
-        std::copy(&c.counts[0], &c.counts[0] + n, offs);
-        tbb::parallel_for(tbb::blocked_range<int>(0, end - begin),
-            [=] (const tbb::blocked_range<int>& range)
-        {
-            for (auto i = range.begin(); i != range.end(); ++i)
-                ids[--offs[*(begin + i)]] = i;
-        });
+private:
+    template <typename Body>
+    static void for_each_block(int blocks, const Body& body) {
+        if (blocks > 1)
+            tbb::parallel_for(0, blocks, body);
+        else
+            body(0);
     }
-};
 
-template <typename Iterator>
-inline void counting_sort(Iterator begin, Iterator end, int n, int* ids) {
-    if (n <= 1024) {
-        std::atomic_int offs[1024];
-        CountingSort<1024>::sort(begin, end, n, offs, ids);
-    } else {
-        static thread_local std::vector<std::atomic_int> offs;
-        if (offs.size() < n) offs = std::vector<std::atomic_int>(n);
-        CountingSort<-1>::sort(begin, end, n, offs.data(), ids);
-    }
-}
+    std::vector<Key> key_scratch_;
+    std::vector<Value> value_scratch_;
+    std::vector<int> counts_;   ///< Counts of the digits of every block, then the offsets at which they are scattered
+};
 
 } // namespace imba
 
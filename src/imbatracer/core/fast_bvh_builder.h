@@ -6,10 +6,17 @@
 #include <cassert>
 #include <iostream>
 #include <chrono>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/core/common.h"
 #include "imbatracer/core/mem_pool.h"
 #include "imbatracer/core/bvh_helper.h"
+#include "imbatracer/core/bvh_stats.h"
 #include "imbatracer/core/float4.h"
 #include "imbatracer/core/stack.h"
 #include "imbatracer/core/mesh.h"
@@ -21,20 +28,30 @@ namespace imba {
 /// A fast binning BVH builder, which produces medium-quality BVHs.
 /// Inspired from "On fast Construction of SAH-based Bounding Volume Hierarchies", I. Wald, 2007
 /// http://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
+/// The temporary arrays are taken from the given pool, which can be shared by several builds.
+/// The nodes close to the root are split using all threads (the binning and partitioning are done in parallel),
+/// while the smaller subtrees are built in parallel by different threads. The tree is written in depth-first order
+/// by the calling thread once it is complete. It only depends on the input, not on the number of threads.
 template <int N, typename CostFn>
 class FastBvhBuilder {
 public:
+    FastBvhBuilder(MemoryPool<>& mem_pool)
+        : mem_pool_(mem_pool)
+    {}
+
     template <typename NodeWriter, typename LeafWriter>
     void build(const Mesh& mesh, NodeWriter write_node, LeafWriter write_leaf, int leaf_threshold) {
         const int tri_count = mesh.triangle_count();
-        BBox* bboxes = mem_pool_.alloc<BBox>(tri_count);
-        float3* centers = mem_pool_.alloc<float3>(tri_count);
-
-        for (int i = 0; i < tri_count; i++) {
-            const Tri& tri = mesh.triangle(i);
-            tri.compute_bbox(bboxes[i]);
-            centers[i] = (1.0f / 3.0f) * (tri.v0 + tri.v1 + tri.v2);
-        }
+        BBox* bboxes = alloc<BBox>(tri_count);
+        float3* centers = alloc<float3>(tri_count);
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, tri_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); i++) {
+                const Tri& tri = mesh.triangle(i);
+                tri.compute_bbox(bboxes[i]);
+                centers[i] = (1.0f / 3.0f) * (tri.v0 + tri.v1 + tri.v2);
+            }
+        });
 
         build(bboxes, centers, tri_count, write_node, write_leaf, leaf_threshold);
     }
@@ -43,134 +60,53 @@ public:
     void build(const BBox* bboxes, const float3* centers, int obj_count, NodeWriter write_node, LeafWriter write_leaf, int leaf_threshold) {
         assert(leaf_threshold >= 1);
 
-#ifdef STATISTICS
         auto time_start = std::chrono::high_resolution_clock::now();
-#endif
+        stats_ = BvhStats();
+        stats_.prim_count = obj_count;
+        object_splits_ = 0;
 
         BBox global_bb = BBox::empty();
         for (int i = 0; i < obj_count; i++) global_bb.extend(bboxes[i]);
-        int* refs = mem_pool_.alloc<int>(obj_count);
+        int* refs = alloc<int>(obj_count);
         for (int i = 0; i < obj_count; i++) refs[i] = i;
 
-        Stack<Node> stack;
-        stack.push(0, obj_count, global_bb);
-
-        while (!stack.is_empty()) {
-            MultiNode<Node, N> multi_node(stack.pop());
-
-            // Iterate over the available split candidates in the multi-node
-            while (!multi_node.is_full() && multi_node.node_available()) {
-                const int node_id = multi_node.next_node();
-                Node node = multi_node.nodes[node_id];
-
-                multi_node.nodes[node_id].tested = true;
-
-                const int begin = node.begin;
-                const int end = node.end;
-                const BBox& parent_bb = node.bbox;
-                assert(end - begin != 0);
-
-                // Test longest axes first
-                float3 extents = parent_bb.max - parent_bb.min;
-                int axes[3] = {0, 1, 2};
-                if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
-                if (extents[axes[1]] < extents[axes[2]]) std::swap(axes[1], axes[2]);
-                if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
-                for (int j = 0; j < 3; j++) {
-                    const int axis = axes[j];
-
-                    // Compute the min/max center position
-                    float center_min = parent_bb.max[axis];
-                    float center_max = parent_bb.min[axis];
-                    for (int i = begin; i < end; i++) {
-                        const float c = centers[refs[i]][axis];
-                        center_min = std::min(center_min, c);
-                        center_max = std::max(center_max, c);
-                    }
-
-                    // Put the triangles into the bins
-                    Bin bins[num_bins];
-                    bin_triangles(axis, bins, refs, bboxes, centers, center_min, center_max, begin, end);
-
-                    // Find the best split position
-                    const float parent_area = parent_bb.half_area();
-                    int best_split = find_best_split(bins, CostFn::leaf_cost(end - begin, parent_area) - CostFn::traversal_cost(parent_area));
-                    if (best_split >= 0 && best_split < num_bins - 1) {
-                        // The node was succesfully split
-                        const int begin_right = apply_split(axis, best_split, refs, centers, center_min, center_max, begin, end);
-                        const int end_right = end;
-                        const int begin_left = begin;
-                        const int end_left = begin_right;
-
-                        BBox left_bb  = BBox::empty();
-                        BBox right_bb = BBox::empty();
-                        if (num_bins < end - begin) {
-                            // Compute the bounding box using the bins
-                            for (int i = 0; i < best_split; i++) left_bb.extend(bins[i].bbox);
-                            for (int i = best_split; i < num_bins; i++) right_bb.extend(bins[i].bbox);
-                        } else {
-                            // Compute the bounding box using the objects
-                            for (int i = begin_left; i < end_left; i++) left_bb.extend(bboxes[refs[i]]);
-                            for (int i = begin_right; i < end_right; i++) right_bb.extend(bboxes[refs[i]]);
-                        }
-
-                        // Exit once the first candidate is found
-                        multi_node.split_node(node_id,
-                                              Node(begin_left, end_left, left_bb),
-                                              Node(begin_right, end_right, right_bb));
-                        break;
-                    }
-                }
-            }
+        // The blocks of build nodes from the previous build have been returned to the pool.
+        for (auto& scratch : scratch_) scratch.nodes_left = 0;
 
-            assert(multi_node.count > 0);
-            // Process the smallest nodes first
-            multi_node.sort_nodes();
+        bboxes_ = bboxes;
+        centers_ = centers;
+        refs_ = refs;
 
-            // The multi-node is ready to be stored
-            if (multi_node.is_leaf()) {
-                // Store a leaf if it could not be split
-                const Node& node = multi_node.nodes[0];
-                assert(node.tested);
-                make_leaf(node, refs, write_leaf);
-            } else {
-                // Store a multi-node
-                make_node(multi_node, write_node);
-                assert(N > 2 || multi_node.count == 2);
-
-                if (stack.size() + multi_node.count < stack.capacity()) {
-                    for (int i = multi_node.count - 1; i >= 0; i--) {
-                        stack.push(multi_node.nodes[i]);
-                    }
-                } else {
-                    // Insufficient space on the stack, we have to stop recursion here
-                    for (int i = 0; i < multi_node.count; i++) {
-                        make_leaf(multi_node.nodes[i], refs, write_leaf);
-                    }
-                }
-            }
-        }
+        const BuildNode* root = build_subtree(Node(0, obj_count, global_bb), 0);
+        write_build_tree(root,
+            [&] (const BuildNode& node) { make_node(node, write_node); },
+            [&] (const BuildNode& node) { make_leaf(node, write_leaf); });
 
-#ifdef STATISTICS
         auto time_end = std::chrono::high_resolution_clock::now();
-        total_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
-#endif
+        stats_.build_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
+        stats_.sah_cost /= root->bbox.half_area();
+        stats_.object_splits = object_splits_;
 
-        mem_pool_.cleanup();
+        mem_pool_.release();
     }
 
-#ifdef STATISTICS
-    void print_stats() const {
-        std::cout << "BVH built in " << total_time_ << "ms ("
-                  << total_nodes_ << " nodes, "
-                  << total_leaves_ << " leaves)"
-                  << std::endl;
-    }
-#endif
+    /// Returns the statistics of the last build.
+    const BvhStats& stats() const { return stats_; }
 
 private:
     static constexpr int num_bins = 32;
 
+    // Nodes with more objects than this are binned and partitioned in parallel.
+    static constexpr int parallel_split_threshold = 32768;
+    // Nodes with more objects than this have their children built in parallel.
+    static constexpr int parallel_subtree_threshold = 1024;
+    // Number of objects processed by one task during parallel binning and partitioning.
+    static constexpr int parallel_grain_size = 8192;
+    // Number of build nodes allocated at once by a thread.
+    static constexpr int node_block_size = 256;
+    // Depth of the traversal stack used by the serial build, which limits the recursion.
+    static constexpr int stack_capacity = Stack<int>::capacity();
+
     struct Bin {
         int count;
         BBox bbox;
@@ -191,24 +127,207 @@ private:
         int size() const { return end - begin; }
     };
 
+    struct Leaf {
+        int begin, end;
+    };
+
+    typedef imba::BuildNode<N, Leaf> BuildNode;
+
+    struct Scratch {
+        BuildNode* nodes;
+        int nodes_left;
+
+        Scratch() : nodes(nullptr), nodes_left(0) {}
+    };
+
+    template <typename T>
+    T* alloc(size_t count) {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        return mem_pool_.template alloc<T>(count);
+    }
+
+    BuildNode* new_build_node() {
+        Scratch& scratch = scratch_.local();
+        if (scratch.nodes_left == 0) {
+            scratch.nodes = alloc<BuildNode>(node_block_size);
+            scratch.nodes_left = node_block_size;
+        }
+        scratch.nodes_left--;
+        return scratch.nodes++;
+    }
+
+    BuildNode* new_leaf(const Node& node) {
+        BuildNode* leaf = new_build_node();
+        leaf->bbox = node.bbox;
+        leaf->count = 0;
+        leaf->leaf.begin = node.begin;
+        leaf->leaf.end = node.end;
+        return leaf;
+    }
+
+    /// Builds the subtree rooted at the given node. The stack size is the number of nodes that would be
+    /// on the stack of a serial depth-first build when this node is processed, and limits the depth of the tree.
+    const BuildNode* build_subtree(const Node& root, int stack_size) {
+        MultiNode<Node, N> multi_node(root);
+
+        // Iterate over the available split candidates in the multi-node
+        while (!multi_node.is_full() && multi_node.node_available()) {
+            const int node_id = multi_node.next_node();
+            const Node node = multi_node.nodes[node_id];
+
+            multi_node.nodes[node_id].tested = true;
+
+            Node left, right;
+            if (split(node, left, right))
+                multi_node.split_node(node_id, left, right);
+        }
+
+        assert(multi_node.count > 0);
+        // Process the smallest nodes first
+        multi_node.sort_nodes();
+
+        if (multi_node.is_leaf()) {
+            // Store a leaf if it could not be split
+            assert(multi_node.nodes[0].tested);
+            return new_leaf(multi_node.nodes[0]);
+        }
+
+        assert(N > 2 || multi_node.count == 2);
+        BuildNode* build_node = new_build_node();
+        build_node->bbox = multi_node.bbox;
+        build_node->count = multi_node.count;
+
+        if (stack_size + multi_node.count < stack_capacity) {
+            // The children are processed in order, so the later siblings of a child are on the stack meanwhile.
+            auto build_child = [&] (int i) {
+                build_node->children[i] = build_subtree(multi_node.nodes[i], stack_size + multi_node.count - 1 - i);
+            };
+
+            if (root.size() > parallel_subtree_threshold) {
+                tbb::task_group group;
+                for (int i = 0; i < multi_node.count; i++)
+                    group.run([&build_child, i] { build_child(i); });
+                group.wait();
+            } else {
+                for (int i = 0; i < multi_node.count; i++)
+                    build_child(i);
+            }
+        } else {
+            // Insufficient space on the stack, we have to stop recursion here
+            for (int i = 0; i < multi_node.count; i++)
+                build_node->children[i] = new_leaf(multi_node.nodes[i]);
+        }
+
+        return build_node;
+    }
+
+    /// Splits the given node along the first axis (longest first) for which a beneficial split is found.
+    bool split(const Node& node, Node& left, Node& right) {
+        const BBox* bboxes = bboxes_;
+        const float3* centers = centers_;
+        int* refs = refs_;
+
+        const int begin = node.begin;
+        const int end = node.end;
+        const BBox& parent_bb = node.bbox;
+        assert(end - begin != 0);
+
+        const bool parallel = end - begin > parallel_split_threshold;
+
+        // Test longest axes first
+        float3 extents = parent_bb.max - parent_bb.min;
+        int axes[3] = {0, 1, 2};
+        if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
+        if (extents[axes[1]] < extents[axes[2]]) std::swap(axes[1], axes[2]);
+        if (extents[axes[0]] < extents[axes[1]]) std::swap(axes[0], axes[1]);
+        for (int j = 0; j < 3; j++) {
+            const int axis = axes[j];
+
+            // Compute the min/max center position
+            float center_min = parent_bb.max[axis];
+            float center_max = parent_bb.min[axis];
+            if (parallel) {
+                typedef std::pair<float, float> Range;
+                const Range range = tbb::parallel_reduce(tbb::blocked_range<int>(begin, end, parallel_grain_size), Range(center_min, center_max),
+                    [&] (const tbb::blocked_range<int>& r, Range init) {
+                        for (int i = r.begin(); i != r.end(); i++) {
+                            const float c = centers[refs[i]][axis];
+                            init.first = std::min(init.first, c);
+                            init.second = std::max(init.second, c);
+                        }
+                        return init;
+                    },
+                    [] (const Range& a, const Range& b) {
+                        return Range(std::min(a.first, b.first), std::max(a.second, b.second));
+                    });
+                center_min = range.first;
+                center_max = range.second;
+            } else {
+                for (int i = begin; i < end; i++) {
+                    const float c = centers[refs[i]][axis];
+                    center_min = std::min(center_min, c);
+                    center_max = std::max(center_max, c);
+                }
+            }
+
+            // Put the triangles into the bins
+            Bin bins[num_bins];
+            if (parallel)
+                bin_triangles_parallel(axis, bins, refs, bboxes, centers, center_min, center_max, begin, end);
+            else
+                bin_triangles(axis, bins, refs, bboxes, centers, center_min, center_max, begin, end);
+
+            // Find the best split position
+            const float parent_area = parent_bb.half_area();
+            int best_split = find_best_split(bins, CostFn::leaf_cost(end - begin, parent_area) - CostFn::traversal_cost(parent_area));
+            if (best_split >= 0 && best_split < num_bins - 1) {
+                // The node was succesfully split
+                const int begin_right = parallel
+                    ? apply_split_parallel(axis, best_split, refs, centers, center_min, center_max, begin, end)
+                    : apply_split(axis, best_split, refs, centers, center_min, center_max, begin, end);
+                const int end_right = end;
+                const int begin_left = begin;
+                const int end_left = begin_right;
+
+                BBox left_bb  = BBox::empty();
+                BBox right_bb = BBox::empty();
+                if (num_bins < end - begin) {
+                    // Compute the bounding box using the bins
+                    for (int i = 0; i < best_split; i++) left_bb.extend(bins[i].bbox);
+                    for (int i = best_split; i < num_bins; i++) right_bb.extend(bins[i].bbox);
+                } else {
+                    // Compute the bounding box using the objects
+                    for (int i = begin_left; i < end_left; i++) left_bb.extend(bboxes[refs[i]]);
+                    for (int i = begin_right; i < end_right; i++) right_bb.extend(bboxes[refs[i]]);
+                }
+
+                // Exit once the first candidate is found
+                left  = Node(begin_left, end_left, left_bb);
+                right = Node(begin_right, end_right, right_bb);
+                object_splits_++;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
     template <typename NodeWriter>
-    void make_node(const MultiNode<Node, N>& multi_node, NodeWriter write_node) {
-        write_node(multi_node.bbox, multi_node.count, [&] (int i) {
-            return multi_node.nodes[i].bbox;
+    void make_node(const BuildNode& node, NodeWriter& write_node) {
+        write_node(node.bbox, node.count, [&] (int i) {
+            return node.children[i]->bbox;
         });
-#ifdef STATISTICS
-        total_nodes_++;
-#endif
+        stats_.node_count++;
+        stats_.sah_cost += CostFn::traversal_cost(node.bbox.half_area());
     }
 
     template <typename LeafWriter>
-    void make_leaf(const Node& node, const int* refs, LeafWriter write_leaf) {
-        write_leaf(node.bbox, node.end - node.begin, [&] (int i) {
-            return refs[node.begin + i];
+    void make_leaf(const BuildNode& node, LeafWriter& write_leaf) {
+        write_leaf(node.bbox, node.leaf.end - node.leaf.begin, [&] (int i) {
+            return refs_[node.leaf.begin + i];
         });
-#ifdef STATISTICS
-        total_leaves_++;
-#endif
+        stats_.add_leaf(node.leaf.end - node.leaf.begin);
+        stats_.sah_cost += CostFn::leaf_cost(node.leaf.end - node.leaf.begin, node.bbox.half_area());
     }
 
     int compute_bin_id(float c, float min, float inv) {
@@ -230,6 +349,40 @@ private:
         }
     }
 
+    /// Same as bin_triangles, but every task fills its own set of bins, which are merged afterwards.
+    void bin_triangles_parallel(int axis, Bin* bins, const int* refs, const BBox* bboxes, const float3* centers, float min, float max, int begin, int end) {
+        struct Bins {
+            Bin bins[num_bins];
+        };
+
+        Bins empty;
+        for (int i = 0; i < num_bins; i++) {
+            empty.bins[i].count = 0;
+            empty.bins[i].bbox = BBox::empty();
+        }
+
+        const float inv = 1.0f / (max - min);
+        const Bins res = tbb::parallel_reduce(tbb::blocked_range<int>(begin, end, parallel_grain_size), empty,
+            [&] (const tbb::blocked_range<int>& range, Bins init) {
+                for (int i = range.begin(); i != range.end(); i++) {
+                    const int ref = refs[i];
+                    const int bin_id = compute_bin_id(centers[ref][axis], min, inv);
+                    init.bins[bin_id].count++;
+                    init.bins[bin_id].bbox.extend(bboxes[ref]);
+                }
+                return init;
+            },
+            [] (Bins a, const Bins& b) {
+                for (int i = 0; i < num_bins; i++) {
+                    a.bins[i].count += b.bins[i].count;
+                    a.bins[i].bbox.extend(b.bins[i].bbox);
+                }
+                return a;
+            });
+
+        std::copy(res.bins, res.bins + num_bins, bins);
+    }
+
     int find_best_split(const Bin* bins, float max_cost) {
         float left_cost[num_bins];
         int left_count = 0;
@@ -268,13 +421,57 @@ private:
         }) - refs;
     }
 
-#ifdef STATISTICS
-    long total_time_ = 0;
-    int total_nodes_ = 0;
-    int total_leaves_ = 0;
-#endif
+    /// Stable partition of the objects into the left and right side of the split, using all threads.
+    /// The range is cut into blocks of a fixed size, so that the result does not depend on the number of threads.
+    int apply_split_parallel(int axis, int split, int* refs, const float3* centers, float center_min, float center_max, int begin, int end) {
+        const float inv = 1.0f / (center_max - center_min);
+        auto is_left = [&] (const int ref) {
+            return compute_bin_id(centers[ref][axis], center_min, inv) < split;
+        };
+
+        const int block_count = (end - begin + parallel_grain_size - 1) / parallel_grain_size;
+        std::vector<int> left_counts(block_count + 1, 0);
+        tbb::parallel_for(0, block_count, [&] (int b) {
+            const int block_end = std::min(end, begin + (b + 1) * parallel_grain_size);
+            int count = 0;
+            for (int i = begin + b * parallel_grain_size; i < block_end; i++)
+                count += is_left(refs[i]) ? 1 : 0;
+            left_counts[b + 1] = count;
+        });
+
+        // Compute the first index of the left and right objects of every block.
+        for (int b = 0; b < block_count; b++) left_counts[b + 1] += left_counts[b];
+        const int total_left = left_counts[block_count];
+
+        int* tmp = alloc<int>(end - begin);
+        tbb::parallel_for(0, block_count, [&] (int b) {
+            const int block_begin = begin + b * parallel_grain_size;
+            const int block_end = std::min(end, block_begin + parallel_grain_size);
+            int left = left_counts[b];
+            int right = total_left + (block_begin - begin) - left_counts[b];
+            for (int i = block_begin; i < block_end; i++) {
+                if (is_left(refs[i])) tmp[left++] = refs[i];
+                else                  tmp[right++] = refs[i];
+            }
+        });
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, end - begin, parallel_grain_size), [&] (const tbb::blocked_range<int>& range) {
+            std::copy(tmp + range.begin(), tmp + range.end(), refs + begin + range.begin());
+        });
+
+        return begin + total_left;
+    }
+
+    BvhStats stats_;
+    std::atomic<int> object_splits_{0};
+
+    const BBox* bboxes_;
+    const float3* centers_;
+    int* refs_;
 
-    MemoryPool<> mem_pool_;
+    tbb::enumerable_thread_specific<Scratch> scratch_;
+    std::mutex pool_mutex_;
+    MemoryPool<>& mem_pool_;
 };
 
 } // namespace imba
@@ -2,6 +2,7 @@
 #define IMBA_FLOAT3_H
 
 #include <cmath>
+#include <cstdint>
 #include "imbatracer/core/float2.h"
 
 namespace imba {
@@ -127,6 +128,36 @@ inline float3 normalize(const float3& a) {
     return a * (1.0f / length(a));
 }
 
+/// Encodes a unit vector in 32 bits, using an octahedral mapping with 16 bits per coordinate.
+inline uint32_t oct_encode(const float3& n) {
+    const float inv_l1 = 1.0f / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+    float u = n.x * inv_l1;
+    float v = n.y * inv_l1;
+    if (n.z < 0.0f) {
+        // Fold the lower hemisphere over the diagonals.
+        const float fu = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        const float fv = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+        u = fu;
+        v = fv;
+    }
+
+    const uint32_t qu = uint32_t(roundf((u * 0.5f + 0.5f) * 65535.0f));
+    const uint32_t qv = uint32_t(roundf((v * 0.5f + 0.5f) * 65535.0f));
+    return qu | (qv << 16);
+}
+
+/// Decodes a unit vector that was encoded with oct_encode().
+inline float3 oct_decode(uint32_t e) {
+    const float u = float(e & 0xFFFF) * (2.0f / 65535.0f) - 1.0f;
+    const float v = float(e >> 16)    * (2.0f / 65535.0f) - 1.0f;
+    float3 n(u, v, 1.0f - fabsf(u) - fabsf(v));
+    if (n.z < 0.0f) {
+        n.x = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
 } // namespace imba
 
 #endif // IMBA_FLOAT3_H
@@ -35,18 +35,20 @@ class GpuMeshAdapter : public MeshAdapter {
     std::vector<Vec4>& tris_;
 public:
     GpuMeshAdapter(std::vector<Node>& nodes, std::vector<Vec4>& tris)
-        : nodes_(nodes), tris_(tris)
+        : nodes_(nodes), tris_(tris), builder_(scratch_), fast_builder_(scratch_)
     {}
 
-    void build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout) override {
+    BvhStats build_accel(const Mesh& mesh, int mesh_id, const std::vector<int>& tri_layout, BvhBuilderType builder) override {
         mesh_ = &mesh;
+        if (builder == BVH_BUILDER_FAST) {
+            fast_builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), 2);
+            return fast_builder_.stats();
+        }
+
         builder_.build(mesh, NodeWriter(this), LeafWriter(this, mesh_id, tri_layout), 2);
+        return builder_.stats();
     }
 
-#ifdef STATISTICS
-    void print_stats() const override { builder_.print_stats(); }
-#endif
-
 private:
     struct CostFn {
         static float leaf_cost(int count, float area) {
@@ -58,6 +60,7 @@ private:
     };
 
     typedef SplitBvhBuilder<2, CostFn> BvhBuilder;
+    typedef FastBvhBuilder<2, CostFn> FastBuilder;
 
     struct NodeWriter {
         GpuMeshAdapter* adapter;
@@ -150,45 +153,120 @@ private:
 
     Stack<StackElem> stack_;
     const Mesh* mesh_;
+    MemoryPool<> scratch_;
     BvhBuilder builder_;
+    FastBuilder fast_builder_;
 };
 
+/// Bounding box of the mesh of an instance, in world space.
+static BBox instance_bounds(const std::vector<Mesh>& meshes, const std::vector<Mesh::Transform>& transforms,
+                            const Mesh::Instance& inst) {
+    auto bb = meshes[inst.id].bounding_box();
+    const float3x4& mat = transforms[inst.transform].mat;
+
+    const float3 center = mat * float4((bb.max + bb.min) * 0.5f, 1.0f);
+    const float3 abs_ext = abs(mat) * float4((bb.max - bb.min) * 0.5f, 0.0f);
+
+    BBox res;
+    res.min = center - abs_ext;
+    res.max = center + abs_ext;
+    return res;
+}
+
 class GpuTopLevelAdapter : public TopLevelAdapter {
     std::vector<Node>& nodes_;
     std::vector<InstanceNode>& instance_nodes_;
 public:
     GpuTopLevelAdapter(std::vector<Node>& nodes, std::vector<InstanceNode>& instance_nodes)
-        : nodes_(nodes), instance_nodes_(instance_nodes)
+        : nodes_(nodes), instance_nodes_(instance_nodes), builder_(scratch_)
     {}
 
-    void build_accel(const std::vector<Mesh>& meshes,
-                     const std::vector<Mesh::Instance>& instances,
-                     const std::vector<int>& layout,
-                     int root_offset) override {
+    BvhStats build_accel(const std::vector<Mesh>& meshes,
+                         const std::vector<Mesh::Instance>& instances,
+                         const std::vector<Mesh::Transform>& transforms,
+                         const std::vector<int>& layout,
+                         int root_offset) override {
         // Copy the bounding boxes and centers of all meshes into an array.
+        // With millions of instances, this is a large part of the build, so it is done in parallel.
         std::vector<BBox> bounds(instances.size());
         std::vector<float3> centers(instances.size());
-        for (int i = 0; i < instances.size(); ++i) {
-            auto bb = meshes[instances[i].id].bounding_box();
-
-            centers[i] = instances[i].mat * float4((bb.max + bb.min) * 0.5f, 1.0f);
-            float3 abs_ext = abs(instances[i].mat) * float4((bb.max - bb.min) * 0.5f, 0.0f);
+        tbb::parallel_for(tbb::blocked_range<int>(0, instances.size()), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i) {
+                bounds[i] = instance_bounds(meshes, transforms, instances[i]);
+                centers[i] = (bounds[i].max + bounds[i].min) * 0.5f;
+            }
+        });
 
-            bounds[i].min = centers[i] - abs_ext;
-            bounds[i].max = centers[i] + abs_ext;
-        }
+        instance_nodes_.reserve(instances.size());
 
         // Build the acceleration structure.
         builder_.build(bounds.data(), centers.data(), instances.size(),
             NodeWriter(this, meshes, instances, root_offset),
-            LeafWriter(this, meshes, instances, layout), 1);
+            LeafWriter(this, meshes, instances, transforms, layout), 1);
+
+        return builder_.stats();
     }
 
-private:
-#ifdef STATISTICS
-    void print_stats() const override { builder_.print_stats(); }
-#endif
+    void refit_accel(const std::vector<Mesh>& meshes,
+                     const std::vector<Mesh::Instance>& instances,
+                     const std::vector<Mesh::Transform>& transforms,
+                     const std::vector<int>& moved,
+                     int root_offset,
+                     ModifiedRange& modified_nodes,
+                     ModifiedRange& modified_instances) override {
+        std::vector<bool> is_moved(instances.size(), false);
+        for (auto i : moved) is_moved[i] = true;
+
+        // Update the transformations of the moved instances.
+        for (int i = 0; i < instance_nodes_.size(); ++i) {
+            auto& inst_node = instance_nodes_[i];
+            if (!is_moved[inst_node.id]) continue;
+            memcpy(&inst_node.transf, &transforms[instances[inst_node.id].transform].inv_mat, sizeof(inst_node.transf));
+            modified_instances.add(i);
+        }
 
+        // The instances of a leaf are stored contiguously, the last one is marked by a sentinel.
+        auto leaf_bounds = [&] (int first) {
+            BBox bb = BBox::empty();
+            for (int i = first; ; ++i) {
+                bb.extend(instance_bounds(meshes, transforms, instances[instance_nodes_[i].id]));
+                if (instance_nodes_[i].pad[0] == -1) break;
+            }
+            return bb;
+        };
+
+        // The children of a node are always stored after it, so the nodes can be refitted in reverse order.
+        std::vector<BBox> node_bounds(nodes_.size());
+        for (int i = nodes_.size() - 1; i >= 0; --i) {
+            auto& node = nodes_[i];
+            node_bounds[i] = BBox::empty();
+
+            bool modified = false;
+            auto refit_child = [&] (int child, decltype(node.left_bb)& child_bb) {
+                const BBox bb = child < 0 ? leaf_bounds(~child) : node_bounds[child - root_offset];
+                node_bounds[i].extend(bb);
+
+                if (child_bb.lo_x != bb.min.x || child_bb.lo_y != bb.min.y || child_bb.lo_z != bb.min.z ||
+                    child_bb.hi_x != bb.max.x || child_bb.hi_y != bb.max.y || child_bb.hi_z != bb.max.z) {
+                    child_bb.lo_x = bb.min.x;
+                    child_bb.lo_y = bb.min.y;
+                    child_bb.lo_z = bb.min.z;
+                    child_bb.hi_x = bb.max.x;
+                    child_bb.hi_y = bb.max.y;
+                    child_bb.hi_z = bb.max.z;
+                    modified = true;
+                }
+            };
+
+            refit_child(node.left, node.left_bb);
+            // The right child of the dummy parent of a single leaf is empty.
+            if (node.right != 0x76543210) refit_child(node.right, node.right_bb);
+
+            if (modified) modified_nodes.add(i);
+        }
+    }
+
+private:
     struct CostFn {
         static float leaf_cost(int count, float area) {
             return count * area;
@@ -251,11 +329,13 @@ private:
         GpuTopLevelAdapter* adapter;
         const std::vector<Mesh>& meshes;
         const std::vector<Mesh::Instance>& instances;
+        const std::vector<Mesh::Transform>& transforms;
         const std::vector<int>& layout;
 
         LeafWriter(GpuTopLevelAdapter* adapter, const std::vector<Mesh>& meshes,
-            const std::vector<Mesh::Instance>& instances, const std::vector<int>& layout)
-            : adapter(adapter), meshes(meshes), instances(instances), layout(layout)
+            const std::vector<Mesh::Instance>& instances, const std::vector<Mesh::Transform>& transforms,
+            const std::vector<int>& layout)
+            : adapter(adapter), meshes(meshes), instances(instances), transforms(transforms), layout(layout)
         {}
 
         template <typename RefFn>
@@ -275,7 +355,7 @@ private:
 
             for (int j = 0; j < ref_count; ++j) {
                 int inst_idx = refs(j);
-                Mesh::Instance inst = instances[inst_idx];
+                const Mesh::Instance& inst = instances[inst_idx];
 
                 // Create an instance node.
                 int i = instance_nodes.size();
@@ -283,7 +363,7 @@ private:
 
                 // Write instance data to the node.
                 auto& inst_node = instance_nodes[i];
-                memcpy(&inst_node.transf, &inst.inv_mat, sizeof(inst_node.transf));
+                memcpy(&inst_node.transf, &transforms[inst.transform].inv_mat, sizeof(inst_node.transf));
                 inst_node.id = inst_idx; // id
                 inst_node.next = layout[inst.id]; // sub-bvh
                 inst_node.pad[0] = 0;
@@ -304,6 +384,7 @@ private:
 
     Stack<StackElem> stack_;
     const Mesh* mesh_;
+    MemoryPool<> scratch_;
     BvhBuilder builder_;
 };
 
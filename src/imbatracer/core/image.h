@@ -6,6 +6,7 @@
 #include <atomic>
 
 #include "imbatracer/core/rgb.h"
+#include "imbatracer/core/memory_report.h"
 
 namespace imba {
 
@@ -41,6 +42,8 @@ public:
 
     int size() { return width_ * height_; }
 
+    size_t memory_bytes() const { return vector_bytes(pixels_); }
+
 private:
     std::vector<T> pixels_;
     int width_, height_;
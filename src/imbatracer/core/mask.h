@@ -1,9 +1,17 @@
 #ifndef IMBA_MASK_H
 #define IMBA_MASK_H
 
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
 namespace imba {
 
 /// A container for opacity masks.
+/// The traversal kernels read one byte per texel. The masks that are fully opaque or fully transparent are stored
+/// as a single texel, so that their hits never read the image. The buffer starts with opaque texels, which are
+/// used by the default mask.
 class MaskBuffer {
 public:
     struct MaskDesc {
@@ -19,23 +27,45 @@ public:
         {}
     };
 
-    MaskBuffer() {
+    MaskBuffer() : transparent_offset_(-1) {
         int align = 4;
         for (int i = 0; i < align; i++)
             buffer_.push_back(1);
     }
 
-    /// Adds an image to the mask.
-    MaskDesc append_mask(const Image& image) {
+    /// Creates a mask buffer from the contents of another one.
+    MaskBuffer(std::vector<uint8_t>&& buffer, std::vector<MaskDesc>&& descs)
+        : buffer_(std::move(buffer)), descs_(std::move(descs)), transparent_offset_(-1)
+    {}
+
+    /// Adds an image to the mask. The image must provide width(), height(), and the color of a pixel with image(x, y).
+    /// Returns the description of the mask, which is 1x1 if the image is fully opaque or fully transparent.
+    template <typename ImageT>
+    MaskDesc append_mask(const ImageT& image) {
+        const int w = image.width();
+        const int h = image.height();
         const int offset = buffer_.size();
-        descs_.emplace_back(image.width(), image.height(), offset);
-        buffer_.resize(buffer_.size() + image.width() * image.height());
-        for (int y = 0; y < image.height(); y++) {
-            for (int x = 0; x < image.width(); x++) {
+        buffer_.resize(offset + w * h);
+
+        int opaque = 0;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
                 auto pix = image(x, y);
-                buffer_[offset + y * image.width() + x] = (pix.x + pix.y + pix.z > 0);
+                const uint8_t texel = (pix.x + pix.y + pix.z > 0);
+                buffer_[offset + y * w + x] = texel;
+                opaque += texel;
             }
         }
+
+        if (opaque == w * h) {
+            buffer_.resize(offset);
+            descs_.emplace_back();
+        } else if (opaque == 0) {
+            buffer_.resize(offset);
+            descs_.emplace_back(1, 1, transparent_offset());
+        } else {
+            descs_.emplace_back(w, h, offset);
+        }
         return descs_.back();
     }
 
@@ -54,9 +84,35 @@ public:
 
     int mask_count() const { return descs_.size(); }
 
+    /// Returns the texels of the buffer packed in one bit each, e.g. to store them in a file.
+    std::vector<uint8_t> pack() const {
+        std::vector<uint8_t> bits((buffer_.size() + 7) / 8, 0);
+        for (size_t i = 0; i < buffer_.size(); i++)
+            bits[i / 8] |= (buffer_[i] != 0) << (i % 8);
+        return bits;
+    }
+
+    /// Creates a mask buffer from the given number of texels, packed with pack().
+    static MaskBuffer unpack(const std::vector<uint8_t>& bits, size_t texel_count, std::vector<MaskDesc>&& descs) {
+        std::vector<uint8_t> buffer(texel_count);
+        for (size_t i = 0; i < texel_count; i++)
+            buffer[i] = (bits[i / 8] >> (i % 8)) & 1;
+        return MaskBuffer(std::move(buffer), std::move(descs));
+    }
+
 private:
+    /// Returns the offset of a transparent texel, which is shared by all the fully transparent masks.
+    int transparent_offset() {
+        if (transparent_offset_ < 0) {
+            transparent_offset_ = buffer_.size();
+            buffer_.push_back(0);
+        }
+        return transparent_offset_;
+    }
+
     std::vector<uint8_t> buffer_;
     std::vector<MaskDesc> descs_;
+    int transparent_offset_;
 };
 
 } // namespace imba
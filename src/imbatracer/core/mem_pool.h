@@ -2,34 +2,73 @@
 #define IMBA_MEM_POOL_H
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 namespace imba {
 
+/// Pool of scratch memory chunks. The chunks are rounded up to a power of two, and chunks that are
+/// released are kept in one free list per size, so that they can be reused by later allocations.
 template <typename Allocator = std::allocator<uint8_t> >
 class MemoryPool {
+    static constexpr int MIN_CLASS = 8; // Smallest chunk size is 256 bytes
+
 public:
+    MemoryPool() {}
     ~MemoryPool() {
         cleanup();
     }
 
+    MemoryPool(const MemoryPool&) = delete;
+    MemoryPool& operator= (const MemoryPool&) = delete;
+
     template <typename T>
     T* alloc(size_t count) {
-        size_t size = count * sizeof(T);
-        chunks_.emplace_back(alloc_.allocate(size), size);
-        return reinterpret_cast<T*>(chunks_.back().first);
+        const int size_class = chunk_class(count * sizeof(T));
+        if (size_class >= free_.size())
+            free_.resize(size_class + 1);
+
+        Chunk chunk;
+        if (!free_[size_class].empty()) {
+            chunk = free_[size_class].back();
+            free_[size_class].pop_back();
+        } else {
+            const size_t size = size_t(1) << size_class;
+            chunk = Chunk(alloc_.allocate(size), size);
+        }
+
+        chunks_.push_back(chunk);
+        return reinterpret_cast<T*>(chunk.first);
     }
 
-    void cleanup() {
-        for (auto chunk: chunks_)
-            alloc_.deallocate(chunk.first, chunk.second);
+    /// Makes all the chunks available for reuse, without freeing any memory.
+    void release() {
+        for (auto chunk : chunks_)
+            free_[chunk_class(chunk.second)].push_back(chunk);
         chunks_.clear();
     }
 
+    /// Frees all the chunks.
+    void cleanup() {
+        release();
+        for (auto& list : free_) {
+            for (auto chunk : list)
+                alloc_.deallocate(chunk.first, chunk.second);
+        }
+        free_.clear();
+    }
+
 private:
     typedef std::pair<uint8_t*, size_t> Chunk;
 
+    static int chunk_class(size_t size) {
+        int c = MIN_CLASS;
+        while ((size_t(1) << c) < size) c++;
+        return c;
+    }
+
     std::vector<Chunk> chunks_;
+    std::vector<std::vector<Chunk> > free_;
     Allocator alloc_;
 };
 
@@ -0,0 +1,75 @@
+#ifndef IMBA_MEMORY_REPORT_H
+#define IMBA_MEMORY_REPORT_H
+
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace imba {
+
+/// Returns the number of bytes allocated by a vector, including its unused capacity.
+template <typename T, typename Alloc>
+size_t vector_bytes(const std::vector<T, Alloc>& v) { return v.capacity() * sizeof(T); }
+
+/// Number of bytes allocated by the subsystems of the renderer, in host and in device memory.
+/// The subsystems add their entries with add(), the entries with the same name are accumulated.
+class MemoryReport {
+public:
+    void add(const std::string& name, size_t host_bytes, size_t device_bytes = 0) {
+        for (auto& e : entries_) {
+            if (e.name == name) {
+                e.host += host_bytes;
+                e.device += device_bytes;
+                return;
+            }
+        }
+        entries_.push_back(Entry{ name, host_bytes, device_bytes });
+    }
+
+    size_t total_host() const {
+        size_t total = 0;
+        for (auto& e : entries_) total += e.host;
+        return total;
+    }
+
+    size_t total_device() const {
+        size_t total = 0;
+        for (auto& e : entries_) total += e.device;
+        return total;
+    }
+
+    /// Prints the entries as a table, in MB, in the order in which they were added.
+    void print(std::ostream& out) const {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+
+        out << "Memory usage (MB):" << std::endl
+            << "    " << std::left << std::setw(32) << "" << std::right << std::setw(10) << "host" << std::setw(10) << "device" << std::endl
+            << std::fixed << std::setprecision(1);
+        for (auto& e : entries_) {
+            out << "    " << std::left << std::setw(32) << e.name
+                << std::right << std::setw(10) << e.host * mb << std::setw(10) << e.device * mb << std::endl;
+        }
+        out << "    " << std::left << std::setw(32) << "total"
+            << std::right << std::setw(10) << total_host() * mb << std::setw(10) << total_device() * mb << std::endl;
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        size_t host;
+        size_t device;
+    };
+
+    std::vector<Entry> entries_;
+};
+
+} // namespace imba
+
+#endif // IMBA_MEMORY_REPORT_H
@@ -7,6 +7,7 @@
 #include "imbatracer/core/float4.h"
 #include "imbatracer/core/float4x4.h"
 #include "imbatracer/core/float3x4.h"
+#include "imbatracer/core/memory_report.h"
 #include "imbatracer/core/tri.h"
 
 namespace imba {
@@ -15,14 +16,23 @@ namespace imba {
 /// and a collection of attributes.
 class Mesh {
 public:
-    /// A mesh instance that refers to a particular mesh within an array of meshes.
-    struct Instance {
-        int      id;
+    /// Transformation of instances from the local space of their mesh to world space, with its inverse.
+    struct Transform {
         float3x4 mat;
         float3x4 inv_mat;
 
+        Transform() {}
+        Transform(const float4x4& m) : mat(m), inv_mat(invert(m)) {}
+    };
+
+    /// A mesh instance that refers to a particular mesh within an array of meshes, and to its transformation within
+    /// an array of transformations. Several instances can share the same transformation.
+    struct Instance {
+        int id;
+        int transform;
+
         Instance() {}
-        Instance(int i, const float4x4& m) : id(i), mat(m), inv_mat(invert(m)) {}
+        Instance(int i, int t) : id(i), transform(t) {}
     };
 
     enum class AttributeType {
@@ -96,6 +106,10 @@ public:
     AttributeProxy<T> attribute(int i) {
         return AttributeProxy<T>(attrs_[i].data.data(), attrs_[i].stride);
     }
+    /// Raw data of an attribute, attribute_size() bytes long.
+    const uint8_t* attribute_data(int i) const { return attrs_[i].data.data(); }
+    uint8_t* attribute_data(int i) { return attrs_[i].data.data(); }
+    size_t attribute_size(int i) const { return attrs_[i].data.size(); }
     size_t attribute_stride(int i) const { return attrs_[i].stride; }
     AttributeType attribute_type(int i) const { return attrs_[i].type; }
     AttributeBinding attribute_binding(int i) const { return attrs_[i].binding; }
@@ -116,8 +130,24 @@ public:
     void compute_normals(int normal_attr);
     void compute_bounding_box();
 
+    /// Frees the vertices, the indices and the attributes. The bounding box is kept, the counts become zero.
+    void release_data() {
+        std::vector<uint32_t>().swap(indices_);
+        std::vector<float4>().swap(vertices_);
+        for (auto& attr : attrs_) std::vector<uint8_t>().swap(attr.data);
+    }
+
     BBox bounding_box() const { return bbox_; }
 
+    /// Number of bytes allocated for the indices and the vertices.
+    size_t geometry_bytes() const { return vector_bytes(indices_) + vector_bytes(vertices_); }
+    /// Number of bytes allocated for the attributes.
+    size_t attribute_bytes() const {
+        size_t bytes = 0;
+        for (auto& attr : attrs_) bytes += vector_bytes(attr.data);
+        return bytes;
+    }
+
 private:
     static int stride_bytes(AttributeType type) {
         switch (type) {
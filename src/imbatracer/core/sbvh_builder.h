@@ -6,10 +6,17 @@
 #include <cassert>
 #include <chrono>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/core/common.h"
 #include "imbatracer/core/mem_pool.h"
 #include "imbatracer/core/bvh_helper.h"
+#include "imbatracer/core/bvh_stats.h"
 #include "imbatracer/core/float4.h"
 #include "imbatracer/core/stack.h"
 #include "imbatracer/core/mesh.h"
@@ -22,164 +29,81 @@ namespace imba {
 /// that controls when to do a spatial split. The tree is built in depth-first order.
 /// See  Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009
 /// http://www.nvidia.com/docs/IO/77714/sbvh.pdf
+/// The temporary arrays are taken from the given pool, which can be shared by several builds.
+/// The subtrees are built in parallel, and the split candidates of large nodes are evaluated in parallel.
+/// The resulting tree is identical to the one of a serial build: it is first stored in a temporary
+/// representation and then written in depth-first order by the calling thread.
 template <int N, typename CostFn>
 class SplitBvhBuilder {
 public:
+    SplitBvhBuilder(MemoryPool<>& mem_pool)
+        : mem_pool_(mem_pool)
+    {}
+
     template <typename NodeWriter, typename LeafWriter>
     void build(const Mesh& mesh, NodeWriter write_node, LeafWriter write_leaf, int leaf_threshold, float alpha = 1e-5f) {
         assert(leaf_threshold >= 1);
 
-#ifdef STATISTICS
-        total_tris_ += mesh.triangle_count();
         auto time_start = std::chrono::high_resolution_clock::now();
-#endif
+        stats_ = BvhStats();
+        stats_.prim_count = mesh.triangle_count();
+        spatial_splits_ = 0;
+        object_splits_ = 0;
 
         const int tri_count = mesh.triangle_count();
 
-        Ref* initial_refs = mem_pool_.alloc<Ref>(tri_count);
-        right_bbs_ = mem_pool_.alloc<BBox>(std::max((int)spatial_bins, tri_count));
-        BBox mesh_bb = BBox::empty();
-        for (int i = 0; i < tri_count; i++) {
-            const Tri& tri = mesh.triangle(i);
-            tri.compute_bbox(initial_refs[i].bb);
-            mesh_bb.extend(initial_refs[i].bb);
-            initial_refs[i].id = i;
-        }
-
-        const float spatial_threshold = mesh_bb.half_area() * alpha;
-
-        Stack<Node> stack;
-        stack.push(initial_refs, tri_count, mesh_bb);
-
-        while (!stack.is_empty()) {
-            MultiNode<Node, N> multi_node(stack.pop());
-
-            // Iterate over the available split candidates in the multi-node
-            while (!multi_node.is_full() && multi_node.node_available()) {
-                const int node_id = multi_node.next_node();
-                Node node = multi_node.nodes[node_id];
-                Ref* refs = node.refs;
-                int ref_count = node.ref_count;
-                const BBox& parent_bb = node.bbox;
-                assert(ref_count != 0);
-
-                if (ref_count <= leaf_threshold) {
-                    // This candidate does not have enough triangles
-                    multi_node.nodes[node_id].tested = true;
-                    continue;
+        Ref* initial_refs = alloc<Ref>(tri_count);
+        const BBox mesh_bb = tbb::parallel_reduce(tbb::blocked_range<int>(0, tri_count), BBox::empty(),
+            [&] (const tbb::blocked_range<int>& range, BBox bb) {
+                for (int i = range.begin(); i != range.end(); i++) {
+                    const Tri& tri = mesh.triangle(i);
+                    tri.compute_bbox(initial_refs[i].bb);
+                    bb.extend(initial_refs[i].bb);
+                    initial_refs[i].id = i;
                 }
+                return bb;
+            },
+            [] (BBox a, const BBox& b) { return a.extend(b); });
 
-                // Try object splits
-                ObjectSplit object_split;
-                for (int axis = 0; axis < 3; axis++)
-                    find_object_split(object_split, axis, refs, ref_count);
-
-                SpatialSplit spatial_split;
-                if (BBox(object_split.left_bb).overlap(object_split.right_bb).half_area() > spatial_threshold) {
-                    // Try spatial splits
-                    for (int axis = 0; axis < 3; axis++) {
-                        if (parent_bb.min[axis] == parent_bb.max[axis])
-                            continue;
-                        find_spatial_split(spatial_split, parent_bb, mesh, axis, refs, ref_count);
-                    }
-                }
+        // The blocks of build nodes from the previous build have been returned to the pool.
+        for (auto& scratch : scratch_) scratch.nodes_left = 0;
 
-                bool spatial = spatial_split.cost < object_split.cost;
-                const float split_cost = spatial ? spatial_split.cost : object_split.cost;
+        mesh_ = &mesh;
+        leaf_threshold_ = leaf_threshold;
+        spatial_threshold_ = mesh_bb.half_area() * alpha;
 
-                if (split_cost + CostFn::traversal_cost(parent_bb.half_area()) >= node.cost) {
-                    // Split is not beneficial
-                    multi_node.nodes[node_id].tested = true;
-                    continue;
-                }
-
-                if (spatial) {
-                    Ref* left_refs, *right_refs;
-                    BBox left_bb, right_bb;
-                    int left_count, right_count;
-                    apply_spatial_split(spatial_split, mesh,
-                                        refs, ref_count,
-                                        left_refs, left_count, left_bb,
-                                        right_refs, right_count, right_bb);
-
-                    multi_node.split_node(node_id,
-                                          Node(left_refs,  left_count,  left_bb),
-                                          Node(right_refs, right_count, right_bb));
-
-#ifdef STATISTICS
-                    spatial_splits_++;
-#endif
-                } else {
-                    // Partitioning can be done in-place
-                    apply_object_split(object_split, refs, ref_count);
-
-                    const int right_count = ref_count - object_split.left_count;
-                    const int left_count = object_split.left_count;
-
-                    Ref *right_refs = refs + object_split.left_count;
-                    Ref* left_refs = refs;
-
-                    multi_node.split_node(node_id,
-                                          Node(left_refs,  left_count,  object_split.left_bb),
-                                          Node(right_refs, right_count, object_split.right_bb));
-#ifdef STATISTICS
-                    object_splits_++;
-#endif
-                }
-            }
-
-            assert(multi_node.count > 0);
-            // Process the smallest nodes first
-            multi_node.sort_nodes();
-
-            // The multi-node is ready to be stored
-            if (multi_node.is_leaf()) {
-                // Store a leaf if it could not be split
-                const Node& node = multi_node.nodes[0];
-                assert(node.tested);
-                make_leaf(node, write_leaf);
-            } else {
-                // Store a multi-node
-                make_node(multi_node, write_node);
-                assert(N > 2 || multi_node.count == 2);
-
-                if (stack.size() + multi_node.count < stack.capacity()) {
-                    for (int i = multi_node.count - 1; i >= 0; i--) {
-                        stack.push(multi_node.nodes[i]);
-                    }
-                } else {
-                    // Insufficient space on the stack, we have to stop recursion here
-                    for (int i = 0; i < multi_node.count; i++) {
-                        make_leaf(multi_node.nodes[i], write_leaf);
-                    }
-                }
-            }
-        }
+        const BuildNode* root = build_subtree(Node(initial_refs, tri_count, mesh_bb), 0);
+        write_build_tree(root,
+            [&] (const BuildNode& node) { make_node(node, write_node); },
+            [&] (const BuildNode& node) { make_leaf(node, write_leaf); });
 
-#ifdef STATISTICS
         auto time_end = std::chrono::high_resolution_clock::now();
-        total_time_ += std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
-#endif
+        stats_.build_time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_end - time_start).count();
+        stats_.sah_cost /= root->bbox.half_area();
+        stats_.object_splits = object_splits_;
+        stats_.spatial_splits = spatial_splits_;
 
-        mem_pool_.cleanup();
+        mem_pool_.release();
     }
 
-#ifdef STATISTICS
-    void print_stats() const {
-        std::cout << "BVH built in " << total_time_ << "ms ("
-                  << total_nodes_ << " nodes, "
-                  << total_leaves_ << " leaves, "
-                  << object_splits_ << " object splits, "
-                  << spatial_splits_ << " spatial splits, "
-                  << "+" << (total_refs_ - total_tris_) * 100  / total_tris_ << "% references)"
-                  << std::endl;
-    }
-#endif
+    /// Returns the statistics of the last build.
+    const BvhStats& stats() const { return stats_; }
 
 private:
     static constexpr int spatial_bins = 64;
     static constexpr int binning_passes = 2;
 
+    // Nodes with more references than this have their split candidates evaluated in parallel.
+    static constexpr int parallel_split_threshold = 16384;
+    // Nodes with more references than this have their children built in parallel.
+    static constexpr int parallel_subtree_threshold = 1024;
+    // Arrays with more references than this are sorted in parallel.
+    static constexpr int parallel_sort_threshold = 4096;
+    // Number of build nodes allocated at once by a thread.
+    static constexpr int node_block_size = 256;
+    // Depth of the traversal stack used by the serial build, which limits the recursion.
+    static constexpr int stack_capacity = Stack<int>::capacity();
+
     struct Ref {
         uint32_t id;
         BBox bb;
@@ -200,7 +124,7 @@ private:
         BBox left_bb, right_bb;
         int left_count;
 
-        ObjectSplit() : cost (FLT_MAX) {}
+        ObjectSplit() : axis(0), cost(FLT_MAX), left_bb(BBox::empty()), right_bb(BBox::empty()), left_count(0) {}
     };
 
     struct SpatialSplit {
@@ -208,7 +132,7 @@ private:
         float cost;
         float position;
 
-        SpatialSplit() : cost (FLT_MAX) {}
+        SpatialSplit() : axis(0), cost(FLT_MAX), position(0.0f) {}
     };
 
     struct Node {
@@ -228,63 +152,269 @@ private:
         int size() const { return ref_count; }
     };
 
+    struct Leaf {
+        const Ref* refs;
+        int ref_count;
+    };
+
+    typedef imba::BuildNode<N, Leaf> BuildNode;
+
+    /// Temporary memory owned by each thread.
+    struct Scratch {
+        std::vector<BBox> right_bbs;
+        std::vector<Ref> dup_refs;
+        BuildNode* nodes;
+        int nodes_left;
+
+        Scratch() : nodes(nullptr), nodes_left(0) {}
+    };
+
+    template <typename T>
+    T* alloc(size_t count) {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        return mem_pool_.template alloc<T>(count);
+    }
+
+    BuildNode* new_build_node(Scratch& scratch) {
+        if (scratch.nodes_left == 0) {
+            scratch.nodes = alloc<BuildNode>(node_block_size);
+            scratch.nodes_left = node_block_size;
+        }
+        scratch.nodes_left--;
+        return scratch.nodes++;
+    }
+
+    BuildNode* new_leaf(Scratch& scratch, const Node& node) {
+        BuildNode* leaf = new_build_node(scratch);
+        leaf->bbox = node.bbox;
+        leaf->count = 0;
+        leaf->leaf.refs = node.refs;
+        leaf->leaf.ref_count = node.ref_count;
+        return leaf;
+    }
+
+    /// Builds the subtree rooted at the given node. The stack size is the number of nodes that would be
+    /// on the stack of a serial depth-first build when this node is processed, and limits the depth of the tree.
+    const BuildNode* build_subtree(const Node& root, int stack_size) {
+        MultiNode<Node, N> multi_node(root);
+
+        // Iterate over the available split candidates in the multi-node
+        while (!multi_node.is_full() && multi_node.node_available()) {
+            const int node_id = multi_node.next_node();
+            const Node node = multi_node.nodes[node_id];
+            assert(node.ref_count != 0);
+
+            Node left, right;
+            if (node.ref_count <= leaf_threshold_ || !split(node, left, right)) {
+                // This candidate does not have enough triangles, or splitting it is not beneficial
+                multi_node.nodes[node_id].tested = true;
+                continue;
+            }
+
+            multi_node.split_node(node_id, left, right);
+        }
+
+        assert(multi_node.count > 0);
+        // Process the smallest nodes first
+        multi_node.sort_nodes();
+
+        Scratch& scratch = scratch_.local();
+
+        if (multi_node.is_leaf()) {
+            // Store a leaf if it could not be split
+            assert(multi_node.nodes[0].tested);
+            return new_leaf(scratch, multi_node.nodes[0]);
+        }
+
+        assert(N > 2 || multi_node.count == 2);
+        BuildNode* build_node = new_build_node(scratch);
+        build_node->bbox = multi_node.bbox;
+        build_node->count = multi_node.count;
+
+        if (stack_size + multi_node.count < stack_capacity) {
+            // The children are processed in order, so the later siblings of a child are on the stack meanwhile.
+            auto build_child = [&] (int i) {
+                build_node->children[i] = build_subtree(multi_node.nodes[i], stack_size + multi_node.count - 1 - i);
+            };
+
+            if (root.ref_count > parallel_subtree_threshold) {
+                tbb::task_group group;
+                for (int i = 0; i < multi_node.count; i++)
+                    group.run([&build_child, i] { build_child(i); });
+                group.wait();
+            } else {
+                for (int i = 0; i < multi_node.count; i++)
+                    build_child(i);
+            }
+        } else {
+            // Insufficient space on the stack, we have to stop recursion here
+            for (int i = 0; i < multi_node.count; i++)
+                build_node->children[i] = new_leaf(scratch, multi_node.nodes[i]);
+        }
+
+        return build_node;
+    }
+
+    /// Finds the best split of the given node and applies it. Returns false if no split is beneficial.
+    bool split(const Node& node, Node& left, Node& right) {
+        Ref* refs = node.refs;
+        const int ref_count = node.ref_count;
+        const BBox& parent_bb = node.bbox;
+        const bool parallel = ref_count > parallel_split_threshold;
+
+        // Try object splits
+        ObjectSplit object_split;
+        Ref* sorted_refs[3] = { refs, refs, refs };
+        if (parallel) {
+            // Every axis needs its own sorted copy of the references, the original array is sorted along the last axis.
+            sorted_refs[0] = alloc<Ref>(ref_count);
+            sorted_refs[1] = alloc<Ref>(ref_count);
+            std::copy(refs, refs + ref_count, sorted_refs[0]);
+            std::copy(refs, refs + ref_count, sorted_refs[1]);
+
+            ObjectSplit axis_splits[3];
+            tbb::parallel_for(0, 3, [&] (int axis) {
+                std::vector<BBox> right_bbs(ref_count);
+                axis_splits[axis] = find_object_split(axis, sorted_refs[axis], ref_count, right_bbs.data());
+            });
+            for (int axis = 0; axis < 3; axis++) {
+                if (axis_splits[axis].cost < object_split.cost) object_split = axis_splits[axis];
+            }
+        } else {
+            auto& right_bbs = scratch_.local().right_bbs;
+            if (right_bbs.size() < ref_count) right_bbs.resize(ref_count);
+            for (int axis = 0; axis < 3; axis++) {
+                const ObjectSplit axis_split = find_object_split(axis, refs, ref_count, right_bbs.data());
+                if (axis_split.cost < object_split.cost) object_split = axis_split;
+            }
+        }
+
+        SpatialSplit spatial_split;
+        if (BBox(object_split.left_bb).overlap(object_split.right_bb).half_area() > spatial_threshold_) {
+            // Try spatial splits. The result of the binning along an axis only depends on the previous axes through the
+            // cost of their best split: the refinement passes are only done if the first pass finds a better split.
+            SpatialSplit axis_splits[3];
+            float first_pass_costs[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+            auto find_axis_split = [&] (int axis) {
+                if (parent_bb.min[axis] != parent_bb.max[axis])
+                    find_spatial_split(axis_splits[axis], first_pass_costs[axis], parent_bb, axis, refs, ref_count);
+            };
+
+            if (parallel)
+                tbb::parallel_for(0, 3, find_axis_split);
+            else
+                for (int axis = 0; axis < 3; axis++) find_axis_split(axis);
+
+            for (int axis = 0; axis < 3; axis++) {
+                if (first_pass_costs[axis] < spatial_split.cost) spatial_split = axis_splits[axis];
+            }
+        }
+
+        bool spatial = spatial_split.cost < object_split.cost;
+        const float split_cost = spatial ? spatial_split.cost : object_split.cost;
+
+        if (split_cost + CostFn::traversal_cost(parent_bb.half_area()) >= node.cost) {
+            // Split is not beneficial
+            return false;
+        }
+
+        if (spatial) {
+            Ref* left_refs, *right_refs;
+            BBox left_bb, right_bb;
+            int left_count, right_count;
+            apply_spatial_split(spatial_split, refs, ref_count,
+                                left_refs, left_count, left_bb,
+                                right_refs, right_count, right_bb);
+
+            left  = Node(left_refs,  left_count,  left_bb);
+            right = Node(right_refs, right_count, right_bb);
+
+            spatial_splits_++;
+        } else {
+            // Partitioning can be done in-place
+            if (sorted_refs[object_split.axis] != refs)
+                std::copy(sorted_refs[object_split.axis], sorted_refs[object_split.axis] + ref_count, refs);
+            else
+                apply_object_split(object_split, refs, ref_count);
+
+            const int right_count = ref_count - object_split.left_count;
+            const int left_count = object_split.left_count;
+
+            Ref *right_refs = refs + object_split.left_count;
+            Ref* left_refs = refs;
+
+            left  = Node(left_refs,  left_count,  object_split.left_bb);
+            right = Node(right_refs, right_count, object_split.right_bb);
+            object_splits_++;
+        }
+
+        return true;
+    }
+
     template <typename NodeWriter>
-    void make_node(const MultiNode<Node, N>& multi_node, NodeWriter write_node) {
-        write_node(multi_node.bbox, multi_node.count, [&] (int i) {
-            return multi_node.nodes[i].bbox;
+    void make_node(const BuildNode& node, NodeWriter& write_node) {
+        write_node(node.bbox, node.count, [&] (int i) {
+            return node.children[i]->bbox;
         });
-#ifdef STATISTICS
-        total_nodes_++;
-#endif
+        stats_.node_count++;
+        stats_.sah_cost += CostFn::traversal_cost(node.bbox.half_area());
     }
 
     template <typename LeafWriter>
-    void make_leaf(const Node& node, LeafWriter write_leaf) {
-        write_leaf(node.bbox, node.ref_count, [&] (int i) {
-            return node.refs[i].id;
+    void make_leaf(const BuildNode& node, LeafWriter& write_leaf) {
+        write_leaf(node.bbox, node.leaf.ref_count, [&] (int i) {
+            return node.leaf.refs[i].id;
         });
-#ifdef STATISTICS
-        total_leaves_++;
-        total_refs_ += node.ref_count;
-#endif
+        stats_.add_leaf(node.leaf.ref_count);
+        stats_.sah_cost += CostFn::leaf_cost(node.leaf.ref_count, node.bbox.half_area());
     }
 
     void sort_refs(int axis, Ref* refs, int ref_count) {
-        // Sort the primitives based on their centroids
-        std::sort(refs, refs + ref_count, [axis] (const Ref& a, const Ref& b) {
+        // Sort the primitives based on their centroids. The order is total, since a node never
+        // contains two references to the same triangle, so the parallel sort gives the same result.
+        auto cmp = [axis] (const Ref& a, const Ref& b) {
             const float ca = a.bb.min[axis] + a.bb.max[axis];
             const float cb = b.bb.min[axis] + b.bb.max[axis];
             return (ca < cb) || (ca == cb && a.id < b.id);
-        });
+        };
+        // The sort is isolated: a thread waiting for it must not pick up another subtree, which would reuse the
+        // scratch memory of the thread, e.g. the bounding boxes that find_object_split() is still writing.
+        if (ref_count > parallel_sort_threshold)
+            tbb::this_task_arena::isolate([&] { tbb::parallel_sort(refs, refs + ref_count, cmp); });
+        else
+            std::sort(refs, refs + ref_count, cmp);
     }
 
-    void find_object_split(ObjectSplit& split, int axis, Ref* refs, int ref_count) {
+    /// Finds the best object split along the given axis. Sorts the references along the axis.
+    ObjectSplit find_object_split(int axis, Ref* refs, int ref_count, BBox* right_bbs) {
         assert(ref_count > 0);
 
+        ObjectSplit split;
         sort_refs(axis, refs, ref_count);
 
         // Sweep from the right and accumulate the bounding boxes
         BBox cur_bb = BBox::empty();
         for (int i = ref_count - 1; i > 0; i--) {
             cur_bb.extend(refs[i].bb);
-            right_bbs_[i - 1] = cur_bb;
+            right_bbs[i - 1] = cur_bb;
         }
 
         // Sweep from the left and compute the SAH cost
         cur_bb = BBox::empty();
         for (int i = 0; i < ref_count - 1; i++) {
             cur_bb.extend(refs[i].bb);
-            const float cost = CostFn::leaf_cost(i + 1, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - i - 1, right_bbs_[i].half_area());
+            const float cost = CostFn::leaf_cost(i + 1, cur_bb.half_area()) + CostFn::leaf_cost(ref_count - i - 1, right_bbs[i].half_area());
             if (cost < split.cost) {
                 split.axis = axis;
                 split.cost = cost;
                 split.left_count = i + 1;
                 split.left_bb = cur_bb;
-                split.right_bb = right_bbs_[i];
+                split.right_bb = right_bbs[i];
             }
         }
 
         assert(split.left_count != 0 && split.left_count != ref_count);
+        return split;
     }
 
     void apply_object_split(const ObjectSplit& split, Ref* refs, int ref_count) {
@@ -292,9 +422,11 @@ private:
     }
 
     int spatial_binning(Bin* bins, int num_bins, SpatialSplit& split,
-                         const Mesh& mesh, int axis,
-                         Ref* refs, int ref_count,
+                         int axis, Ref* refs, int ref_count,
                          float axis_min, float axis_max) {
+        const Mesh& mesh = *mesh_;
+        BBox right_bbs[spatial_bins];
+
         // Initialize bins
         for (int i = 0; i < num_bins; i++) {
             bins[i].entry = 0;
@@ -328,7 +460,7 @@ private:
         BBox cur_bb = BBox::empty();
         for (int i = num_bins - 1; i > 0; i--) {
             cur_bb.extend(bins[i].bb);
-            right_bbs_[i - 1] = cur_bb;
+            right_bbs[i - 1] = cur_bb;
         }
 
         // Sweep from the left and compute the SAH cost
@@ -341,7 +473,7 @@ private:
             right_count -= bins[i].exit;
             cur_bb.extend(bins[i].bb);
 
-            const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(right_count, right_bbs_[i].half_area());
+            const float cost = CostFn::leaf_cost(left_count, cur_bb.half_area()) + CostFn::leaf_cost(right_count, right_bbs[i].half_area());
             if (cost < split.cost) {
                 split.axis = axis;
                 split.cost = cost;
@@ -352,9 +484,9 @@ private:
         return split_index;
     }
 
-    void find_spatial_split(SpatialSplit& split, const BBox& parent_bb,
-                            const Mesh& mesh, int axis,
-                            Ref* refs, int ref_count) {
+    /// Finds the best spatial split along the given axis, and the cost of the best split found by the first binning pass.
+    void find_spatial_split(SpatialSplit& split, float& first_pass_cost, const BBox& parent_bb,
+                            int axis, Ref* refs, int ref_count) {
         float axis_min = parent_bb.min[axis];
         float axis_max = parent_bb.max[axis];
         assert(axis_max > axis_min);
@@ -364,8 +496,9 @@ private:
         do {
             if (axis_max <= axis_min) break;
 
-            int split_index = spatial_binning(bins, spatial_bins, split, mesh, axis, refs, ref_count, axis_min, axis_max);
+            int split_index = spatial_binning(bins, spatial_bins, split, axis, refs, ref_count, axis_min, axis_max);
             if (split_index < 0) break;
+            if (n == 0) first_pass_cost = split.cost;
 
             float bin_size = (axis_max - axis_min) / spatial_bins;
             axis_min = split.position - bin_size;
@@ -374,7 +507,7 @@ private:
         } while (n < binning_passes);
     }
 
-    void apply_spatial_split(const SpatialSplit& split, const Mesh& mesh,
+    void apply_spatial_split(const SpatialSplit& split,
                              Ref* refs, int ref_count,
                              Ref*& left_refs, int& left_count, BBox& left_bb,
                              Ref*& right_refs, int& right_count, BBox& right_bb) {
@@ -382,6 +515,7 @@ private:
         // [0.. left_count[ : references that are completely on the left
         // [left_count.. first_right[ : references that lie in between
         // [first_right.. ref_count[ : references that are completely on the right
+        const Mesh& mesh = *mesh_;
         int first_right = ref_count;
         int cur_ref = 0;
 
@@ -404,7 +538,8 @@ private:
         right_count = ref_count - first_right;
 
         // Handle straddling references
-        std::vector<Ref> dup_refs;
+        auto& dup_refs = scratch_.local().dup_refs;
+        dup_refs.clear();
         while (left_count < first_right) {
             const Ref& ref = refs[left_count];
             BBox left_split_bb, right_split_bb;
@@ -456,7 +591,7 @@ private:
         } else {
             // We need to reallocate a new array for the right child
             left_refs = refs;
-            right_refs = mem_pool_.alloc<Ref>(right_count);
+            right_refs = alloc<Ref>(right_count);
             std::copy(refs + first_right, refs + ref_count, right_refs + dup_refs.size());
             std::copy(dup_refs.begin(), dup_refs.end(), right_refs);
         }
@@ -466,18 +601,17 @@ private:
     }
 
 
-#ifdef STATISTICS
-    long total_time_ = 0;
-    int total_nodes_ = 0;
-    int total_leaves_ = 0;
-    int total_refs_ = 0;
-    int total_tris_ = 0;
-    int spatial_splits_ = 0;
-    int object_splits_ = 0;
-#endif
+    BvhStats stats_;
+    std::atomic<int> spatial_splits_{0};
+    std::atomic<int> object_splits_{0};
+
+    const Mesh* mesh_;
+    int leaf_threshold_;
+    float spatial_threshold_;
 
-    BBox* right_bbs_;
-    MemoryPool<> mem_pool_;
+    tbb::enumerable_thread_specific<Scratch> scratch_;
+    std::mutex pool_mutex_;
+    MemoryPool<>& mem_pool_;
 };
 
 } // namespace imba
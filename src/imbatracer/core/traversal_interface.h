@@ -16,4 +16,8 @@ using traversal_cpu::TransparencyMask;
 using traversal_cpu::Ray;
 using traversal_cpu::Hit;
 
+/// Number of children of the nodes used for CPU traversal. It is given by the node layout of the traversal library,
+/// 4 for SSE and 8 for AVX, and every node is built with as many children as fit into its SIMD lanes.
+constexpr int CPU_NODE_WIDTH = sizeof(traversal_cpu::Node::children) / sizeof(traversal_cpu::Node::children[0]);
+
 #endif
\ No newline at end of file
@@ -4,11 +4,16 @@
 #include <locale>
 #include <memory>
 #include <fstream>
+#include <unordered_map>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 // For isnan
 #include <math.h>
 
 #include "imbatracer/frontend/build_scene.h"
+#include "imbatracer/frontend/scene_cache.h"
 #include "imbatracer/loaders/loaders.h"
 #include "imbatracer/core/adapter.h"
 
@@ -52,36 +57,78 @@ struct CompareIndex {
 
 using MtlLightBuffer = std::unordered_map<int, rgb>;
 
-void convert_materials(const Path& path, const obj::File& obj_file, const obj::MaterialLib& mtl_lib, Scene& scene,
-                       MtlLightBuffer& mtl_to_light_intensity, MaskBuffer& masks) {
-    std::unordered_map<std::string, int> tex_map;
-    auto load_texture = [&](const std::string& name) {
-        auto tex = tex_map.find(name);
-        if (tex != tex_map.end())
-            return tex->second;
-
-        std::cout << "  Loading texture " << name << "..." << std::flush;
-
-        Image img;
-        int id;
-        if (load_image(name, img)) {
-            id = scene.texture_count();
-            tex_map.emplace(name, id);
-            scene.textures().emplace_back(new TextureSampler(std::move(img)));
+/// Adds a material to the scene, keeping its description so that it can be cached.
+static void add_material(Scene& scene, SceneDesc& desc, const MaterialDesc& mat) {
+    desc.materials.push_back(mat);
+    scene.materials().emplace_back(create_material(mat, scene));
+}
+
+/// Adds a light to the scene, keeping its description so that it can be cached.
+static void add_light(Scene& scene, SceneDesc& desc, const LightDesc& light) {
+    desc.lights.push_back(light);
+    scene.lights().emplace_back(create_light(light, scene));
+}
+
+/// Textures shared by all the meshes of the scene.
+struct TextureCache {
+    std::unordered_map<std::string, int> ids;   ///< Texture id for every file, or -1 if it could not be loaded
+    std::unordered_map<int, MaskBuffer::MaskDesc> mask_descs;   ///< Mask of the textures used as masks
+};
+
+/// Decodes the images that are not in the cache yet concurrently, and adds them to the scene in the order of the list.
+static void load_textures(const std::vector<std::string>& names, Scene& scene, SceneDesc& desc, TextureCache& cache) {
+    std::vector<std::string> new_names;
+    for (auto& name : names) {
+        if (cache.ids.emplace(name, -1).second)
+            new_names.push_back(name);
+    }
+
+    std::vector<Image> images(new_names.size());
+    std::vector<char> loaded(new_names.size());
+    tbb::parallel_for(0, static_cast<int>(new_names.size()), [&] (int i) {
+        loaded[i] = load_image(new_names[i], images[i]);
+    });
+
+    for (int i = 0; i < new_names.size(); i++) {
+        std::cout << "  Loading texture " << new_names[i] << "..." << std::flush;
+        desc.dependencies.push_back(new_names[i]);
+
+        if (loaded[i]) {
+            cache.ids[new_names[i]] = scene.texture_count();
+            scene.textures().emplace_back(new TextureSampler(std::move(images[i])));
             std::cout << std::endl;
         } else {
-            id = -1;
-            tex_map.emplace(name, -1);
             std::cout << " FAILED!" << std::endl;
         }
+    }
+}
+
+void convert_materials(const Path& path, const obj::File& obj_file, const obj::MaterialLib& mtl_lib, Scene& scene, SceneDesc& desc,
+                       TextureCache& textures, MtlLightBuffer& mtl_to_light_intensity, MaskBuffer& masks) {
+    // Decode all the textures used by the materials first, in the order in which the materials use them.
+    std::vector<std::string> tex_names;
+    for (int i = 1; i < obj_file.materials.size(); i++) {
+        auto it = mtl_lib.find(obj_file.materials[i]);
+        if (it == mtl_lib.end()) continue;
+
+        const obj::Material& mat = it->second;
+        if (!mat.map_bump.empty())
+            tex_names.push_back(path.base_name() + "/" + mat.map_bump);
+        if (!mat.map_kd.empty() && mat.illum != 5 && mat.illum != 7)
+            tex_names.push_back(path.base_name() + "/" + mat.map_kd);
+        if (!mat.map_d.empty())
+            tex_names.push_back(path.base_name() + "/" + mat.map_d);
+    }
+    load_textures(tex_names, scene, desc, textures);
 
-        return id;
+    auto load_texture = [&](const std::string& name) {
+        return textures.ids.find(name)->second;
     };
 
-    std::unordered_map<int, int> mask_map;
+    auto& mask_map = textures.mask_descs;
 
     // Add a dummy material, for objects that have no material
-    scene.materials().emplace_back(new DiffuseMaterial);
+    add_material(scene, desc, MaterialDesc(MaterialDesc::DIFFUSE));
     masks.add_desc();
 
     for (int i = 1; i < obj_file.materials.size(); i++) {
@@ -91,7 +138,7 @@ void convert_materials(const Path& path, const obj::File& obj_file, const obj::M
         int mask_id = -1;
         if (it == mtl_lib.end()) {
             // Add a dummy material in this case
-            scene.materials().emplace_back(new DiffuseMaterial);
+            add_material(scene, desc, MaterialDesc(MaterialDesc::DIFFUSE));
         } else {
             const obj::Material& mat = it->second;
 
@@ -113,51 +160,42 @@ void convert_materials(const Path& path, const obj::File& obj_file, const obj::M
             if (is_emissive)
                 mtl_to_light_intensity.insert(std::make_pair(scene.material_count(), mat.ke));
 
-            TextureSampler* bump_sampler = nullptr;
+            int bump_id = -1;
             if (!mat.map_bump.empty()) {
                 // Load the bump map.
                 const std::string img_file = path.base_name() + "/" + mat.map_bump;
-                int sampler_id = load_texture(img_file);
-                if (sampler_id >= 0)
-                    bump_sampler = scene.texture(sampler_id).get();
+                bump_id = load_texture(img_file);
             }
 
-            if (mat.illum == 5)
-                scene.materials().emplace_back(new MirrorMaterial(1.0f, mat.ns, mat.ks, bump_sampler));
-            else if (mat.illum == 7)
-                scene.materials().emplace_back(new GlassMaterial(mat.ni, mat.tf, mat.ks, bump_sampler));
-            else if (is_phong){
-                Material* mtl;
-                if (!mat.map_kd.empty()) {
-                    const std::string img_file = path.base_name() + "/" + mat.map_kd;
-
-                    int sampler_id = load_texture(img_file);
-                    if (sampler_id < 0) {
-                        mtl = new GlossyMaterial(mat.ns, mat.ks, rgb(1.0f, 0.0f, 1.0f), bump_sampler);
-                    } else {
-                        mtl = new GlossyMaterial(mat.ns, mat.ks, scene.texture(sampler_id).get(), bump_sampler);
-                    }
-                } else {
-                    mtl = new GlossyMaterial(mat.ns, mat.ks, mat.kd, bump_sampler);
-                }
-
-                scene.materials().emplace_back(mtl);
+            if (mat.illum == 5) {
+                MaterialDesc mtl(MaterialDesc::MIRROR);
+                mtl.eta = 1.0f;
+                mtl.exponent = mat.ns;
+                mtl.specular = mat.ks;
+                mtl.bump = bump_id;
+                add_material(scene, desc, mtl);
+            } else if (mat.illum == 7) {
+                MaterialDesc mtl(MaterialDesc::GLASS);
+                mtl.eta = mat.ni;
+                mtl.diffuse = mat.tf;
+                mtl.specular = mat.ks;
+                mtl.bump = bump_id;
+                add_material(scene, desc, mtl);
             } else {
-                Material* mtl;
+                MaterialDesc mtl(is_phong ? MaterialDesc::GLOSSY : MaterialDesc::DIFFUSE);
+                mtl.exponent = mat.ns;
+                mtl.specular = mat.ks;
+                mtl.diffuse = mat.kd;
+                mtl.bump = bump_id;
                 if (!mat.map_kd.empty()) {
                     const std::string img_file = path.base_name() + "/" + mat.map_kd;
 
-                    int sampler_id = load_texture(img_file);
-                    if (sampler_id < 0) {
-                        mtl = new DiffuseMaterial(rgb(1.0f, 0.0f, 1.0f), bump_sampler);
-                    } else {
-                        mtl = new DiffuseMaterial(scene.texture(sampler_id).get(), bump_sampler);
-                    }
-                } else {
-                    mtl = new DiffuseMaterial(mat.kd, bump_sampler);
+                    mtl.texture = load_texture(img_file);
+                    if (mtl.texture < 0)
+                        mtl.diffuse = rgb(1.0f, 0.0f, 1.0f);
                 }
 
-                scene.materials().emplace_back(mtl);
+                add_material(scene, desc, mtl);
             }
 
             // If specified, load the alpha map
@@ -167,13 +205,12 @@ void convert_materials(const Path& path, const obj::File& obj_file, const obj::M
         }
 
         if (mask_id >= 0) {
-            auto offset = mask_map.find(mask_id);
-            const auto& image = scene.texture(mask_id)->image();
-            if (offset != mask_map.end()) {
-                masks.add_desc(MaskBuffer::MaskDesc(image.width(), image.height(), offset->second));
+            auto mask = mask_map.find(mask_id);
+            if (mask != mask_map.end()) {
+                masks.add_desc(mask->second);
             } else {
-                auto desc = masks.append_mask(image);
-                mask_map.emplace(mask_id, desc.offset);
+                auto mask_desc = masks.append_mask(*scene.texture(mask_id));
+                mask_map.emplace(mask_id, mask_desc);
             }
         } else {
             masks.add_desc();
@@ -181,7 +218,7 @@ void convert_materials(const Path& path, const obj::File& obj_file, const obj::M
     }
 }
 
-void create_mesh(const obj::File& obj_file, Scene& scene, std::vector<TriangleLight>& tri_lights, MtlLightBuffer& mtl_to_light_intensity,
+void create_mesh(const obj::File& obj_file, Scene& scene, SceneDesc& desc, std::vector<TriangleLight>& tri_lights, MtlLightBuffer& mtl_to_light_intensity,
                  int mtl_offset, MaskBuffer& masks) {
     // This function creates a big mesh out of the whole scene.
     scene.meshes().emplace_back();
@@ -222,22 +259,23 @@ void create_mesh(const obj::File& obj_file, Scene& scene, std::vector<TriangleLi
                     // as the emitter might be different (different area)
                     auto iter = mtl_to_light_intensity.find(mtl_idx);
                     if (iter != mtl_to_light_intensity.end()) {
-                        auto mat = scene.material(mtl_idx).get();
-                        scene.materials().emplace_back(mat->duplicate());
-                        mat = scene.materials().back().get();
-                        mtl_idx = scene.materials().size() - 1;
+                        auto p0 = obj_file.vertices[face.indices[0].v];
+                        auto p1 = obj_file.vertices[face.indices[i].v];
+                        auto p2 = obj_file.vertices[face.indices[i+1].v];
+
+                        MaterialDesc mat = desc.materials[mtl_idx];
+                        mat.emissive = 1;
+                        mat.emit_intensity = iter->second;
+                        mat.emit_area = Tri(p0, p1, p2).area();
+                        mtl_idx = scene.materials().size();
+                        add_material(scene, desc, mat);
 
                         // We created a new material, thus we have to add a corresponding alpha mask as well.
                         // TODO: Change this if support for masked light sources is desired.
                         masks.add_desc();
 
-                        auto p0 = obj_file.vertices[face.indices[0].v];
-                        auto p1 = obj_file.vertices[face.indices[i].v];
-                        auto p2 = obj_file.vertices[face.indices[i+1].v];
-
                         // Create a light source for this emissive object.
                         tri_lights.emplace_back(iter->second, p0, p1, p2);
-                        mat->set_emitter(new AreaEmitter(iter->second, Tri(p0, p1, p2).area()));
                     }
 
                     // Now emplace the triangle with either the original or the new material
@@ -301,9 +339,61 @@ void create_mesh(const obj::File& obj_file, Scene& scene, std::vector<TriangleLi
     }
 }
 
+/// Hashes the geometry and material assignment of an OBJ file, to detect meshes that are loaded more than once.
+static uint64_t obj_content_hash(const Path& obj_path, const obj::File& obj_file, BvhBuilderType builder) {
+    // FNV-1a, one 32-bit word at a time
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto add = [&h] (uint32_t word) {
+        h ^= word;
+        h *= 0x100000001b3ull;
+    };
+    auto add_float = [&add] (float f) {
+        uint32_t word;
+        memcpy(&word, &f, sizeof(float));
+        add(word);
+    };
+    auto add_string = [&add] (const std::string& str) {
+        add(str.size());
+        for (char c : str) add(c);
+    };
+
+    add(builder);
+
+    add(obj_file.vertices.size());
+    for (auto& v : obj_file.vertices)  { add_float(v.x); add_float(v.y); add_float(v.z); }
+    add(obj_file.normals.size());
+    for (auto& n : obj_file.normals)   { add_float(n.x); add_float(n.y); add_float(n.z); }
+    add(obj_file.texcoords.size());
+    for (auto& t : obj_file.texcoords) { add_float(t.x); add_float(t.y); }
+
+    add(obj_file.objects.size());
+    for (auto& obj : obj_file.objects) {
+        add(obj.groups.size());
+        for (auto& group : obj.groups) {
+            add(group.faces.size());
+            for (auto& face : group.faces) {
+                add(face.index_count);
+                add(face.material);
+                for (int i = 0; i < face.index_count; i++) {
+                    add(face.indices[i].v);
+                    add(face.indices[i].n);
+                    add(face.indices[i].t);
+                }
+            }
+        }
+    }
+
+    // The materials are only the same if they have the same names in the same libraries.
+    for (auto& mat : obj_file.materials) add_string(mat);
+    for (auto& lib : obj_file.mtl_libs) add_string(obj_path.base_name() + "/" + lib);
+
+    return h;
+}
+
 struct SceneInfo {
     std::vector<std::string> mesh_filenames;
     std::vector<std::string> accel_filenames;
+    std::vector<BvhBuilderType> builders;
     float3 cam_pos;
     float3 cam_dir;
     float3 cam_up;
@@ -312,7 +402,7 @@ struct SceneInfo {
 /// Loads the scene from a file.
 /// Light sources and instances are written to the scene file directly.
 /// Everything else is stored in the SceneInfo structure.
-bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
+bool parse_scene_file(const Path& path, Scene& scene, SceneDesc& desc, SceneInfo& info, BvhBuilderType default_builder) {
     std::ifstream stream(path);
 
     std::string cmd;
@@ -355,6 +445,7 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
         } else if (cmd == "mesh") {
             info.mesh_filenames.emplace_back();
             info.accel_filenames.emplace_back();
+            info.builders.push_back(default_builder);
 
             // Mesh file is the entire remainder of this line (can include whitespace)
             if (!(stream >> info.mesh_filenames.back())) {
@@ -377,6 +468,26 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
 
             // Mesh file paths are relative to the scene file.
             info.accel_filenames.back() = path.base_name() + '/' + info.accel_filenames.back();
+        } else if (cmd == "builder") {
+            if (info.builders.size() == 0) {
+                std::cout << " BVH builders have to be specified after the mesh they belong to." << std::endl;
+                return false;
+            }
+
+            std::string builder;
+            if (!(stream >> builder)) {
+                std::cout << " Error reading the BVH builder." << std::endl;
+                return false;
+            }
+
+            if (builder == "fast")
+                info.builders.back() = BVH_BUILDER_FAST;
+            else if (builder == "sbvh")
+                info.builders.back() = BVH_BUILDER_SBVH;
+            else {
+                std::cout << " Unknown BVH builder '" << builder << "', supported builders are 'sbvh' and 'fast'." << std::endl;
+                return false;
+            }
         } else if (cmd == "dir_light") {
             float3 dir;
             float3 intensity;
@@ -395,7 +506,10 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
                 return false;
             }
 
-            scene.lights().emplace_back(new DirectionalLight(normalize(dir), intensity, scene.bounding_sphere()));
+            LightDesc light(LightDesc::DIRECTIONAL);
+            light.dir = normalize(dir);
+            light.intensity = intensity;
+            add_light(scene, desc, light);
         } else if (cmd == "point_light") {
             float3 pos;
             float3 intensity;
@@ -414,7 +528,10 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
                 return false;
             }
 
-            scene.lights().emplace_back(new PointLight(pos, intensity));
+            LightDesc light(LightDesc::POINT);
+            light.pos[0] = pos;
+            light.intensity = intensity;
+            add_light(scene, desc, light);
         } else if (cmd == "spot_light") {
             float3 pos;
             float3 dir;
@@ -447,7 +564,12 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
                 return false;
             }
 
-            scene.lights().emplace_back(new SpotLight(pos, normalize(dir), radians(angle), intensity));
+            LightDesc light(LightDesc::SPOT);
+            light.pos[0] = pos;
+            light.dir = normalize(dir);
+            light.angle = radians(angle);
+            light.intensity = intensity;
+            add_light(scene, desc, light);
         } else if (cmd == "instance") {
             // Read the mesh index.
             int idx;
@@ -499,7 +621,7 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
 
             float4x4 mat = translate(pos.x, pos.y, pos.z) * ::imba::euler(euler.x, euler.y, euler.z) * ::imba::scale(scale.x, scale.y, scale.z);
 
-            scene.instances().emplace_back(idx, mat);
+            scene.instances().emplace_back(idx, scene.add_transform(mat));
             skip = true;
         } else if (cmd == "env") {
             if (scene.env_map() != nullptr) {
@@ -515,6 +637,7 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
             }
 
             filename = path.base_name() + '/' + filename;
+            desc.dependencies.push_back(filename);
 
             Image img;
             if (!load_hdr(filename, img)) {
@@ -523,7 +646,7 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
             }
 
             scene.set_env_map(new EnvMap(img, intensity, scene.bounding_sphere()));
-            scene.lights().emplace_back(new EnvLight(scene.env_map(), scene.bounding_sphere()));
+            add_light(scene, desc, LightDesc(LightDesc::ENV));
         }
     }
 
@@ -537,43 +660,87 @@ bool parse_scene_file(const Path& path, Scene& scene, SceneInfo& info) {
     }
 
     if (scene.instances().size() == 0) {
-        // No instances were specified. Add an identity instance for every mesh.
+        // No instances were specified. Add an identity instance for every mesh, which all share the same transformation.
+        const int identity = scene.add_transform(float4x4::identity());
         for (int i = 0; i < info.mesh_filenames.size(); ++i)
-            scene.instances().emplace_back(i, float4x4::identity());
+            scene.instances().emplace_back(i, identity);
     }
 
     return true;
 }
 
-bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_dir, float3& cam_up) {
+/// Loads the scene file, the meshes, the materials and the textures, and instances the light sources.
+static bool load_scene_files(const Path& path, Scene& scene, SceneDesc& desc, MaskBuffer& masks, BvhBuilderType default_builder) {
     SceneInfo scene_info;
     std::cout << "[1/5] Parsing Scene File..." << std::endl;
-    if (!parse_scene_file(path, scene, scene_info)) {
+    desc.dependencies.push_back(path.path());
+    if (!parse_scene_file(path, scene, desc, scene_info, default_builder)) {
         std::cout << " FAILED" << std::endl;
         return false;
     }
-    cam_pos = scene_info.cam_pos;
-    cam_dir = scene_info.cam_dir;
-    cam_up  = scene_info.cam_up;
+    desc.cam_pos = scene_info.cam_pos;
+    desc.cam_dir = scene_info.cam_dir;
+    desc.cam_up  = scene_info.cam_up;
     std::cout << std::endl;
 
     std::cout << "[2/5] Loading mesh files..." << std::endl;
     std::vector<std::vector<TriangleLight> > tri_lights;
-    MaskBuffer masks;
+    TextureCache textures;
+
+    // A mesh that appears several times in the scene file, with the same file or the same content, is only created once.
+    // Its instances all refer to the same mesh, and thus share its acceleration structure.
+    std::vector<int> mesh_ids(scene_info.mesh_filenames.size());
+    std::vector<int> first_occurrence;
+    std::vector<std::string> accel_filenames;
+    std::vector<BvhBuilderType> builders;
+    std::unordered_map<std::string, int> file_to_mesh;
+    std::unordered_map<uint64_t, int> content_to_mesh;
+
+    auto share_mesh = [&] (int i, int mesh_id) {
+        mesh_ids[i] = mesh_id;
+        if (accel_filenames[mesh_id] == "") accel_filenames[mesh_id] = scene_info.accel_filenames[i];
+        std::cout << "  identical to mesh " << first_occurrence[mesh_id] + 1 << ", sharing its acceleration structure." << std::endl;
+    };
+
     for (int i = 0; i < scene_info.mesh_filenames.size(); ++i) {
         std::cout << " Mesh " << i + 1 << " of " << scene_info.mesh_filenames.size() << "..." << std::endl;
 
+        // Meshes built with different builders are kept apart.
+        const std::string file_key = scene_info.mesh_filenames[i] + '\n' + std::to_string(scene_info.builders[i]);
+        auto file_it = file_to_mesh.find(file_key);
+        if (file_it != file_to_mesh.end()) {
+            share_mesh(i, file_it->second);
+            continue;
+        }
+
         Path obj_path(scene_info.mesh_filenames[i]);
         obj::File obj_file;
+        desc.dependencies.push_back(obj_path.path());
         if (!load_obj(obj_path, obj_file)) {
             std::cout << " FAILED loading obj" << std::endl;
             return false;
         }
 
+        const uint64_t content_hash = obj_content_hash(obj_path, obj_file, scene_info.builders[i]);
+        auto content_it = content_to_mesh.find(content_hash);
+        if (content_it != content_to_mesh.end()) {
+            file_to_mesh.emplace(file_key, content_it->second);
+            share_mesh(i, content_it->second);
+            continue;
+        }
+
+        mesh_ids[i] = scene.mesh_count();
+        file_to_mesh.emplace(file_key, mesh_ids[i]);
+        content_to_mesh.emplace(content_hash, mesh_ids[i]);
+        first_occurrence.push_back(i);
+        accel_filenames.push_back(scene_info.accel_filenames[i]);
+        builders.push_back(scene_info.builders[i]);
+
         obj::MaterialLib mtl_lib;
 
         // Parse the associated MTL files
         for (auto& lib : obj_file.mtl_libs) {
+            desc.dependencies.push_back(obj_path.base_name() + "/" + lib);
             if (!load_mtl(obj_path.base_name() + "/" + lib, mtl_lib)) {
                 std::cout << " FAILED loading materials" << std::endl;
                 return false;
@@ -582,10 +749,10 @@ bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_di
 
         MtlLightBuffer mtl_to_light_intensity;
         int mtl_offset = scene.materials().size();
-        convert_materials(obj_path, obj_file, mtl_lib, scene, mtl_to_light_intensity, masks);
+        convert_materials(obj_path, obj_file, mtl_lib, scene, desc, textures, mtl_to_light_intensity, masks);
 
         tri_lights.emplace_back();
-        create_mesh(obj_file, scene, tri_lights.back(), mtl_to_light_intensity, mtl_offset, masks);
+        create_mesh(obj_file, scene, desc, tri_lights.back(), mtl_to_light_intensity, mtl_offset, masks);
 
         std::cout << "  validating..." << std::flush;
 
@@ -613,15 +780,35 @@ bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_di
         std::cout << " done." << std::endl;
     }
 
+    // The instances refer to the meshes of the scene file, which are now numbered without the duplicates.
+    for (auto& inst : scene.instances()) {
+        if (inst.id < 0 || inst.id >= mesh_ids.size()) {
+            std::cout << " Instance of the unknown mesh " << inst.id << "." << std::endl;
+            return false;
+        }
+        inst.id = mesh_ids[inst.id];
+    }
+
+    if (scene.mesh_count() < scene_info.mesh_filenames.size()) {
+        std::cout << " " << scene_info.mesh_filenames.size() - scene.mesh_count()
+                  << " duplicated meshes have been replaced by instances." << std::endl;
+    }
+
     std::cout << "[3/5] Instancing light sources..." << std::endl;
 
     for (auto& inst : scene.instances()) {
         // Copy the triangle lights if there are any.
+        const Mesh::Transform& transf = scene.transforms()[inst.transform];
         for (auto& light : tri_lights[inst.id]) {
-            auto p0 = inst.mat * float4(light.vertex(0), 1.0f);
-            auto p1 = inst.mat * float4(light.vertex(1), 1.0f);
-            auto p2 = inst.mat * float4(light.vertex(2), 1.0f);
-            scene.lights().emplace_back(new TriangleLight(light.emitter()->intensity, p0, p1, p2));
+            auto p0 = transf.mat * float4(light.vertex(0), 1.0f);
+            auto p1 = transf.mat * float4(light.vertex(1), 1.0f);
+            auto p2 = transf.mat * float4(light.vertex(2), 1.0f);
+            LightDesc tri_light(LightDesc::TRIANGLE);
+            tri_light.pos[0] = float3(p0);
+            tri_light.pos[1] = float3(p1);
+            tri_light.pos[2] = float3(p2);
+            tri_light.intensity = light.emitter()->intensity;
+            add_light(scene, desc, tri_light);
         }
     }
 
@@ -630,15 +817,43 @@ bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_di
         return false;
     }
 
+    desc.accel_filenames = std::move(accel_filenames);
+    desc.builders = std::move(builders);
+    return true;
+}
+
+bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_dir, float3& cam_up,
+                 BvhBuilderType default_builder, const std::string& cache_file, bool force_builder) {
+    SceneDesc desc;
+    MaskBuffer masks;
+    if (cache_file != "" && load_scene_cache(cache_file, default_builder, desc, scene, masks)) {
+        std::cout << "[1-3/5] Loaded the scene from the cache " << cache_file << "." << std::endl;
+    } else {
+        if (!load_scene_files(path, scene, desc, masks, default_builder))
+            return false;
+
+        if (cache_file != "" && !store_scene_cache(cache_file, default_builder, desc, scene, masks))
+            std::cout << " The scene cache could not be written to " << cache_file << "." << std::endl;
+    }
+    cam_pos = desc.cam_pos;
+    cam_dir = desc.cam_dir;
+    cam_up  = desc.cam_up;
+
+    if (force_builder) {
+        desc.builders.assign(desc.builders.size(), default_builder);
+        desc.accel_filenames.assign(desc.accel_filenames.size(), "");
+    }
+
     std::cout << "[4/5] Building acceleration structure..." << std::endl;
 
     for (auto& m : scene.meshes()) {
         m.compute_bounding_box();
     }
 
-    scene.build_mesh_accels(scene_info.accel_filenames);
+    scene.build_mesh_accels(desc.accel_filenames, desc.builders);
     scene.build_top_level_accel();
     scene.compute_bounding_sphere();
+    scene.build_light_distribution();
 
     std::cout << "[5/5] Moving the scene to the device..." << std::flush;
     scene.upload_mesh_accels();
@@ -647,6 +862,31 @@ bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_di
 
     std::cout << std::endl;
 
+    // With packed shading data, the host does not need the geometry of most meshes anymore.
+    const int released = scene.release_mesh_data();
+    if (released > 0)
+        std::cout << "Freed the geometry of " << released << " mesh(es) on the host." << std::endl;
+    else if (!scene.has_shading_triangles())
+        std::cout << "The geometry of the meshes stays on the host, since shading reads it (see --packed-shading)." << std::endl;
+
+    return true;
+}
+
+bool translate_transforms(Scene& scene, const TransformContainer& original,
+                          const std::vector<std::pair<int, float3>>& translations) {
+    for (auto& t : translations) {
+        if (t.first < 0 || t.first >= original.size()) {
+            std::cout << "The scene has no transformation " << t.first << "." << std::endl;
+            return false;
+        }
+    }
+
+    for (auto& t : translations) {
+        const float3x4& m = original[t.first].mat;
+        const float4x4 mat(m[0], m[1], m[2], float4(0.0f, 0.0f, 0.0f, 1.0f));
+        scene.set_transform(t.first, translate(t.second.x, t.second.y, t.second.z) * mat);
+    }
+    scene.refit_top_level_accel();
     return true;
 }
 
@@ -2,6 +2,7 @@
 #define BUILD_SCENE_H
 
 #include "imbatracer/core/mesh.h"
+#include "imbatracer/core/adapter.h"
 #include "imbatracer/render/scene.h"
 #include "imbatracer/render/light.h"
 #include "imbatracer/render/texture_sampler.h"
@@ -10,10 +11,24 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <utility>
 
 namespace imba {
 
-bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_dir, float3& cam_up);
+/// Loads the scene file and builds the acceleration structures. Meshes that do not specify a
+/// BVH builder in the scene file are built with the given default builder.
+/// If a cache file is given, the scene is loaded from it when it is up to date, and stored in it otherwise.
+/// If force_builder is set, every mesh is built with the default builder, ignoring the builders and the BVH files given
+/// in the scene file.
+bool build_scene(const Path& path, Scene& scene, float3& cam_pos, float3& cam_dir, float3& cam_up,
+                 BvhBuilderType default_builder = BVH_BUILDER_SBVH, const std::string& cache_file = "",
+                 bool force_builder = false);
+
+/// Moves the given transformations of the scene by the given offsets, starting from the original transformations,
+/// and refits the top-level acceleration structure. The scene must have been built with dynamic instances.
+/// Returns false if an index does not refer to a transformation of the scene, in which case nothing is moved.
+bool translate_transforms(Scene& scene, const TransformContainer& original,
+                          const std::vector<std::pair<int, float3>>& translations);
 
 }
 
@@ -7,6 +7,11 @@
 #include <cfloat>
 #include <climits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "imbatracer/core/float3.h"
+#include "imbatracer/render/sampler.h"
 
 namespace imba {
 
@@ -23,19 +28,66 @@ struct UserSettings {
     // If specified, BVH data will be written to this file.
     std::string accel_output;
 
+    // If specified, the scene is loaded from this binary cache when it is up to date, and stored in it otherwise.
+    std::string scene_cache;
+
+    // Default BVH builder for the meshes that do not specify one in the scene file.
+    enum MeshBuilder {
+        sbvh,
+        fast_bvh
+    } mesh_builder;
+
+    // Stores the BVH nodes in treelets instead of depth-first order.
+    bool treelet_layout;
+
+    // Packs the shading data of every triangle into one cache line.
+    bool packed_shading;
+
+    // Keeps the top-level BVH on the host, so that the instances can be moved and the BVH refitted.
+    bool dynamic_instances;
+    // Offsets by which the transformations of the scene file are moved, with their index (requires dynamic_instances).
+    std::vector<std::pair<int, float3>> translations;
+
+    // Sequence of numbers used to sample the paths.
+    enum SamplerType {
+        independent,
+        sobol
+    } sampler;
+
+    // If specified, statistics about the quality of the BVHs are written to this file, in JSON.
+    std::string bvh_stats_file;
+
     // Camera and canvas
     unsigned int width, height;
     float fov;
+    // If given, the camera is placed here instead of the camera of the scene file.
+    bool camera_given;
+    float3 cam_pos, cam_dir, cam_up;
 
     float gamma;
+    float display_fps;      ///< Maximum refresh rate of the window
 
     // Execution properties
     unsigned int max_samples;
     float max_time_sec;
+    float budget_sec;       ///< Deadline of the rendering, in seconds: enables the adaptation of the quality of the frames
+    float dynamic_res_ms;   ///< Target duration of the frames while the camera moves, in milliseconds: enables the dynamic resolution
     bool background;
+    // If given, the scene is kept in memory and the jobs listed in this file are rendered one after the other.
+    std::string jobs_file;
 
     float intermediate_image_time;
     std::string intermediate_image_name;
+    std::string intermediate_image_format;  ///< Extension of the intermediate images: png, or pfm to keep the linear values
+
+    // Denoising of the final and intermediate images, guided by the albedo and normal of the first hits.
+    bool denoise;
+    unsigned int denoise_iterations;
+    // If given, the albedo and normal of the first hits are written next to the final image, with this prefix.
+    std::string aov_path;
+
+    // Reprojects the accumulated image into the new view when the camera moves, instead of discarding it.
+    bool reproject;
 
     // Algorithm settings
     enum Algorithm {
@@ -44,66 +96,180 @@ struct UserSettings {
         VCM,
         PPM,
         VCM_PT,
-        LT
+        LT,
+        SPPM
     } algorithm;
 
     float radius_factor;
+    float sppm_alpha;       ///< Fraction of the photons gathered by a pixel that SPPM keeps, which shrinks its radius
     unsigned int num_knn;
+
+    enum PhotonAccel {
+        hash_grid,
+        kd_tree
+    } photon_accel;
+
+    // Sorts the camera path vertices by position before vertex merging.
+    bool sort_merge_queries;
+    // Traces the light paths of the next frame while the camera paths of the current one are traced.
+    bool pipeline_light_paths;
     unsigned int max_path_len;
     unsigned int light_path_count;
 
     // Scheduler
     unsigned int concurrent_spp;
     unsigned int tile_size;
+    // Index of the first sample of the pixels (and of the first iteration of the light paths), so that several
+    // processes can render disjoint ranges of samples of the same image.
+    unsigned int sample_offset;
+    // If given, the accumulated samples are also written to this file, to be merged with the ones of other processes.
+    std::string partial_file;
+
+    enum TileOrder {
+        row_major,
+        hilbert,
+        spiral,
+        interleaved
+    } tile_order;
+
     unsigned int thread_count;
+    unsigned int gpu_thread_count;
     unsigned int num_connections;
+    float regen_threshold;
+    bool sort_rays;
+    bool pin_threads;   ///< Pins every tile thread to a core, so that its queues stay on the NUMA node of the core
+
+    // Adaptive sampling: tiles whose relative error is below this value are not sampled anymore (0 disables it).
+    float adaptive_error;
+
+    // Convergence benchmark: if a reference image is given, the error of the image is measured every convergence_time
+    // seconds, or every convergence_spp samples per pixel if given, and written to the convergence file, in JSON.
+    std::string reference_file;
+    std::string convergence_file;
+    float convergence_time;
+    unsigned int convergence_spp;
+
+    // Profiling: prints a summary of the time spent per stage if enabled, writes one line per frame to the csv file if given.
+    bool profile;
+    std::string profile_csv;
+    // If given, the activity of every thread is recorded and written to this file as a Chrome trace, in JSON.
+    std::string trace_file;
 
     UserSettings()
         : input_file("")
-        , accel_output("")
         , output_file("render.png")
-        , algorithm(PT)
+        , traversal_platform(cpu)
+        , accel_output("")
+        , scene_cache("")
+        , mesh_builder(sbvh)
+        , treelet_layout(false)
+        , packed_shading(false)
+        , dynamic_instances(false)
+        , sampler(sobol)
+        , bvh_stats_file("")
         , width(512), height(512)
-        , max_samples(INT_MAX), max_time_sec(FLT_MAX)
-        , background(false)
         , fov(60.0f)
-        , radius_factor(2.0f)
+        , camera_given(false)
+        , gamma(0.5f), display_fps(60.0f)
+        , max_samples(INT_MAX), max_time_sec(FLT_MAX), budget_sec(0.0f), dynamic_res_ms(0.0f)
+        , background(false), jobs_file("")
+        , intermediate_image_time(10.0f), intermediate_image_name(""), intermediate_image_format("png")
+        , denoise(false), denoise_iterations(5), aov_path("")
+        , reproject(false)
+        , algorithm(PT)
+        , radius_factor(2.0f), sppm_alpha(0.7f)
+        , num_knn(10)
+        , photon_accel(hash_grid)
+        , sort_merge_queries(false)
+        , pipeline_light_paths(false)
         , max_path_len(10)
         , light_path_count(512 * 512 / 2)
-        , concurrent_spp(1), tile_size(256), thread_count(4)
-        , intermediate_image_time(10.0f), intermediate_image_name("")
+        , concurrent_spp(1), tile_size(256), sample_offset(0), partial_file(""), tile_order(row_major)
+        , thread_count(4), gpu_thread_count(2)
         , num_connections(1)
-        , traversal_platform(cpu)
-        , gamma(0.5f)
-        , num_knn(10)
+        , regen_threshold(0.0f)
+        , sort_rays(false)
+        , pin_threads(false)
+        , adaptive_error(0.0f)
+        , reference_file(""), convergence_file("convergence.json"), convergence_time(1.0f), convergence_spp(0)
+        , profile(false), profile_csv(""), trace_file("")
     {}
 };
 
 inline void print_help() {
-    std::cout << "Usage: imbatracer <input_file.scene> [options]"
+    std::cout << "Usage: imbatracer <input_file.scene> [options] [output_file]" << std::endl
+              << "       imbatracer --merge <output_file> <partial files...>" << std::endl
+              << "  The output file is stored as PFM if its extension is .pfm, and as PNG otherwise (default: render.png)" << std::endl
+              << "  The second form adds up the samples of partial renderings of the same image (see --partial)."
               << std::endl << std::endl
               << "    -q  Quiet mode, render in background without SDL preview." << std::endl
               << "    -s  Number of samples per pixel to render (default: unlimited)" << std::endl
               << "    -t  Number of seconds to run the render algorithm (default: unlimited)" << std::endl
-              << "    -a  Selects which algorithm to use, 'pt', 'bpt', 'ppm', 'lt', 'vcm_pt', or 'vcm' (default: pt)" << std::endl
+              << "    -a  Selects which algorithm to use, 'pt', 'bpt', 'ppm', 'sppm', 'lt', 'vcm_pt', or 'vcm' (default: pt)" << std::endl
               << "    -w  Sets the horizontal resolution in pixels (default: 512)" << std::endl
               << "    -h  Sets the vertical resolution in pixels (default: 512)" << std::endl
               << "    -f  Sets the horizontal field of view (default: 60)" << std::endl
               << "    -r  Sets the initial radius for photon mapping as a factor of the approx. pixel size (default: 2)" << std::endl
               << "    -c  Sets the number of vertices form the light path that any vertex on a camera path is connected to (default: 1)" << std::endl
-              << "    -k  Sets the number of photons to use for density estimation (default: 10)" << std::endl
+              << "    -k  Sets the number of photons to use for density estimation, 0 uses all photons within the radius (default: 10)" << std::endl
+              << "        SPPM always uses all photons within the radius of the pixel." << std::endl
               << "    --gamma   Sets the gamma correction value (default: 0.5)"
               << "    --gpu     Enables GPU traversal (default)" << std::endl
               << "    --cpu     Enables CPU traversal" << std::endl
-              << "    --hybrid  Enables hybrid traversal (not yet implemented)" << std::endl
+              << "    --hybrid  Enables hybrid traversal, using both the CPU and the GPU" << std::endl
               << "    --write-accel <filename>   Writes the acceleration structure to the specified file." << std::endl
+              << "    --scene-cache <filename>   Loads the scene from the specified cache file, or creates it if it is missing or out of date." << std::endl
+              << "    --bvh <builder>            BVH builder for the meshes, 'sbvh' or 'fast', unless set in the scene file. (default: sbvh)" << std::endl
+              << "    --bvh-treelets             Groups the BVH nodes into treelets that fill a page of memory. (default: disabled)" << std::endl
+              << "    --bvh-stats <filename>     Writes statistics about the quality of the BVHs to the specified file, in JSON." << std::endl
+              << "    --packed-shading           Packs the shading data of every triangle into one cache line, using more memory. (default: disabled)" << std::endl
+              << "    --sampler <type>           Sequence used to sample the paths, 'random' or 'sobol'. (default: sobol)" << std::endl
               << "    --max-path-len <len>       Specifies the maximum number of vertices within any path. (default: 10)" << std::endl
               << "    --light-path-count <nr>    Specifies the number of light paths to be traced per frame. (default: width * height * 0.5)" << std::endl
               << "    --spp <nr>                 Specifies the number of samples per pixel within a single frame. (default: 1)" << std::endl
               << "    --tile-size <size>         Specifies the size of the rectangular tiles. (default: 256)" << std::endl
+              << "    --tile-order <order>       Order in which the tiles are rendered, 'row', 'hilbert', 'spiral', or 'interleaved'. (default: row)" << std::endl
               << "    --thread-count <nr>        Specifies the number of threads for processing tiles. (default: 4)" << std::endl
+              << "    --gpu-threads <nr>         Specifies the number of additional threads that traverse on the GPU in hybrid mode. (default: 2)" << std::endl
+              << "    --regen <fraction>         Refills a queue from the next tile when it is less than this fraction full. (default: 0, disabled)" << std::endl
+              << "    --sort-rays                Sorts the rays by origin and direction before CPU traversal. (default: disabled)" << std::endl
+              << "    --pin-threads              Pins every thread that processes tiles to a core, Linux only. (default: disabled)" << std::endl
+              << "    --adaptive <error>         Stops sampling tiles whose relative error is below this value, 'pt' only. (default: 0, disabled)" << std::endl
+              << "    --photon-accel <type>      Acceleration structure for photon queries, 'grid' or 'kdtree'. (default: grid)" << std::endl
+              << "    --sort-merge               Sorts the camera path vertices by position before vertex merging. (default: disabled)" << std::endl
+              << "    --pipeline-light           Traces the light paths of the next frame while the camera paths of the current one" << std::endl
+              << "                               are traced, with VCM, BPT, PPM and SPPM, and CPU traversal. (default: disabled)" << std::endl
+              << "    --sppm-alpha <a>           Fraction of the photons gathered by a pixel that SPPM keeps, in (0,1]. (default: 0.7)" << std::endl
+              << "    --profile                  Prints the average time per frame spent in ray generation, traversal and shading." << std::endl
+              << "    --profile-csv <filename>   Writes the time spent in every stage to the specified file, one line per frame." << std::endl
+              << "    --trace <filename>         Writes a timeline of the activity of every thread to the specified file, for chrome://tracing." << std::endl
+              << "    --reference <file>         Measures the error of the image against the reference (png, pfm or hdr) at regular checkpoints." << std::endl
+              << "    --convergence <file>       File to which the errors are written, in JSON. (default: convergence.json)" << std::endl
+              << "    --convergence-time <sec>   Rendering time between the checkpoints of the convergence benchmark. (default: 1)" << std::endl
+              << "    --convergence-spp <nr>     Number of samples per pixel between the checkpoints, replaces the time if given. (default: 0)" << std::endl
               << "    --intermediate-time <sec>  Specifies the rate in seconds at which to store intermediate results. (default: 10)" << std::endl
               << "    --intermediate-path <path> When given, store intermediate results with filename starting with <path>. (default: not given)" << std::endl
+              << "    --intermediate-format <f>  Format of the intermediate results: png, or pfm for floating point values. (default: png)" << std::endl
+              << "    --denoise                  Denoises the final and intermediate images with an a-trous filter. (default: disabled)" << std::endl
+              << "    --denoise-iterations <nr>  Number of iterations of the denoising filter, each doubles its radius. (default: 5)" << std::endl
+              << "    --aov-path <path>          When given, store the albedo and normal of the first hits with filenames starting with <path>. (default: not given)" << std::endl
+              << "    --reproject                Keeps the samples that are still visible when the camera moves. (default: disabled)" << std::endl
+              << "    --budget <sec>             Finishes the image within the given time, adapting the samples per frame (up to --spp) or the" << std::endl
+              << "                               light path count, and the path length. Disables the intermediate results. (default: 0, disabled)" << std::endl
+              << "    --dynamic-res <ms>         Lowers the resolution while the camera moves, so that the frames take at most the given time." << std::endl
+              << "                               The full resolution is restored once the camera stops. (default: 0, disabled)" << std::endl
+              << "    --display-fps <fps>        Maximum refresh rate of the window, which is updated on a separate thread. (default: 60)" << std::endl
+              << "    --camera <pos> <dir> <up>  Places the camera at the given position, with the given direction and up vector (9 numbers)." << std::endl
+              << "                               (default: the camera of the scene file)" << std::endl
+              << "    --jobs <file>              Keeps the scene in memory and renders the jobs of the file, or of the standard input if" << std::endl
+              << "                               the file is '-'. Every line holds the options of a job, e.g. '--camera ... -s 64 out.png'." << std::endl
+              << "    --dynamic-instances        Keeps the top-level BVH on the host, so that --translate can move the instances of the" << std::endl
+              << "                               jobs. (default: disabled)" << std::endl
+              << "    --translate <i> <x y z>    Moves the instances that use the transformation i of the scene file by the given offset," << std::endl
+              << "                               and refits the top-level BVH. Can be repeated. The lights are not moved. (default: none)" << std::endl
+              << "    --sample-offset <nr>       Index of the first sample of the pixels, and of the first light path iteration. Processes that" << std::endl
+              << "                               render the same image with disjoint ranges of samples can be merged. (default: 0)" << std::endl
+              << "    --partial <file>           Also writes the accumulated samples to the file, to be merged with --merge. (default: not given)" << std::endl
               << "  If time (-t) and number of samples (-s) are both given, rendering will be stopped once either of the two has been reached." << std::endl;
 }
 
@@ -145,9 +311,32 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
         {"vcm", UserSettings::VCM},
         {"lt", UserSettings::LT},
         {"ppm", UserSettings::PPM},
+        {"sppm", UserSettings::SPPM},
         {"vcm_pt", UserSettings::VCM_PT}
     };
 
+    std::unordered_map<std::string, UserSettings::TileOrder> supported_orders = {
+        {"row", UserSettings::row_major},
+        {"hilbert", UserSettings::hilbert},
+        {"spiral", UserSettings::spiral},
+        {"interleaved", UserSettings::interleaved}
+    };
+
+    std::unordered_map<std::string, UserSettings::PhotonAccel> supported_accels = {
+        {"grid", UserSettings::hash_grid},
+        {"kdtree", UserSettings::kd_tree}
+    };
+
+    std::unordered_map<std::string, UserSettings::MeshBuilder> supported_builders = {
+        {"sbvh", UserSettings::sbvh},
+        {"fast", UserSettings::fast_bvh}
+    };
+
+    std::unordered_map<std::string, UserSettings::SamplerType> supported_samplers = {
+        {"random", UserSettings::independent},
+        {"sobol", UserSettings::sobol}
+    };
+
     bool lp_count_given = false;
 
     for (int i = 2; i < argc; ++i) {
@@ -165,7 +354,7 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
             auto alg_iter = supported_algs.find(algname);
             if (alg_iter == supported_algs.end()) {
                 std::cout << "Invalid algorithm name: " << algname
-                          << " Supported algorithms are: 'pt', 'bpt', 'ppm', 'lt', 'vcm_pt', and 'vcm'. Defaulting to 'pt'..." << std::endl;
+                          << " Supported algorithms are: 'pt', 'bpt', 'ppm', 'sppm', 'lt', 'vcm_pt', and 'vcm'. Defaulting to 'pt'..." << std::endl;
                 settings.algorithm = UserSettings::PT;
             } else {
                 settings.algorithm = alg_iter->second;
@@ -177,11 +366,81 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
             }
 
             settings.accel_output = argv[i];
+        } else if (arg == "--bvh") {
+            if (++i >= argc) {
+                std::cout << "Too few arguments." << std::endl;
+                return false;
+            }
+            std::string builder = argv[i];
+
+            auto builder_iter = supported_builders.find(builder);
+            if (builder_iter == supported_builders.end()) {
+                std::cout << "Invalid BVH builder: " << builder
+                          << " Supported builders are: 'sbvh' and 'fast'. Defaulting to 'sbvh'..." << std::endl;
+                settings.mesh_builder = UserSettings::sbvh;
+            } else {
+                settings.mesh_builder = builder_iter->second;
+            }
         }
+        else if (arg == "--bvh-treelets")
+            settings.treelet_layout = true;
+        else if (arg == "--packed-shading")
+            settings.packed_shading = true;
+        else if (arg == "--sampler") {
+            if (++i >= argc) {
+                std::cout << "Too few arguments." << std::endl;
+                return false;
+            }
+            std::string sampler = argv[i];
+
+            auto sampler_iter = supported_samplers.find(sampler);
+            if (sampler_iter == supported_samplers.end()) {
+                std::cout << "Invalid sampler: " << sampler
+                          << " Supported samplers are: 'random' and 'sobol'. Defaulting to 'sobol'..." << std::endl;
+                settings.sampler = UserSettings::sobol;
+            } else {
+                settings.sampler = sampler_iter->second;
+            }
+        }
+        else if (arg == "--scene-cache")
+            parse_argument(++i, argc, argv, settings.scene_cache);
+        else if (arg == "--bvh-stats")
+            parse_argument(++i, argc, argv, settings.bvh_stats_file);
         else if (arg == "-s")
             parse_argument(++i, argc, argv, settings.max_samples);
         else if (arg == "-t")
             parse_argument(++i, argc, argv, settings.max_time_sec);
+        else if (arg == "--budget")
+            parse_argument(++i, argc, argv, settings.budget_sec);
+        else if (arg == "--dynamic-res")
+            parse_argument(++i, argc, argv, settings.dynamic_res_ms);
+        else if (arg == "--display-fps")
+            parse_argument(++i, argc, argv, settings.display_fps);
+        else if (arg == "--camera") {
+            float3* vecs[] = { &settings.cam_pos, &settings.cam_dir, &settings.cam_up };
+            for (auto v : vecs) {
+                parse_argument(++i, argc, argv, v->x);
+                parse_argument(++i, argc, argv, v->y);
+                parse_argument(++i, argc, argv, v->z);
+            }
+            settings.camera_given = i < argc;
+        }
+        else if (arg == "--jobs")
+            parse_argument(++i, argc, argv, settings.jobs_file);
+        else if (arg == "--dynamic-instances")
+            settings.dynamic_instances = true;
+        else if (arg == "--translate") {
+            std::pair<int, float3> t;
+            parse_argument(++i, argc, argv, t.first);
+            parse_argument(++i, argc, argv, t.second.x);
+            parse_argument(++i, argc, argv, t.second.y);
+            parse_argument(++i, argc, argv, t.second.z);
+            if (i < argc) settings.translations.push_back(t);
+        }
+        else if (arg == "--sample-offset")
+            parse_argument(++i, argc, argv, settings.sample_offset);
+        else if (arg == "--partial")
+            parse_argument(++i, argc, argv, settings.partial_file);
         else if (arg == "-w")
             parse_argument(++i, argc, argv, settings.width);
         else if (arg == "-h")
@@ -192,20 +451,92 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
             parse_argument(++i, argc, argv, settings.concurrent_spp);
         else if (arg == "--tile-size")
             parse_argument(++i, argc, argv, settings.tile_size);
+        else if (arg == "--tile-order") {
+            if (++i >= argc) {
+                std::cout << "Too few arguments." << std::endl;
+                return false;
+            }
+            std::string order = argv[i];
+
+            auto order_iter = supported_orders.find(order);
+            if (order_iter == supported_orders.end()) {
+                std::cout << "Invalid tile order: " << order
+                          << " Supported orders are: 'row', 'hilbert', 'spiral', and 'interleaved'. Defaulting to 'row'..." << std::endl;
+                settings.tile_order = UserSettings::row_major;
+            } else {
+                settings.tile_order = order_iter->second;
+            }
+        }
         else if (arg == "--thread-count")
             parse_argument(++i, argc, argv, settings.thread_count);
+        else if (arg == "--gpu-threads")
+            parse_argument(++i, argc, argv, settings.gpu_thread_count);
+        else if (arg == "--regen")
+            parse_argument(++i, argc, argv, settings.regen_threshold);
+        else if (arg == "--sort-rays")
+            settings.sort_rays = true;
+        else if (arg == "--pin-threads")
+            settings.pin_threads = true;
+        else if (arg == "--adaptive")
+            parse_argument(++i, argc, argv, settings.adaptive_error);
+        else if (arg == "--profile")
+            settings.profile = true;
+        else if (arg == "--profile-csv")
+            parse_argument(++i, argc, argv, settings.profile_csv);
+        else if (arg == "--trace")
+            parse_argument(++i, argc, argv, settings.trace_file);
+        else if (arg == "--reference")
+            parse_argument(++i, argc, argv, settings.reference_file);
+        else if (arg == "--convergence")
+            parse_argument(++i, argc, argv, settings.convergence_file);
+        else if (arg == "--convergence-time")
+            parse_argument(++i, argc, argv, settings.convergence_time);
+        else if (arg == "--convergence-spp")
+            parse_argument(++i, argc, argv, settings.convergence_spp);
         else if (arg == "-f")
             parse_argument(++i, argc, argv, settings.fov);
         else if (arg == "-r")
             parse_argument(++i, argc, argv, settings.radius_factor);
+        else if (arg == "--sppm-alpha")
+            parse_argument(++i, argc, argv, settings.sppm_alpha);
         else if (arg == "-c")
             parse_argument(++i, argc, argv, settings.num_connections);
         else if (arg == "-k")
             parse_argument(++i, argc, argv, settings.num_knn);
+        else if (arg == "--photon-accel") {
+            if (++i >= argc) {
+                std::cout << "Too few arguments." << std::endl;
+                return false;
+            }
+            std::string accel = argv[i];
+
+            auto accel_iter = supported_accels.find(accel);
+            if (accel_iter == supported_accels.end()) {
+                std::cout << "Invalid photon acceleration structure: " << accel
+                          << " Supported types are: 'grid' and 'kdtree'. Defaulting to 'grid'..." << std::endl;
+                settings.photon_accel = UserSettings::hash_grid;
+            } else {
+                settings.photon_accel = accel_iter->second;
+            }
+        }
+        else if (arg == "--sort-merge")
+            settings.sort_merge_queries = true;
+        else if (arg == "--pipeline-light")
+            settings.pipeline_light_paths = true;
         else if (arg == "--intermediate-time")
             parse_argument(++i, argc, argv, settings.intermediate_image_time);
         else if (arg == "--intermediate-path")
             parse_argument(++i, argc, argv, settings.intermediate_image_name);
+        else if (arg == "--intermediate-format")
+            parse_argument(++i, argc, argv, settings.intermediate_image_format);
+        else if (arg == "--denoise")
+            settings.denoise = true;
+        else if (arg == "--denoise-iterations")
+            parse_argument(++i, argc, argv, settings.denoise_iterations);
+        else if (arg == "--aov-path")
+            parse_argument(++i, argc, argv, settings.aov_path);
+        else if (arg == "--reproject")
+            settings.reproject = true;
         else if (arg == "--gpu")
             settings.traversal_platform = UserSettings::gpu;
         else if (arg == "--cpu")
@@ -224,8 +555,33 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
             settings.output_file = arg;
     }
 
-    if (settings.background && (settings.max_samples > MAX_ALLOWED_SAMPLES && settings.max_time_sec > MAX_ALLOWED_TIME)) {
-        std::cout << "You need to specify a valid maximum time (-t) or maximum number of samples (-s) to use background rendering." << std::endl;
+    if (settings.budget_sec < 0.0f || settings.budget_sec > MAX_ALLOWED_TIME) {
+        std::cout << "The time budget has to be in [0, " << MAX_ALLOWED_TIME << "] seconds. Disabling the time budget." << std::endl;
+        settings.budget_sec = 0.0f;
+    }
+
+    if (settings.dynamic_res_ms < 0.0f) {
+        std::cout << "The target frame time of the dynamic resolution cannot be negative. Disabling the dynamic resolution." << std::endl;
+        settings.dynamic_res_ms = 0.0f;
+    }
+
+    if (settings.intermediate_image_format != "png" && settings.intermediate_image_format != "pfm") {
+        std::cout << "Unknown intermediate image format: " << settings.intermediate_image_format << ". Using png." << std::endl;
+        settings.intermediate_image_format = "png";
+    }
+
+    if (settings.convergence_time <= 0.0f) {
+        std::cout << "The time between the checkpoints of the convergence benchmark has to be positive. Using one second." << std::endl;
+        settings.convergence_time = 1.0f;
+    }
+
+    if (settings.display_fps <= 0.0f) {
+        std::cout << "The refresh rate of the window has to be positive. Using 60 frames per second." << std::endl;
+        settings.display_fps = 60.0f;
+    }
+
+    if (settings.background && (settings.max_samples > MAX_ALLOWED_SAMPLES && settings.max_time_sec > MAX_ALLOWED_TIME) && settings.budget_sec <= 0.0f) {
+        std::cout << "You need to specify a valid maximum time (-t), maximum number of samples (-s) or time budget (--budget) to use background rendering." << std::endl;
         return false;
     }
 
@@ -234,6 +590,41 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
         settings.num_connections = 1;
     }
 
+    if (!settings.translations.empty() && !settings.dynamic_instances) {
+        std::cout << "Moving the instances requires --dynamic-instances. Ignoring --translate." << std::endl;
+        settings.translations.clear();
+    }
+
+    if (settings.pipeline_light_paths && settings.traversal_platform != UserSettings::cpu) {
+        std::cout << "Pipelining the light paths requires CPU traversal. Disabling the pipelining." << std::endl;
+        settings.pipeline_light_paths = false;
+    }
+
+    if (settings.sppm_alpha <= 0.0f || settings.sppm_alpha > 1.0f) {
+        std::cout << "The fraction of photons kept by SPPM has to be in (0,1]. Using default value 0.7." << std::endl;
+        settings.sppm_alpha = 0.7f;
+    }
+
+    if (settings.denoise_iterations > 10) {
+        std::cout << "The number of denoising iterations has to be in [0,10]. Using default value five." << std::endl;
+        settings.denoise_iterations = 5;
+    }
+
+    if (settings.regen_threshold < 0.0f || settings.regen_threshold > 1.0f) {
+        std::cout << "Regeneration threshold has to be in [0,1]. Disabling regeneration." << std::endl;
+        settings.regen_threshold = 0.0f;
+    }
+
+    if (settings.adaptive_error < 0.0f) {
+        std::cout << "The error threshold for adaptive sampling has to be positive. Disabling adaptive sampling." << std::endl;
+        settings.adaptive_error = 0.0f;
+    }
+
+    if (settings.adaptive_error > 0.0f && settings.algorithm != UserSettings::PT) {
+        std::cout << "Adaptive sampling is only supported by the path tracer. Disabling adaptive sampling." << std::endl;
+        settings.adaptive_error = 0.0f;
+    }
+
     if (!lp_count_given) {
         settings.light_path_count = (settings.width * settings.height) >> 1;
     }
@@ -241,6 +632,25 @@ inline bool parse_cmd_line(int argc, char* argv[], UserSettings& settings) {
     return settings.input_file != "" && settings.output_file != "";
 }
 
+/// Returns the traversal device for every rendering thread: true for the GPU, false for the CPU.
+/// In hybrid mode, the GPU threads are added to the CPU threads.
+inline std::vector<bool> thread_devices(const UserSettings& settings) {
+    switch (settings.traversal_platform) {
+    case UserSettings::gpu: return std::vector<bool>(settings.thread_count, true);
+    case UserSettings::cpu: return std::vector<bool>(settings.thread_count, false);
+    default: break;
+    }
+
+    std::vector<bool> devices(settings.thread_count, false);
+    devices.resize(settings.thread_count + settings.gpu_thread_count, true);
+    return devices;
+}
+
+/// Returns the sequence used by the ray generators.
+inline SampleSequence sample_sequence(const UserSettings& settings) {
+    return settings.sampler == UserSettings::independent ? SampleSequence::RANDOM : SampleSequence::SOBOL;
+}
+
 }
 
 #endif
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#include <tbb/parallel_reduce.h>
+
+#include "imbatracer/frontend/convergence.h"
+#include "imbatracer/loaders/loaders.h"
+
+namespace imba {
+
+constexpr float ConvergenceBench::REL_EPSILON;
+
+static const char* algorithm_name(UserSettings::Algorithm algo) {
+    switch (algo) {
+        case UserSettings::PT:     return "pt";
+        case UserSettings::BPT:    return "bpt";
+        case UserSettings::VCM:    return "vcm";
+        case UserSettings::PPM:    return "ppm";
+        case UserSettings::VCM_PT: return "vcm_pt";
+        case UserSettings::LT:     return "lt";
+        case UserSettings::SPPM:   return "sppm";
+    }
+    return "";
+}
+
+ConvergenceBench::ConvergenceBench(const UserSettings& settings)
+    : clamp_(false)
+    , valid_(false)
+    , reference_file_(settings.reference_file)
+    , output_file_(settings.convergence_file)
+    , algorithm_(algorithm_name(settings.algorithm))
+    , interval_ms_(settings.convergence_time * 1000.0f)
+    , interval_spp_(settings.convergence_spp)
+    , base_rays_(0)
+    , overhead_ms_(0)
+{
+    const Path path(settings.reference_file);
+    const std::string ext = path.extension();
+    bool loaded = false;
+    if (ext == "pfm") {
+        loaded = load_pfm(path, reference_);
+    } else if (ext == "hdr") {
+        loaded = load_hdr(path, reference_);
+    } else if (load_png(path, reference_)) {
+        // The PNG images store the gamma corrected values, see store_png().
+        loaded = true;
+        const float inv_gamma = 1.0f / settings.gamma;
+        for (int y = 0; y < reference_.height(); ++y) {
+            for (int x = 0; x < reference_.width(); ++x) {
+                rgba& p = reference_(x, y);
+                p = rgba(powf(p.x, inv_gamma), powf(p.y, inv_gamma), powf(p.z, inv_gamma), 1.0f);
+            }
+        }
+        clamp_ = true;
+    }
+
+    if (!loaded) {
+        std::cout << "The reference image " << settings.reference_file << " could not be loaded." << std::endl;
+        return;
+    }
+
+    if (reference_.width() != settings.width || reference_.height() != settings.height) {
+        std::cout << "The reference image " << settings.reference_file << " has a size of "
+                  << reference_.width() << "x" << reference_.height() << ", instead of "
+                  << settings.width << "x" << settings.height << "." << std::endl;
+        return;
+    }
+
+    valid_ = true;
+}
+
+void ConvergenceBench::reset(int64_t rays) {
+    records_.clear();
+    base_rays_ = rays;
+    overhead_ms_ = 0;
+}
+
+bool ConvergenceBench::due(int64_t elapsed_ms, int samples) const {
+    const int n = records_.size() + 1;
+    if (interval_spp_ > 0) return samples >= n * interval_spp_;
+    return elapsed_ms - overhead_ms_ >= n * interval_ms_;
+}
+
+void ConvergenceBench::record(const Image& img, int64_t elapsed_ms, int samples, int64_t rays) {
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    struct Sums { double sqr, rel; };
+    const int w = img.width();
+    const Sums sums = tbb::parallel_reduce(tbb::blocked_range<int>(0, img.height()), Sums{ 0.0, 0.0 },
+        [&] (const tbb::blocked_range<int>& range, Sums s) {
+            for (int y = range.begin(); y != range.end(); ++y) {
+                for (int x = 0; x < w; ++x) {
+                    const rgba& c = img(x, y);
+                    const rgba& r = reference_(x, y);
+                    for (int i = 0; i < 3; ++i) {
+                        // The PNG references are clamped, so are the values compared to them.
+                        const float v = clamp_ ? std::min(std::max(c[i], 0.0f), 1.0f) : c[i];
+                        const double d = v - r[i];
+                        s.sqr += d * d;
+                        s.rel += d * d / (double(r[i]) * r[i] + REL_EPSILON);
+                    }
+                }
+            }
+            return s;
+        },
+        [] (Sums a, const Sums& b) { return Sums{ a.sqr + b.sqr, a.rel + b.rel }; });
+
+    const double n = 3.0 * img.width() * img.height();
+    records_.push_back(Record{ double(elapsed_ms - overhead_ms_), samples, rays - base_rays_,
+                               std::sqrt(sums.sqr / n), sums.rel / n });
+
+    overhead_ms_ += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+bool ConvergenceBench::write() const {
+    std::ofstream out(output_file_);
+    if (!out) return false;
+
+    out << "{\n    \"reference\": \"" << reference_file_ << "\",\n"
+        << "    \"algorithm\": \"" << algorithm_ << "\",\n"
+        << "    \"width\": " << reference_.width() << ", \"height\": " << reference_.height() << ",\n"
+        << "    \"checkpoints\": [";
+    for (size_t i = 0; i < records_.size(); ++i) {
+        const Record& r = records_[i];
+        out << (i > 0 ? "," : "") << "\n        { \"time_ms\": " << r.time_ms
+            << ", \"samples\": " << r.samples
+            << ", \"rays\": " << r.rays
+            << ", \"rmse\": " << r.rmse
+            << ", \"relmse\": " << r.rel_mse << " }";
+    }
+    out << "\n    ]\n}" << std::endl;
+
+    return bool(out);
+}
+
+} // namespace imba
@@ -0,0 +1,74 @@
+#ifndef IMBA_CONVERGENCE_H
+#define IMBA_CONVERGENCE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/frontend/cmd_line.h"
+
+namespace imba {
+
+/// Measures the convergence of the rendering against a reference image. At regular checkpoints, given in seconds or in
+/// samples per pixel, the error of the current image is recorded with the rendering time, the number of samples and the
+/// number of rays traversed so far. The records are written to a JSON file once the rendering is done.
+/// The error is given as the root mean squared error and the relative mean squared error of the linear RGB values.
+/// The time spent computing the errors is not counted as rendering time.
+class ConvergenceBench {
+public:
+    /// Loads the reference image given in the settings. PNG images are converted to linear values with the gamma of
+    /// the settings, PFM and HDR images are used as they are.
+    ConvergenceBench(const UserSettings& settings);
+
+    /// Returns false if the reference image could not be loaded or does not have the size of the rendering.
+    bool valid() const { return valid_; }
+
+    /// Discards the records and restarts the clock of the rendering, e.g. because the camera moved.
+    void reset(int64_t rays);
+
+    /// Returns true if a checkpoint has been reached, given the elapsed time and the number of samples per pixel.
+    bool due(int64_t elapsed_ms, int samples) const;
+
+    /// Records the error of the given image, which contains the average color of the pixels.
+    void record(const Image& img, int64_t elapsed_ms, int samples, int64_t rays);
+
+    /// Time spent in record() since the last reset, which the caller may subtract from the elapsed time.
+    int64_t overhead_ms() const { return overhead_ms_; }
+
+    /// Returns the number of samples of the last record, or -1 if there is none.
+    int last_samples() const { return records_.empty() ? -1 : records_.back().samples; }
+
+    /// Writes the records to the JSON file given in the settings.
+    bool write() const;
+
+private:
+    // Added to the squared reference value in the relative error, so that dark pixels do not dominate it.
+    static constexpr float REL_EPSILON = 1e-2f;
+
+    struct Record {
+        double time_ms;
+        int samples;
+        int64_t rays;
+        double rmse;
+        double rel_mse;
+    };
+
+    Image reference_;
+    bool clamp_;    ///< True if the reference is a PNG image, whose values are clamped to [0, 1]
+    bool valid_;
+
+    std::string reference_file_;
+    std::string output_file_;
+    std::string algorithm_;
+    float interval_ms_;
+    int interval_spp_;
+
+    int64_t base_rays_;
+    int64_t overhead_ms_;
+    std::vector<Record> records_;
+};
+
+} // namespace imba
+
+#endif // IMBA_CONVERGENCE_H
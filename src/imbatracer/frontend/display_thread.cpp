@@ -0,0 +1,95 @@
+#include <cmath>
+#include <cstring>
+
+#include "imbatracer/frontend/display_thread.h"
+
+namespace imba {
+
+DisplayThread::DisplayThread(int width, int height, float gamma, float max_fps, const SDL_PixelFormat* format)
+    : width_(width), height_(height)
+    , min_interval_(std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<float>(1.0f / max_fps)))
+    , lut_(LUT_SIZE)
+    , r_shift_(format->Rshift), g_shift_(format->Gshift), b_shift_(format->Bshift), a_mask_(format->Amask)
+    , snapshot_(width, height)
+    , back_(width * height), front_(width * height)
+    , new_frame_(false)
+    , pending_(false)
+    , quit_(false)
+{
+    for (int i = 0; i < LUT_SIZE; ++i)
+        lut_[i] = 255.0f * clamp(powf(float(i) / (LUT_SIZE - 1), gamma), 0.0f, 1.0f);
+
+    thread_ = std::thread([this] { run(); });
+}
+
+DisplayThread::~DisplayThread() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+}
+
+bool DisplayThread::ready() const {
+    return !pending_ && std::chrono::high_resolution_clock::now() - last_submit_ >= min_interval_;
+}
+
+void DisplayThread::submit() {
+    last_submit_ = std::chrono::high_resolution_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_ = true;
+    }
+    cond_.notify_one();
+}
+
+bool DisplayThread::present(SDL_Surface* surface) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!new_frame_) return false;
+
+    SDL_LockSurface(surface);
+    for (int y = 0; y < std::min(height_, surface->h); ++y) {
+        std::memcpy((uint8_t*)surface->pixels + surface->pitch * y, front_.data() + y * width_,
+                    sizeof(uint32_t) * std::min(width_, surface->w));
+    }
+    SDL_UnlockSurface(surface);
+
+    new_frame_ = false;
+    return true;
+}
+
+void DisplayThread::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return pending_ || quit_; });
+            if (quit_) return;
+        }
+
+        convert();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            back_.swap(front_);
+            new_frame_ = true;
+            pending_ = false;
+        }
+    }
+}
+
+void DisplayThread::convert() {
+    const bool scaled = snapshot_.width() != width_ || snapshot_.height() != height_;
+
+    for (int y = 0; y < height_; ++y) {
+        uint32_t* row = back_.data() + y * width_;
+        for (int x = 0; x < width_; ++x) {
+            const rgb c = scaled ? upscale(snapshot_, x, y, width_, height_) : rgb(snapshot_(x, y));
+            row[x] = (uint32_t(to_byte(c.x)) << r_shift_) |
+                     (uint32_t(to_byte(c.y)) << g_shift_) |
+                     (uint32_t(to_byte(c.z)) << b_shift_) | a_mask_;
+        }
+    }
+}
+
+} // namespace imba
@@ -0,0 +1,91 @@
+#ifndef IMBA_DISPLAY_THREAD_H
+#define IMBA_DISPLAY_THREAD_H
+
+#include <SDL2/SDL.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "imbatracer/core/common.h"
+#include "imbatracer/core/image.h"
+
+namespace imba {
+
+/// Bilinear interpolation of an image at the center of a pixel of a larger image that covers the same area.
+inline rgb upscale(const Image& img, int x, int y, int width, int height) {
+    const int w = img.width();
+    const int h = img.height();
+    const float u = clamp((x + 0.5f) * w / width  - 0.5f, 0.0f, float(w - 1));
+    const float v = clamp((y + 0.5f) * h / height - 0.5f, 0.0f, float(h - 1));
+    const int x0 = int(u), y0 = int(v);
+    const int x1 = std::min(x0 + 1, w - 1), y1 = std::min(y0 + 1, h - 1);
+    const float fx = u - x0, fy = v - y0;
+
+    const rgb top    = lerp(rgb(img(x0, y0)), rgb(img(x1, y0)), fx);
+    const rgb bottom = lerp(rgb(img(x0, y1)), rgb(img(x1, y1)), fx);
+    return lerp(top, bottom, fy);
+}
+
+/// Converts the rendered images into the pixels of the window on a separate thread, at a limited rate, so that the
+/// display does not slow down the rendering. The render loop fills a snapshot of the average color of the pixels
+/// whenever the thread is idle and the next refresh is due, and hands it over with submit(). The thread applies the
+/// gamma correction with a lookup table and upscales the snapshot if it is smaller than the window. The converted
+/// pixels are copied to the surface of the window by present(), on the thread that owns the window.
+class DisplayThread {
+public:
+    DisplayThread(int width, int height, float gamma, float max_fps, const SDL_PixelFormat* format);
+    ~DisplayThread();
+
+    DisplayThread(const DisplayThread&) = delete;
+    DisplayThread& operator=(const DisplayThread&) = delete;
+
+    /// Returns true if the snapshot can be written, i.e. if the thread is idle and the next refresh is due.
+    bool ready() const;
+
+    /// Image that receives the average color of the pixels, at the resolution of the accumulated image.
+    /// Must only be written if ready() returns true.
+    Image& snapshot() { return snapshot_; }
+
+    /// Hands the snapshot over to the thread.
+    void submit();
+
+    /// Copies the last converted frame to the surface. Returns false if there is no new frame since the last call.
+    bool present(SDL_Surface* surface);
+
+private:
+    static constexpr int LUT_SIZE = 1 << 16;
+
+    int width_, height_;
+    std::chrono::high_resolution_clock::duration min_interval_;
+    std::chrono::high_resolution_clock::time_point last_submit_;
+
+    std::vector<uint8_t> lut_;      ///< Gamma corrected value of the colors in [0, 1]
+    int r_shift_, g_shift_, b_shift_;
+    uint32_t a_mask_;
+
+    Image snapshot_;
+    std::vector<uint32_t> back_;    ///< Pixels written by the thread
+    std::vector<uint32_t> front_;   ///< Last converted frame, protected by the mutex
+    bool new_frame_;
+
+    std::atomic<bool> pending_;     ///< Set while the snapshot is converted
+    bool quit_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+
+    void run();
+    void convert();
+
+    uint8_t to_byte(float c) const { return lut_[c > 0.0f ? int(std::min(c, 1.0f) * (LUT_SIZE - 1) + 0.5f) : 0]; }
+};
+
+} // namespace imba
+
+#endif // IMBA_DISPLAY_THREAD_H
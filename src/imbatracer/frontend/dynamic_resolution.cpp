@@ -0,0 +1,31 @@
+#include "imbatracer/frontend/dynamic_resolution.h"
+
+namespace imba {
+
+DynamicResolution::DynamicResolution(float target_ms)
+    : target_ms_(target_ms), full_ms_(0.0f), still_ms_(0.0f), scale_(1)
+{}
+
+bool DynamicResolution::end_frame(float frame_ms, bool moved) {
+    const float full_ms = frame_ms * scale_ * scale_;
+    full_ms_ = full_ms_ > 0.0f ? full_ms_ + (full_ms - full_ms_) * SMOOTHING : full_ms;
+
+    int scale = scale_;
+    if (moved) {
+        still_ms_ = 0.0f;
+
+        while (scale < MAX_SCALE && full_ms_ > target_ms_ * scale * scale)
+            scale++;
+        while (scale > 1 && full_ms_ < HEADROOM * target_ms_ * (scale - 1) * (scale - 1))
+            scale--;
+    } else {
+        still_ms_ += frame_ms;
+        if (still_ms_ >= STILL_MS) scale = 1;
+    }
+
+    const bool changed = scale != scale_;
+    scale_ = scale;
+    return changed;
+}
+
+} // namespace imba
@@ -0,0 +1,38 @@
+#ifndef IMBA_DYNAMIC_RESOLUTION_H
+#define IMBA_DYNAMIC_RESOLUTION_H
+
+namespace imba {
+
+/// Selects the resolution of the frames in interactive mode. While the camera moves, the image is rendered with
+/// 1 / scale of the full resolution in each dimension, with the smallest scale for which the frames take at most the
+/// target time. The full resolution is restored once the camera has not moved for a short time.
+/// The duration of a frame is assumed to be proportional to its number of pixels, and the duration of a frame at full
+/// resolution is estimated with a running average of the measured frame times.
+class DynamicResolution {
+public:
+    DynamicResolution(float target_ms);
+
+    /// Selects the scale of the next frame, given the duration of the frame that has just been rendered, and whether
+    /// the camera moved after it. Returns true if the scale changed.
+    bool end_frame(float frame_ms, bool moved);
+
+    int scale() const { return scale_; }
+
+private:
+    static constexpr int MAX_SCALE = 8;
+    // The scale is only decreased if the frames at the finer scale are predicted to take this fraction of the target.
+    static constexpr float HEADROOM = 0.8f;
+    // Weight of the last frame in the running average.
+    static constexpr float SMOOTHING = 0.25f;
+    // Time without camera motion after which the full resolution is restored.
+    static constexpr float STILL_MS = 250.0f;
+
+    float target_ms_;
+    float full_ms_;     ///< Estimated duration of a frame at full resolution
+    float still_ms_;    ///< Time since the last camera motion
+    int scale_;
+};
+
+} // namespace imba
+
+#endif // IMBA_DYNAMIC_RESOLUTION_H
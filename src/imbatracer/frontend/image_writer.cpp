@@ -0,0 +1,60 @@
+#include <iostream>
+
+#include "imbatracer/frontend/image_writer.h"
+#include "imbatracer/loaders/loaders.h"
+
+namespace imba {
+
+ImageWriter::ImageWriter(float gamma)
+    : gamma_(gamma), busy_(false), quit_(false)
+{
+    thread_ = std::thread([this] { run(); });
+}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+void ImageWriter::write(const std::string& file_name, Image&& img) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return jobs_.size() < size_t(MAX_PENDING); });
+        jobs_.push_back(Job { file_name, std::move(img) });
+    }
+    cond_.notify_all();
+}
+
+void ImageWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return jobs_.empty() && !busy_; });
+}
+
+void ImageWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cond_.wait(lock, [this] { return !jobs_.empty() || quit_; });
+
+        // The queue is emptied before quitting, so that no image is lost.
+        if (jobs_.empty()) return;
+
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        busy_ = true;
+        lock.unlock();
+        cond_.notify_all();
+
+        if (!store_image(job.file_name, job.img, 1.0f, gamma_))
+            std::cout << "The image could not be written to " << job.file_name << "." << std::endl;
+
+        lock.lock();
+        busy_ = false;
+        cond_.notify_all();
+    }
+}
+
+} // namespace imba
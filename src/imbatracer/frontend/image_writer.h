@@ -0,0 +1,54 @@
+#ifndef IMBA_IMAGE_WRITER_H
+#define IMBA_IMAGE_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "imbatracer/core/image.h"
+
+namespace imba {
+
+/// Encodes and stores images on a background thread, so that the rendering does not wait for the compression.
+/// The images are written in the order in which they are queued, in the format given by the extension of the file.
+/// At most MAX_PENDING images are kept in memory: queuing another one waits until the oldest has been written.
+class ImageWriter {
+public:
+    ImageWriter(float gamma);
+    /// Writes the remaining images before returning.
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    /// Queues an image, which contains the average color of the pixels, to be written to the given file.
+    void write(const std::string& file_name, Image&& img);
+
+    /// Waits until all the queued images have been written.
+    void wait();
+
+private:
+    static constexpr int MAX_PENDING = 2;
+
+    struct Job {
+        std::string file_name;
+        Image img;
+    };
+
+    float gamma_;
+
+    std::deque<Job> jobs_;
+    bool busy_;     ///< Set while the thread writes an image
+    bool quit_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+
+    void run();
+};
+
+} // namespace imba
+
+#endif // IMBA_IMAGE_WRITER_H
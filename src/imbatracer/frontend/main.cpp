@@ -1,18 +1,16 @@
+#include <fstream>
+
 #include "imbatracer/frontend/cmd_line.h"
 #include "imbatracer/frontend/build_scene.h"
+#include "imbatracer/frontend/partial_image.h"
+#include "imbatracer/frontend/pipeline.h"
+#include "imbatracer/frontend/render_server.h"
 #include "imbatracer/frontend/render_window.h"
 
 #include "imbatracer/loaders/loaders.h"
 
 #include "imbatracer/render/scene.h"
-#include "imbatracer/render/ray_gen/ray_gen.h"
-#include "imbatracer/render/scheduling/tile_scheduler.h"
-#include "imbatracer/render/scheduling/queue_scheduler.h"
-
-#include "imbatracer/render/integrators/pt.h"
-#include "imbatracer/render/integrators/vcm.h"
-
-//#define QUEUE_SCHEDULER
+#include "imbatracer/render/scheduling/frame_profiler.h"
 
 using namespace imba;
 
@@ -87,81 +85,85 @@ private:
 int main(int argc, char* argv[]) {
     std::cout << "Imbatracer - An interactive raytracer" << std::endl;
 
+    // Merging partial renderings does not need a scene.
+    if (argc >= 2 && std::string(argv[1]) == "--merge") {
+        if (argc < 4) {
+            print_help();
+            return 1;
+        }
+        return merge_partials(argv[2], std::vector<std::string>(argv + 3, argv + argc), UserSettings().gamma);
+    }
+
     UserSettings settings;
     if (!parse_cmd_line(argc, argv, settings))
         return 0;
 
     Scene scene(settings.traversal_platform == UserSettings::cpu || settings.traversal_platform == UserSettings::hybrid,
                 settings.traversal_platform == UserSettings::gpu || settings.traversal_platform == UserSettings::hybrid);
+    scene.set_treelet_layout(settings.treelet_layout);
+    scene.set_packed_shading(settings.packed_shading);
+    scene.set_dynamic_instances(settings.dynamic_instances);
     float3 cam_pos, cam_dir, cam_up;
-    if (!build_scene(Path(settings.input_file), scene, cam_pos, cam_dir, cam_up)) {
+    const BvhBuilderType mesh_builder = settings.mesh_builder == UserSettings::fast_bvh ? BVH_BUILDER_FAST : BVH_BUILDER_SBVH;
+    if (!build_scene(Path(settings.input_file), scene, cam_pos, cam_dir, cam_up, mesh_builder, settings.scene_cache)) {
         std::cerr << "ERROR: Scene could not be built" << std::endl;
         return 1;
     }
 
     std::cout << "The scene has been loaded successfully." << std::endl;
 
-    PerspectiveCamera cam(settings.width, settings.height, settings.fov);
-    CameraControl ctrl(cam, cam_pos, cam_dir, cam_up);
-
-    const bool gpu_traversal = settings.traversal_platform == UserSettings::gpu;
-
-    if (settings.algorithm == UserSettings::PT) {
-#ifdef QUEUE_SCHEDULER
-        PixelRayGen<PTState> ray_gen(settings.width, settings.height, settings.concurrent_spp);
-        QueueScheduler<PTState, ShadowState> scheduler(ray_gen, scene, 1, gpu_traversal);
-#else
-        DefaultTileGen<PTState> ray_gen(settings.width, settings.height, settings.concurrent_spp, settings.tile_size);
-        TileScheduler<PTState, ShadowState> scheduler(ray_gen, scene, 1, settings.thread_count, settings.tile_size * settings.tile_size * settings.concurrent_spp, gpu_traversal);
-#endif
-        PathTracer integrator(scene, cam, scheduler, settings.max_path_len);
-        integrator.preprocess();
-        ctrl.set_speed(integrator.pixel_size() * 10.0f);
-
-        RenderWindow wnd(settings, integrator, ctrl, settings.concurrent_spp);
-        wnd.render_loop();
+    if (settings.camera_given) {
+        cam_pos = settings.cam_pos;
+        cam_dir = settings.cam_dir;
+        cam_up  = settings.cam_up;
+    }
 
-        return 0;
+    if (settings.bvh_stats_file != "") {
+        std::ofstream stats_file(settings.bvh_stats_file);
+        scene.write_accel_stats(stats_file);
+        if (!stats_file)
+            std::cout << "The BVH statistics could not be written to " << settings.bvh_stats_file << "." << std::endl;
     }
 
-#ifdef QUEUE_SCHEDULER
-    PixelRayGen<VCMState> ray_gen(settings.width, settings.height, settings.concurrent_spp);
-    QueueScheduler<VCMState, VCMShadowState> scheduler(ray_gen, scene, settings.num_connections + 1, gpu_traversal);
-#else
-    DefaultTileGen<VCMState> ray_gen(settings.width, settings.height, settings.concurrent_spp, settings.tile_size);
-    TileScheduler<VCMState, VCMShadowState> scheduler(ray_gen, scene, settings.num_connections + 1, settings.thread_count, settings.tile_size * settings.tile_size * settings.concurrent_spp, gpu_traversal);
-#endif
+    if (settings.profile_csv != "")
+        FrameProfiler::instance().configure(FrameProfiler::csv, settings.profile_csv);
+    else if (settings.profile)
+        FrameProfiler::instance().configure(FrameProfiler::summary);
+    else if (settings.reference_file != "")
+        FrameProfiler::instance().configure(FrameProfiler::totals);  // The convergence benchmark counts the rays
 
-    Integrator* integrator;
+    if (settings.trace_file != "")
+        EventTracer::instance().enable(settings.trace_file);
 
-    switch (settings.algorithm) {
-    case UserSettings::BPT:
-        integrator = new BPT(scene, cam, scheduler, settings);
-        break;
+    // The jobs move the instances from the transformations of the scene file, which are kept.
+    const TransformContainer original_transforms = settings.dynamic_instances ? scene.transforms() : TransformContainer();
 
-    case UserSettings::PPM:
-        integrator = new PPM(scene, cam, scheduler, settings);
-        break;
+    if (settings.jobs_file != "") {
+        const int result = run_render_server(scene, original_transforms, argc, argv, settings, cam_pos, cam_dir, cam_up);
+        EventTracer::instance().write();
+        return result;
+    }
 
-    case UserSettings::LT:
-        integrator = new LT(scene, cam, scheduler, settings);
-        break;
+    if (!translate_transforms(scene, original_transforms, settings.translations))
+        return 1;
 
-    case UserSettings::VCM_PT:
-        integrator = new VCM_PT(scene, cam, scheduler, settings);
-        break;
+    PerspectiveCamera cam(settings.width, settings.height, settings.fov);
+    CameraControl ctrl(cam, cam_pos, cam_dir, cam_up);
 
-    default:
-        integrator = new VCM(scene, cam, scheduler, settings);
-        break;
-    }
+    auto pipeline = create_pipeline(scene, cam, settings);
+    Integrator& integrator = pipeline->integrator();
+    integrator.preprocess();
+    ctrl.set_speed(integrator.pixel_size() * 10.0f);
 
-    integrator->preprocess();
-    ctrl.set_speed(integrator->pixel_size() * 10.0f);
+    // The rendering threads allocate their queues when the pipeline is created, so they are included.
+    MemoryReport memory;
+    integrator.report_memory(memory);
+    memory.print(std::cout);
 
-    RenderWindow wnd(settings, *integrator, ctrl, settings.concurrent_spp);
+    RenderWindow wnd(settings, integrator, ctrl, settings.concurrent_spp);
     wnd.render_loop();
 
-    delete integrator;
+    EventTracer::instance().write();
+
     return 0;
 }
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "imbatracer/frontend/partial_image.h"
+#include "imbatracer/loaders/loaders.h"
+
+namespace imba {
+
+static const char* partial_magic = "IMBA_PARTIAL";
+
+bool store_partial(const std::string& file_name, const AtomicImage& accum, int samples) {
+    std::ofstream file(file_name, std::ofstream::binary);
+    if (!file)
+        return false;
+
+    file << partial_magic << "\n" << accum.width() << " " << accum.height() << " " << samples << "\n";
+
+    std::unique_ptr<float[]> row(new float[3 * accum.width()]);
+    for (int y = 0; y < accum.height(); y++) {
+        for (int x = 0; x < accum.width(); x++) {
+            const rgb c = accum(x, y);
+            row[x * 3 + 0] = c.x;
+            row[x * 3 + 1] = c.y;
+            row[x * 3 + 2] = c.z;
+        }
+        file.write((const char*)row.get(), sizeof(float) * 3 * accum.width());
+    }
+
+    return bool(file);
+}
+
+bool load_partial(const std::string& file_name, Image& sum, int& samples) {
+    std::ifstream file(file_name, std::ifstream::binary);
+    std::string magic;
+    int width, height;
+    if (!(file >> magic >> width >> height >> samples) || magic != partial_magic || width <= 0 || height <= 0)
+        return false;
+    file.get(); // End of the header
+
+    if (sum.size() == 0) {
+        sum.resize(width, height);
+        std::fill(sum.pixels(), sum.pixels() + width * height, rgba(0.0f));
+    }
+    else if (sum.width() != width || sum.height() != height)
+        return false;
+
+    std::unique_ptr<float[]> row(new float[3 * width]);
+    for (int y = 0; y < height; y++) {
+        if (!file.read((char*)row.get(), sizeof(float) * 3 * width))
+            return false;
+        for (int x = 0; x < width; x++)
+            sum(x, y) += rgba(row[x * 3 + 0], row[x * 3 + 1], row[x * 3 + 2], 0.0f);
+    }
+
+    return true;
+}
+
+int merge_partials(const std::string& output_file, const std::vector<std::string>& partial_files, float gamma) {
+    Image sum(0, 0);
+    int total = 0;
+
+    for (auto& f : partial_files) {
+        int samples;
+        if (!load_partial(f, sum, samples)) {
+            std::cout << "The partial rendering " << f << " could not be loaded, or has a different size." << std::endl;
+            return 1;
+        }
+        total += samples;
+    }
+
+    if (total == 0) {
+        std::cout << "The partial renderings do not contain any sample." << std::endl;
+        return 1;
+    }
+
+    if (!store_image(output_file, sum, 1.0f / total, gamma)) {
+        std::cout << "The image could not be written to " << output_file << "." << std::endl;
+        return 1;
+    }
+
+    std::cout << partial_files.size() << " partial rendering(s) merged, " << total << " samples per pixel." << std::endl;
+    return 0;
+}
+
+} // namespace imba
@@ -0,0 +1,29 @@
+#ifndef IMBA_PARTIAL_IMAGE_H
+#define IMBA_PARTIAL_IMAGE_H
+
+#include <string>
+#include <vector>
+
+#include "imbatracer/core/image.h"
+
+namespace imba {
+
+/// Partial renderings store the sum of the samples of every pixel, with the number of samples per pixel, so that the
+/// renderings of the same image by several processes (with disjoint ranges of samples, see --sample-offset) can be
+/// added up. The first line of the file is "IMBA_PARTIAL", the second the width, height and number of samples, then
+/// follow the RGB sums of the pixels, as little endian floats, row by row from the top of the image.
+
+/// Stores the accumulated image, which holds the given number of samples per pixel.
+bool store_partial(const std::string& file_name, const AtomicImage& accum, int samples);
+
+/// Loads a partial rendering, whose pixels are added to the sum of the samples. The sum is resized if it is empty,
+/// and the partial rendering must have the same size otherwise.
+bool load_partial(const std::string& file_name, Image& sum, int& samples);
+
+/// Merges the partial renderings of an image by a sample-weighted sum, and stores the result in the output file.
+/// Returns the exit code of the program.
+int merge_partials(const std::string& output_file, const std::vector<std::string>& partial_files, float gamma);
+
+} // namespace imba
+
+#endif // IMBA_PARTIAL_IMAGE_H
@@ -0,0 +1,152 @@
+#include "imbatracer/frontend/pipeline.h"
+
+#include "imbatracer/render/ray_gen/ray_gen.h"
+#include "imbatracer/render/ray_gen/adaptive_tile_gen.h"
+#include "imbatracer/render/scheduling/tile_scheduler.h"
+#include "imbatracer/render/scheduling/queue_scheduler.h"
+
+#include "imbatracer/render/integrators/pt.h"
+#include "imbatracer/render/integrators/vcm.h"
+
+//#define QUEUE_SCHEDULER
+
+namespace imba {
+
+static TileOrder tile_order(const UserSettings& settings) {
+    switch (settings.tile_order) {
+        case UserSettings::hilbert:     return TILE_ORDER_HILBERT;
+        case UserSettings::spiral:      return TILE_ORDER_SPIRAL;
+        case UserSettings::interleaved: return TILE_ORDER_INTERLEAVED;
+        default:                        return TILE_ORDER_ROW_MAJOR;
+    }
+}
+
+#ifdef QUEUE_SCHEDULER
+// The queue scheduler does not support hybrid traversal and falls back to the CPU.
+static bool gpu_traversal(const UserSettings& settings) { return settings.traversal_platform == UserSettings::gpu; }
+#endif
+
+/// Returns true if the ray generators and schedulers created with both settings are the same.
+/// The samples of a reused pipeline continue after the ones of the previous job, so the jobs that render a given
+/// range of samples always get a new pipeline.
+static bool same_scheduling(const UserSettings& a, const UserSettings& b) {
+    return a.sample_offset == 0 && b.sample_offset == 0 &&
+           a.algorithm          == b.algorithm &&
+           a.concurrent_spp     == b.concurrent_spp &&
+           a.tile_size          == b.tile_size &&
+           a.tile_order         == b.tile_order &&
+           a.sampler            == b.sampler &&
+           a.adaptive_error     == b.adaptive_error &&
+           a.traversal_platform == b.traversal_platform &&
+           a.thread_count       == b.thread_count &&
+           a.gpu_thread_count   == b.gpu_thread_count &&
+           a.num_connections    == b.num_connections &&
+           a.regen_threshold    == b.regen_threshold &&
+           a.sort_rays          == b.sort_rays &&
+           a.pin_threads        == b.pin_threads;
+}
+
+class PTPipeline : public Pipeline {
+public:
+    PTPipeline(Scene& scene, PerspectiveCamera& cam, const UserSettings& settings)
+        : settings_(settings)
+#ifdef QUEUE_SCHEDULER
+        , ray_gen_(settings.width, settings.height, settings.concurrent_spp, sample_sequence(settings), settings.sample_offset)
+        , scheduler_(ray_gen_, scene, 1, gpu_traversal(settings))
+#else
+        , ray_gen_(settings.adaptive_error > 0.0f
+            ? static_cast<TileGen<PTState>*>(new AdaptiveTileGen<PTState>(settings.width, settings.height, settings.concurrent_spp, settings.tile_size, settings.adaptive_error, tile_order(settings), sample_sequence(settings), settings.sample_offset))
+            : static_cast<TileGen<PTState>*>(new DefaultTileGen<PTState>(settings.width, settings.height, settings.concurrent_spp, settings.tile_size, tile_order(settings), sample_sequence(settings), settings.sample_offset)))
+        , scheduler_(*ray_gen_, scene, 1, thread_devices(settings), settings.tile_size * settings.tile_size * settings.concurrent_spp, settings.regen_threshold, settings.sort_rays, settings.pin_threads)
+#endif
+        , integrator_(scene, cam, scheduler_, settings.max_path_len)
+    {}
+
+    Integrator& integrator() override { return integrator_; }
+
+    bool reuse(const UserSettings& settings) override {
+        if (!same_scheduling(settings, settings_)) return false;
+
+        // The adaptive tile generator cannot be resized.
+        if ((settings.width != settings_.width || settings.height != settings_.height) &&
+            !integrator_.set_resolution(settings.width, settings.height))
+            return false;
+
+        integrator_.set_max_path_len(settings.max_path_len);
+        settings_ = settings;
+        return true;
+    }
+
+private:
+    UserSettings settings_;
+#ifdef QUEUE_SCHEDULER
+    PixelRayGen<PTState> ray_gen_;
+    QueueScheduler<PTState, ShadowState> scheduler_;
+#else
+    std::unique_ptr<TileGen<PTState> > ray_gen_;
+    TileScheduler<PTState, ShadowState> scheduler_;
+#endif
+    PathTracer integrator_;
+};
+
+/// Pipeline of a sub-algorithm of VCM. The ray states of the schedulers only store the MIS weights it uses.
+template <VCMSubAlgorithm algo>
+class VCMPipeline : public Pipeline {
+    typedef VCMState<algo> State;
+
+public:
+    VCMPipeline(Scene& scene, PerspectiveCamera& cam, const UserSettings& settings)
+        : settings_(settings)
+#ifdef QUEUE_SCHEDULER
+        , ray_gen_(settings.width, settings.height, settings.concurrent_spp, sample_sequence(settings), settings.sample_offset)
+        , scheduler_(ray_gen_, scene, settings.num_connections + 1, gpu_traversal(settings))
+#else
+        , ray_gen_(settings.width, settings.height, settings.concurrent_spp, settings.tile_size, tile_order(settings), sample_sequence(settings), settings.sample_offset)
+        , scheduler_(ray_gen_, scene, settings.num_connections + 1, thread_devices(settings), settings.tile_size * settings.tile_size * settings.concurrent_spp, settings.regen_threshold, settings.sort_rays, settings.pin_threads)
+#endif
+        , integrator_(scene, cam, scheduler_, settings)
+    {}
+
+    Integrator& integrator() override { return integrator_; }
+
+    bool reuse(const UserSettings& settings) override {
+        // The integrator keeps a copy of the settings, and sizes its light paths with them.
+        return same_scheduling(settings, settings_) &&
+               settings.width              == settings_.width &&
+               settings.height             == settings_.height &&
+               settings.radius_factor      == settings_.radius_factor &&
+               settings.sppm_alpha         == settings_.sppm_alpha &&
+               settings.num_knn            == settings_.num_knn &&
+               settings.photon_accel       == settings_.photon_accel &&
+               settings.sort_merge_queries == settings_.sort_merge_queries &&
+               settings.pipeline_light_paths == settings_.pipeline_light_paths &&
+               settings.max_path_len       == settings_.max_path_len &&
+               settings.light_path_count   == settings_.light_path_count;
+    }
+
+private:
+    UserSettings settings_;
+#ifdef QUEUE_SCHEDULER
+    PixelRayGen<State> ray_gen_;
+    QueueScheduler<State, VCMShadowState> scheduler_;
+#else
+    DefaultTileGen<State> ray_gen_;
+    TileScheduler<State, VCMShadowState> scheduler_;
+#endif
+    VCMIntegrator<algo> integrator_;
+};
+
+std::unique_ptr<Pipeline> create_pipeline(Scene& scene, PerspectiveCamera& cam, const UserSettings& settings) {
+    if (settings.algorithm == UserSettings::PT)
+        return std::unique_ptr<Pipeline>(new PTPipeline(scene, cam, settings));
+    switch (settings.algorithm) {
+    case UserSettings::BPT:    return std::unique_ptr<Pipeline>(new VCMPipeline<ALGO_BPT>(scene, cam, settings));
+    case UserSettings::PPM:    return std::unique_ptr<Pipeline>(new VCMPipeline<ALGO_PPM>(scene, cam, settings));
+    case UserSettings::SPPM:   return std::unique_ptr<Pipeline>(new VCMPipeline<ALGO_SPPM>(scene, cam, settings));
+    case UserSettings::LT:     return std::unique_ptr<Pipeline>(new VCMPipeline<ALGO_LT >(scene, cam, settings));
+    case UserSettings::VCM_PT: return std::unique_ptr<Pipeline>(new VCMPipeline<ALGO_PT >(scene, cam, settings));
+    default:                   return std::unique_ptr<Pipeline>(new VCMPipeline<ALGO_VCM>(scene, cam, settings));
+    }
+}
+
+} // namespace imba
@@ -0,0 +1,32 @@
+#ifndef IMBA_PIPELINE_H
+#define IMBA_PIPELINE_H
+
+#include <memory>
+
+#include "imbatracer/frontend/cmd_line.h"
+#include "imbatracer/render/integrators/integrator.h"
+#include "imbatracer/render/ray_gen/camera.h"
+#include "imbatracer/render/scene.h"
+
+namespace imba {
+
+/// An integrator, together with the ray generator and the scheduler it renders with.
+/// Creating a pipeline starts the rendering threads and allocates their queues, so the render server keeps it between
+/// the jobs that it can render.
+class Pipeline {
+public:
+    virtual ~Pipeline() {}
+
+    virtual Integrator& integrator() = 0;
+
+    /// Prepares the pipeline for rendering with the given settings, with the same camera. Returns false if the
+    /// pipeline cannot render them, in which case it must be recreated.
+    virtual bool reuse(const UserSettings& settings) = 0;
+};
+
+/// Creates the pipeline of the algorithm given in the settings. The camera must outlive the pipeline.
+std::unique_ptr<Pipeline> create_pipeline(Scene& scene, PerspectiveCamera& cam, const UserSettings& settings);
+
+} // namespace imba
+
+#endif // IMBA_PIPELINE_H
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <iostream>
+
+#include "imbatracer/frontend/render_budget.h"
+
+namespace imba {
+
+RenderBudget::RenderBudget(const UserSettings& settings, Integrator& integrator)
+    : integrator_(integrator)
+    , budget_ms_(1000.0f * settings.budget_sec)
+    , max_spp_(settings.concurrent_spp)
+    , max_light_paths_(settings.algorithm == UserSettings::PT ? 1 : settings.light_path_count)
+    , max_path_len_(settings.max_path_len)
+    , path_len_(settings.max_path_len)
+    , sum_w_(0.0), sum_t_(0.0), sum_ww_(0.0), sum_wt_(0.0)
+    , frames_(0)
+{
+    // Writing the image takes longer for large images, but should never use a large part of the budget.
+    reserve_ms_ = std::min(std::max(0.01f * budget_ms_, 100.0f), 0.1f * budget_ms_);
+
+    // The first frame is as small as possible, to calibrate the prediction without exceeding a short budget.
+    adapt_spp_ = integrator_.set_spp(1);
+    spp_ = adapt_spp_ ? 1 : max_spp_;
+
+    const int min_light_paths = std::max(1, int(max_light_paths_ * MIN_LIGHT_FRACTION));
+    adapt_light_paths_ = max_light_paths_ > 1 && integrator_.set_light_path_count(min_light_paths);
+    light_paths_ = adapt_light_paths_ ? min_light_paths : max_light_paths_;
+
+    adapt_path_len_ = integrator_.set_max_path_len(path_len_);
+}
+
+void RenderBudget::start() {
+    start_time_ = std::chrono::high_resolution_clock::now();
+    std::cout << "Rendering within a budget of " << budget_ms_ / 1000.0f << " seconds." << std::endl;
+}
+
+bool RenderBudget::end_frame(float frame_ms) {
+    const float w = work(spp_, light_paths_, path_len_);
+    sum_w_  += w;
+    sum_t_  += frame_ms;
+    sum_ww_ += w * w;
+    sum_wt_ += w * frame_ms;
+    frames_++;
+
+    float fixed_ms, work_ms;
+    fit(fixed_ms, work_ms);
+
+    const float elapsed = elapsed_ms();
+    const float remaining = budget_ms_ - reserve_ms_ - elapsed;
+
+    // Shorten the paths if the remaining time is not enough for a minimum number of passes.
+    // The work of a frame is assumed to be proportional to the maximum path length.
+    if (adapt_path_len_ && elapsed < CALIBRATION_FRACTION * budget_ms_ && work_ms > 0.0f) {
+        const float pass_ms = fixed_ms + work_ms * work(adapt_spp_ ? 1 : max_spp_, max_light_paths_, path_len_);
+        const float needed_ms = remaining / MIN_PASSES;
+        if (pass_ms > needed_ms) {
+            const float scale = std::max(needed_ms - fixed_ms, 0.0f) / (pass_ms - fixed_ms);
+            const int len = std::min(path_len_, std::max(MIN_PATH_LEN, int(path_len_ * scale)));
+            if (len != path_len_) {
+                path_len_ = len;
+                integrator_.set_max_path_len(len);
+                std::cout << "Reducing the maximum path length to " << len << " to meet the time budget." << std::endl;
+            }
+        }
+    }
+
+    // Fraction of a frame of full size that can be rendered in the given time.
+    const float len_work = float(path_len_) / max_path_len_;
+    auto fraction = [&] (float ms) {
+        if (work_ms <= 0.0f) return ms >= fixed_ms ? 1.0f : 0.0f;
+        return clamp((ms - fixed_ms) / (work_ms * len_work), 0.0f, 1.0f);
+    };
+
+    // The next frame must fit in the remaining time, and should not be longer than the target duration.
+    const float fit_fraction = fraction(remaining / SAFETY);
+    const float target_fraction = fraction(budget_ms_ / TARGET_FRAMES);
+    auto frame_size = [&] (int max_size, int min_size) {
+        const int size = std::min(max_size, std::max(min_size, int(target_fraction * max_size)));
+        return std::min(size, int(fit_fraction * max_size));
+    };
+
+    if (adapt_spp_) {
+        const int spp = frame_size(max_spp_, 1);
+        if (spp < 1) return false;
+        if (spp != spp_) {
+            spp_ = spp;
+            integrator_.set_spp(spp);
+        }
+    } else if (adapt_light_paths_) {
+        const int min_light_paths = std::max(1, int(max_light_paths_ * MIN_LIGHT_FRACTION));
+        const int light_paths = frame_size(max_light_paths_, min_light_paths);
+        if (light_paths < min_light_paths) return false;
+        if (light_paths != light_paths_) {
+            light_paths_ = light_paths;
+            integrator_.set_light_path_count(light_paths);
+        }
+    } else if (fit_fraction < 1.0f) {
+        return false;
+    }
+
+    return true;
+}
+
+void RenderBudget::fit(float& fixed_ms, float& work_ms) const {
+    const double n = frames_;
+    const double var_w = sum_ww_ - sum_w_ * sum_w_ / n;
+
+    // Least squares fit if the frames had different amounts of work, proportional fit otherwise.
+    double a = 0.0, b = sum_wt_ / sum_ww_;
+    if (var_w > 1e-6 * sum_ww_) {
+        b = (sum_wt_ - sum_w_ * sum_t_ / n) / var_w;
+        a = (sum_t_ - b * sum_w_) / n;
+    }
+
+    if (b < 0.0) {
+        // Noise dominates: the duration does not depend on the work.
+        a = sum_t_ / n;
+        b = 0.0;
+    } else if (a < 0.0) {
+        a = 0.0;
+        b = sum_wt_ / sum_ww_;
+    }
+
+    fixed_ms = a;
+    work_ms  = b;
+}
+
+float RenderBudget::elapsed_ms() const {
+    const auto d = std::chrono::high_resolution_clock::now() - start_time_;
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0f;
+}
+
+} // namespace imba
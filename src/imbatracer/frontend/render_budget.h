@@ -0,0 +1,74 @@
+#ifndef IMBA_RENDER_BUDGET_H
+#define IMBA_RENDER_BUDGET_H
+
+#include <chrono>
+
+#include "imbatracer/frontend/cmd_line.h"
+#include "imbatracer/render/integrators/integrator.h"
+
+namespace imba {
+
+/// Adapts the quality of the frames, so that the rendering finishes within a deadline with as many samples as possible.
+/// The size of a frame is controlled by the number of samples per pixel (path tracer) or by the number of light paths
+/// (VCM and its variants), at most the values given on the command line, so that there are enough frames to hit the
+/// deadline precisely, and so that the last frame still fits in the remaining time. If the budget is too short to
+/// render a minimum number of samples, the maximum path length is reduced at the beginning of the rendering.
+/// The duration of a frame is predicted with an affine function of its relative amount of work, fitted to the
+/// measured frame times.
+class RenderBudget {
+public:
+    RenderBudget(const UserSettings& settings, Integrator& integrator);
+
+    /// Starts the clock. The deadline is relative to this call.
+    void start();
+
+    /// Adapts the quality of the next frame, given the duration of the frame that has just been rendered.
+    /// Returns false if the next frame cannot be rendered before the deadline.
+    bool end_frame(float frame_ms);
+
+    /// Number of samples per pixel of the next frame.
+    int spp() const { return spp_; }
+
+private:
+    // Duration of a frame relative to the whole budget, when the deadline is far away.
+    static constexpr int TARGET_FRAMES = 32;
+    // Minimum number of passes in the budget, below which the paths are shortened. A pass is one sample per pixel for
+    // the path tracer, and one frame with all the light paths for the other integrators.
+    static constexpr int MIN_PASSES = 8;
+    // The path length is only adapted during this fraction of the budget, so that most frames use the same length.
+    static constexpr float CALIBRATION_FRACTION = 0.25f;
+    static constexpr int MIN_PATH_LEN = 3;
+    // Frames with fewer light paths than this fraction of the maximum are not worth rendering.
+    static constexpr float MIN_LIGHT_FRACTION = 0.25f;
+    // Factor applied to the predicted duration of the last frames.
+    static constexpr float SAFETY = 1.25f;
+
+    Integrator& integrator_;
+
+    std::chrono::high_resolution_clock::time_point start_time_;
+    float budget_ms_;
+    float reserve_ms_;      ///< Time left for writing the final image
+
+    int max_spp_, spp_;
+    int max_light_paths_, light_paths_;
+    int max_path_len_, path_len_;
+    bool adapt_spp_, adapt_light_paths_, adapt_path_len_;
+
+    // Sums for the least squares fit of the frame duration.
+    double sum_w_, sum_t_, sum_ww_, sum_wt_;
+    int frames_;
+
+    /// Amount of work of a frame, relative to a frame with the maximum quality.
+    float work(int spp, int light_paths, int path_len) const {
+        return (float(spp) / max_spp_) * (float(light_paths) / max_light_paths_) * (float(path_len) / max_path_len_);
+    }
+
+    /// Computes the duration of a frame as fixed_ms + work * work_ms.
+    void fit(float& fixed_ms, float& work_ms) const;
+
+    float elapsed_ms() const;
+};
+
+} // namespace imba
+
+#endif // IMBA_RENDER_BUDGET_H
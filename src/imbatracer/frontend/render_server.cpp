@@ -0,0 +1,116 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "imbatracer/frontend/render_server.h"
+#include "imbatracer/frontend/build_scene.h"
+#include "imbatracer/frontend/pipeline.h"
+#include "imbatracer/frontend/render_window.h"
+
+namespace imba {
+
+/// Parses the options of a job, on top of the options of the server. Returns false if the job is invalid.
+static bool parse_job(const std::string& line, int argc, char* argv[], const UserSettings& server, UserSettings& job) {
+    std::vector<std::string> args(argv, argv + argc);
+    args.push_back("-q");
+
+    std::istringstream stream(line);
+    std::string token;
+    while (stream >> token) args.push_back(token);
+
+    std::vector<char*> job_argv;
+    for (auto& a : args) job_argv.push_back(&a[0]);
+
+    if (!parse_cmd_line(job_argv.size(), job_argv.data(), job))
+        return false;
+
+    if (job.traversal_platform != server.traversal_platform) {
+        std::cout << "The traversal platform of the jobs cannot differ from the one of the server." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int run_render_server(Scene& scene, const TransformContainer& original_transforms, int argc, char* argv[], const UserSettings& settings,
+                      const float3& cam_pos, const float3& cam_dir, const float3& cam_up) {
+    std::ifstream file;
+    if (settings.jobs_file != "-") {
+        file.open(settings.jobs_file);
+        if (!file) {
+            std::cout << "The job file " << settings.jobs_file << " could not be opened." << std::endl;
+            return 1;
+        }
+    }
+    std::istream& jobs = settings.jobs_file != "-" ? file : std::cin;
+
+    PerspectiveCamera cam;
+    std::unique_ptr<Pipeline> pipeline;
+    InputController no_input;
+    std::vector<std::pair<int, float3>> moved;
+
+    int line_count = 0, done = 0, failed = 0;
+    std::string line;
+    while (std::getline(jobs, line)) {
+        line_count++;
+
+        const auto first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+
+        UserSettings job;
+        if (!parse_job(line, argc, argv, settings, job)) {
+            std::cout << "Invalid job on line " << line_count << ", skipped." << std::endl;
+            failed++;
+            continue;
+        }
+
+        // Restore the transformations moved by the previous job, then move the ones of this job.
+        if (!moved.empty() || !job.translations.empty()) {
+            for (auto& t : moved) t.second = float3(0.0f);
+            auto translations = moved;
+            translations.insert(translations.end(), job.translations.begin(), job.translations.end());
+            if (!translate_transforms(scene, original_transforms, translations)) {
+                std::cout << "Invalid job on line " << line_count << ", skipped." << std::endl;
+                translate_transforms(scene, original_transforms, moved);
+                moved.clear();
+                failed++;
+                continue;
+            }
+            moved = job.translations;
+        }
+
+        std::cout << "Rendering job " << done + failed + 1 << " (line " << line_count << ") to " << job.output_file << "." << std::endl;
+
+        // The integrators keep a reference to the camera, which is replaced for every job.
+        cam = PerspectiveCamera(job.width, job.height, job.fov);
+        if (job.camera_given)
+            cam.move(job.cam_pos, job.cam_dir, job.cam_up);
+        else
+            cam.move(cam_pos, cam_dir, cam_up);
+
+        bool created = false;
+        if (!pipeline || !pipeline->reuse(job)) {
+            pipeline.reset();
+            pipeline = create_pipeline(scene, cam, job);
+            created = true;
+        }
+
+        Integrator& integrator = pipeline->integrator();
+        integrator.preprocess();
+
+        if (created) {
+            MemoryReport memory;
+            integrator.report_memory(memory);
+            memory.print(std::cout);
+        }
+
+        RenderWindow wnd(job, integrator, no_input, job.concurrent_spp);
+        wnd.render_loop();
+        done++;
+    }
+
+    std::cout << done << " job(s) rendered, " << failed << " invalid job(s)." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+} // namespace imba
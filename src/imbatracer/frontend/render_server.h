@@ -0,0 +1,26 @@
+#ifndef IMBA_RENDER_SERVER_H
+#define IMBA_RENDER_SERVER_H
+
+#include "imbatracer/frontend/cmd_line.h"
+#include "imbatracer/render/scene.h"
+
+namespace imba {
+
+/// Renders the jobs of the file given by settings.jobs_file one after the other, with the same scene, which is only
+/// loaded, built and uploaded once. Every non-empty line of the file that does not start with '#' is a job, given by
+/// command line options that are appended to the ones of the server (argc, argv), e.g.
+///     --camera 0 1 -5  0 0 1  0 1 0 -w 1920 -h 1080 -a vcm -s 256 view0.png
+/// The jobs are rendered in the background, and need a maximum number of samples, a maximum time, or a time budget.
+/// The options that affect the scene (traversal platform, BVH builder and layout) are the ones of the server.
+/// The jobs are read as they come, so the file can be a named pipe fed by another process. With "-" they are read
+/// from the standard input.
+/// If the scene was built with dynamic instances, every job can move them with --translate, starting from the given
+/// original transformations: the transformations moved by the previous job are restored first.
+/// The pipeline of the previous job, with its threads and queues, is reused if it can render the next job.
+/// Returns the exit code of the program: zero if all the jobs were rendered.
+int run_render_server(Scene& scene, const TransformContainer& original_transforms, int argc, char* argv[], const UserSettings& settings,
+                      const float3& cam_pos, const float3& cam_dir, const float3& cam_up);
+
+} // namespace imba
+
+#endif // IMBA_RENDER_SERVER_H
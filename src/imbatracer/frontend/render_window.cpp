@@ -11,7 +11,10 @@
 #include <tbb/tbb.h>
 
 #include "imbatracer/frontend/render_window.h"
+#include "imbatracer/frontend/partial_image.h"
 #include "imbatracer/loaders/loaders.h"
+#include "imbatracer/render/denoiser.h"
+#include "imbatracer/render/scheduling/frame_profiler.h"
 
 namespace imba {
 
@@ -24,26 +27,69 @@ static InitOnce init_once;
 
 RenderWindow::RenderWindow(const UserSettings& settings, Integrator& r, InputController& ctrl, int spp)
     : accum_buffer_(settings.width, settings.height)
+    , width_(settings.width), height_(settings.height), scale_(1)
+    , window_(nullptr)
     , integrator_(r)
     , ctrl_(ctrl)
+    , gamma_(settings.gamma)
     , mouse_speed_(0.01f)
-    , window_(nullptr)
     , max_samples_(settings.max_samples)
-    , max_time_sec_(settings.max_time_sec)
-    , output_file_(settings.output_file)
     , spp_(spp)
-    , conv_interval_sec_(settings.intermediate_image_time)
+    , max_time_sec_(settings.max_time_sec)
     , conv_file_base_(settings.intermediate_image_name)
-    , gamma_(settings.gamma)
+    , conv_format_(settings.intermediate_image_format)
+    , conv_interval_sec_(settings.intermediate_image_time)
+    , output_file_(settings.output_file)
+    , partial_file_(settings.partial_file)
+    , writer_(settings.gamma)
+    , denoise_(settings.denoise)
+    , denoise_iterations_(settings.denoise_iterations)
+    , aov_path_(settings.aov_path)
 {
     if (!settings.background) {
         window_ = SDL_CreateWindow("Imbatracer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, settings.width, settings.height, 0);
-        SDL_GetWindowSurface(window_); // Creates a surface for the window
+        SDL_Surface* surface = SDL_GetWindowSurface(window_); // Creates a surface for the window
+        display_.reset(new DisplayThread(settings.width, settings.height, settings.gamma, settings.display_fps, surface->format));
+    }
+
+    if (denoise_ || aov_path_ != "" || settings.reproject) {
+        aovs_.reset(new AOVImages(settings.width, settings.height));
+        integrator_.set_aovs(aovs_.get());
+    }
+
+    if (settings.reproject)
+        reprojection_.reset(new Reprojection(settings.width, settings.height));
+
+    if (settings.budget_sec > 0.0f) {
+        budget_.reset(new RenderBudget(settings, r));
+        spp_ = budget_->spp();
+
+        // Only the final image is written, the time budget does not account for the intermediate images.
+        if (conv_file_base_ != "") {
+            std::cout << "Intermediate images are disabled by the time budget." << std::endl;
+            conv_file_base_ = "";
+        }
     }
+
+    if (settings.reference_file != "") {
+        convergence_.reset(new ConvergenceBench(settings));
+        if (!convergence_->valid()) convergence_.reset();
+    }
+
+    if (settings.dynamic_res_ms > 0.0f) {
+        if (!window_ || budget_)
+            std::cout << "The dynamic resolution is only available in interactive mode, without a time budget." << std::endl;
+        else if (!integrator_.set_resolution(width_, height_))
+            std::cout << "The dynamic resolution is not supported by this integrator or tile generator." << std::endl;
+        else
+            dynamic_res_.reset(new DynamicResolution(settings.dynamic_res_ms));
+    }
+
     clear();
 }
 
 RenderWindow::~RenderWindow() {
+    display_.reset();
     if (window_) SDL_DestroyWindow(window_);
 }
 
@@ -52,7 +98,10 @@ void RenderWindow::render_loop() {
     std::chrono::time_point<clock_type> msg_time = clock_type::now();
     std::chrono::time_point<clock_type> cur_time = msg_time;
 
+    if (budget_) budget_->start();
+
     while (true) {
+        const auto frame_start = clock_type::now();
         render();
 
         cur_time = clock_type::now();
@@ -61,67 +110,111 @@ void RenderWindow::render_loop() {
         const auto msg_ms = std::chrono::duration_cast<std::chrono::milliseconds>(cur_time - msg_time).count();
         const auto avg_frame_time = frames_ == 0 ? static_cast<float>(elapsed_ms) : static_cast<float>(elapsed_ms) / frames_;
         if (msg_ms > msg_interval_ms && frames_ > 0) {
-            std::cout << frames_ * spp_ << " samples, "
+            std::cout << samples_ << " samples, "
                       << 1000.0f * frames_ / static_cast<float>(elapsed_ms) << " frames per second, "
                       << avg_frame_time << "ms per frame"
                       << std::endl;
             msg_time = cur_time;
         }
 
-        if ((window_ && handle_events()) ||
-            (frames_ + 1) * spp_ > max_samples_ ||
+        if (convergence_ && convergence_->due(elapsed_ms, samples_))
+            record_convergence(elapsed_ms);
+
+        // The budget selects the number of samples of the next frame.
+        bool out_of_budget = false;
+        if (budget_) {
+            const auto frame_us = std::chrono::duration_cast<std::chrono::microseconds>(cur_time - frame_start).count();
+            out_of_budget = !budget_->end_frame(frame_us / 1000.0f);
+            spp_ = budget_->spp();
+        }
+
+        bool moved = false;
+        if ((window_ && handle_events(moved)) || out_of_budget ||
+            samples_ + spp_ > max_samples_ ||
             (elapsed_ms + avg_frame_time * 0.5f) / 1000.0f > max_time_sec_) // Allow only 50% average frame time more than specified.
             break;
 
+        if (dynamic_res_) {
+            const auto frame_us = std::chrono::duration_cast<std::chrono::microseconds>(cur_time - frame_start).count();
+            if (dynamic_res_->end_frame(frame_us / 1000.0f, moved))
+                set_scale(dynamic_res_->scale());
+        }
+
         if (conv_file_base_ != "" && elapsed_ms / static_cast<int>(1000 * conv_interval_sec_) >= conv_count_) {
             ++conv_count_;
             std::stringstream str;
-            str << conv_file_base_ << elapsed_ms << "ms" << ".png";
-            write_image(str.str().c_str());
+            str << conv_file_base_ << elapsed_ms << "ms" << "." << conv_format_;
+
+            // The image is encoded on the background thread, the rendering continues with the next frame.
+            Image img;
+            output_image(img);
+            writer_.write(str.str(), std::move(img));
         }
     }
 
     auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(cur_time - start_time_).count();
     std::cout << "Done after " << elapsed_ms / 1000.0f << " seconds, "
-              << frames_ * spp_ << " samples @ "
+              << samples_ << " samples @ "
               << 1000.0f * frames_ / static_cast<float>(elapsed_ms) << " frames per second, "
               << static_cast<float>(elapsed_ms) / frames_ << "ms per frame"  << std::endl;
 
-    write_image(output_file_.c_str());
+    FrameProfiler::instance().print_summary();
+
+    if (convergence_) {
+        if (convergence_->last_samples() != samples_)
+            record_convergence(std::chrono::duration_cast<std::chrono::milliseconds>(cur_time - start_time_).count());
+        if (!convergence_->write())
+            std::cout << "The convergence benchmark could not be written." << std::endl;
+    }
+
+    writer_.wait();
+    if (!write_image(output_file_.c_str()))
+        std::cout << "The image could not be written to " << output_file_ << "." << std::endl;
+    if (partial_file_ != "") {
+        if (scale_ != 1)
+            std::cout << "The partial rendering is not written, the image is not at full resolution." << std::endl;
+        else if (!store_partial(partial_file_, accum_buffer_, samples_))
+            std::cout << "The partial rendering could not be written to " << partial_file_ << "." << std::endl;
+    }
+    if (aov_path_ != "" && !write_aovs())
+        std::cout << "The auxiliary images could not be written to " << aov_path_ << "." << std::endl;
 }
 
 void RenderWindow::render() {
-    integrator_.render(accum_buffer_);
+    {
+        EventTracer::Span span("frame");
+        integrator_.render(accum_buffer_);
+    }
+    FrameProfiler::instance().end_frame();
     frames_++;
+    samples_ += spp_;
 
-    if (!window_) return;
-
-    SDL_Surface* surface = SDL_GetWindowSurface(window_);
-    SDL_LockSurface(surface);
+    // The auxiliary images are only recorded at full resolution.
+    if (scale_ == 1) {
+        if (aovs_) aovs_->end_frame(accum_buffer_, spp_);
+        if (reprojection_) reprojection_->end_frame(*aovs_, integrator_.camera());
+    }
 
-    const int r = surface->format->Rshift / 8;
-    const int g = surface->format->Gshift / 8;
-    const int b = surface->format->Bshift / 8;
-    const float weight = 1.0f / (frames_ * spp_);
+    if (!window_) return;
 
-    tbb::parallel_for(tbb::blocked_range<int>(0, surface->h), [&] (const tbb::blocked_range<int>& range) {
-        for (int y = range.begin(); y != range.end(); ++y) {
-            unsigned char* row = (unsigned char*)surface->pixels + surface->pitch * y;
-            const auto* accum_row = accum_buffer_.row(y);
+    // The conversion to the pixels of the window happens on the display thread.
+    if (display_->ready()) {
+        resolve(display_->snapshot());
+        display_->submit();
+    }
 
-            for (int x = 0; x < surface->w; x++) {
-                row[x * 4 + r] = 255.0f * clamp(powf(accum_row[x][0] * weight, gamma_), 0.0f, 1.0f);
-                row[x * 4 + g] = 255.0f * clamp(powf(accum_row[x][1] * weight, gamma_), 0.0f, 1.0f);
-                row[x * 4 + b] = 255.0f * clamp(powf(accum_row[x][2] * weight, gamma_), 0.0f, 1.0f);
-            }
-        }
-    });
+    if (display_->present(SDL_GetWindowSurface(window_)))
+        SDL_UpdateWindowSurface(window_);
+}
 
-    SDL_UnlockSurface(surface);
-    SDL_UpdateWindowSurface(window_);
+void RenderWindow::print_memory() const {
+    MemoryReport report;
+    integrator_.report_memory(report);
+    report.add("accumulation image", accum_buffer_.memory_bytes());
+    report.print(std::cout);
 }
 
-bool RenderWindow::handle_events() {
+bool RenderWindow::handle_events(bool& moved) {
     SDL_Event event;
     bool update = false;
 
@@ -137,6 +230,7 @@ bool RenderWindow::handle_events() {
                     case SDLK_KP_MINUS:  update |= ctrl_.key_press(Key::MINUS);     break;
                     case SDLK_SPACE:     update |= ctrl_.key_press(Key::SPACE);     break;
                     case SDLK_BACKSPACE: update |= ctrl_.key_press(Key::BACKSPACE); break;
+                    case SDLK_m:         print_memory(); break;
                     case SDLK_ESCAPE:    return true;
                     default: break;
                 }
@@ -155,8 +249,12 @@ bool RenderWindow::handle_events() {
         }
     }
 
-    if (update)
+    if (update) {
+        if (reprojection_ && scale_ == 1) reprojection_->save(accum_buffer_, samples_, *aovs_);
         clear();
+    }
+
+    moved = update;
 
     return false;
 }
@@ -166,17 +264,95 @@ void RenderWindow::clear() {
 
     // Reset number of samples and start time
     frames_ = 0;
+    samples_ = 0;
     std::chrono::high_resolution_clock clock;
     start_time_ = clock.now();
     msg_counter_ = 1;
     conv_count_ = 0;
 
+    if (aovs_) aovs_->clear();
+    if (convergence_) convergence_->reset(FrameProfiler::instance().total_rays());
+
     integrator_.reset();
 }
 
+void RenderWindow::set_scale(int scale) {
+    const int w = (width_ + scale - 1) / scale;
+    const int h = (height_ + scale - 1) / scale;
+    integrator_.set_resolution(w, h);
+    accum_buffer_.resize(w, h);
+    integrator_.set_aovs(scale == 1 ? aovs_.get() : nullptr);
+    scale_ = scale;
+
+    clear();
+}
+
+void RenderWindow::resolve(Image& out) const {
+    const int w = accum_buffer_.width();
+    const int h = accum_buffer_.height();
+    if (out.width() != w || out.height() != h) out.resize(w, h);
+
+    const float weight = 1.0f / samples_;
+    tbb::parallel_for(0, h, [&] (int y) {
+        for (int x = 0; x < w; ++x) {
+            // The reprojected samples are only available at full resolution.
+            const rgb c = reprojection_ && scale_ == 1
+                ? reprojection_->resolve(accum_buffer_, samples_, x, y)
+                : rgb(accum_buffer_(x, y)) * weight;
+            out(x, y) = rgba(c, 1.0f);
+        }
+    });
+}
+
+void RenderWindow::output_image(Image& img) {
+    img.resize(accum_buffer_.width(), accum_buffer_.height());
+    resolve(img);
+
+    if (scale_ > 1) {
+        Image small(img.width(), img.height());
+        std::swap(small, img);
+        img.resize(width_, height_);
+        tbb::parallel_for(0, height_, [&] (int y) {
+            for (int x = 0; x < width_; ++x)
+                img(x, y) = rgba(upscale(small, x, y, width_, height_), 1.0f);
+        });
+    }
+
+    if (denoise_ && scale_ == 1) {
+        Image denoised;
+        denoise(img, *aovs_, denoise_iterations_, denoised);
+        std::swap(denoised, img);
+    }
+}
+
+void RenderWindow::record_convergence(int64_t elapsed_ms) {
+    Image img;
+    output_image(img);
+    convergence_->record(img, elapsed_ms, samples_, FrameProfiler::instance().total_rays());
+}
+
 bool RenderWindow::write_image(const char* file_name) {
-    const float weight = 1.0f / (frames_ * spp_);
-    return store_png(file_name, accum_buffer_, weight, gamma_, false);
+    Image img;
+    output_image(img);
+    return store_image(file_name, img, 1.0f, gamma_);
+}
+
+bool RenderWindow::write_aovs() {
+    Image albedo(aovs_->width(), aovs_->height());
+    Image normal(aovs_->width(), aovs_->height());
+
+    tbb::parallel_for(0, albedo.height(), [&] (int y) {
+        for (int x = 0; x < albedo.width(); ++x) {
+            const float3 n = aovs_->normal(x, y);
+            const float len = length(n);
+            albedo(x, y) = rgba(aovs_->albedo(x, y), 1.0f);
+            normal(x, y) = rgba(len > 0.0f ? n * (0.5f / len) + float3(0.5f) : float3(0.0f), 1.0f);
+        }
+    });
+
+    // The auxiliary images are stored without gamma correction.
+    return store_png(aov_path_ + "albedo.png", albedo, 1.0f, 1.0f, false) &&
+           store_png(aov_path_ + "normal.png", normal, 1.0f, 1.0f, false);
 }
 
 } // namespace imba
@@ -3,8 +3,15 @@
 
 #include <SDL2/SDL.h>
 #include <chrono>
+#include <memory>
 
 #include "imbatracer/frontend/cmd_line.h"
+#include "imbatracer/frontend/convergence.h"
+#include "imbatracer/frontend/display_thread.h"
+#include "imbatracer/frontend/dynamic_resolution.h"
+#include "imbatracer/frontend/image_writer.h"
+#include "imbatracer/frontend/render_budget.h"
+#include "imbatracer/frontend/reprojection.h"
 #include "imbatracer/render/integrators/integrator.h"
 
 namespace imba {
@@ -29,13 +36,32 @@ public:
 
 private:
     void clear();
-    bool handle_events();
+    /// Processes the pending events. Returns true if the window was closed, and sets moved if the camera moved.
+    bool handle_events(bool& moved);
     void render();
 
+    /// Renders the next frames with 1 / scale of the full resolution in each dimension, and clears the image.
+    void set_scale(int scale);
+
+    /// Computes the average color of the pixels of the accumulated image, which may be smaller than the window.
+    void resolve(Image& out) const;
+
+    /// Computes the image that is written to the files: the average color of the pixels at full resolution, denoised
+    /// if enabled.
+    void output_image(Image& img);
+    /// Writes the image synchronously, in the format given by the extension of the file.
     bool write_image(const char* filename);
+    bool write_aovs();
+    /// Records a checkpoint of the convergence benchmark with the current image.
+    void record_convergence(int64_t elapsed_ms);
+    /// Prints the memory used by the integrator, the scene and the images of the window.
+    void print_memory() const;
 
     AtomicImage accum_buffer_;
+    int width_, height_;    ///< Full resolution of the image
+    int scale_;             ///< The accumulated image has 1 / scale_ of the full resolution in each dimension
     SDL_Window* window_;
+    std::unique_ptr<DisplayThread> display_;
     Integrator& integrator_;
     InputController& ctrl_;
 
@@ -44,19 +70,33 @@ private:
     float mouse_speed_;
 
     int frames_;
+    int samples_;   ///< Number of samples per pixel in the accumulation buffer
     std::chrono::high_resolution_clock::time_point start_time_;
     int msg_counter_;
     static constexpr int msg_interval_ms = 10000;
 
     int max_samples_;
-    int spp_;
+    int spp_;       ///< Number of samples per pixel of the next frame
     float max_time_sec_;
 
+    std::unique_ptr<RenderBudget> budget_;
+    std::unique_ptr<ConvergenceBench> convergence_;
+    std::unique_ptr<DynamicResolution> dynamic_res_;
+
     std::string conv_file_base_;
+    std::string conv_format_;   ///< Extension, and thus format, of the intermediate images
     float conv_interval_sec_;
     int conv_count_;
 
     std::string output_file_;
+    std::string partial_file_;  ///< If given, the accumulated samples are written to this file as well
+    ImageWriter writer_;    ///< Writes the intermediate images in the background
+
+    std::unique_ptr<AOVImages> aovs_;
+    std::unique_ptr<Reprojection> reprojection_;
+    bool denoise_;
+    int denoise_iterations_;
+    std::string aov_path_;
 };
 
 } // namespace imba
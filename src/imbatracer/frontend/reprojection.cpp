@@ -0,0 +1,82 @@
+#include <algorithm>
+
+#include <tbb/parallel_for.h>
+
+#include "imbatracer/frontend/reprojection.h"
+
+namespace imba {
+
+constexpr float Reprojection::MAX_HISTORY;
+
+Reprojection::Reprojection(int width, int height)
+    : width_(width), height_(height)
+    , history_(width * height, rgb(0.0f))
+    , weight_(width * height, 0.0f)
+    , saved_(width * height)
+    , pending_(false)
+    , has_frame_(false)
+{}
+
+void Reprojection::save(const AtomicImage& accum, int samples, const AOVImages& aovs) {
+    if (!has_frame_) return;
+
+    tbb::parallel_for(0, height_, [&] (int y) {
+        for (int x = 0; x < width_; ++x) {
+            const int i = y * width_ + x;
+            SavedPixel& p = saved_[i];
+            p.color  = resolve(accum, samples, x, y);
+            p.weight = samples + weight_[i];
+            p.depth  = aovs.coverage(x, y) >= MIN_COVERAGE ? aovs.depth(x, y) : 0.0f;
+            p.id     = aovs.id(x, y);
+        }
+    });
+
+    // The history is now part of the saved image, until it is reprojected.
+    std::fill(weight_.begin(), weight_.end(), 0.0f);
+
+    saved_cam_ = cam_;
+    pending_ = true;
+    has_frame_ = false;
+}
+
+void Reprojection::end_frame(const AOVImages& aovs, const PerspectiveCamera& cam) {
+    has_frame_ = true;
+    cam_ = cam;
+
+    if (!pending_) return;
+    pending_ = false;
+
+    // Position of the first hit of a pixel, on the ray through its center.
+    auto hit_pos = [] (const PerspectiveCamera& c, int x, int y, float depth) {
+        const float3 dir = normalize(c.raster_to_world(float2(x + 0.5f, y + 0.5f)) - c.pos());
+        return c.pos() + dir * depth;
+    };
+
+    tbb::parallel_for(0, height_, [&] (int y) {
+        for (int x = 0; x < width_; ++x) {
+            const int i = y * width_ + x;
+            weight_[i] = 0.0f;
+
+            if (aovs.coverage(x, y) < MIN_COVERAGE) continue;
+
+            const float depth = aovs.depth(x, y);
+            const float3 pos = hit_pos(cam, x, y, depth);
+            if (dot(pos - saved_cam_.pos(), saved_cam_.dir()) <= 0.0f) continue;
+
+            const int o = saved_cam_.raster_to_id(saved_cam_.world_to_raster(pos));
+            if (o < 0) continue;
+
+            // Reject the disocclusions: the old pixel must have seen the same surface.
+            const SavedPixel& p = saved_[o];
+            if (p.depth == 0.0f || p.id != aovs.id(x, y)) continue;
+
+            const float3 old_pos = hit_pos(saved_cam_, o % width_, o / width_, p.depth);
+            if (length(old_pos - pos) > DEPTH_TOLERANCE * depth) continue;
+
+            history_[i] = p.color;
+            weight_[i]  = std::min(p.weight, MAX_HISTORY);
+        }
+    });
+}
+
+} // namespace imba
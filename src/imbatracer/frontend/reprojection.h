@@ -0,0 +1,68 @@
+#ifndef IMBA_REPROJECTION_H
+#define IMBA_REPROJECTION_H
+
+#include <vector>
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/render/aov.h"
+#include "imbatracer/render/ray_gen/camera.h"
+
+namespace imba {
+
+/// Keeps the samples of the accumulated image when the camera moves, by reprojecting them into the new view.
+/// When the camera moves, the average color of the pixels is saved with the distance and the instance id of their first
+/// hits. Once the first frame has been rendered in the new view, the first hits of its pixels are projected into the old
+/// view, and the saved color of the old pixel is reused if it saw the same surface: the ids must match, the distances
+/// must agree, and both pixels must be fully covered, which rejects the disocclusions and the silhouettes.
+/// The reused color counts for at most MAX_HISTORY samples, so that the view-dependent effects and the errors of the
+/// reprojection fade out as new samples are accumulated.
+class Reprojection {
+public:
+    Reprojection(int width, int height);
+
+    /// Saves the accumulated image, before it is cleared because the camera moved.
+    /// Does nothing if no frame has been rendered since the previous call.
+    void save(const AtomicImage& accum, int samples, const AOVImages& aovs);
+
+    /// Called after every frame with the camera it was rendered with. Reprojects the saved image into the view of
+    /// the frame if the camera moved before it.
+    void end_frame(const AOVImages& aovs, const PerspectiveCamera& cam);
+
+    /// Average color of a pixel, combining the samples of the accumulated image with the reprojected ones.
+    rgb resolve(const AtomicImage& accum, int samples, int x, int y) const {
+        const int i = y * width_ + x;
+        const float w = samples + weight_[i];
+        return w > 0.0f ? (rgb(accum(x, y)) + history_[i] * weight_[i]) * (1.0f / w) : rgb(0.0f);
+    }
+
+private:
+    static constexpr float MAX_HISTORY = 64.0f;
+    // Maximum difference between the distances of the first hits, relative to the distance.
+    static constexpr float DEPTH_TOLERANCE = 0.02f;
+    // Minimum fraction of the samples of a pixel that must hit something for the pixel to be reprojected.
+    static constexpr float MIN_COVERAGE = 0.99f;
+
+    int width_, height_;
+
+    // Samples reprojected into the current view.
+    std::vector<rgb> history_;
+    std::vector<float> weight_;
+
+    // Image saved before the camera moved.
+    struct SavedPixel {
+        rgb color;
+        float weight;
+        float depth;    ///< Zero if the pixel is not fully covered by a surface
+        int id;
+    };
+    std::vector<SavedPixel> saved_;
+    PerspectiveCamera saved_cam_;
+    bool pending_;
+
+    PerspectiveCamera cam_;     ///< Camera of the accumulated image
+    bool has_frame_;            ///< True if a frame has been rendered since the last save
+};
+
+} // namespace imba
+
+#endif // IMBA_REPROJECTION_H
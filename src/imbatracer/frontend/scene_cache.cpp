@@ -0,0 +1,392 @@
+#include <fstream>
+#include <cstring>
+#include <type_traits>
+
+#include <sys/stat.h>
+
+#include "imbatracer/frontend/scene_cache.h"
+#include "imbatracer/loaders/mapped_file.h"
+
+namespace imba {
+
+// File layout: a CacheHeader followed by the sections below, in this order.
+// Every array starts with its number of elements as a 64-bit integer, strings are arrays of characters.
+//   dependencies: (path, size, modification time) for every file the scene was built from
+//   camera, accel filenames and builders
+//   meshes: vertex, index and attribute arrays
+//   textures, masks (the texels packed in bits), materials, lights, environment map, transformations and instances
+
+static constexpr uint32_t CACHE_MAGIC = 0x43534D49;
+static constexpr uint32_t CACHE_VERSION = 5;
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t  default_builder;
+    // The raw structures can only be read by a build with the same layout.
+    uint32_t material_size;
+    uint32_t light_size;
+    uint32_t instance_size;
+    uint32_t transform_size;
+};
+
+struct FileStamp {
+    int64_t size;
+    int64_t mtime;
+};
+
+static FileStamp file_stamp(const std::string& filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return FileStamp{ -1, -1 };
+    return FileStamp{ int64_t(st.st_size), int64_t(st.st_mtime) };
+}
+
+static CacheHeader cache_header(BvhBuilderType default_builder) {
+    CacheHeader h;
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.default_builder = default_builder;
+    h.material_size = sizeof(MaterialDesc);
+    h.light_size = sizeof(LightDesc);
+    h.instance_size = sizeof(Mesh::Instance);
+    h.transform_size = sizeof(Mesh::Transform);
+    return h;
+}
+
+class CacheWriter {
+public:
+    CacheWriter(const std::string& filename) : out_(filename, std::ofstream::binary | std::ofstream::trunc) {}
+
+    template <typename T>
+    void write(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only raw data can be written to the cache");
+        out_.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    void write_array(const T* data, uint64_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "Only raw data can be written to the cache");
+        write(count);
+        out_.write(reinterpret_cast<const char*>(data), sizeof(T) * count);
+    }
+
+    template <typename T>
+    void write_array(const std::vector<T>& v) { write_array(v.data(), v.size()); }
+
+    void write_string(const std::string& str) { write_array(str.data(), str.size()); }
+
+    bool ok() const { return static_cast<bool>(out_); }
+
+private:
+    std::ofstream out_;
+};
+
+/// Reads the cache from memory, checking that every read stays within the file.
+class CacheReader {
+public:
+    CacheReader(const char* data, uint64_t size) : ptr_(data), end_(data + size), ok_(data != nullptr) {}
+
+    template <typename T>
+    bool read(T& value) {
+        return read_bytes(&value, sizeof(T));
+    }
+
+    /// Returns the number of elements of the next array, which can then be read with read_data().
+    bool read_count(uint64_t& count, uint64_t elem_size) {
+        if (!read(count)) return false;
+        if (count > uint64_t(end_ - ptr_) / elem_size) ok_ = false;
+        return ok_;
+    }
+
+    template <typename T>
+    bool read_data(T* data, uint64_t count) {
+        return read_bytes(data, sizeof(T) * count);
+    }
+
+    template <typename T>
+    bool read_array(std::vector<T>& v) {
+        uint64_t count;
+        if (!read_count(count, sizeof(T))) return false;
+        v.resize(count);
+        return read_data(v.data(), count);
+    }
+
+    bool read_string(std::string& str) {
+        uint64_t count;
+        if (!read_count(count, 1)) return false;
+        str.assign(ptr_, count);
+        ptr_ += count;
+        return true;
+    }
+
+    bool ok() const { return ok_; }
+
+private:
+    bool read_bytes(void* dst, uint64_t size) {
+        if (!ok_ || uint64_t(end_ - ptr_) < size) return ok_ = false;
+        if (size > 0) memcpy(dst, ptr_, size);
+        ptr_ += size;
+        return true;
+    }
+
+    const char* ptr_;
+    const char* end_;
+    bool ok_;
+};
+
+Material* create_material(const MaterialDesc& desc, const Scene& scene) {
+    const TextureSampler* texture = desc.texture >= 0 ? scene.texture(desc.texture).get() : nullptr;
+    TextureSampler* bump = desc.bump >= 0 ? scene.texture(desc.bump).get() : nullptr;
+
+    Material* mat;
+    switch (desc.type) {
+        case MaterialDesc::GLOSSY:
+            if (texture)
+                mat = new GlossyMaterial(desc.exponent, desc.specular, texture, bump);
+            else
+                mat = new GlossyMaterial(desc.exponent, desc.specular, desc.diffuse, bump);
+            break;
+        case MaterialDesc::MIRROR:
+            mat = new MirrorMaterial(desc.eta, desc.exponent, desc.specular, bump);
+            break;
+        case MaterialDesc::GLASS:
+            mat = new GlassMaterial(desc.eta, desc.diffuse, desc.specular, bump);
+            break;
+        default:
+            if (texture)
+                mat = new DiffuseMaterial(texture, bump);
+            else
+                mat = new DiffuseMaterial(desc.diffuse, bump);
+            break;
+    }
+
+    if (desc.emissive)
+        mat->set_emitter(new AreaEmitter(desc.emit_intensity, desc.emit_area));
+
+    return mat;
+}
+
+Light* create_light(const LightDesc& desc, const Scene& scene) {
+    switch (desc.type) {
+        case LightDesc::TRIANGLE:    return new TriangleLight(desc.intensity, desc.pos[0], desc.pos[1], desc.pos[2]);
+        case LightDesc::DIRECTIONAL: return new DirectionalLight(desc.dir, desc.intensity, scene.bounding_sphere());
+        case LightDesc::SPOT:        return new SpotLight(desc.pos[0], desc.dir, desc.angle, desc.intensity);
+        case LightDesc::ENV:         return new EnvLight(scene.env_map(), scene.bounding_sphere());
+        default:                     return new PointLight(desc.pos[0], desc.intensity);
+    }
+}
+
+bool store_scene_cache(const std::string& filename, BvhBuilderType default_builder, const SceneDesc& desc,
+                       const Scene& scene, const MaskBuffer& masks) {
+    CacheWriter out(filename);
+    if (!out.ok()) return false;
+
+    out.write(cache_header(default_builder));
+
+    out.write<uint64_t>(desc.dependencies.size());
+    for (auto& dep : desc.dependencies) {
+        out.write_string(dep);
+        out.write(file_stamp(dep));
+    }
+
+    out.write(desc.cam_pos);
+    out.write(desc.cam_dir);
+    out.write(desc.cam_up);
+
+    out.write<uint64_t>(desc.accel_filenames.size());
+    for (auto& accel : desc.accel_filenames) out.write_string(accel);
+    out.write_array(desc.builders);
+
+    out.write<uint64_t>(scene.mesh_count());
+    for (auto& mesh : scene.meshes()) {
+        out.write<uint64_t>(mesh.attribute_count());
+        for (int i = 0; i < mesh.attribute_count(); i++) {
+            out.write(mesh.attribute_type(i));
+            out.write(mesh.attribute_binding(i));
+        }
+
+        out.write_array(mesh.vertices(), mesh.vertex_count());
+        out.write_array(mesh.indices(), mesh.index_count());
+        for (int i = 0; i < mesh.attribute_count(); i++)
+            out.write_array(mesh.attribute_data(i), mesh.attribute_size(i));
+    }
+
+    out.write<uint64_t>(scene.texture_count());
+    for (auto& tex : scene.textures()) {
+        out.write(tex->format());
+        out.write<int32_t>(tex->width());
+        out.write<int32_t>(tex->height());
+        out.write_array(tex->texel_data());
+    }
+
+    out.write<uint64_t>(masks.buffer_size());
+    out.write_array(masks.pack());
+    out.write_array(masks.descs(), masks.mask_count());
+
+    out.write_array(desc.materials);
+    out.write_array(desc.lights);
+
+    const EnvMap* env_map = scene.env_map();
+    out.write<int32_t>(env_map != nullptr);
+    if (env_map) {
+        out.write(env_map->intensity());
+        out.write<int32_t>(env_map->image().width());
+        out.write<int32_t>(env_map->image().height());
+        out.write_array(env_map->image().pixels(), uint64_t(env_map->image().width()) * env_map->image().height());
+    }
+
+    out.write_array(scene.transforms());
+    out.write_array(scene.instances());
+
+    return out.ok();
+}
+
+static bool read_image(CacheReader& in, Image& img) {
+    int32_t w, h;
+    uint64_t count;
+    if (!in.read(w) || !in.read(h) || w < 0 || h < 0 ||
+        !in.read_count(count, sizeof(rgba)) || count != uint64_t(w) * h)
+        return false;
+
+    img.resize(w, h);
+    return in.read_data(img.pixels(), count);
+}
+
+static bool read_scene(CacheReader& in, BvhBuilderType default_builder, SceneDesc& desc, Scene& scene, MaskBuffer& masks) {
+    const CacheHeader expected = cache_header(default_builder);
+    CacheHeader h;
+    if (!in.read(h) || memcmp(&h, &expected, sizeof(CacheHeader)))
+        return false;
+
+    // The cache is stale if any of the files the scene depends on has changed.
+    uint64_t dep_count;
+    if (!in.read_count(dep_count, sizeof(uint64_t) + sizeof(FileStamp))) return false;
+    desc.dependencies.resize(dep_count);
+    for (auto& dep : desc.dependencies) {
+        FileStamp stamp;
+        if (!in.read_string(dep) || !in.read(stamp)) return false;
+
+        const FileStamp current = file_stamp(dep);
+        if (current.size != stamp.size || current.mtime != stamp.mtime) {
+            std::cout << " The scene cache is out of date (" << dep << " has changed)." << std::endl;
+            return false;
+        }
+    }
+
+    if (!in.read(desc.cam_pos) || !in.read(desc.cam_dir) || !in.read(desc.cam_up))
+        return false;
+
+    uint64_t accel_count;
+    if (!in.read_count(accel_count, sizeof(uint64_t))) return false;
+    desc.accel_filenames.resize(accel_count);
+    for (auto& accel : desc.accel_filenames) {
+        if (!in.read_string(accel)) return false;
+    }
+    if (!in.read_array(desc.builders)) return false;
+
+    uint64_t mesh_count;
+    if (!in.read_count(mesh_count, 4 * sizeof(uint64_t))) return false;
+    for (uint64_t m = 0; m < mesh_count; m++) {
+        scene.meshes().emplace_back();
+        Mesh& mesh = scene.meshes().back();
+
+        uint64_t attr_count;
+        if (!in.read_count(attr_count, sizeof(Mesh::AttributeType) + sizeof(Mesh::AttributeBinding))) return false;
+        for (uint64_t i = 0; i < attr_count; i++) {
+            Mesh::AttributeType type;
+            Mesh::AttributeBinding binding;
+            if (!in.read(type) || !in.read(binding)) return false;
+            mesh.add_attribute(type, binding);
+        }
+
+        uint64_t vertex_count, index_count;
+        if (!in.read_count(vertex_count, sizeof(float4))) return false;
+        mesh.set_vertex_count(vertex_count);
+        if (!in.read_data(mesh.vertices(), vertex_count)) return false;
+
+        if (!in.read_count(index_count, sizeof(uint32_t))) return false;
+        mesh.set_index_count(index_count);
+        if (!in.read_data(mesh.indices(), index_count)) return false;
+
+        for (int i = 0; i < attr_count; i++) {
+            uint64_t size;
+            if (!in.read_count(size, 1) || size != mesh.attribute_size(i) ||
+                !in.read_data(mesh.attribute_data(i), size))
+                return false;
+        }
+    }
+
+    uint64_t texture_count;
+    if (!in.read_count(texture_count, sizeof(TexelFormat) + 2 * sizeof(int32_t) + sizeof(uint64_t))) return false;
+    for (uint64_t i = 0; i < texture_count; i++) {
+        TexelFormat format;
+        int32_t w, h;
+        std::vector<uint8_t> texels;
+        if (!in.read(format) || !in.read(w) || !in.read(h) || w <= 0 || h <= 0 || !in.read_array(texels))
+            return false;
+
+        if (format < TexelFormat::R8 || format > TexelFormat::RGBA32F ||
+            texels.size() != TextureSampler::texel_data_size(format, w, h))
+            return false;
+        scene.textures().emplace_back(new TextureSampler(format, w, h, std::move(texels)));
+    }
+
+    uint64_t mask_texels;
+    std::vector<uint8_t> mask_bits;
+    std::vector<MaskBuffer::MaskDesc> mask_descs;
+    if (!in.read(mask_texels) || !in.read_array(mask_bits) || !in.read_array(mask_descs)) return false;
+    if (mask_bits.size() != (mask_texels + 7) / 8) return false;
+    masks = MaskBuffer::unpack(mask_bits, mask_texels, std::move(mask_descs));
+
+    if (!in.read_array(desc.materials) || !in.read_array(desc.lights)) return false;
+    for (auto& mat : desc.materials) {
+        if (mat.texture >= int(scene.texture_count()) || mat.bump >= int(scene.texture_count())) return false;
+        scene.materials().emplace_back(create_material(mat, scene));
+    }
+
+    int32_t has_env_map;
+    if (!in.read(has_env_map)) return false;
+    if (has_env_map) {
+        float intensity;
+        Image img;
+        if (!in.read(intensity) || !read_image(in, img)) return false;
+        scene.set_env_map(new EnvMap(img, intensity, scene.bounding_sphere()));
+    }
+
+    for (auto& light : desc.lights) {
+        if (light.type == LightDesc::ENV && !scene.env_map()) return false;
+        scene.lights().emplace_back(create_light(light, scene));
+    }
+
+    if (!in.read_array(scene.transforms()) || !in.read_array(scene.instances())) return false;
+    for (auto& inst : scene.instances()) {
+        if (inst.id < 0 || inst.id >= scene.mesh_count()) return false;
+        if (inst.transform < 0 || inst.transform >= int(scene.transforms().size())) return false;
+    }
+
+    return desc.accel_filenames.size() == scene.mesh_count() && desc.builders.size() == scene.mesh_count() &&
+           desc.materials.size() == scene.material_count();
+}
+
+bool load_scene_cache(const std::string& filename, BvhBuilderType default_builder, SceneDesc& desc,
+                      Scene& scene, MaskBuffer& masks) {
+    MappedFile file(filename);
+    if (!file.data()) return false;
+
+    CacheReader in(file.data(), file.size());
+    if (read_scene(in, default_builder, desc, scene, masks)) return true;
+
+    // Leave the scene as it was, so that it can be loaded from the original files.
+    scene.lights().clear();
+    scene.set_env_map(nullptr);
+    scene.materials().clear();
+    scene.textures().clear();
+    scene.meshes().clear();
+    scene.instances().clear();
+    scene.transforms().clear();
+    desc = SceneDesc();
+    masks = MaskBuffer();
+    return false;
+}
+
+} // namespace imba
@@ -0,0 +1,92 @@
+#ifndef IMBA_SCENE_CACHE_H
+#define IMBA_SCENE_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "imbatracer/core/adapter.h"
+#include "imbatracer/core/image.h"
+#include "imbatracer/core/mask.h"
+#include "imbatracer/render/scene.h"
+
+namespace imba {
+
+/// Parameters of a material, from which the material can be created again without its MTL file.
+struct MaterialDesc {
+    enum Type : int32_t {
+        DIFFUSE,
+        GLOSSY,
+        MIRROR,
+        GLASS
+    };
+
+    int32_t type;
+    int32_t texture;        ///< Diffuse texture (diffuse and glossy), or -1
+    int32_t bump;           ///< Bump map, or -1
+    int32_t emissive;       ///< Non-zero if the material is attached to an area emitter
+    rgb     diffuse;        ///< Diffuse color (diffuse and glossy), transmittance (glass)
+    rgb     specular;       ///< Specular color (glossy), reflectance (glass), scale (mirror)
+    float   exponent;       ///< Exponent (glossy), absorption coefficient (mirror)
+    float   eta;            ///< Index of refraction (glass and mirror)
+    rgb     emit_intensity;
+    float   emit_area;
+
+    explicit MaterialDesc(int32_t type = DIFFUSE)
+        : type(type), texture(-1), bump(-1), emissive(0)
+        , diffuse(1.0f), specular(0.0f), exponent(0.0f), eta(1.0f)
+        , emit_intensity(0.0f), emit_area(0.0f)
+    {}
+};
+
+/// Parameters of a light source, from which the light can be created again without the scene file.
+struct LightDesc {
+    enum Type : int32_t {
+        TRIANGLE,
+        DIRECTIONAL,
+        POINT,
+        SPOT,
+        ENV
+    };
+
+    int32_t type;
+    float3  pos[3];         ///< Vertices (triangle), position (point and spot)
+    float3  dir;            ///< Normalized direction (directional and spot)
+    rgb     intensity;
+    float   angle;          ///< Angle of the cone in radians (spot)
+
+    explicit LightDesc(int32_t type = POINT)
+        : type(type), pos{ float3(0.0f), float3(0.0f), float3(0.0f) }, dir(0.0f), intensity(0.0f), angle(0.0f)
+    {}
+};
+
+/// What is needed, on top of the contents of the Scene, to create the scene again without parsing the files it was loaded from.
+struct SceneDesc {
+    std::vector<std::string> dependencies;      ///< Files that were read to build the scene
+    std::vector<MaterialDesc> materials;        ///< One per material of the scene
+    std::vector<LightDesc> lights;              ///< One per light of the scene
+    std::vector<std::string> accel_filenames;   ///< One per mesh of the scene
+    std::vector<BvhBuilderType> builders;       ///< One per mesh of the scene
+    float3 cam_pos;
+    float3 cam_dir;
+    float3 cam_up;
+
+    SceneDesc() : cam_pos(0.0f), cam_dir(0.0f, 0.0f, 1.0f), cam_up(0.0f, 1.0f, 0.0f) {}
+};
+
+/// Creates a material. The textures it refers to must already be in the scene.
+Material* create_material(const MaterialDesc& desc, const Scene& scene);
+/// Creates a light source. The environment map must already be set for environment lights.
+Light* create_light(const LightDesc& desc, const Scene& scene);
+
+/// Stores the meshes, textures, materials, lights and instances of the scene, along with the masks and the description.
+bool store_scene_cache(const std::string& filename, BvhBuilderType default_builder, const SceneDesc& desc,
+                       const Scene& scene, const MaskBuffer& masks);
+/// Loads a scene stored with store_scene_cache(), which must be empty. The cache is only loaded if it was stored with the
+/// same default builder and none of the files the scene depends on have changed since then, otherwise the scene is left empty.
+bool load_scene_cache(const std::string& filename, BvhBuilderType default_builder, SceneDesc& desc,
+                      Scene& scene, MaskBuffer& masks);
+
+} // namespace imba
+
+#endif // IMBA_SCENE_CACHE_H
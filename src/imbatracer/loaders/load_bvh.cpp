@@ -1,304 +1,234 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <cstring>
 #include <anydsl_runtime.hpp>
 
 #include "imbatracer/loaders/loaders.h"
+#include "imbatracer/loaders/mapped_file.h"
 #include "imbatracer/core/common.h"
 #include "imbatracer/core/traversal_interface.h"
 
 namespace imba {
 
-enum class BlockType {
+// File layout (version 2):
+//   FileHeader
+//   block_count x BlockHeader
+//   node and triangle arrays of every block, each aligned to DATA_ALIGNMENT bytes
+// The nodes of a block are numbered from 0 and its leaves point to triangles relative to the start of the block,
+// so the arrays can be used directly once the file is mapped in memory.
+
+enum class BlockType : uint32_t {
     BVH = 1,
     MBVH = 2
 };
 
-struct Header {
-    uint32_t node_count;
-    uint32_t prim_count;
-};
+static constexpr uint32_t ACCEL_MAGIC = 0x313F1A57;
+static constexpr uint32_t ACCEL_VERSION = 2;
+static constexpr uint64_t DATA_ALIGNMENT = 64;
 
-inline bool check_header(std::istream& is) {
+struct FileHeader {
     uint32_t magic;
-    is.read((char*)&magic, sizeof(uint32_t));
-    return magic == 0x313F1A57;
-}
+    uint32_t version;
+    uint32_t block_count;
+    uint32_t reserved;
+};
 
-inline bool locate_block(std::istream& is, BlockType type) {
-    uint32_t block_type;
-    uint64_t offset = 0;
-    do {
-        is.seekg(offset, std::istream::cur);
+struct BlockHeader {
+    uint32_t type;
+    int32_t  tri_id_offset;  ///< Offset that was added to the triangle ids when the block was stored
+    uint64_t hash;           ///< Hash of the mesh and build options, see accel_hash()
+    uint64_t node_count;
+    uint64_t prim_count;
+    uint64_t nodes_offset;   ///< Position of the nodes from the start of the file
+    uint64_t tris_offset;    ///< Position of the triangles from the start of the file
+};
 
-        is.read((char*)&offset, sizeof(uint64_t));
-        if (is.gcount() != sizeof(uint64_t)) return false;
-        is.read((char*)&block_type, sizeof(uint32_t));
-        if (is.gcount() != sizeof(uint32_t)) return false;
+/// Returns the list of blocks in the file, or an empty list if the file is not a valid version 2 file.
+static std::vector<BlockHeader> read_blocks(const MappedFile& file) {
+    std::vector<BlockHeader> blocks;
+    if (file.size() < sizeof(FileHeader)) return blocks;
 
-        offset -= sizeof(BlockType);
-    } while (!is.eof() && block_type != (uint32_t)type);
+    FileHeader h;
+    memcpy(&h, file.data(), sizeof(FileHeader));
+    if (h.magic != ACCEL_MAGIC || h.version != ACCEL_VERSION ||
+        file.size() < sizeof(FileHeader) + h.block_count * sizeof(BlockHeader))
+        return blocks;
 
-    return static_cast<bool>(is);
+    blocks.resize(h.block_count);
+    memcpy(blocks.data(), file.data() + sizeof(FileHeader), h.block_count * sizeof(BlockHeader));
+    return blocks;
 }
 
-bool load_accel_cpu(const std::string& filename, std::vector<traversal_cpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset) {
-    const BlockType block_type = BlockType::MBVH;
-    using traversal_cpu::Node;
-
-    // Account for the nodes of other BVHs that might already be inside the array.
-    const int node_offset = nodes_out.size();
-    const int tris_offset = tris_out.size();
-
-    std::ifstream in(filename, std::ifstream::binary);
-    if (!in || !check_header(in) || !locate_block(in, block_type))
-        return false;
-
-    Header h;
-    in.read((char*)&h, sizeof(Header));
-
-    nodes_out.resize(nodes_out.size() + h.node_count);
-    tris_out .resize( tris_out.size() + h.prim_count);
-
-    in.read((char*)(nodes_out.data() + node_offset), sizeof(Node) * h.node_count);
-    in.read((char*)( tris_out.data() + tris_offset), sizeof(Vec4) * h.prim_count);
-
-    if (node_offset > 0) {
-        for (int i = node_offset; i < nodes_out.size(); ++i) {
-            for (int j = 0; j < 4; ++j) {
-                if (nodes_out[i].children[j] > 0)
-                    nodes_out[i].children[j] += node_offset;
-                else if (nodes_out[i].children[j] < 0)
-                    nodes_out[i].children[j] = ~(~nodes_out[i].children[j] + tris_offset);
-            }
-        }
-    }
-
-    if (tri_id_offset != 0) {
-        for (int i = tris_offset; i < tris_out.size(); ) {
-            for (int j = 0; j < 13; ++j)
-                i++;
-
-            auto set = [tri_id_offset] (float& val) {
-                if (float_as_int(val) != 0x80000000)
-                    val = int_as_float(float_as_int(val) + tri_id_offset);
-            };
-
-            set(tris_out[i - 1].x);
-            set(tris_out[i - 1].y);
-            set(tris_out[i - 1].z);
-            set(tris_out[i - 1].w);
-
-            if (float_as_int(tris_out[i].x) == 0x80000000)
-                i++; // Skip the sentinel
-        }
-    }
-
-    return true;
+static uint64_t node_size(const BlockHeader& b) {
+    return b.type == static_cast<uint32_t>(BlockType::MBVH) ? sizeof(traversal_cpu::Node) : sizeof(traversal_gpu::Node);
 }
 
-bool load_accel_gpu(const std::string& filename, std::vector<traversal_gpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset) {
-    const BlockType block_type = BlockType::BVH;
-    using traversal_gpu::Node;
-
-    // Account for the nodes of other BVHs that might already be inside the array.
-    const int node_offset = nodes_out.size();
-    const int tris_offset = tris_out.size();
-
-    std::ifstream in(filename, std::ifstream::binary);
-    if (!in || !check_header(in) || !locate_block(in, block_type))
-        return false;
-
-    Header h;
-    in.read((char*)&h, sizeof(Header));
-
-    nodes_out.resize(nodes_out.size() + h.node_count);
-    tris_out .resize( tris_out.size() + h.prim_count);
-
-    in.read((char*)(nodes_out.data() + node_offset), sizeof(Node) * h.node_count);
-    in.read((char*)( tris_out.data() + tris_offset), sizeof(Vec4) * h.prim_count);
+static bool block_in_file(const MappedFile& file, const BlockHeader& b) {
+    return b.nodes_offset + b.node_count * node_size(b) <= file.size() &&
+           b.tris_offset  + b.prim_count * sizeof(Vec4) <= file.size();
+}
 
-    if (node_offset > 0) {
-        for (int i = node_offset; i < nodes_out.size(); ++i) {
-            if (nodes_out[i].left < 0)
-                nodes_out[i].left = ~(~nodes_out[i].left + tris_offset);
-            else
-                nodes_out[i].left += node_offset;
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + DATA_ALIGNMENT - 1) / DATA_ALIGNMENT * DATA_ALIGNMENT;
+}
 
-            if (nodes_out[i].right < 0)
-                nodes_out[i].right = ~(~nodes_out[i].right + tris_offset);
-            else
-                nodes_out[i].right += node_offset;
+/// Maps the block of the given type, if it was stored for the same mesh and build options.
+/// The triangle ids are only rewritten, in a copy, if the mesh has moved in the triangle layout since the block was stored.
+template <typename Node, typename OffsetTriIdsFn>
+static bool map_accel(const std::string& filename, BlockType type, uint64_t hash,
+                      MappedAccel<Node>& accel, int tri_id_offset, OffsetTriIdsFn offset_tri_ids) {
+    std::unique_ptr<MappedFile> file(new MappedFile(filename));
+    if (!file->data()) return false;
+
+    for (auto& b : read_blocks(*file)) {
+        if (b.type != static_cast<uint32_t>(type) || b.hash != hash || !block_in_file(*file, b))
+            continue;
+
+        // The arrays are aligned within the file, and the mapping starts at a page boundary.
+        accel.nodes = reinterpret_cast<const Node*>(file->data() + b.nodes_offset);
+        accel.node_count = b.node_count;
+        accel.tris = reinterpret_cast<const Vec4*>(file->data() + b.tris_offset);
+        accel.tri_count = b.prim_count;
+
+        if (b.tri_id_offset != tri_id_offset) {
+            accel.relocated_tris.assign(accel.tris, accel.tris + accel.tri_count);
+            offset_tri_ids(accel.relocated_tris, tri_id_offset - b.tri_id_offset);
+            accel.tris = accel.relocated_tris.data();
         }
-    }
 
-    if (tri_id_offset != 0) {
-        for (int i = tris_offset; i < tris_out.size(); i += 3) {
-            tris_out[i + 1].w = int_as_float(float_as_int(tris_out[i + 1].w) + tri_id_offset);
-        }
+        accel.file = std::move(file);
+        return true;
     }
 
-    return true;
+    // No block for this platform, or the block is stale.
+    return false;
 }
 
-bool store_accel_cpu(const std::string& filename, const std::vector<traversal_cpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
-    const BlockType block_type = BlockType::MBVH;
-    using traversal_cpu::Node;
+/// Stores the block of the given type. The blocks of other types are kept if they were stored for the same mesh
+/// and build options, any other block is stale and is removed.
+template <typename Node>
+static bool store_accel(const std::string& filename, BlockType type, uint64_t hash,
+                        const std::vector<Node>& nodes, const std::vector<Vec4>& tris, int tri_id_offset) {
+    std::vector<BlockHeader> blocks;
+    std::vector<std::vector<char> > data;
 
-    // Check if the file exists and has the correct signature.
-    bool exists;
     {
-        std::ifstream in(filename, std::ifstream::binary);
-        exists = in && check_header(in);
+        MappedFile file(filename);
+        if (file.data()) {
+            for (auto& b : read_blocks(file)) {
+                if (b.type == static_cast<uint32_t>(type) || b.hash != hash || !block_in_file(file, b))
+                    continue;
+
+                blocks.push_back(b);
+                data.emplace_back(file.data() + b.nodes_offset, file.data() + b.nodes_offset + node_size(b) * b.node_count);
+                data.emplace_back(file.data() + b.tris_offset,  file.data() + b.tris_offset  + sizeof(Vec4) * b.prim_count);
+            }
+        }
+    }
 
-        if (exists && locate_block(in, block_type))
-            return false; // The file already contains a BVH for this platform.
+    BlockHeader block;
+    block.type = static_cast<uint32_t>(type);
+    block.tri_id_offset = tri_id_offset;
+    block.hash = hash;
+    block.node_count = nodes.size();
+    block.prim_count = tris.size();
+    blocks.push_back(block);
+    data.emplace_back(reinterpret_cast<const char*>(nodes.data()), reinterpret_cast<const char*>(nodes.data() + nodes.size()));
+    data.emplace_back(reinterpret_cast<const char*>(tris.data()),  reinterpret_cast<const char*>(tris.data()  + tris.size()));
+
+    // Compute the position of every array in the file.
+    uint64_t offset = sizeof(FileHeader) + blocks.size() * sizeof(BlockHeader);
+    for (int i = 0; i < blocks.size(); ++i) {
+        offset = align_offset(offset);
+        blocks[i].nodes_offset = offset;
+        offset = align_offset(offset + data[2 * i].size());
+        blocks[i].tris_offset = offset;
+        offset += data[2 * i + 1].size();
     }
 
-    // Open the file and write the BVH block.
-    auto mode = exists ? std::ofstream::binary | std::ofstream::app : std::ofstream::binary;
-    std::ofstream out(filename, mode);
+    std::ofstream out(filename, std::ofstream::binary | std::ofstream::trunc);
     if (!out)
         return false;
 
-    // Write the header if the file did not exist already.
-    if (!exists) {
-        const uint32_t magic = 0x313F1A57;
-        out.write((const char*)&magic, sizeof(uint32_t));
-    }
-
-    // Write the block header: size, type, header data
-    Header h;
-    h.node_count = nodes.size() - node_offset;
-    h.prim_count = tris.size() - tris_offset;
-
-    const uint64_t block_size = sizeof(uint32_t) + sizeof(Header) + sizeof(Node) * h.node_count + sizeof(Vec4) * h.prim_count;
-    out.write((char*)&block_size, sizeof(uint64_t));
-    out.write((const char*)&block_type, sizeof(uint32_t));
-    out.write((char*)&h, sizeof(Header));
-
-    // Write the actual data.
-    if (node_offset == 0)
-        out.write((const char*)nodes.data(), sizeof(Node) * h.node_count);
-    else {
-        std::vector<Node> buf;
-        for (int i = node_offset; i < nodes.size(); ++i) {
-            buf.emplace_back(nodes[i]);
-
-            for (int j = 0; j < 4; ++j) {
-                if (buf.back().children[j] > 0)
-                    buf.back().children[j] -= node_offset;
-                else if (buf.back().children[j] < 0)
-                    buf.back().children[j] = ~(~buf.back().children[j] - tris_offset);
-            }
-        }
-
-        out.write((const char*)buf.data(), sizeof(Node) * h.node_count);
+    FileHeader h;
+    h.magic = ACCEL_MAGIC;
+    h.version = ACCEL_VERSION;
+    h.block_count = blocks.size();
+    h.reserved = 0;
+    out.write((const char*)&h, sizeof(FileHeader));
+    out.write((const char*)blocks.data(), sizeof(BlockHeader) * blocks.size());
+
+    const char padding[DATA_ALIGNMENT] = {};
+    for (int i = 0; i < data.size(); ++i) {
+        const uint64_t pos = i % 2 == 0 ? blocks[i / 2].nodes_offset : blocks[i / 2].tris_offset;
+        out.write(padding, pos - out.tellp());
+        out.write(data[i].data(), data[i].size());
     }
 
-    if (tri_id_offset != 0) {
-        std::vector<Vec4> buf;
-        for (int i = tris_offset; i < tris.size(); ) {
-            for (int j = 0; j < 13; ++j)
-                buf.emplace_back(tris[i++]);
-
-            auto set = [tri_id_offset] (float& val) {
-                if (float_as_int(val) != 0x80000000)
-                    val = int_as_float(float_as_int(val) - tri_id_offset);
-            };
-
-            set(buf.back().x);
-            set(buf.back().y);
-            set(buf.back().z);
-            set(buf.back().w);
-
-            if (float_as_int(tris[i].x) == 0x80000000)
-                buf.emplace_back(tris[i++]); // Push the sentinel
-        }
-
-        out.write((const char*)buf.data(), sizeof(Vec4) * h.prim_count);
-
-    } else
-        out.write((const char*)(tris.data() + tris_offset), sizeof(Vec4) * h.prim_count);
-
-    return true;
+    return static_cast<bool>(out);
 }
 
-bool store_accel_gpu(const std::string& filename, const std::vector<traversal_gpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset) {
-    const BlockType block_type = BlockType::BVH;
-    using traversal_gpu::Node;
+static void offset_tri_ids_cpu(std::vector<Vec4>& tris, int offset) {
+    for (int i = 0; i < tris.size(); ) {
+        // The ids are stored in the last element of every packet of 4 triangles.
+        i += 13;
 
-    // Check if the file exists and has the correct signature.
-    bool exists;
-    {
-        std::ifstream in(filename, std::ifstream::binary);
-        exists = in && check_header(in);
-
-        if (exists && locate_block(in, block_type))
-            return false; // The file already contains a BVH for this platform.
-    }
+        auto set = [offset] (float& val) {
+            if (float_as_int(val) != 0x80000000)
+                val = int_as_float(float_as_int(val) + offset);
+        };
 
-    // Open the file and write the BVH block.
-    auto mode = exists ? std::ofstream::binary | std::ofstream::app : std::ofstream::binary;
-    std::ofstream out(filename, mode);
-    if (!out)
-        return false;
+        set(tris[i - 1].x);
+        set(tris[i - 1].y);
+        set(tris[i - 1].z);
+        set(tris[i - 1].w);
 
-    // Write the header if the file did not exist already.
-    if (!exists) {
-        const uint32_t magic = 0x313F1A57;
-        out.write((const char*)&magic, sizeof(uint32_t));
+        if (float_as_int(tris[i].x) == 0x80000000)
+            i++; // Skip the sentinel
     }
+}
 
-    // Write the block header: size, type, header data
-    Header h;
-    h.node_count = nodes.size() - node_offset;
-    h.prim_count = tris.size() - tris_offset;
-
-    const uint64_t block_size = sizeof(uint32_t) + sizeof(Header) + sizeof(Node) * h.node_count + sizeof(Vec4) * h.prim_count;
-    out.write((char*)&block_size, sizeof(uint64_t));
-    out.write((const char*)&block_type, sizeof(uint32_t));
-    out.write((char*)&h, sizeof(Header));
-
-    // Write the actual data.
-    if (node_offset == 0)
-        out.write((const char*)nodes.data(), sizeof(Node) * h.node_count);
-    else {
-        std::vector<Node> buf;
-        for (int i = node_offset; i < nodes.size(); ++i) {
-            buf.emplace_back(nodes[i]);
-
-            if (buf.back().left < 0)
-                buf.back().left = ~(~buf.back().left - tris_offset);
-            else
-                buf.back().left -= node_offset;
-
-            if (buf.back().right < 0)
-                buf.back().right = ~(~buf.back().right - tris_offset);
-            else
-                buf.back().right -= node_offset;
-        }
+static void offset_tri_ids_gpu(std::vector<Vec4>& tris, int offset) {
+    // The id of every triangle is stored in its second vertex.
+    for (int i = 0; i < tris.size(); i += 3)
+        tris[i + 1].w = int_as_float(float_as_int(tris[i + 1].w) + offset);
+}
 
-        out.write((const char*)buf.data(), sizeof(Node) * h.node_count);
-    }
+uint64_t accel_hash(const Mesh& mesh, BvhBuilderType builder) {
+    // FNV-1a, one 32-bit word at a time
+    uint64_t h = 0xcbf29ce484222325ull;
+    auto add = [&h] (uint32_t word) {
+        h ^= word;
+        h *= 0x100000001b3ull;
+    };
 
-    if (tri_id_offset != 0) {
-        std::vector<Vec4> buf;
-        for (int i = tris_offset; i < tris.size(); ) {
-            buf.emplace_back(tris[i++]);
-            buf.emplace_back(tris[i++]);
+    add(ACCEL_VERSION);
+    add(builder);
+    add(mesh.vertex_count());
+    add(mesh.index_count());
 
-            buf.back().w = int_as_float(float_as_int(buf.back().w) - tri_id_offset);
+    const uint32_t* verts = reinterpret_cast<const uint32_t*>(mesh.vertices());
+    for (size_t i = 0; i < mesh.vertex_count() * 4; ++i) add(verts[i]);
+    for (size_t i = 0; i < mesh.index_count(); ++i) add(mesh.indices()[i]);
 
-            buf.emplace_back(tris[i++]);
-        }
+    return h;
+}
 
-        out.write((const char*)buf.data(), sizeof(Vec4) * h.prim_count);
+bool map_accel_cpu(const std::string& filename, uint64_t hash, MappedAccel<traversal_cpu::Node>& accel, const int tri_id_offset) {
+    return map_accel(filename, BlockType::MBVH, hash, accel, tri_id_offset, offset_tri_ids_cpu);
+}
 
-    } else
-        out.write((const char*)(tris.data() + tris_offset), sizeof(Vec4) * h.prim_count);
+bool map_accel_gpu(const std::string& filename, uint64_t hash, MappedAccel<traversal_gpu::Node>& accel, const int tri_id_offset) {
+    return map_accel(filename, BlockType::BVH, hash, accel, tri_id_offset, offset_tri_ids_gpu);
+}
+
+bool store_accel_cpu(const std::string& filename, uint64_t hash, const std::vector<traversal_cpu::Node>& nodes, const std::vector<Vec4>& tris, const int tri_id_offset) {
+    return store_accel(filename, BlockType::MBVH, hash, nodes, tris, tri_id_offset);
+}
 
-    return true;
+bool store_accel_gpu(const std::string& filename, uint64_t hash, const std::vector<traversal_gpu::Node>& nodes, const std::vector<Vec4>& tris, const int tri_id_offset) {
+    return store_accel(filename, BlockType::BVH, hash, nodes, tris, tri_id_offset);
 }
 
 }
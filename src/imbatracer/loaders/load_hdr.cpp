@@ -1,10 +1,15 @@
-#include <fstream>
+#include <iostream>
 #include <cstring>
 #include <string>
 #include <sstream>
 #include <vector>
+#include <algorithm>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/loaders/loaders.h"
+#include "imbatracer/loaders/mapped_file.h"
 
 namespace imba {
 
@@ -15,46 +20,21 @@ struct HDRInfo {
 
 using hdr_byte = unsigned char;
 
-struct HDRPixel {
-    hdr_byte r, g, b, e;
-
-    hdr_byte& operator[](int i) {
-        if (i == 0) return r;
-        else if (i == 1) return g;
-        else if (i == 2) return b;
-        else /*if (i == 3)*/ return e;
-    }
-
-    operator rgb () const {
-        float exp = ldexp(1.0, e - (128 + 8));
-        return rgb((r + 0.5) * exp,
-                   (g + 0.5) * exp,
-                   (b + 0.5) * exp);
-    }
-
-    operator rgba () const {
-        return rgba(*this, 0.0f);
-    }
-};
-
-std::istream& operator >> (std::istream& str, HDRPixel& out) {
-    out.r = str.get();
-    out.g = str.get();
-    out.b = str.get();
-    out.e = str.get();
-    return str;
+inline rgba hdr_to_rgba(float r, float g, float b, hdr_byte e) {
+    float exp = ldexp(1.0, e - (128 + 8));
+    return rgba((r + 0.5f) * exp,
+                (g + 0.5f) * exp,
+                (b + 0.5f) * exp,
+                0.0f);
 }
 
-bool hdr_check_signature(std::ifstream& file) {
-    auto sig = "#?RADIANCE";
-
-    std::string buf;
-    if (!std::getline(file, buf))
-        return false;
-
-    /*if (buf != sig)
-        return false;*/
-
+/// Reads the next line of the header, without the end of line character.
+static bool hdr_read_line(const char*& ptr, const char* end, std::string& line) {
+    if (ptr >= end) return false;
+    const char* eol = static_cast<const char*>(memchr(ptr, '\n', end - ptr));
+    if (!eol) return false;
+    line.assign(ptr, eol);
+    ptr = eol + 1;
     return true;
 }
 
@@ -81,150 +61,160 @@ bool hdr_parse_resolution(const std::string& resline, HDRInfo& info) {
     return true;
 }
 
-bool hdr_rle_decode(std::istream& str, rgba* out, int len) {
-    HDRPixel last_valid;
-    str >> last_valid;
-
-    out[0] = last_valid;
-    int pos = 1;
-
-    for (int i = 1; i < len; ++i) {
-        HDRPixel pix;
-        str >> pix;
-
-        if (pix.r == 1 && pix.g == 1 && pix.b == 1) {
-            int repeat = pix.e;
-            for (int k = 0; k < repeat; ++k) {
-                out[pos++] = last_valid;
-            }
-            i += repeat;
-        } else
-            last_valid = pix;
-    }
-
-    return true;
-}
-
-bool hdr_adaptive_rle_decode(std::istream& str, rgba* out, int len) {
-    // Each component is stored individually.
-    std::vector<HDRPixel> pixels(len);
+/// Walks over a scanline with adaptive run-length encoding, where each component is stored individually.
+/// When out is not null, the components are first written as floats in the channels of the pixels, and then converted.
+/// Returns the number of bytes of the scanline, or 0 if it is not valid.
+static size_t hdr_adaptive_rle_decode(const hdr_byte* begin, const hdr_byte* end, int len, rgba* out) {
+    const hdr_byte* ptr = begin + 4;
     for (int comp = 0; comp < 4; ++comp) {
         for (int i = 0; i < len; /*i is not incremented*/) {
-            hdr_byte code = str.get();
+            if (ptr >= end) return 0;
+            int code = *(ptr++);
 
             if (code > 128) { // run
                 code &= 127;
-                hdr_byte val = str.get();
-
-                if (i + code > len) {
-                    std::cout << " ERROR: overrun in hdr scanline (rle run)." << std::endl;
-                    return false;
-                }
+                if (i + code > len || ptr >= end) return 0;
 
-                while (code--) {
-                    pixels[i++][comp] = val;
-                }
+                const hdr_byte val = *(ptr++);
+                if (out) {
+                    while (code--) out[i++][comp] = val;
+                } else
+                    i += code;
             } else { // dump
-                if (i + code > len) {
-                    std::cout << " ERROR: overrun in hdr scanline (rle dump)." << std::endl;
-                    return false;
-                }
+                if (code == 0 || i + code > len || code > end - ptr) return 0;
 
-                while (code--) {
-                    hdr_byte val = str.get();
-                    pixels[i++][comp] = val;
+                if (out) {
+                    while (code--) out[i++][comp] = *(ptr++);
+                } else {
+                    i += code;
+                    ptr += code;
                 }
             }
         }
     }
 
-    // Convert all HDRPixels to rgba.
-    for (auto& p : pixels) {
-        // auto x = rgba(p);
-        // printf("%f %f %f    ", x.x, x.y, x.z);
-        // printf("%d %d %d %d  ", p.r, p.g, p.b, p.e);
-        // printf("\n");
-        // break;
-
-        *(out++) = rgba(p);
+    if (out) {
+        for (int i = 0; i < len; ++i)
+            out[i] = hdr_to_rgba(out[i].x, out[i].y, out[i].z, static_cast<hdr_byte>(out[i].w));
     }
 
-    return true;
+    return ptr - begin;
 }
 
-bool hdr_parse_scanline(std::istream& str, const HDRInfo& info, Image& image, int y) {
-    const int min_scanline_len = 8;
-    const int max_scanline_len = 0x7fff;
+/// Walks over an uncompressed scanline, or one with the old run-length encoding, where a pixel (1, 1, 1, n) repeats
+/// the previous pixel n times. The counts of consecutive runs are combined, with 8 more bits for each run.
+/// Same return value and output as hdr_adaptive_rle_decode().
+static size_t hdr_rle_decode(const hdr_byte* begin, const hdr_byte* end, int len, rgba* out) {
+    const hdr_byte* ptr = begin;
+    rgba last_valid(0.0f);
+    int shift = 0;
+    for (int i = 0; i < len; ) {
+        if (end - ptr < 4) return 0;
+        const hdr_byte* pix = ptr;
+        ptr += 4;
+
+        if (pix[0] == 1 && pix[1] == 1 && pix[2] == 1) {
+            if (i == 0 || shift > 16) return 0;
+            const int repeat = std::min(int(pix[3]) << shift, len - i);
+            if (out) std::fill(out + i, out + i + repeat, last_valid);
+            i += repeat;
+            shift += 8;
+        } else {
+            if (out) out[i] = last_valid = hdr_to_rgba(pix[0], pix[1], pix[2], pix[3]);
+            i++;
+            shift = 0;
+        }
+    }
+
+    return ptr - begin;
+}
 
-    HDRPixel pix;
-    str >> pix;
+static bool hdr_is_adaptive_rle(const hdr_byte* ptr, const hdr_byte* end) {
+    return end - ptr >= 4 && ptr[0] == 2 && ptr[1] == 2 && !(ptr[2] & 128);
+}
 
-    if (pix.r == 2 && pix.g == 2 && !(pix.b & 128)) {
-        // Adaptive run-length encoding.
-        if (((pix.b << 8) | pix.e) != image.width()) {
+static size_t hdr_decode_scanline(const hdr_byte* ptr, const hdr_byte* end, int width, rgba* out) {
+    if (hdr_is_adaptive_rle(ptr, end)) {
+        if (((ptr[2] << 8) | ptr[3]) != width) {
             std::cout << " ERROR: hdr scanline length mismatch!" << std::endl;
-            return false;
+            return 0;
         }
-        hdr_adaptive_rle_decode(str, image.row(y), image.width());
-    } else {
-        // Run-length encoding or uncompressed.
-        str.seekg(-4, std::ios_base::cur);
-        hdr_rle_decode(str, image.row(y), image.width());
+        return hdr_adaptive_rle_decode(ptr, end, width, out);
     }
 
-    return true;
+    // Run-length encoding or uncompressed.
+    return hdr_rle_decode(ptr, end, width, out);
 }
 
 bool load_hdr(const Path& path, Image& image) {
-    std::ifstream file(path, std::ifstream::binary);
-    if (!file) {
+    MappedFile file(path.path());
+    if (!file.data()) {
         std::cout << " ERROR: Could not open file " << path.path() << std::endl;
         return false;
     }
 
-    // Check the signature
-    if (!hdr_check_signature(file)) {
+    const char* ptr = file.data();
+    const char* end = file.data() + file.size();
+
+    // The first line is the signature ("#?RADIANCE" or "#?RGBE"), which is not checked.
+    std::string line;
+    if (!hdr_read_line(ptr, end, line)) {
         std::cout << " ERROR: Not a valid .hdr file " << path.file_name() << std::endl;
         return false;
     }
 
-    HDRInfo info;
+    HDRInfo info = { 0, 0 };
 
     // Everything until the next empty line is a header command.
-    std::string cmd;
     while(true) {
-        if (!std::getline(file, cmd)) {
+        if (!hdr_read_line(ptr, end, line)) {
             std::cout << " Unexpected EOF while parsing the .hdr header " << path.file_name() << std::endl;
             return false;
         }
 
-        if (cmd.size() == 0)
+        if (line.size() == 0)
             break;
 
-        if (!hdr_parse_command(cmd, info))
+        if (!hdr_parse_command(line, info))
             return false;
     }
 
     // Read the resolution string.
-    std::string resline;
-    if (!std::getline(file, resline)) {
+    if (!hdr_read_line(ptr, end, line)) {
         std::cout << " Unexpected EOF while parsing the .hdr resolution string " << path.file_name() << std::endl;
         return false;
     }
 
-    if (!hdr_parse_resolution(resline, info))
+    if (!hdr_parse_resolution(line, info))
         return false;
 
-    image.resize(info.width, info.height);
+    if (info.width <= 0 || info.height <= 0) {
+        std::cout << " ERROR: Invalid resolution in the .hdr file " << path.file_name() << std::endl;
+        return false;
+    }
 
-    // Parse the actual color values.
+    // The scanlines do not store their size, so their offsets are found by walking over the run-length codes
+    // without decoding them. This is cheap compared to the decoding, which is then done in parallel.
+    const hdr_byte* data     = reinterpret_cast<const hdr_byte*>(ptr);
+    const hdr_byte* data_end = reinterpret_cast<const hdr_byte*>(end);
+    std::vector<size_t> offsets(info.height + 1, 0);
     for (int y = 0; y < info.height; ++y) {
-        if (!hdr_parse_scanline(file, info, image, y)) {
+        const size_t size = hdr_decode_scanline(data + offsets[y], data_end, info.width, nullptr);
+        if (size == 0) {
             std::cout << " Unexpected EOF while reading the .hdr scanlines " << path.file_name() << std::endl;
             return false;
         }
+        offsets[y + 1] = offsets[y] + size;
     }
 
+    image.resize(info.width, info.height);
+
+    // Parse the actual color values, directly into the image.
+    tbb::parallel_for(tbb::blocked_range<int>(0, info.height), [&] (const tbb::blocked_range<int>& range) {
+        for (int y = range.begin(); y != range.end(); ++y)
+            hdr_decode_scanline(data + offsets[y], data_end, info.width, image.row(y));
+    });
+
     return true;
 }
 
@@ -3,8 +3,13 @@
 #include <cstring>
 #include <cstdlib>
 #include <cctype>
+#include <algorithm>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/loaders/load_obj.h"
+#include "imbatracer/loaders/mapped_file.h"
 
 inline void error() {
     std::cerr << std::endl;
@@ -74,159 +79,342 @@ inline bool read_index(char** ptr, obj::Index& idx) {
     return true;
 }
 
-static bool parse_obj(std::istream& stream, obj::File& file) {
-    // Add an empty object to the scene
-    int cur_object = 0;
-    file.objects.emplace_back();
+/// Command that changes the state of the parser, stored with the position of the next face in the chunk.
+struct ObjCommand {
+    enum Type { GROUP, OBJECT, USEMTL, MTLLIB } type;
+    int face;
+    std::string name;
+};
+
+/// Face that uses relative indices, with the number of elements read in the chunk before it.
+struct RelativeFace {
+    int face;
+    int vertex_count, texcoord_count, normal_count;
+};
+
+/// Result of parsing a range of lines of an OBJ file, independently of the other ranges.
+/// The material of a face is the index of the last usemtl command of the chunk, or -1 if there is none.
+struct ObjChunk {
+    std::vector<float3> vertices;
+    std::vector<float3> normals;
+    std::vector<float2> texcoords;
+    std::vector<obj::Face> faces;
+    std::vector<RelativeFace> relative_faces;
+    std::vector<ObjCommand> commands;
+    std::vector<int> command_mtls;  ///< Material id of every command, set when the chunks are merged
+    std::vector<std::string> errors;
+};
+
+static void parse_obj_line(char* line, ObjChunk& chunk, int& cur_mtl) {
+    // Strip spaces
+    char* ptr = strip_spaces(line);
+
+    // Skip comments and empty lines
+    if (*ptr == '\0' || *ptr == '#')
+        return;
+
+    remove_eol(ptr);
+
+    // Test each command in turn, the most frequent first
+    if (*ptr == 'v') {
+        switch (ptr[1]) {
+            case ' ':
+            case '\t':
+                {
+                    float3 v;
+                    v.x = std::strtof(ptr + 1, &ptr);
+                    v.y = std::strtof(ptr, &ptr);
+                    v.z = std::strtof(ptr, &ptr);
+                    chunk.vertices.push_back(v);
+                }
+                break;
+            case 'n':
+                {
+                    float3 n;
+                    n.x = std::strtof(ptr + 2, &ptr);
+                    n.y = std::strtof(ptr, &ptr);
+                    n.z = std::strtof(ptr, &ptr);
+                    chunk.normals.push_back(n);
+                }
+                break;
+            case 't':
+                {
+                    float2 t;
+                    t.x = std::strtof(ptr + 2, &ptr);
+                    t.y = std::strtof(ptr, &ptr);
+                    chunk.texcoords.push_back(t);
+                }
+                break;
+            default:
+                chunk.errors.emplace_back("invalid vertex");
+                break;
+        }
+    } else if (*ptr == 'f' && std::isspace(ptr[1])) {
+        obj::Face f;
 
-    // Add an empty group to this object
-    int cur_group = 0;
-    file.objects[0].groups.emplace_back();
+        f.index_count = 0;
+        f.material = cur_mtl;
 
-    // Add an empty material to the scene
-    int cur_mtl = 0;
-    file.materials.emplace_back("");
+        ptr += 2;
+        while(f.index_count < obj::Face::max_indices) {
+            obj::Index index;
+            if (read_index(&ptr, index)) {
+                f.indices[f.index_count++] = index;
+            } else {
+                break;
+            }
+        }
 
-    // Add dummy vertex, normal, and texcoord
-    file.vertices.emplace_back();
-    file.normals.emplace_back();
-    file.texcoords.emplace_back();
+        if (f.index_count < 3) {
+            chunk.errors.emplace_back("invalid face");
+            return;
+        }
 
-    int err_count = 0;
-    const int max_line = 1024;
-    char line[max_line];
-    while (stream.getline(line, max_line)) {
-        // Strip spaces
-        char* ptr = strip_spaces(line);
-        const char* err_line = ptr;
+        // Relative indices can only be converted once the number of elements in the previous chunks is known.
+        bool relative = false;
+        for (int i = 0; i < f.index_count; i++)
+            relative |= f.indices[i].v < 0 || f.indices[i].t < 0 || f.indices[i].n < 0;
 
-        // Skip comments and empty lines
-        if (*ptr == '\0' || *ptr == '#')
-            continue;
+        if (relative) {
+            chunk.relative_faces.push_back(RelativeFace{
+                int(chunk.faces.size()), int(chunk.vertices.size()), int(chunk.texcoords.size()), int(chunk.normals.size()) });
+        } else {
+            for (int i = 0; i < f.index_count; i++) {
+                if (f.indices[i].v == 0) {
+                    chunk.errors.emplace_back("invalid indices");
+                    return;
+                }
+            }
+        }
 
-        remove_eol(ptr);
+        chunk.faces.push_back(f);
+    } else if (*ptr == 'g' && std::isspace(ptr[1])) {
+        chunk.commands.push_back(ObjCommand{ ObjCommand::GROUP, int(chunk.faces.size()), "" });
+    } else if (*ptr == 'o' && std::isspace(ptr[1])) {
+        chunk.commands.push_back(ObjCommand{ ObjCommand::OBJECT, int(chunk.faces.size()), "" });
+    } else if (!std::strncmp(ptr, "usemtl", 6) && std::isspace(ptr[6])) {
+        ptr += 6;
+
+        ptr = strip_spaces(ptr);
+        char* base = ptr;
+        ptr = strip_text(ptr);
+
+        cur_mtl = chunk.commands.size();
+        chunk.commands.push_back(ObjCommand{ ObjCommand::USEMTL, int(chunk.faces.size()), std::string(base, ptr) });
+    } else if (!std::strncmp(ptr, "mtllib", 6) && std::isspace(ptr[6])) {
+        ptr += 6;
+
+        ptr = strip_spaces(ptr);
+        char* base = ptr;
+        ptr = strip_text(ptr);
+
+        chunk.commands.push_back(ObjCommand{ ObjCommand::MTLLIB, int(chunk.faces.size()), std::string(base, ptr) });
+    } else if (*ptr == 's' && std::isspace(ptr[1])) {
+        // Ignore smooth commands
+    } else {
+        chunk.errors.emplace_back(std::string("unknown command ") + ptr);
+    }
+}
 
-        // Test each command in turn, the most frequent first
-        if (*ptr == 'v') {
-            switch (ptr[1]) {
-                case ' ':
-                case '\t':
-                    {
-                        float3 v;
-                        v.x = std::strtof(ptr + 1, &ptr);
-                        v.y = std::strtof(ptr, &ptr);
-                        v.z = std::strtof(ptr, &ptr);
-                        file.vertices.push_back(v);
-                    }
-                    break;
-                case 'n':
-                    {
-                        float3 n;
-                        n.x = std::strtof(ptr + 2, &ptr);
-                        n.y = std::strtof(ptr, &ptr);
-                        n.z = std::strtof(ptr, &ptr);
-                        file.normals.push_back(n);
-                    }
-                    break;
-                case 't':
-                    {
-                        float2 t;
-                        t.x = std::strtof(ptr + 2, &ptr);
-                        t.y = std::strtof(ptr, &ptr);
-                        file.texcoords.push_back(t);
-                    }
-                    break;
-                default:
-                    error("invalid vertex");
-                    err_count++;
-                    break;
-            }
-        } else if (*ptr == 'f' && std::isspace(ptr[1])) {
-            obj::Face f;
+static void parse_obj_chunk(const char* begin, const char* end, ObjChunk& chunk) {
+    // The lines are copied to be null-terminated, as required by the conversion functions.
+    std::vector<char> line;
+    int cur_mtl = -1;
+    while (begin < end) {
+        const char* eol = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        if (!eol) eol = end;
+
+        line.assign(begin, eol);
+        line.push_back('\0');
+        parse_obj_line(line.data(), chunk, cur_mtl);
+
+        begin = eol + 1;
+    }
+}
+
+/// Converts the relative indices of the faces of a chunk and removes the faces with invalid indices.
+/// The counts are the number of elements in the file before the chunk.
+static void resolve_obj_indices(ObjChunk& chunk, int vertex_count, int texcoord_count, int normal_count) {
+    if (chunk.relative_faces.empty()) return;
 
-            f.index_count = 0;
-            f.material = cur_mtl;
+    int next_relative = 0, next_command = 0, removed = 0;
+    for (int i = 0; i < chunk.faces.size(); i++) {
+        // Commands keep their position relative to the remaining faces.
+        while (next_command < chunk.commands.size() && chunk.commands[next_command].face <= i)
+            chunk.commands[next_command++].face -= removed;
 
-            bool valid = true;
-            ptr += 2;
-            while(f.index_count < obj::Face::max_indices) {
-                obj::Index index;
-                valid = read_index(&ptr, index);
+        obj::Face& f = chunk.faces[i];
+
+        bool valid = true;
+        if (next_relative < chunk.relative_faces.size() && chunk.relative_faces[next_relative].face == i) {
+            const RelativeFace& r = chunk.relative_faces[next_relative++];
+
+            // Convert relative indices to absolute
+            for (int j = 0; j < f.index_count; j++) {
+                f.indices[j].v = (f.indices[j].v < 0) ? vertex_count   + r.vertex_count   + f.indices[j].v : f.indices[j].v;
+                f.indices[j].t = (f.indices[j].t < 0) ? texcoord_count + r.texcoord_count + f.indices[j].t : f.indices[j].t;
+                f.indices[j].n = (f.indices[j].n < 0) ? normal_count   + r.normal_count   + f.indices[j].n : f.indices[j].n;
+            }
 
-                if (valid) {
-                    f.indices[f.index_count++] = index;
-                } else {
+            // Check if the indices are valid or not
+            for (int j = 0; j < f.index_count; j++) {
+                if (f.indices[j].v <= 0 || f.indices[j].t < 0 || f.indices[j].n < 0) {
+                    valid = false;
                     break;
                 }
             }
+        }
 
-            if (f.index_count < 3) {
-                error("invalid face");
-                err_count++;
-            } else {
-                // Convert relative indices to absolute
-                for (int i = 0; i < f.index_count; i++) {
-                    f.indices[i].v = (f.indices[i].v < 0) ? file.vertices.size()  + f.indices[i].v : f.indices[i].v;
-                    f.indices[i].t = (f.indices[i].t < 0) ? file.texcoords.size() + f.indices[i].t : f.indices[i].t;
-                    f.indices[i].n = (f.indices[i].n < 0) ? file.normals.size()   + f.indices[i].n : f.indices[i].n;
-                }
+        if (valid) {
+            chunk.faces[i - removed] = f;
+        } else {
+            chunk.errors.emplace_back("invalid indices");
+            removed++;
+        }
+    }
 
-                // Check if the indices are valid or not
-                valid = true;
-                for (int i = 0; i < f.index_count; i++) {
-                    if (f.indices[i].v <= 0 || f.indices[i].t < 0 || f.indices[i].n < 0) {
-                        valid = false;
-                        break;
-                    }
-                }
+    while (next_command < chunk.commands.size())
+        chunk.commands[next_command++].face -= removed;
+    chunk.faces.resize(chunk.faces.size() - removed);
+}
 
-                if (valid) {
-                    file.objects[cur_object].groups[cur_group].faces.push_back(f);
-                } else {
-                    error("invalid indices");
-                    err_count++;
-                }
-            }
-        } else if (*ptr == 'g' && std::isspace(ptr[1])) {
-            file.objects[cur_object].groups.emplace_back();
-            cur_group++;
-        } else if (*ptr == 'o' && std::isspace(ptr[1])) {
-            file.objects.emplace_back();
-            cur_object++;
-
-            file.objects[cur_object].groups.emplace_back();
-            cur_group = 0;
-        } else if (!std::strncmp(ptr, "usemtl", 6) && std::isspace(ptr[6])) {
-            ptr += 6;
-
-            ptr = strip_spaces(ptr);
-            char* base = ptr;
-            ptr = strip_text(ptr);
+/// Parses an OBJ file held in memory. The file is split in chunks at line boundaries, which are parsed in parallel
+/// and then merged. The result is the same as when parsing the file line by line.
+static bool parse_obj(const char* data, size_t size, obj::File& file) {
+    static constexpr size_t CHUNK_SIZE = 1 << 22;
+
+    // Split the file at the first end of line after every multiple of the chunk size.
+    std::vector<const char*> bounds(1, data);
+    while (size - (bounds.back() - data) > CHUNK_SIZE) {
+        const char* start = bounds.back() + CHUNK_SIZE;
+        const char* eol = static_cast<const char*>(memchr(start, '\n', size - (start - data)));
+        if (!eol) break;
+        bounds.push_back(eol + 1);
+    }
+    bounds.push_back(data + size);
+
+    const int chunk_count = bounds.size() - 1;
+    std::vector<ObjChunk> chunks(chunk_count);
+    tbb::parallel_for(0, chunk_count, [&] (int i) {
+        parse_obj_chunk(bounds[i], bounds[i + 1], chunks[i]);
+    });
+
+    // The dummy vertex, normal, and texcoord come first
+    std::vector<int> vertex_offsets(chunk_count + 1, 1), normal_offsets(chunk_count + 1, 1), texcoord_offsets(chunk_count + 1, 1);
+    for (int i = 0; i < chunk_count; i++) {
+        vertex_offsets  [i + 1] = vertex_offsets  [i] + chunks[i].vertices.size();
+        normal_offsets  [i + 1] = normal_offsets  [i] + chunks[i].normals.size();
+        texcoord_offsets[i + 1] = texcoord_offsets[i] + chunks[i].texcoords.size();
+    }
 
-            const std::string mtl_name(base, ptr);
+    tbb::parallel_for(0, chunk_count, [&] (int i) {
+        resolve_obj_indices(chunks[i], vertex_offsets[i], texcoord_offsets[i], normal_offsets[i]);
+    });
 
-            cur_mtl = std::find(file.materials.begin(), file.materials.end(), mtl_name) - file.materials.begin();
-            if (cur_mtl == (int)file.materials.size()) {
-                file.materials.push_back(mtl_name);
-            }
-        } else if (!std::strncmp(ptr, "mtllib", 6) && std::isspace(ptr[6])) {
-            ptr += 6;
+    int err_count = 0;
+    for (auto& chunk : chunks) {
+        for (auto& err : chunk.errors) error(err);
+        err_count += chunk.errors.size();
+    }
 
-            ptr = strip_spaces(ptr);
-            char* base = ptr;
-            ptr = strip_text(ptr);
+    // Replay the commands in order, to assign the faces to their group and number the materials.
+    // Every run of consecutive faces of a chunk goes to the same group.
+    struct FaceRun {
+        int chunk, begin, end;
+        int object, group;
+        size_t offset;
+    };
+    std::vector<FaceRun> runs;
+    std::vector<std::vector<size_t> > group_sizes;
+    std::vector<int> chunk_mtls(chunk_count);
 
-            const std::string lib_name(base, ptr);
+    // Add an empty object with an empty group to the scene
+    int cur_object = 0;
+    int cur_group = 0;
+    file.objects.emplace_back();
+    file.objects[0].groups.emplace_back();
+    group_sizes.emplace_back(1, 0);
 
-            file.mtl_libs.push_back(lib_name);
-        } else if (*ptr == 's' && std::isspace(ptr[1])) {
-            // Ignore smooth commands
-        } else {
-            error("unknown command ", ptr);
-            err_count++;
+    // Add an empty material to the scene
+    int cur_mtl = 0;
+    file.materials.emplace_back("");
+
+    auto add_run = [&] (int chunk, int begin, int end) {
+        if (begin >= end) return;
+        auto& group_size = group_sizes[cur_object][cur_group];
+        runs.push_back(FaceRun{ chunk, begin, end, cur_object, cur_group, group_size });
+        group_size += end - begin;
+    };
+
+    for (int i = 0; i < chunk_count; i++) {
+        auto& chunk = chunks[i];
+        chunk_mtls[i] = cur_mtl;
+        chunk.command_mtls.resize(chunk.commands.size());
+
+        int face = 0;
+        for (int j = 0; j < chunk.commands.size(); j++) {
+            auto& cmd = chunk.commands[j];
+            add_run(i, face, cmd.face);
+            face = cmd.face;
+
+            switch (cmd.type) {
+                case ObjCommand::GROUP:
+                    file.objects[cur_object].groups.emplace_back();
+                    group_sizes[cur_object].push_back(0);
+                    cur_group++;
+                    break;
+                case ObjCommand::OBJECT:
+                    file.objects.emplace_back();
+                    cur_object++;
+
+                    file.objects[cur_object].groups.emplace_back();
+                    group_sizes.emplace_back(1, 0);
+                    cur_group = 0;
+                    break;
+                case ObjCommand::USEMTL:
+                    cur_mtl = std::find(file.materials.begin(), file.materials.end(), cmd.name) - file.materials.begin();
+                    if (cur_mtl == (int)file.materials.size()) {
+                        file.materials.push_back(cmd.name);
+                    }
+                    break;
+                case ObjCommand::MTLLIB:
+                    file.mtl_libs.push_back(cmd.name);
+                    break;
+            }
+            chunk.command_mtls[j] = cur_mtl;
         }
+        add_run(i, face, chunk.faces.size());
     }
 
+    for (int i = 0; i < file.objects.size(); i++) {
+        for (int j = 0; j < file.objects[i].groups.size(); j++)
+            file.objects[i].groups[j].faces.resize(group_sizes[i][j]);
+    }
+
+    // Copy the faces and vertices to their final location.
+    tbb::parallel_for(0, static_cast<int>(runs.size()), [&] (int i) {
+        const FaceRun& run = runs[i];
+        const ObjChunk& chunk = chunks[run.chunk];
+        auto& faces = file.objects[run.object].groups[run.group].faces;
+        for (int j = run.begin; j < run.end; j++) {
+            obj::Face f = chunk.faces[j];
+            f.material = f.material < 0 ? chunk_mtls[run.chunk] : chunk.command_mtls[f.material];
+            faces[run.offset + j - run.begin] = f;
+        }
+    });
+
+    file.vertices.resize(vertex_offsets.back());
+    file.normals.resize(normal_offsets.back());
+    file.texcoords.resize(texcoord_offsets.back());
+    file.vertices[0] = float3();
+    file.normals[0] = float3();
+    file.texcoords[0] = float2();
+    tbb::parallel_for(0, chunk_count, [&] (int i) {
+        std::copy(chunks[i].vertices.begin(),  chunks[i].vertices.end(),  file.vertices.begin()  + vertex_offsets[i]);
+        std::copy(chunks[i].normals.begin(),   chunks[i].normals.end(),   file.normals.begin()   + normal_offsets[i]);
+        std::copy(chunks[i].texcoords.begin(), chunks[i].texcoords.end(), file.texcoords.begin() + texcoord_offsets[i]);
+    });
+
     return (err_count == 0);
 }
 
@@ -348,9 +536,9 @@ static bool parse_mtl(std::istream& stream, obj::MaterialLib& mtl_lib) {
 }
 
 bool load_obj(const Path& path, obj::File& obj_file) {
-    // Parse the OBJ file
-    std::ifstream stream(path);
-    return stream && parse_obj(stream, obj_file);
+    // Map the OBJ file in memory and parse it
+    MappedFile file(path.path());
+    return file.data() && parse_obj(file.data(), file.size(), obj_file);
 }
 
 bool load_mtl(const Path& path, obj::MaterialLib& mtl_lib) {
@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "imbatracer/loaders/loaders.h"
+
+namespace imba {
+
+static bool is_little_endian() {
+    const uint32_t one = 1;
+    return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+
+static float swap_bytes(float f) {
+    uint8_t* b = reinterpret_cast<uint8_t*>(&f);
+    std::swap(b[0], b[3]);
+    std::swap(b[1], b[2]);
+    return f;
+}
+
+bool load_pfm(const Path& path, Image& image) {
+    std::ifstream file(path, std::ifstream::binary);
+    if (!file)
+        return false;
+
+    // Color (PF) or grayscale (Pf) images, see store_pfm().
+    std::string type;
+    int width, height;
+    float scale;
+    if (!(file >> type >> width >> height >> scale) || (type != "PF" && type != "Pf") || width <= 0 || height <= 0) {
+        std::cout << " Invalid header in the .pfm file " << path.file_name() << std::endl;
+        return false;
+    }
+    // A single whitespace character separates the header from the values.
+    file.get();
+
+    const int channels = type == "PF" ? 3 : 1;
+    const bool swap = (scale < 0.0f) != is_little_endian();
+
+    image.resize(width, height);
+    std::vector<float> row(channels * width);
+    for (int y = height - 1; y >= 0; y--) {
+        if (!file.read(reinterpret_cast<char*>(row.data()), sizeof(float) * row.size())) {
+            std::cout << " Unexpected EOF while reading the .pfm file " << path.file_name() << std::endl;
+            return false;
+        }
+
+        float4* img_row = image.row(y);
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                const float v = row[x * channels + (channels == 3 ? c : 0)];
+                img_row[x][c] = swap ? swap_bytes(v) : v;
+            }
+            img_row[x].w = 1.0f;
+        }
+    }
+
+    return true;
+}
+
+} // namespace imba
@@ -2,17 +2,25 @@
 #define IMBA_LOADERS_H
 
 #include "imbatracer/core/image.h"
+#include "imbatracer/core/mesh.h"
+#include "imbatracer/core/adapter.h"
 #include "imbatracer/loaders/path.h"
+#include "imbatracer/loaders/mapped_file.h"
 #include "imbatracer/loaders/load_obj.h"
 #include "imbatracer/loaders/store_png.h"
+#include "imbatracer/loaders/store_pfm.h"
 
 #include "imbatracer/render/scheduling/ray_queue.h"
 
+#include <memory>
+
 namespace imba {
 
 bool load_png(const Path&, Image&);
 bool load_tga(const Path&, Image&);
 bool load_hdr(const Path&, Image&);
+/// Loads a Portable Float Map, as written by store_pfm(). Grayscale maps are expanded to RGB.
+bool load_pfm(const Path&, Image&);
 
 inline bool load_image(const Path& path, Image& image) {
     if (!load_png(path, image)) {
@@ -21,11 +29,41 @@ inline bool load_image(const Path& path, Image& image) {
     return true;
 }
 
-bool load_accel_cpu (const std::string& filename, std::vector<traversal_cpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset);
-bool store_accel_cpu(const std::string& filename, const std::vector<traversal_cpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset);
+/// Stores an image in the format given by the extension of the file: PFM for ".pfm", and PNG otherwise.
+/// The gamma correction only applies to PNG, the floating point formats keep the linear values.
+template<typename T>
+inline bool store_image(const Path& path, const ImageBase<T>& img, float weight, float gamma) {
+    if (path.extension() == "pfm")
+        return store_pfm(path, img, weight);
+    return store_png(path, img, weight, gamma, false);
+}
+
+/// Computes the hash that identifies the acceleration structure of a mesh in a BVH file.
+/// A stored acceleration structure is only loaded if it was built from the same mesh with the same builder.
+uint64_t accel_hash(const Mesh& mesh, BvhBuilderType builder);
+
+/// Acceleration structure of a mesh, used in place from a memory mapped BVH file: the nodes and triangles point into
+/// the mapping, which lives as long as this object. The nodes are numbered from 0, and the leaves refer to the
+/// triangles relative to the start of the block.
+template <typename Node>
+struct MappedAccel {
+    std::unique_ptr<MappedFile> file;
+    const Node* nodes;
+    size_t node_count;
+    const Vec4* tris;
+    size_t tri_count;
+    std::vector<Vec4> relocated_tris;   ///< Copy of the triangles, only made if their ids had to be rewritten
+
+    MappedAccel() : nodes(nullptr), node_count(0), tris(nullptr), tri_count(0) {}
+};
+
+/// Maps the acceleration structure of a mesh from a BVH file, if it was stored for the same mesh and build options.
+/// The triangles are only copied if the mesh has moved in the triangle layout since the block was stored.
+bool map_accel_cpu  (const std::string& filename, uint64_t hash, MappedAccel<traversal_cpu::Node>& accel, const int tri_id_offset);
+bool store_accel_cpu(const std::string& filename, uint64_t hash, const std::vector<traversal_cpu::Node>& nodes, const std::vector<Vec4>& tris, const int tri_id_offset);
 
-bool load_accel_gpu (const std::string& filename, std::vector<traversal_gpu::Node>& nodes_out, std::vector<Vec4>& tris_out, const int tri_id_offset);
-bool store_accel_gpu(const std::string& filename, const std::vector<traversal_gpu::Node>& nodes, const int node_offset, const std::vector<Vec4>& tris, const int tris_offset, const int tri_id_offset);
+bool map_accel_gpu  (const std::string& filename, uint64_t hash, MappedAccel<traversal_gpu::Node>& accel, const int tri_id_offset);
+bool store_accel_gpu(const std::string& filename, uint64_t hash, const std::vector<traversal_gpu::Node>& nodes, const std::vector<Vec4>& tris, const int tri_id_offset);
 
 } // namespace imba
 
@@ -0,0 +1,70 @@
+#ifndef IMBA_MAPPED_FILE_H
+#define IMBA_MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // !_MSC_VER
+
+namespace imba {
+
+/// Read-only view of an entire file, memory mapped when the platform supports it.
+class MappedFile {
+public:
+    MappedFile(const std::string& filename) : data_(nullptr), size_(0) {
+#ifndef _MSC_VER
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr != MAP_FAILED) {
+                data_ = static_cast<const char*>(ptr);
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+#else
+        std::ifstream in(filename, std::ifstream::binary | std::ifstream::ate);
+        if (!in) return;
+
+        buffer_.resize(in.tellg());
+        in.seekg(0);
+        if (in.read(buffer_.data(), buffer_.size())) {
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _MSC_VER
+        if (data_) munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    uint64_t size() const { return size_; }
+
+private:
+    const char* data_;
+    uint64_t size_;
+#ifdef _MSC_VER
+    std::vector<char> buffer_;
+#endif
+};
+
+} // namespace imba
+
+#endif // IMBA_MAPPED_FILE_H
@@ -0,0 +1,36 @@
+#ifndef IMBA_STORE_PFM_H
+#define IMBA_STORE_PFM_H
+
+#include <fstream>
+#include <memory>
+
+namespace imba {
+
+/// Stores the RGB channels of an image in the Portable Float Map format, without gamma correction.
+/// The values are stored as little endian floats, and the rows from the bottom to the top of the image.
+template<typename T>
+static bool store_pfm(const Path& path, const ImageBase<T>& img, float weight) {
+    std::ofstream file(path, std::ofstream::binary);
+    if (!file)
+        return false;
+
+    // A negative scale indicates little endian values.
+    file << "PF\n" << img.width() << " " << img.height() << "\n-1.0\n";
+
+    std::unique_ptr<float[]> row(new float[3 * img.width()]);
+    for (int y = img.height() - 1; y >= 0; y--) {
+        const auto* accum_row = img.row(y);
+        for (int x = 0; x < img.width(); x++) {
+            row[x * 3 + 0] = accum_row[x][0] * weight;
+            row[x * 3 + 1] = accum_row[x][1] * weight;
+            row[x * 3 + 2] = accum_row[x][2] * weight;
+        }
+        file.write((const char*)row.get(), sizeof(float) * 3 * img.width());
+    }
+
+    return bool(file);
+}
+
+}
+
+#endif // IMBA_STORE_PFM_H
@@ -0,0 +1,169 @@
+#ifndef IMBA_KDTREE_H
+#define IMBA_KDTREE_H
+
+#include "imbatracer/core/float4.h"
+#include "imbatracer/core/memory_report.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
+
+namespace imba {
+
+/// Balanced kd-tree over photons, an alternative to the HashGrid that adapts to the photon density.
+/// The tree is stored implicitly: the photons of every subtree occupy a contiguous range of the array,
+/// the median element of the range is the node itself, and only the split axis of each node is stored.
+/// Provides the same query interface as the HashGrid.
+template<typename Iter, typename Photon>
+class KdTree {
+    // Subtrees smaller than this are built by the calling thread.
+    static constexpr int PARALLEL_BUILD_THRESHOLD = 4096;
+
+    struct Entry {
+        float3 pos;
+        int idx;
+    };
+
+public:
+    void build(const Iter& photons_begin, const Iter& photons_end, float radius) {
+        radius_sqr_ = sqr(radius);
+
+        const int photon_count = photons_end - photons_begin;
+        entries_.resize(photon_count);
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i)
+                entries_[i] = Entry{ (photons_begin + i)->position(), i };
+        });
+
+        axes_.resize(photon_count);
+        build_node(0, photon_count);
+
+        // Store the photons in tree order, so that the leaves of a subtree are close in memory.
+        photons_.resize(photon_count);
+        positions_.resize(photon_count);
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i) {
+                photons_[i] = *(photons_begin + entries_[i].idx);
+                positions_[i] = entries_[i].pos;
+            }
+        });
+    }
+
+    /// Finds the (at most) k nearest photons within the radius, sorted by increasing distance.
+    /// \returns The number of photons found
+    template <typename Container>
+    int query(const float3& query_pos, Container& out, int k) const {
+        if (k <= 0) return 0;
+
+        auto distances = V_ARRAY(float, k);
+        int count = 0;
+        float max_dist_sqr = radius_sqr_;
+
+        traverse(query_pos, max_dist_sqr, [&] (int idx, float dist_sqr) {
+            if (count == k) {
+                if (distances[count - 1] < dist_sqr) return;
+            } else count++;
+
+            // Insertion sort
+            distances[count - 1] = dist_sqr;
+            out[count - 1] = &photons_[idx];
+            for (int l = count - 2; l >= 0; --l) {
+                if (distances[l] > dist_sqr) {
+                    std::swap(distances[l], distances[l + 1]);
+                    std::swap(out[l], out[l + 1]);
+                } else break;
+            }
+
+            // Once k photons have been found, only closer ones are of interest.
+            if (count == k) max_dist_sqr = distances[k - 1];
+        });
+
+        return count;
+    }
+
+    /// Calls f(photon, squared distance) for every photon within the radius, in no particular order.
+    template <typename F>
+    void for_each_in_radius(const float3& query_pos, F f) const {
+        const float max_dist_sqr = radius_sqr_;
+        traverse(query_pos, max_dist_sqr, [&] (int idx, float dist_sqr) {
+            f(photons_[idx], dist_sqr);
+        });
+    }
+
+    /// Number of bytes allocated for the tree and the photons.
+    size_t memory_bytes() const {
+        return vector_bytes(entries_) + vector_bytes(photons_) + vector_bytes(positions_) + vector_bytes(axes_);
+    }
+
+private:
+    std::vector<Entry> entries_;
+    std::vector<Photon> photons_;
+    std::vector<float3> positions_;
+    std::vector<uint8_t> axes_;
+
+    float radius_sqr_;
+
+    void build_node(int begin, int end) {
+        if (end - begin <= 1) {
+            if (begin < end) axes_[begin] = 0;
+            return;
+        }
+
+        // Split along the largest axis of the bounding box, at the median.
+        BBox bbox = BBox::empty();
+        for (int i = begin; i < end; ++i) bbox.extend(entries_[i].pos);
+        const float3 extents = bbox.max - bbox.min;
+        const int axis = extents.x > extents.y ? (extents.x > extents.z ? 0 : 2) : (extents.y > extents.z ? 1 : 2);
+
+        const int mid = (begin + end) / 2;
+        std::nth_element(entries_.begin() + begin, entries_.begin() + mid, entries_.begin() + end,
+            [axis] (const Entry& a, const Entry& b) { return a.pos[axis] < b.pos[axis]; });
+        axes_[mid] = axis;
+
+        if (end - begin > PARALLEL_BUILD_THRESHOLD) {
+            tbb::parallel_invoke([this, begin, mid] { build_node(begin, mid); },
+                                 [this, mid, end]   { build_node(mid + 1, end); });
+        } else {
+            build_node(begin, mid);
+            build_node(mid + 1, end);
+        }
+    }
+
+    /// Calls f(index, squared distance) for every photon closer than max_dist_sqr.
+    /// The callback may reduce max_dist_sqr to prune the remaining traversal.
+    template <typename F>
+    void traverse(const float3& query_pos, const float& max_dist_sqr, F f) const {
+        // Every range stores the squared distance from the query point to the splitting plane that separates it from the query.
+        struct Range { int begin, end; float plane_dist_sqr; };
+        Range stack[64];
+        int top = 0;
+        stack[top++] = Range{ 0, int(photons_.size()), 0.0f };
+
+        while (top > 0) {
+            const Range r = stack[--top];
+            if (r.begin >= r.end || r.plane_dist_sqr > max_dist_sqr) continue;
+
+            const int mid = (r.begin + r.end) / 2;
+            const float3& pos = positions_[mid];
+            const float dist_sqr = lensqr(query_pos - pos);
+            if (dist_sqr <= max_dist_sqr) f(mid, dist_sqr);
+
+            const int axis = axes_[mid];
+            const float d = query_pos[axis] - pos[axis];
+            const Range near_child = d < 0.0f ? Range{ r.begin, mid, r.plane_dist_sqr } : Range{ mid + 1, r.end, r.plane_dist_sqr };
+            const Range far_child  = d < 0.0f ? Range{ mid + 1, r.end, d * d } : Range{ r.begin, mid, d * d };
+
+            // The far child is skipped if the splitting plane is farther away than the search radius.
+            // Since the near child is visited first, the radius may have shrunk when the far child is popped.
+            if (d * d <= max_dist_sqr) stack[top++] = far_child;
+            stack[top++] = near_child;
+        }
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_KDTREE_H
@@ -2,7 +2,11 @@
 #define IMBA_RANGESEARCH_H
 
 #include "imbatracer/core/float4.h"
+#include "imbatracer/core/common.h"
+#include "imbatracer/core/memory_report.h"
+#include "imbatracer/core/counting_sort.h"
 
+#include <algorithm>
 #include <vector>
 
 #define NOMINMAX
@@ -21,7 +25,14 @@ struct CellIdx {
 template<typename Iter, typename Photon>
 class HashGrid {
     typedef unsigned int uint;
+
+    // Number of bits of the Morton code of a photon within its cell that are sorted, see local_morton_code().
+    // Sorting by a grid of 16^3 points per cell orders the photons well enough, and saves passes of the radix sort.
+    static constexpr int LOCAL_CODE_BITS = 12;
+
 public:
+    HashGrid() : cell_count_(1) {}
+
     void build(const Iter& photons_begin, const Iter& photons_end, float radius) {
         constexpr int inv_load_factor = 2;
         radius_        = radius;
@@ -29,9 +40,9 @@ public:
         cell_size_     = radius_ * 2.f;
         inv_cell_size_ = 1.f / cell_size_;
 
-        int photon_count = photons_end - photons_begin;
-        if (cell_ends_.size() < photon_count * inv_load_factor)
-            cell_ends_ = std::vector<std::atomic<int>>(photon_count * inv_load_factor);
+        const int photon_count = photons_end - photons_begin;
+        // The number of cells only grows, so that the photons of similar iterations are hashed the same way.
+        cell_count_ = std::max(cell_count_, photon_count * inv_load_factor);
 
         // Compute the extents of the bounding box.
         bbox_ = tbb::parallel_reduce(tbb::blocked_range<Iter>(photons_begin, photons_end), BBox::empty(),
@@ -45,39 +56,100 @@ public:
         bbox_.max += extents * 0.001f;
         bbox_.min -= extents * 0.001f;
 
-        // Distribute the photons to the HashGrid cells using Counting Sort.
         photons_.resize(photon_count);
-        std::fill(cell_ends_.begin(), cell_ends_.end(), 0);
-
-        // Count the number of photons in each cell.
-        tbb::parallel_for(tbb::blocked_range<Iter>(photons_begin, photons_end), [this](const tbb::blocked_range<Iter>& range){
-            for (Iter it = range.begin(); it != range.end(); ++it) {
-                cell_ends_[cell_index(it->position())]++;
+        pos_x_.resize(photon_count);
+        pos_y_.resize(photon_count);
+        pos_z_.resize(photon_count);
+        sort_keys_.resize(photon_count);
+        sort_ids_.resize(photon_count);
+
+        // Every photon gets a key made of the index of its cell, and of the Morton code of its position within the cell.
+        // The cells themselves are ordered by the Morton code of their coordinates, see cell_index().
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i) {
+                const float3& pos = (photons_begin + i)->position();
+                sort_keys_[i] = (uint64_t(cell_index(pos)) << LOCAL_CODE_BITS) | (local_morton_code(pos) >> (30 - LOCAL_CODE_BITS));
+                sort_ids_[i] = i;
             }
         });
 
-        // Set the cell_ends_[x] to the first index that belongs to the respective cell.
-        int sum = 0;
-        for(size_t i = 0; i < cell_ends_.size(); i++) {
-            int temp = cell_ends_[i];
-            cell_ends_[i] = sum;
-            sum += temp;
-        }
+        radix_sort_.sort(sort_keys_.data(), sort_ids_.data(), photon_count, LOCAL_CODE_BITS + key_bits(cell_count_ - 1));
 
-        // Assign the photons to the cells.
-        tbb::parallel_for(tbb::blocked_range<Iter>(photons_begin, photons_end), [this](const tbb::blocked_range<Iter>& range){
-            for (Iter it = range.begin(); it != range.end(); ++it) {
-                const float3 &pos = it->position();
-                const int target_idx = cell_ends_[cell_index(pos)]++;
-                photons_[target_idx] = *it;
+        // Set cell_starts_[x] to the first index that belongs to the respective cell. Every cell is set by the photon
+        // that follows it in the sorted order, or by the end of the photons if there is none.
+        cell_starts_.resize(cell_count_ + 1);
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count + 1), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i) {
+                const int first = i == 0 ? 0 : int(sort_keys_[i - 1] >> LOCAL_CODE_BITS) + 1;
+                const int last = i == photon_count ? cell_count_ : int(sort_keys_[i] >> LOCAL_CODE_BITS);
+                for (int c = first; c <= last; ++c) cell_starts_[c] = i;
+            }
+        });
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, photon_count), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i) {
+                const auto& photon = *(photons_begin + sort_ids_[i]);
+                const float3& pos = photon.position();
+                photons_[i] = photon;
+                pos_x_[i] = pos.x;
+                pos_y_[i] = pos.y;
+                pos_z_[i] = pos.z;
             }
         });
     }
 
+    /// Finds the (at most) k nearest photons within the radius, sorted by increasing distance.
+    /// \returns The number of photons found
     template <typename Container>
     int query(const float3& query_pos, Container& out, int k) const {
+        auto distances = V_ARRAY(float, k);
+        int count = 0;
+        for_each_candidate(query_pos, [&] (int idx, float dist_sqr) {
+            if (count == k) {
+                if (distances[count - 1] < dist_sqr) return;
+            } else count++;
+
+            // Insertion sort
+            distances[count - 1] = dist_sqr;
+            out[count - 1] = &photons_[idx];
+            for (int l = count - 2; l >= 0; --l) {
+                if (distances[l] > dist_sqr) {
+                    std::swap(distances[l], distances[l + 1]);
+                    std::swap(out[l], out[l + 1]);
+                } else break;
+            }
+        });
+
+        return count;
+    }
+
+    /// Calls f(photon, squared distance) for every photon within the radius, in no particular order.
+    template <typename F>
+    void for_each_in_radius(const float3& query_pos, F f) const {
+        for_each_candidate(query_pos, [&] (int idx, float dist_sqr) {
+            f(photons_[idx], dist_sqr);
+        });
+    }
+
+    /// Number of bytes allocated for the photons and their positions.
+    size_t photon_bytes() const {
+        return vector_bytes(photons_) + vector_bytes(pos_x_) + vector_bytes(pos_y_) + vector_bytes(pos_z_);
+    }
+    /// Number of bytes allocated for the cells, including the temporary data of the construction.
+    size_t cell_bytes() const {
+        return vector_bytes(cell_starts_) + vector_bytes(sort_keys_) + vector_bytes(sort_ids_) + radix_sort_.memory_bytes();
+    }
+
+private:
+    // Number of photons whose distances are computed at once. The distance loop only reads
+    // the position streams, so that the compiler can vectorize it.
+    static constexpr int DIST_BATCH = 16;
+
+    /// Calls f(index, squared distance) for every photon within the radius around the query point.
+    template <typename F>
+    void for_each_candidate(const float3& query_pos, F f) const {
         // Check if the position is outside the bounding box.
-        if (!bbox_.is_inside(query_pos)) return 0;
+        if (!bbox_.is_inside(query_pos)) return;
 
         const float3 cell = inv_cell_size_ * (query_pos - bbox_.min);
         const float3 coord(
@@ -95,48 +167,54 @@ public:
         const int pyo = py + (fract_coord.y < 0.5f ? -1 : 1);
         const int pzo = pz + (fract_coord.z < 0.5f ? -1 : 1);
 
-        auto distances = V_ARRAY(float, k);
-        int count = 0;
+        const float* __restrict xs = pos_x_.data();
+        const float* __restrict ys = pos_y_.data();
+        const float* __restrict zs = pos_z_.data();
+
+        float dist_sqr[DIST_BATCH];
         for (int j = 0; j < 8; j++) {
             const int x = j & 4 ? pxo : px;
             const int y = j & 2 ? pyo : py;
             const int z = j & 1 ? pzo : pz;
-            CellIdx active_range = cell_range(cell_index(x , y , z ));
-
-            for (; active_range.x < active_range.y; active_range.x++) {
-                const auto& photon = photons_[active_range.x];
-                const float dist_sqr = lensqr(query_pos - photon.position);
-
-                if (dist_sqr <= radius_sqr_) {
-                    if (count == k) {
-                        if (distances[count - 1] < dist_sqr) continue;
-                    } else count++;
-
-                    // Insertion sort
-                    distances[count - 1] = dist_sqr;
-                    out[count - 1] = &photon;
-                    for (int l = count - 2; l >= 0; --l) {
-                        if (distances[l] > dist_sqr) {
-                            std::swap(distances[l], distances[l + 1]);
-                            std::swap(out[l], out[l + 1]);
-                        } else break;
-                    }
+            const CellIdx active_range = cell_range(cell_index(x , y , z ));
+
+            for (int begin = active_range.x; begin < active_range.y; begin += DIST_BATCH) {
+                const int n = std::min(int(DIST_BATCH), active_range.y - begin);
+
+                for (int i = 0; i < n; ++i) {
+                    const float dx = xs[begin + i] - query_pos.x;
+                    const float dy = ys[begin + i] - query_pos.y;
+                    const float dz = zs[begin + i] - query_pos.z;
+                    dist_sqr[i] = dx * dx + dy * dy + dz * dz;
+                }
+
+                for (int i = 0; i < n; ++i) {
+                    if (dist_sqr[i] <= radius_sqr_) f(begin + i, dist_sqr[i]);
                 }
             }
         }
-
-        return count;
     }
 
-private:
     CellIdx cell_range(int cell_idx) const {
-        if(cell_idx == 0) return CellIdx(0, cell_ends_[0]);
-        return CellIdx(cell_ends_[cell_idx-1], cell_ends_[cell_idx]);
+        return CellIdx(cell_starts_[cell_idx], cell_starts_[cell_idx + 1]);
     }
 
+    /// Maps the coordinates of a cell to its index. Within blocks of 1024^3 cells, the index is the Morton code
+    /// of the coordinates (modulo the number of cells), so that neighbouring cells are also close in memory.
     int cell_index(uint x, uint y, uint z) const {
-        return int(((x * 73856093) ^ (y * 19349663) ^
-            (z * 83492791)) % uint(cell_ends_.size()));
+        const uint64_t local = morton_code(x & 1023, y & 1023, z & 1023);
+        const uint64_t block = ((x >> 10) * 73856093) ^ ((y >> 10) * 19349663) ^ ((z >> 10) * 83492791);
+        return int((local + (block << 30)) % cell_count_);
+    }
+
+    /// Computes the Morton code of a point on a grid of 1024^3 cells inside of the hash grid cell that contains it.
+    uint32_t local_morton_code(const float3& point) const {
+        const float3 cell = inv_cell_size_ * (point - bbox_.min);
+        const float3 coord(std::floor(cell.x), std::floor(cell.y), std::floor(cell.z));
+        const float3 local = (cell - coord) * 1024.0f;
+        return morton_code(clamp(int(local.x), 0, 1023),
+                           clamp(int(local.y), 0, 1023),
+                           clamp(int(local.z), 0, 1023));
     }
 
     int cell_index(const float3 &point) const {
@@ -149,7 +227,16 @@ private:
 
     BBox bbox_;
     std::vector<Photon> photons_;
-    std::vector<std::atomic<int>> cell_ends_;
+    // Positions of the photons, stored separately per coordinate for the distance tests.
+    std::vector<float> pos_x_, pos_y_, pos_z_;
+    std::vector<int> cell_starts_;
+
+    int cell_count_;
+
+    // Temporary data for the construction: the keys by which the photons are sorted, and the indices of the photons.
+    std::vector<uint64_t> sort_keys_;
+    std::vector<int> sort_ids_;
+    RadixSort<uint64_t, int> radix_sort_;
 
     float radius_;
     float radius_sqr_;
@@ -0,0 +1,61 @@
+#ifndef IMBA_ALIAS_TABLE_H
+#define IMBA_ALIAS_TABLE_H
+
+#include <vector>
+#include <algorithm>
+
+namespace imba {
+
+/// Entry of an alias table: the bin is kept with probability prob, otherwise the alias is taken.
+struct AliasEntry {
+    float prob;
+    int alias;
+};
+
+/// Builds an alias table (Walker's method, with the construction of Vose) for a discrete distribution of n elements.
+/// The weights must be non-negative. If they are all zero, the distribution is uniform. Returns the sum of the weights.
+inline double build_alias_table(const float* weights, int n, AliasEntry* table) {
+    double total = 0.0;
+    for (int i = 0; i < n; ++i) total += weights[i];
+
+    std::vector<double> scaled(n);
+    for (int i = 0; i < n; ++i)
+        scaled[i] = total > 0.0 ? weights[i] * n / total : 1.0;
+
+    std::vector<int> small, large;
+    small.reserve(n);
+    large.reserve(n);
+    for (int i = n - 1; i >= 0; --i)
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+
+    while (!small.empty() && !large.empty()) {
+        const int s = small.back(); small.pop_back();
+        const int l = large.back();
+
+        table[s].prob  = scaled[s];
+        table[s].alias = l;
+
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Whatever is left has a probability of one, up to rounding errors.
+    for (int i : small) table[i] = AliasEntry{ 1.0f, i };
+    for (int i : large) table[i] = AliasEntry{ 1.0f, i };
+
+    return total;
+}
+
+/// Samples an element of a distribution in constant time, given a random number in [0, 1).
+inline int sample_alias_table(const AliasEntry* table, int n, float u) {
+    const float x = u * n;
+    const int i = std::min(static_cast<int>(x), n - 1);
+    return x - i < table[i].prob ? i : table[i].alias;
+}
+
+} // namespace imba
+
+#endif // IMBA_ALIAS_TABLE_H
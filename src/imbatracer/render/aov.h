@@ -0,0 +1,132 @@
+#ifndef IMBA_AOV_H
+#define IMBA_AOV_H
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/core/rgb.h"
+#include "imbatracer/render/scheduling/contribution_buffer.h"
+
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace imba {
+
+/// Auxiliary outputs (AOVs) of the rendering, which guide the denoiser and the reprojection: the albedo, the shading
+/// normal, the distance to the camera and the id of the instance at the first hit of the camera paths, and the variance
+/// of the pixels.
+/// The albedo and the normal are accumulated over all the samples, like the color, so they must be divided by the
+/// number of samples. The distance is averaged over the samples that hit something, and the id is the one of the first
+/// sample of the pixel. The variance is estimated from the contribution of every frame to the accumulated color.
+class AOVImages {
+public:
+    AOVImages(int width, int height)
+        : albedo_(width, height), normal_(width, height), depth_(width, height)
+        , ids_(width * height)
+        , prev_(width * height), sum_sqr_(width * height)
+    {
+        albedo_buf_.resize(width, height);
+        normal_buf_.resize(width, height);
+        depth_buf_.resize(width, height);
+        clear();
+    }
+
+    AOVImages(const AOVImages&) = delete;
+    AOVImages& operator=(const AOVImages&) = delete;
+
+    int width() const { return albedo_.width(); }
+    int height() const { return albedo_.height(); }
+
+    /// Records the first hit of a camera path. Can be called concurrently by the rendering threads.
+    void add(int pixel_id, int sample_id, const rgb& albedo, const float3& normal, float depth, int id) {
+        albedo_buf_.add(pixel_id, albedo);
+        normal_buf_.add(pixel_id, normal);
+        depth_buf_.add(pixel_id, rgb(depth, 1.0f, 0.0f));
+
+        // Only one sample of a pixel has the id 0 in a frame, so no other thread writes to the same pixel.
+        if (sample_id == 0) ids_[pixel_id] = id;
+    }
+
+    /// Adds the first hits of a frame to the images, and updates the variance with the contribution of the frame to the
+    /// accumulated color. Must be called after every frame, once the rendering threads are done.
+    void end_frame(const AtomicImage& color, int spp) {
+        albedo_buf_.flush(albedo_);
+        normal_buf_.flush(normal_);
+        depth_buf_.flush(depth_);
+
+        // The mean of the spp samples of the frame has a variance of sigma^2 / spp, so the squared difference to the
+        // mean of all the samples, divided by the variance of the frame, is accumulated to estimate sigma^2.
+        const int w = width();
+        tbb::parallel_for(0, height(), [&] (int y) {
+            for (int x = 0; x < w; ++x) {
+                const rgb c = color(x, y);
+                const rgb d = c - prev_[y * w + x];
+                sum_sqr_[y * w + x] += d * d * (1.0f / spp);
+                prev_[y * w + x] = c;
+            }
+        });
+
+        frames_++;
+        samples_ += spp;
+    }
+
+    /// Discards all the accumulated values, e.g. because the camera moved.
+    void clear() {
+        albedo_.clear();
+        normal_.clear();
+        depth_.clear();
+        std::fill(ids_.begin(), ids_.end(), -1);
+        std::fill(prev_.begin(), prev_.end(), rgb(0.0f));
+        std::fill(sum_sqr_.begin(), sum_sqr_.end(), rgb(0.0f));
+        frames_ = 0;
+        samples_ = 0;
+    }
+
+    /// Average albedo of the first hits in the given pixel.
+    rgb albedo(int x, int y) const { return samples_ > 0 ? rgb(albedo_(x, y)) * (1.0f / samples_) : rgb(0.0f); }
+
+    /// Average shading normal of the first hits in the given pixel, not normalized.
+    float3 normal(int x, int y) const { return samples_ > 0 ? float3(rgb(normal_(x, y))) * (1.0f / samples_) : float3(0.0f); }
+
+    /// Average distance between the camera and the first hits in the given pixel, or zero if nothing was hit.
+    float depth(int x, int y) const {
+        const rgb d = depth_(x, y);
+        return d.y > 0.0f ? d.x / d.y : 0.0f;
+    }
+
+    /// Fraction of the samples of the given pixel that hit something.
+    float coverage(int x, int y) const { return samples_ > 0 ? rgb(depth_(x, y)).y / samples_ : 0.0f; }
+
+    /// Id of the instance hit by the first sample of the given pixel, or -1 if nothing was hit.
+    int id(int x, int y) const { return ids_[y * width() + x]; }
+
+    /// Variance of the estimate of the color of the given pixel, i.e. of the average over all the samples.
+    rgb variance(int x, int y) const {
+        if (frames_ < 2) return rgb(0.0f);
+
+        // sum(spp_i * (m_i - m)^2) = sum(d_i^2 / spp_i) - samples * m^2, where m_i is the mean of frame i.
+        const rgb m = rgb(prev_[y * width() + x]) * (1.0f / samples_);
+        const rgb s = sum_sqr_[y * width() + x] - m * m * float(samples_);
+        return max(s, rgb(0.0f)) * (1.0f / (float(frames_ - 1) * samples_));
+    }
+
+    int samples() const { return samples_; }
+    int frames() const { return frames_; }
+
+private:
+    AtomicImage albedo_;
+    AtomicImage normal_;
+    AtomicImage depth_;         ///< Sum of the distances in the first channel, number of hits in the second
+    ContributionBuffer albedo_buf_;
+    ContributionBuffer normal_buf_;
+    ContributionBuffer depth_buf_;
+    std::vector<int> ids_;
+
+    std::vector<rgb> prev_;         ///< Accumulated color after the previous frame
+    std::vector<rgb> sum_sqr_;      ///< Sum of the squared contributions of the frames, divided by their sample count
+    int frames_, samples_;
+};
+
+} // namespace imba
+
+#endif // IMBA_AOV_H
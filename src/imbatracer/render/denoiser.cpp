@@ -0,0 +1,151 @@
+#include "imbatracer/render/denoiser.h"
+#include "imbatracer/core/common.h"
+
+#include <tbb/parallel_for.h>
+
+#include <cmath>
+#include <vector>
+
+namespace imba {
+
+// Exponent of the cosine between the normals in the weights.
+static constexpr float SIGMA_NORMAL = 64.0f;
+// Difference of albedo at which the weight drops to 1/e.
+static constexpr float SIGMA_ALBEDO = 0.1f;
+// Difference of luminance, in standard deviations, at which the weight drops to 1/e.
+static constexpr float SIGMA_LUM = 4.0f;
+// Smallest albedo by which the color is divided.
+static constexpr float MIN_ALBEDO = 1e-3f;
+
+/// Returns the factor by which the color is demodulated. Pixels without albedo, e.g. the background, are left as is.
+static rgb demodulation(const rgb& a) {
+    return rgb(a.x > MIN_ALBEDO ? a.x : 1.0f, a.y > MIN_ALBEDO ? a.y : 1.0f, a.z > MIN_ALBEDO ? a.z : 1.0f);
+}
+
+void denoise(const Image& color, const AOVImages& aovs, int iterations, Image& out) {
+    const int w = color.width();
+    const int h = color.height();
+    const int n = w * h;
+
+    std::vector<rgb> albedo(n), irradiance(n), next_irradiance(n);
+    std::vector<float3> normal(n);
+    std::vector<float> variance(n), next_variance(n), filtered_variance(n);
+
+    // Demodulate the color by the albedo, and compute the variance of the luminance of the result.
+    tbb::parallel_for(0, h, [&] (int y) {
+        for (int x = 0; x < w; ++x) {
+            const int i = y * w + x;
+            const rgb a = aovs.albedo(x, y);
+            const float3 nrm = aovs.normal(x, y);
+            const float len = length(nrm);
+
+            albedo[i] = a;
+            normal[i] = len > 0.0f ? nrm * (1.0f / len) : float3(0.0f);
+
+            const rgb m = demodulation(a);
+            const rgb inv_m(1.0f / m.x, 1.0f / m.y, 1.0f / m.z);
+            irradiance[i] = rgb(color(x, y)) * inv_m;
+            variance[i] = luminance(aovs.variance(x, y) * inv_m * inv_m);
+        }
+    });
+
+    if (aovs.frames() < 2) {
+        // The variance over the frames is not known: estimate it from the neighbourhood of the pixels instead.
+        tbb::parallel_for(0, h, [&] (int y) {
+            for (int x = 0; x < w; ++x) {
+                float sum = 0.0f, sum_sqr = 0.0f;
+                int count = 0;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        const int qx = x + dx, qy = y + dy;
+                        if (qx < 0 || qy < 0 || qx >= w || qy >= h) continue;
+                        const float l = luminance(irradiance[qy * w + qx]);
+                        sum += l;
+                        sum_sqr += l * l;
+                        count++;
+                    }
+                }
+                const float mean = sum / count;
+                variance[y * w + x] = std::max(sum_sqr / count - mean * mean, 0.0f);
+            }
+        });
+    }
+
+    // B3 spline, the filter is applied with holes of increasing size between the taps.
+    const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    for (int iter = 0; iter < iterations; ++iter) {
+        const int step = 1 << iter;
+
+        // The edge-stopping function uses a blurred variance, which is less noisy.
+        tbb::parallel_for(0, h, [&] (int y) {
+            for (int x = 0; x < w; ++x) {
+                float sum = 0.0f, sum_w = 0.0f;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        const int qx = x + dx, qy = y + dy;
+                        if (qx < 0 || qy < 0 || qx >= w || qy >= h) continue;
+                        const float k = kernel[2 + dx] * kernel[2 + dy];
+                        sum += k * variance[qy * w + qx];
+                        sum_w += k;
+                    }
+                }
+                filtered_variance[y * w + x] = sum / sum_w;
+            }
+        });
+
+        tbb::parallel_for(0, h, [&] (int y) {
+            for (int x = 0; x < w; ++x) {
+                const int p = y * w + x;
+                const float lum_p = luminance(irradiance[p]);
+                const float lum_scale = 1.0f / (SIGMA_LUM * std::sqrt(filtered_variance[p]) + 1e-4f);
+
+                rgb sum_c(0.0f);
+                float sum_v = 0.0f, sum_w = 0.0f;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    const int qy = y + dy * step;
+                    if (qy < 0 || qy >= h) continue;
+
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        const int qx = x + dx * step;
+                        if (qx < 0 || qx >= w) continue;
+                        const int q = qy * w + qx;
+
+                        const float cos_n = dot(normal[p], normal[q]);
+                        const float w_n = std::pow(std::max(cos_n, 0.0f), SIGMA_NORMAL);
+                        const rgb da = albedo[p] - albedo[q];
+                        const float w_a = std::exp(-dot(da, da) * (1.0f / (SIGMA_ALBEDO * SIGMA_ALBEDO)));
+                        const float w_l = std::exp(-std::fabs(lum_p - luminance(irradiance[q])) * lum_scale);
+
+                        // Pixels without a first hit (e.g. the background) are only filtered together.
+                        const bool both_empty = dot(normal[p], normal[p]) == 0.0f && dot(normal[q], normal[q]) == 0.0f;
+                        const float wgt = kernel[2 + dx] * kernel[2 + dy] * (both_empty ? 1.0f : w_n) * w_a * w_l;
+
+                        sum_c += irradiance[q] * wgt;
+                        sum_v += variance[q] * wgt * wgt;
+                        sum_w += wgt;
+                    }
+                }
+
+                // The weight of the center pixel is never zero.
+                next_irradiance[p] = sum_c / sum_w;
+                next_variance[p] = sum_v / (sum_w * sum_w);
+            }
+        });
+
+        irradiance.swap(next_irradiance);
+        variance.swap(next_variance);
+    }
+
+    // Modulate the filtered irradiance by the albedo again.
+    out.resize(w, h);
+    tbb::parallel_for(0, h, [&] (int y) {
+        for (int x = 0; x < w; ++x) {
+            const int i = y * w + x;
+            const rgb c = irradiance[i] * demodulation(albedo[i]);
+            out(x, y) = rgba(c.x, c.y, c.z, 1.0f);
+        }
+    });
+}
+
+} // namespace imba
@@ -0,0 +1,20 @@
+#ifndef IMBA_DENOISER_H
+#define IMBA_DENOISER_H
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/render/aov.h"
+
+namespace imba {
+
+/// Denoises an image with an edge-avoiding a-trous wavelet filter, guided by the auxiliary images
+/// (see "Edge-Avoiding A-Trous Wavelet Transform for fast Global Illumination Filtering", by H. Dammertz et al.,
+/// and "Spatiotemporal Variance-Guided Filtering", by C. Schied et al.).
+/// The color is divided by the albedo before filtering, so that the textures are not blurred. The filter stops at
+/// discontinuities of the normal and the albedo, and at differences of luminance that are larger than the noise,
+/// which is given by the variance of the pixels. Every iteration doubles the radius of the filter.
+/// The input is the average color of the pixels, and so is the result, whose alpha channel is set to one.
+void denoise(const Image& color, const AOVImages& aovs, int iterations, Image& out);
+
+} // namespace imba
+
+#endif // IMBA_DENOISER_H
@@ -4,27 +4,68 @@
 #include <tbb/parallel_for.h>
 #include <tbb/parallel_reduce.h>
 
+#include <deque>
 #include <iostream>
-#include <atomic>
+#include <mutex>
+#include <vector>
 
 namespace imba {
 
-struct EmptyState { };
+namespace {
+
+// Pixel sizes estimated so far, for a view of the camera and the geometry of a scene.
+struct PixelSizeEntry {
+    int traversal_id;
+    PerspectiveCamera cam;
+    float pixel_size;
+};
+
+// Number of entries kept in the cache, the oldest ones are replaced first.
+constexpr int PIXEL_SIZE_CACHE_SIZE = 16;
+
+std::mutex pixel_size_mutex;
+std::deque<PixelSizeEntry> pixel_size_cache;
+
+} // namespace
 
 void Integrator::estimate_pixel_size() {
+    {
+        std::lock_guard<std::mutex> lock(pixel_size_mutex);
+        for (auto& e : pixel_size_cache) {
+            if (e.traversal_id == scene_.traversal_id() && e.cam.same_view(cam_)) {
+                pixel_size_ = e.pixel_size;
+                return;
+            }
+        }
+    }
+
     const bool use_gpu = scene_.has_gpu_buffers();
 
-    // Compute rays from the corners of every 8th pixel
-    const int ray_count = cam_.width() * cam_.height() / 16;
-    RayQueue<EmptyState> q(ray_count, use_gpu);
-    for (int x = 0; x < cam_.width(); x += 8) {
-        for (int y = 0; y < cam_.height(); y += 8) {
-            q.push(cam_.generate_ray(x    , y    ), EmptyState());
-            q.push(cam_.generate_ray(x + 1, y    ), EmptyState());
-            q.push(cam_.generate_ray(x    , y + 1), EmptyState());
-            q.push(cam_.generate_ray(x + 1, y + 1), EmptyState());
+    // Compute rays from the corners of every 8th pixel. Every block of 8x8 pixels gets four consecutive rays.
+    const int blocks_x = (cam_.width()  + 7) / 8;
+    const int blocks_y = (cam_.height() + 7) / 8;
+    const int ray_count = blocks_x * blocks_y * 4;
+    if (!pixel_size_rays_ || pixel_size_rays_->capacity() < ray_count)
+        pixel_size_rays_.reset(new RayQueue<PixelSizeState>(ray_count, use_gpu));
+
+    auto& q = *pixel_size_rays_;
+    q.clear();
+    q.shrink(ray_count);
+    Ray* rays = q.rays();
+
+    // The rays are written in place, one row of blocks per task, instead of being pushed one by one.
+    tbb::parallel_for(0, blocks_y, [&] (int by) {
+        std::vector<float> xs(blocks_x * 4), ys(blocks_x * 4);
+        const float y = by * 8;
+        for (int bx = 0; bx < blocks_x; ++bx) {
+            const float x = bx * 8;
+            xs[bx * 4 + 0] = x;     ys[bx * 4 + 0] = y;
+            xs[bx * 4 + 1] = x + 1; ys[bx * 4 + 1] = y;
+            xs[bx * 4 + 2] = x;     ys[bx * 4 + 2] = y + 1;
+            xs[bx * 4 + 3] = x + 1; ys[bx * 4 + 3] = y + 1;
         }
-    }
+        cam_.generate_rays(blocks_x * 4, xs.data(), ys.data(), rays + by * blocks_x * 4);
+    });
 
     // Traverse the rays and compute the hitpoints
     if (use_gpu)
@@ -32,12 +73,10 @@ void Integrator::estimate_pixel_size() {
     else
         q.traverse_cpu(scene_.traversal_data_cpu());
     auto hits = q.hits();
-    auto rays = q.rays();
 
-    std::atomic<int> count;
-    count = 0;
-    float total = tbb::parallel_reduce(tbb::blocked_range<int>(0, q.size() / 4), 0.0f,
-        [&] (const tbb::blocked_range<int>& range, float init) -> float {
+    struct Sum { float total; int count; };
+    const Sum sum = tbb::parallel_reduce(tbb::blocked_range<int>(0, q.size() / 4), Sum{ 0.0f, 0 },
+        [&] (const tbb::blocked_range<int>& range, Sum init) -> Sum {
             for (auto i = range.begin(); i != range.end(); ++i) {
                 if (hits[i * 4 + 0].tri_id < 0 ||
                     hits[i * 4 + 1].tri_id < 0 ||
@@ -51,23 +90,27 @@ void Integrator::estimate_pixel_size() {
                     return hits[idx].tmax * dir + org; };
                 auto d = [](const float3& a, const float3& b) -> float { return length(a - b); };
 
-                init += d(p(i * 4 + 0), p(i * 4 + 1));
-                init += d(p(i * 4 + 1), p(i * 4 + 3));
-                init += d(p(i * 4 + 3), p(i * 4 + 2));
-                init += d(p(i * 4 + 2), p(i * 4 + 0));
+                init.total += d(p(i * 4 + 0), p(i * 4 + 1));
+                init.total += d(p(i * 4 + 1), p(i * 4 + 3));
+                init.total += d(p(i * 4 + 3), p(i * 4 + 2));
+                init.total += d(p(i * 4 + 2), p(i * 4 + 0));
 
-                count += 4;
+                init.count += 4;
             }
             return init;
         },
-        std::plus<float>());
+        [] (Sum a, const Sum& b) { return Sum{ a.total + b.total, a.count + b.count }; });
 
-    if (count == 0) {
+    if (sum.count == 0) {
         std::cout << "Warning: could not estimate pixel size, nothing was hit by the sample rays." << std::endl;
         pixel_size_ = 1.0f;
     }
     else
-        pixel_size_ = total / count;
+        pixel_size_ = sum.total / sum.count;
+
+    std::lock_guard<std::mutex> lock(pixel_size_mutex);
+    if (pixel_size_cache.size() >= PIXEL_SIZE_CACHE_SIZE) pixel_size_cache.pop_front();
+    pixel_size_cache.push_back(PixelSizeEntry{ scene_.traversal_id(), cam_, pixel_size_ });
 }
 
 } // namespace imba
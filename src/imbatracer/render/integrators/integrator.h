@@ -2,16 +2,20 @@
 #define IMBA_INTEGRATOR_H
 
 #include "imbatracer/render/scheduling/ray_queue.h"
+#include "imbatracer/render/scheduling/contribution_buffer.h"
 #include "imbatracer/render/ray_gen/camera.h"
+#include "imbatracer/render/aov.h"
 #include "imbatracer/render/light.h"
 #include "imbatracer/render/random.h"
 #include "imbatracer/render/scene.h"
+#include "imbatracer/render/shading_triangle.h"
 
 #include "imbatracer/core/mesh.h"
 #include "imbatracer/core/image.h"
 #include "imbatracer/core/rgb.h"
 
 #include <functional>
+#include <memory>
 
 namespace imba {
 
@@ -19,7 +23,7 @@ namespace imba {
 class Integrator {
 public:
     Integrator(const Scene& scene, const PerspectiveCamera& cam)
-        : scene_(scene), cam_(cam)
+        : scene_(scene), cam_(cam), aovs_(nullptr)
     {}
 
     virtual ~Integrator() {}
@@ -30,27 +34,58 @@ public:
     /// Called whenever the camera view is updated.
     virtual void reset() {}
 
+    /// The following functions change the quality of the next frames, and must be called between two frames.
+    /// They return false if the integrator does not support the change.
+
+    /// Changes the number of samples per pixel of the frames.
+    virtual bool set_spp(int) { return false; }
+    /// Changes the maximum number of vertices of the paths, including the vertices on the camera and the lights.
+    virtual bool set_max_path_len(int) { return false; }
+    /// Changes the number of light paths of the frames, which must not exceed the number given at construction.
+    virtual bool set_light_path_count(int) { return false; }
+    /// Changes the resolution of the image, and of the camera, of the frames. The image passed to render() must have
+    /// the same size.
+    virtual bool set_resolution(int, int) { return false; }
+
     /// Called once per scene at the beginning, before the other methods.
     virtual void preprocess() { estimate_pixel_size(); }
 
     /// Estimate of the average distance between hit points of rays from the same pixel.
-    /// The value is computed during the preprocessing phase.
+    /// The value is computed during the preprocessing phase, and cached for the view of the camera and the geometry
+    /// of the scene, so that the integrators created later for the same view do not trace the rays again.
     /// The result of calling this function before preprocess() is undefined.
     float pixel_size() const { return pixel_size_; }
 
+    const PerspectiveCamera& camera() const { return cam_; }
+
+    /// Records the first hits of the camera paths in the given auxiliary images, or nothing if the pointer is null.
+    void set_aovs(AOVImages* aovs) { aovs_ = aovs; }
+
+    /// Adds the memory used by the scene, and by the queues and caches of the integrator, to the report.
+    virtual void report_memory(MemoryReport& report) const { scene_.report_memory(report); }
+
 protected:
     const Scene& scene_;
     const PerspectiveCamera& cam_;
+    AOVImages* aovs_;
+
+    /// Records the first hit of a camera path, if the auxiliary images are enabled.
+    inline void add_first_hit(const RayState& state, const Intersection& isect, const Hit& hit) {
+        if (aovs_) {
+            aovs_->add(state.pixel_id, state.sample_id, isect.mat->albedo(isect), isect.normal,
+                       length(isect.pos - cam_.pos()), hit.inst_id);
+        }
+    }
 
-    inline static void add_contribution(AtomicImage& out, int pixel_id, const rgb& contrib) {
-        out.pixels()[pixel_id].apply<std::plus<float> >(contrib);
+    inline static void add_contribution(ContributionBuffer& out, int pixel_id, const rgb& contrib) {
+        out.add(pixel_id, contrib);
     }
 
-    inline void process_shadow_rays(RayQueue<ShadowState>& ray_in, AtomicImage& out) {
+    inline void process_shadow_rays(RayQueue<ShadowState>& ray_in, ContributionBuffer& out) {
         ShadowState* states = ray_in.states();
         Hit* hits = ray_in.hits();
 
-        tbb::parallel_for(tbb::blocked_range<int>(0, ray_in.size()),
+        ray_in.for_each_range(0, ray_in.size(),
             [&] (const tbb::blocked_range<int>& range)
         {
             for (auto i = range.begin(); i != range.end(); ++i) {
@@ -63,44 +98,84 @@ protected:
     }
 
 private:
+    struct PixelSizeState {};
+
     float pixel_size_;
+    std::unique_ptr<RayQueue<PixelSizeState> > pixel_size_rays_;  ///< Kept for the next estimate, e.g. after a camera change
 
     void estimate_pixel_size();
 };
 
-inline Intersection calculate_intersection(const Scene& scene, const Hit& hit, const Ray& ray) {
+/// Computes the intersection data of a hit. The width of the ray cone at the hit point, if known, selects the
+/// level of detail of the textures.
+inline Intersection calculate_intersection(const Scene& scene, const Hit& hit, const Ray& ray, float cone_width = 0.0f) {
     const Mesh::Instance& inst = scene.instance(hit.inst_id);
-    const Mesh& mesh = scene.mesh(inst.id);
-
-    const int local_tri_id = scene.local_tri_id(hit.tri_id, inst.id);
-
-    const int i0 = mesh.indices()[local_tri_id * 4 + 0];
-    const int i1 = mesh.indices()[local_tri_id * 4 + 1];
-    const int i2 = mesh.indices()[local_tri_id * 4 + 2];
-    const int  m = mesh.indices()[local_tri_id * 4 + 3];
-
-    const auto& mat = scene.material(m);
+    const Mesh::Transform& transf = scene.instance_transform(hit.inst_id);
 
     const float3     org(ray.org.x, ray.org.y, ray.org.z);
     const float3 out_dir(ray.dir.x, ray.dir.y, ray.dir.z);
     const auto       pos = org + hit.tmax * out_dir;
-    const auto local_pos = inst.inv_mat * float4(pos, 1.0f);
+    const auto local_pos = transf.inv_mat * float4(pos, 1.0f);
 
     // Recompute v based on u and local_pos
     const float u = hit.u;
-    const auto v0 = float3(mesh.vertices()[i0]);
-    const auto e1 = float3(mesh.vertices()[i1]) - v0;
-    const auto e2 = float3(mesh.vertices()[i2]) - v0;
-    const float v = dot(local_pos - v0 - u * e1, e2) / dot(e2, e2);
 
-    const auto texcoords    = mesh.attribute<float2>(MeshAttributes::TEXCOORDS);
-    const auto normals      = mesh.attribute<float3>(MeshAttributes::NORMALS);
-    const auto geom_normals = mesh.attribute<float3>(MeshAttributes::GEOM_NORMALS);
+    int m;
+    float2 uv_coords;
+    float4 local_normal, local_geom_normal;  // Transformed to world space by the inverse transpose of the instance
+    float texel_density = 0.0f;              // Only needed if the ray has a footprint
+    if (scene.has_shading_triangles()) {
+        const ShadingTriangle& tri = scene.shading_triangle(hit.tri_id);
+        const float v = dot(local_pos, float3(tri.v_plane)) + tri.v_plane.w;
+
+        m = tri.material;
+        uv_coords = lerp(tri.uv[0], tri.uv[1], tri.uv[2], u, v);
+        local_normal = lerp(decode_octahedral(tri.normals[0]),
+                            decode_octahedral(tri.normals[1]),
+                            decode_octahedral(tri.normals[2]), u, v) * transf.inv_mat;
+        local_geom_normal = decode_octahedral(tri.geom_normal) * transf.inv_mat;
+
+        if (cone_width > 0.0f) {
+            // Areas are scaled by the determinant of the transform times the length of the transformed normal.
+            const float det = dot(float3(transf.mat[0]), cross(float3(transf.mat[1]), float3(transf.mat[2])));
+            const float area_scale = fabsf(det) * length(float3(local_geom_normal));
+            texel_density = area_scale > 0.0f ? tri.texel_density / std::sqrt(area_scale) : 0.0f;
+        }
+    } else {
+        const Mesh& mesh = scene.mesh(inst.id);
+        const int local_tri_id = scene.local_tri_id(hit.tri_id, inst.id);
+
+        const int i0 = mesh.indices()[local_tri_id * 4 + 0];
+        const int i1 = mesh.indices()[local_tri_id * 4 + 1];
+        const int i2 = mesh.indices()[local_tri_id * 4 + 2];
+        m = mesh.indices()[local_tri_id * 4 + 3];
+
+        const auto v0 = float3(mesh.vertices()[i0]);
+        const auto e1 = float3(mesh.vertices()[i1]) - v0;
+        const auto e2 = float3(mesh.vertices()[i2]) - v0;
+        const float v = dot(local_pos - v0 - u * e1, e2) / dot(e2, e2);
+
+        const auto texcoords    = mesh.attribute<float2>(MeshAttributes::TEXCOORDS);
+        const auto normals      = mesh.attribute<float3>(MeshAttributes::NORMALS);
+        const auto geom_normals = mesh.attribute<float3>(MeshAttributes::GEOM_NORMALS);
+
+        uv_coords = lerp(texcoords[i0], texcoords[i1], texcoords[i2], u, v);
+        local_normal = lerp(normals[i0], normals[i1], normals[i2], u, v) * transf.inv_mat;
+        local_geom_normal = geom_normals[local_tri_id] * transf.inv_mat;
+
+        if (cone_width > 0.0f) {
+            const auto t1 = texcoords[i1] - texcoords[i0];
+            const auto t2 = texcoords[i2] - texcoords[i0];
+            const float uv_area    = fabsf(t1.x * t2.y - t1.y * t2.x);
+            const float world_area = length(cross(transf.mat * float4(e1, 0.0f), transf.mat * float4(e2, 0.0f)));
+            texel_density = world_area > 0.0f ? std::sqrt(uv_area / world_area) : 0.0f;
+        }
+    }
+
+    const auto& mat = scene.material(m);
 
-    const auto uv_coords    = lerp(texcoords[i0], texcoords[i1], texcoords[i2], u, v);
-    const auto local_normal = lerp(normals[i0], normals[i1], normals[i2], u, v);
-    const auto normal       = normalize(float3(local_normal * inst.inv_mat));
-    const auto geom_normal  = normalize(float3(geom_normals[local_tri_id] * inst.inv_mat));
+    const auto normal       = normalize(float3(local_normal));
+    const auto geom_normal  = normalize(float3(local_geom_normal));
 
     const auto w_out = -normalize(out_dir);
 
@@ -108,8 +183,15 @@ inline Intersection calculate_intersection(const Scene& scene, const Hit& hit, c
     float3 v_tangent;
     local_coordinates(normal, u_tangent, v_tangent);
 
+    // The footprint of the cone on the triangle is scaled by the ratio of the texture and world space areas.
+    float uv_footprint = 0.0f;
+    if (cone_width > 0.0f) {
+        const float cos_theta = std::max(fabsf(dot(geom_normal, w_out)), 0.01f);
+        uv_footprint = cone_width / cos_theta * texel_density;
+    }
+
     Intersection res {
-        pos, w_out, normal, uv_coords, geom_normal, u_tangent, v_tangent, mat.get()
+        pos, w_out, normal, uv_coords, geom_normal, u_tangent, v_tangent, mat.get(), m, uv_footprint
     };
 
     // If the material has a bump map, modify the shading normal accordingly.
@@ -122,6 +204,19 @@ inline Intersection calculate_intersection(const Scene& scene, const Hit& hit, c
     return res;
 }
 
+/// Computes the area of the triangle that was hit, in world space.
+inline float world_triangle_area(const Scene& scene, const Hit& hit) {
+    const Mesh::Instance& inst = scene.instance(hit.inst_id);
+    const Mesh::Transform& transf = scene.instance_transform(hit.inst_id);
+    const Mesh& mesh = scene.mesh(inst.id);
+    const int local_tri_id = scene.local_tri_id(hit.tri_id, inst.id);
+
+    const auto v0 = transf.mat * float4(float3(mesh.vertices()[mesh.indices()[local_tri_id * 4 + 0]]), 1.0f);
+    const auto v1 = transf.mat * float4(float3(mesh.vertices()[mesh.indices()[local_tri_id * 4 + 1]]), 1.0f);
+    const auto v2 = transf.mat * float4(float3(mesh.vertices()[mesh.indices()[local_tri_id * 4 + 2]]), 1.0f);
+    return length(cross(v1 - v0, v2 - v0)) * 0.5f;
+}
+
 template<typename StateType>
 void terminate_path(StateType& state) {
     state.pixel_id = -1;
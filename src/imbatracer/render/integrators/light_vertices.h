@@ -4,10 +4,12 @@
 #include "imbatracer/render/integrators/integrator.h"
 
 #include "imbatracer/rangesearch/rangesearch.h"
+#include "imbatracer/rangesearch/kdtree.h"
 #include "imbatracer/core/float4.h"
 #include "imbatracer/core/common.h"
 
 #include "imbatracer/render/random.h"
+#include "imbatracer/render/sampler.h"
 
 #define NOMINMAX
 #include <tbb/tbb.h>
@@ -15,8 +17,16 @@
 namespace imba {
 
 /// Stores the data required for connecting (or merging) a camera vertex to (with) a light vertex.
+/// Only the fields that are read by the connection and merging code are kept: the normals are stored
+/// in octahedral encoding, the shading frame is recomputed from the normal, and the material is referenced by its index.
 struct LightPathVertex {
-    Intersection isect;
+    float3 pos;
+    float3 out_dir;
+    float2 uv;
+    uint32_t normal;      ///< Octahedral encoding of the shading normal
+    uint32_t geom_normal; ///< Octahedral encoding of the geometric normal
+    int mat_id;
+
     rgb throughput;
 
     int path_length;
@@ -26,14 +36,32 @@ struct LightPathVertex {
     float dVCM;
     float dVM;
 
-    LightPathVertex(Intersection isect, rgb tp, float dVC, float dVCM, float dVM, int path_length)
-        : isect(isect), throughput(tp), dVC(dVC), dVCM(dVCM), dVM(dVM), path_length(path_length)
+    LightPathVertex(const Intersection& isect, rgb tp, float dVC, float dVCM, float dVM, int path_length)
+        : pos(isect.pos), out_dir(isect.out_dir), uv(isect.uv)
+        , normal(oct_encode(isect.normal)), geom_normal(oct_encode(isect.geom_normal)), mat_id(isect.mat_id)
+        , throughput(tp), path_length(path_length), dVC(dVC), dVCM(dVCM), dVM(dVM)
     {}
 
     LightPathVertex() {}
 
-    float3& position() { return isect.pos; }
-    const float3& position() const { return isect.pos; }
+    float3& position() { return pos; }
+    const float3& position() const { return pos; }
+
+    /// Reconstructs the intersection data at this vertex. The tangents are rebuilt from the shading normal.
+    Intersection intersection(const Scene& scene) const {
+        Intersection isect;
+        isect.pos         = pos;
+        isect.out_dir     = out_dir;
+        isect.normal      = oct_decode(normal);
+        isect.uv          = uv;
+        isect.geom_normal = oct_decode(geom_normal);
+        local_coordinates(isect.normal, isect.u_tangent, isect.v_tangent);
+        isect.mat         = scene.material(mat_id).get();
+        isect.mat_id      = mat_id;
+        // The light paths have no ray cone, so their texture lookups use the finest level.
+        isect.uv_footprint = 0.0f;
+        return isect;
+    }
 };
 
 using PhotonIterator = std::vector<LightPathVertex>::iterator;
@@ -47,40 +75,52 @@ struct VCMPhoton {
 
     VCMPhoton() {}
     VCMPhoton(const LightPathVertex& r) {
-        position   = r.isect.pos;
-        out_dir    = r.isect.out_dir;
+        position   = r.pos;
+        out_dir    = r.out_dir;
         dVCM       = r.dVCM;
         dVM        = r.dVM;
         throughput = r.throughput;
     }
 };
 
+/// Acceleration structures for the photon range queries.
+enum PhotonAccel {
+    PHOTON_ACCEL_HASH_GRID, ///< Uniform grid with a cell size of twice the radius, fastest to build
+    PHOTON_ACCEL_KD_TREE    ///< Balanced kd-tree, adapts to photon densities that vary strongly across the scene
+};
+
 /// Stores the vertices of the light paths and implements selecting vertices for connecting and merging.
+/// Every thread claims blocks of consecutive entries in the cache and fills them without synchronization.
+/// Vertices that do not fit are kept in per-thread overflow buffers, and the cache grows to hold them in build().
 class LightVertices {
-    // Number of light paths to be traced when computing the average length and thus vertex cache size.
-    static const int LIGHT_PATH_LEN_PROBES = 10000;
+    // Number of cache entries claimed by a thread at once.
+    static constexpr int BLOCK_SIZE = 256;
+    // Number of vertices per light path that the cache is initially sized for.
+    static constexpr int INITIAL_VERTICES_PER_PATH = 4;
+
+    struct AppendBuffer {
+        int next, end; ///< Range of entries in the cache that is claimed but not yet filled
+        std::vector<LightPathVertex> overflow;
+
+        AppendBuffer() : next(0), end(0) {}
+    };
+
 public:
-    LightVertices(int path_count)
-        : path_count_(path_count)
+    LightVertices(int path_count, PhotonAccel accel_type = PHOTON_ACCEL_HASH_GRID)
+        : cache_(path_count * INITIAL_VERTICES_PER_PATH), last_(0), count_(0)
+        , path_count_(path_count), accel_type_(accel_type)
     {}
 
-    void compute_cache_size(const Scene& scene, bool use_gpu);
-
     /// Builds the acceleration structure etc to prepare the cache for usage during rendering
-    void build(float radius, bool use_merging) {
-        count_ = std::min<int>(cache_.size(), last_.load());
-        if (use_merging) {
-            accel_.build(cache_.begin(), cache_.begin() + count_, radius);
-        }
-    }
+    void build(float radius, bool use_merging);
 
     inline void add_vertex_to_cache(const LightPathVertex& v) {
-        int i = last_++;
-        if (i >= cache_.size()) {
-            std::cout << "A vertex did not fit into the cache!" << std::endl;
-            return; // Discard vertices that do not fit. This is very unlikely to happen.
+        auto& buf = buffers_.local();
+        if (buf.next == buf.end && !claim_block(buf)) {
+            buf.overflow.push_back(v);
+            return;
         }
-        cache_[i] = v;
+        cache_[buf.next++] = v;
     }
 
     inline int count() const {
@@ -88,38 +128,93 @@ public:
     }
 
     /// Returns a random vertex that can be used to connect to (BPT)
-    inline const LightPathVertex& get_connect(RNG& rng) const {
-        return cache_[rng.random_int(0, count_)];
+    inline const LightPathVertex& get_connect(Sampler& rng) const {
+        return cache_[sample_connect(rng)];
+    }
+
+    /// Returns the index of a random vertex that can be used to connect to (BPT), see vertex().
+    /// Sorting a batch of such indices before reading the vertices makes the accesses to the cache ascending.
+    inline int sample_connect(Sampler& rng) const {
+        return rng.random_int(0, count_);
+    }
+
+    inline const LightPathVertex& vertex(int i) const {
+        return cache_[i];
     }
 
     /// Fills the given container with all photons within the radius around the given point.
     /// \returns The number of photons found
     template <typename Container>
     inline int get_merge(const float3& pos, Container& out, int k) const {
+        if (accel_type_ == PHOTON_ACCEL_KD_TREE)
+            return kdtree_.query(pos, out, k);
         return accel_.query(pos, out, k);
     }
 
+    /// Calls f(photon, squared distance) for all photons within the radius around the given point.
+    template <typename F>
+    inline void for_each_merge(const float3& pos, F f) const {
+        if (accel_type_ == PHOTON_ACCEL_KD_TREE)
+            kdtree_.for_each_in_radius(pos, f);
+        else
+            accel_.for_each_in_radius(pos, f);
+    }
+
+    /// Adds the memory used by the cache and by the acceleration structures of the photons to the report.
+    void report_memory(MemoryReport& report) const {
+        size_t overflow = 0;
+        for (auto& buf : buffers_) overflow += vector_bytes(buf.overflow);
+        report.add("light vertex cache", vector_bytes(cache_) + overflow);
+        report.add("photon hash grid cells", accel_.cell_bytes());
+        report.add("photon hash grid photons", accel_.photon_bytes());
+        report.add("photon kd-tree", kdtree_.memory_bytes());
+    }
+
     /// Removes all vertices currently inside the cache
     void clear() {
         last_.store(0);
+        count_ = 0;
+        for (auto& buf : buffers_) {
+            buf.next = buf.end = 0;
+            buf.overflow.clear();
+        }
     }
 
 private:
     /// Stores all light vertices, without any path structure
     std::vector<LightPathVertex> cache_;
 
-    /// Index of the last free element in the vertex cache
+    /// Index of the first entry in the cache that has not been claimed by any thread
     std::atomic<int> last_;
 
-    /// Number of light vertices currently in the cache,
-    /// separated from last_ because overflow is ignored
+    /// Number of light vertices currently in the cache, only valid after build()
     int count_;
 
+    /// Blocks claimed by each thread, and the vertices that did not fit into the cache
+    tbb::enumerable_thread_specific<AppendBuffer> buffers_;
+
     /// Acceleration structure for photon range queries
     HashGrid<PhotonIterator, VCMPhoton> accel_;
+    KdTree<PhotonIterator, VCMPhoton> kdtree_;
 
     /// Number of light paths that will be traced and stored in this cache
     int path_count_;
+
+    /// Which acceleration structure is used for the photon range queries
+    PhotonAccel accel_type_;
+
+    /// Claims the next block of entries in the cache. Returns false if the cache is full.
+    bool claim_block(AppendBuffer& buf) {
+        const int size = cache_.size();
+        if (last_.load(std::memory_order_relaxed) >= size) return false;
+
+        const int begin = last_.fetch_add(BLOCK_SIZE);
+        if (begin >= size) return false;
+
+        buf.next = begin;
+        buf.end  = std::min(begin + BLOCK_SIZE, size);
+        return true;
+    }
 };
 
 } // namespace imba
@@ -8,6 +8,7 @@
 
 #include <cfloat>
 #include <cassert>
+#include <algorithm>
 
 namespace imba {
 
@@ -16,15 +17,21 @@ static ThreadLocalMemArena bsdf_memory_arenas;
 
 void PathTracer::compute_direct_illum(const Intersection& isect, PTState& state, RayQueue<ShadowState>& ray_out_shadow, BSDF* bsdf) {
     // Generate the shadow ray (sample one point on one lightsource)
-    const auto& ls = scene_.light(state.rng.random_int(0, scene_.light_count()));
-    const float pdf_lightpick = 1.0f / scene_.light_count();
+    float pdf_lightpick;
+    const auto& ls = scene_.light(scene_.sample_light(state.rng.random_float(), pdf_lightpick));
     const auto sample = ls->sample_direct(isect.pos, state.rng);
 
     const auto bsdf_value = bsdf->eval(isect.out_dir, sample.dir, BSDF_ALL);
-
     const float pdf_hit = bsdf->pdf(isect.out_dir, sample.dir);
+
+    add_direct_illum(isect, state, ray_out_shadow, sample, pdf_lightpick, ls->is_delta(), bsdf_value, pdf_hit);
+}
+
+void PathTracer::add_direct_illum(const Intersection& isect, const PTState& state, RayQueue<ShadowState>& ray_out_shadow,
+                                  const Light::DirectIllumSample& sample, float pdf_lightpick, bool is_delta,
+                                  const rgb& bsdf_value, float pdf_hit) {
     const float pdf_di  = pdf_lightpick * sample.pdf_direct_w;
-    const float mis_weight = ls->is_delta() ? 1.0f : pdf_di / (pdf_di + pdf_hit);
+    const float mis_weight = is_delta ? 1.0f : pdf_di / (pdf_di + pdf_hit);
 
     if (pdf_hit == 0.0f || pdf_di == 0.0f)
         return;
@@ -43,19 +50,26 @@ void PathTracer::compute_direct_illum(const Intersection& isect, PTState& state,
     ray_out_shadow.push(ray, s);
 }
 
-void PathTracer::bounce(const Intersection& isect, PTState& state_out, Ray& ray_out, BSDF* bsdf, float offset) {
+bool PathTracer::continue_path(PTState& state_out, float& rr_pdf) {
     // Terminate the path if it is too long or with russian roulette.
     if (state_out.bounces + 1 >= max_path_len_) {// Path length includes the vertices on the camera and the light.
         terminate_path(state_out);
-        return;
+        return false;
     }
 
-    float rr_pdf;
     if (!russian_roulette(state_out.throughput, state_out.rng.random_float(), rr_pdf)) {
         terminate_path(state_out);
-        return;
+        return false;
     }
 
+    return true;
+}
+
+void PathTracer::bounce(const Intersection& isect, PTState& state_out, Ray& ray_out, BSDF* bsdf, float offset) {
+    float rr_pdf;
+    if (!continue_path(state_out, rr_pdf))
+        return;
+
     float pdf;
     float3 sample_dir;
     BxDFFlags sampled_flags;
@@ -66,12 +80,18 @@ void PathTracer::bounce(const Intersection& isect, PTState& state_out, Ray& ray_
         return;
     }
 
+    scatter(isect, state_out, ray_out, sample_dir, bsdf_value, pdf, rr_pdf, sampled_flags & BSDF_SPECULAR, offset);
+}
+
+void PathTracer::scatter(const Intersection& isect, PTState& state_out, Ray& ray_out, const float3& sample_dir,
+                         const rgb& bsdf_value, float pdf, float rr_pdf, bool specular, float offset) {
     const float cos_term = fabsf(dot(isect.normal, sample_dir));
 
     state_out.throughput *= bsdf_value * cos_term / (pdf * rr_pdf);
     state_out.bounces++;
-    state_out.last_specular = sampled_flags & BSDF_SPECULAR;
+    state_out.last_specular = specular;
     state_out.last_pdf = pdf;
+    state_out.cone.scatter(state_out.last_specular, pdf);
 
     ray_out = Ray {
         { isect.pos.x, isect.pos.y, isect.pos.z, offset },
@@ -79,21 +99,87 @@ void PathTracer::bounce(const Intersection& isect, PTState& state_out, Ray& ray_
     };
 }
 
-void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, AtomicImage& res_img) {
+void PathTracer::process_diffuse_hits(const Intersection* isects, const int* ids, int count,
+                                      RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow) {
+    constexpr int N = BSDF_BATCH_SIZE;
+
+    // The unused lanes repeat the last hit, so that the kernels always work on valid data.
+    rgb colors[N];
+    for (int k = 0; k < count; ++k)
+        colors[k] = static_cast<const DiffuseMaterial*>(isects[k].mat)->color(isects[k]);
+
+    DiffuseBSDFBatch batch;
+    for (int k = 0; k < N; ++k) {
+        const int j = std::min(k, count - 1);
+        batch.set(k, isects[j], colors[j]);
+    }
+
+    // Sample one light per hit, and evaluate the BSDFs for all of them at once.
+    Light::DirectIllumSample light_samples[N];
+    float pdf_lightpicks[N];
+    bool is_delta[N];
+    float dir_x[N], dir_y[N], dir_z[N];
+    for (int k = 0; k < N; ++k) {
+        if (k < count) {
+            PTState& state = ray_in.state(ids[k]);
+            const auto& ls = scene_.light(scene_.sample_light(state.rng.random_float(), pdf_lightpicks[k]));
+            light_samples[k] = ls->sample_direct(isects[k].pos, state.rng);
+            is_delta[k] = ls->is_delta();
+        } else
+            light_samples[k] = light_samples[count - 1];
+
+        dir_x[k] = light_samples[k].dir.x;
+        dir_y[k] = light_samples[k].dir.y;
+        dir_z[k] = light_samples[k].dir.z;
+    }
+
+    float r[N], g[N], b[N], pdf[N];
+    batch.eval(dir_x, dir_y, dir_z, r, g, b, pdf);
+
+    for (int k = 0; k < count; ++k) {
+        add_direct_illum(isects[k], ray_in.state(ids[k]), ray_out_shadow, light_samples[k],
+                         pdf_lightpicks[k], is_delta[k], rgb(r[k], g[k], b[k]), pdf[k]);
+    }
+
+    // Sample the continuation of the paths that survive russian roulette, for all of them at once.
+    float rr_pdfs[N], u1[N], u2[N];
+    bool alive[N];
+    for (int k = 0; k < N; ++k) {
+        alive[k] = k < count && continue_path(ray_in.state(ids[k]), rr_pdfs[k]);
+        u1[k] = alive[k] ? ray_in.state(ids[k]).rng.random_float() : 0.5f;
+        u2[k] = alive[k] ? ray_in.state(ids[k]).rng.random_float() : 0.5f;
+    }
+
+    batch.sample(u1, u2, dir_x, dir_y, dir_z, r, g, b, pdf);
+
+    for (int k = 0; k < count; ++k) {
+        if (!alive[k])
+            continue;
+
+        PTState& state = ray_in.state(ids[k]);
+        const rgb bsdf_value(r[k], g[k], b[k]);
+        if (pdf[k] == 0.0f || is_black(bsdf_value)) {
+            terminate_path(state);
+            continue;
+        }
+
+        const float offset = 1e-3f * ray_in.hit(ids[k]).tmax;
+        scatter(isects[k], state, ray_in.ray(ids[k]), float3(dir_x[k], dir_y[k], dir_z[k]),
+                bsdf_value, pdf[k], rr_pdfs[k], false, offset);
+    }
+}
+
+void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, ContributionBuffer& res_img) {
     // Compact and sort the input hits.
     int hit_count = ray_in.compact_hits();
     ray_in.sort_by_material([this](const Hit& hit){
-            const Mesh::Instance& inst = scene_.instance(hit.inst_id);
-            const Mesh& mesh = scene_.mesh(inst.id);
-            const int local_tri_id = scene_.local_tri_id(hit.tri_id, inst.id);
-            const int m = mesh.indices()[local_tri_id * 4 + 3];
-            return m;
+            return scene_.hit_material(hit);
         },
         scene_.material_count(), hit_count);
 
     // Process all rays that hit nothing, if there is an environment map.
     if (scene_.env_map() != nullptr) {
-        tbb::parallel_for(tbb::blocked_range<int>(hit_count, ray_in.size()),
+        ray_in.for_each_range(hit_count, ray_in.size(),
             [&] (const tbb::blocked_range<int>& range)
         {
             for (auto i = range.begin(); i != range.end(); ++i) {
@@ -104,8 +190,7 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
                 float pdf_direct_w, pdf_emit_w;
                 const auto li = scene_.env_map()->radiance(out_dir, pdf_direct_w, pdf_emit_w);
 
-                const float pdf_lightpick = 1.0f / scene_.light_count();
-                const float pdf_di  = pdf_direct_w * pdf_lightpick;
+                const float pdf_di  = pdf_direct_w * scene_.env_light_pdf();
                 const float pdf_hit = state.last_pdf;
                 const float mis_weight = (state.bounces == 0 || state.last_specular) ? 1.0f
                                          : (pdf_hit / (pdf_hit + pdf_di));
@@ -119,22 +204,31 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
     ray_in.shrink(hit_count);
 
     // Process all hits, creating continuation and shadow rays.
-    tbb::parallel_for(tbb::blocked_range<int>(0, ray_in.size()),
+    ray_in.for_each_range(0, ray_in.size(),
         [&] (const tbb::blocked_range<int>& range)
     {
         auto& bsdf_mem_arena = bsdf_memory_arenas.local();
 
+        // Hits on diffuse materials are gathered, and processed in batches by process_diffuse_hits.
+        // Since the hits are sorted by material, the batches are often made of a single material.
+        Intersection batch_isects[BSDF_BATCH_SIZE];
+        int batch_ids[BSDF_BATCH_SIZE];
+        int batch_count = 0;
+
         for (auto i = range.begin(); i != range.end(); ++i) {
-            bsdf_mem_arena.free_all();
             PTState& state = ray_in.state(i);
-            const auto isect = calculate_intersection(scene_, ray_in.hit(i), ray_in.ray(i));
+            state.cone.propagate(ray_in.hit(i).tmax);
+            const auto isect = calculate_intersection(scene_, ray_in.hit(i), ray_in.ray(i), state.cone.width);
             const float offset = 1e-3f * ray_in.hit(i).tmax;
 
+            if (state.bounces == 0)
+                add_first_hit(state, isect, ray_in.hit(i));
+
             if (auto emit = isect.mat->emitter()) {
                 float pdf_direct_a, pdf_emit_w;
                 const auto li = emit->radiance(isect.out_dir, isect.geom_normal, pdf_direct_a, pdf_emit_w);
 
-                float pdf_di = pdf_direct_a / scene_.light_count();
+                float pdf_di = pdf_direct_a * scene_.triangle_light_pdf(*emit, world_triangle_area(scene_, ray_in.hit(i)));
 
                 // convert pdf from area measure to solid angle measure
                 const float d_sqr = ray_in.hit(i).tmax * ray_in.hit(i).tmax;
@@ -150,10 +244,24 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
                 continue;
             }
 
+            if (isect.mat->is_diffuse()) {
+                batch_isects[batch_count] = isect;
+                batch_ids[batch_count++] = i;
+                if (batch_count == BSDF_BATCH_SIZE) {
+                    process_diffuse_hits(batch_isects, batch_ids, batch_count, ray_in, ray_out_shadow);
+                    batch_count = 0;
+                }
+                continue;
+            }
+
+            bsdf_mem_arena.free_all();
             const auto bsdf = isect.mat->get_bsdf(isect, bsdf_mem_arena);
             compute_direct_illum(isect, state, ray_out_shadow, bsdf);
             bounce(isect, state, ray_in.ray(i), bsdf, offset);
         }
+
+        if (batch_count > 0)
+            process_diffuse_hits(batch_isects, batch_ids, batch_count, ray_in, ray_out_shadow);
     });
 
     ray_in.compact_rays();
@@ -161,19 +269,29 @@ void PathTracer::process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<Shadow
 
 void PathTracer::render(AtomicImage& out) {
     scheduler_.run_iteration(out,
-        [this] (RayQueue<ShadowState>& ray_in, AtomicImage& out) { process_shadow_rays(ray_in, out); },
-        [this] (RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, AtomicImage& out) {
+        [this] (RayQueue<ShadowState>& ray_in, ContributionBuffer& out) { process_shadow_rays(ray_in, out); },
+        [this] (RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, ContributionBuffer& out) {
             process_primary_rays(ray_in, ray_out_shadow, out);
         },
-        [this] (int x, int y, ::Ray& ray_out, PTState& state_out) {
-            const float sample_x = static_cast<float>(x) + state_out.rng.random_float();
-            const float sample_y = static_cast<float>(y) + state_out.rng.random_float();
+        [this] (int count, const int* xs, const int* ys, ::Ray* rays_out, PTState* states_out) {
+            assert(count <= RayGen<PTState>::BATCH_SIZE);
+            float sample_x[RayGen<PTState>::BATCH_SIZE] = {};
+            float sample_y[RayGen<PTState>::BATCH_SIZE] = {};
+            for (int i = 0; i < count; ++i) {
+                sample_x[i] = static_cast<float>(xs[i]) + states_out[i].rng.random_float();
+                sample_y[i] = static_cast<float>(ys[i]) + states_out[i].rng.random_float();
+            }
 
-            ray_out = cam_.generate_ray(sample_x, sample_y);
+            cam_.generate_rays(count, sample_x, sample_y, rays_out);
 
-            state_out.throughput = rgb(1.0f);
-            state_out.bounces = 0;
-            state_out.last_specular = false;
+            const RayCone cone = cam_.pixel_cone();
+            for (int i = 0; i < count; ++i) {
+                PTState& state_out = states_out[i];
+                state_out.throughput = rgb(1.0f);
+                state_out.cone = cone;
+                state_out.bounces = 0;
+                state_out.last_specular = false;
+            }
         });
 }
 
@@ -19,21 +19,52 @@ class PathTracer : public Integrator {
 public:
     PathTracer(Scene& scene, PerspectiveCamera& cam, RayScheduler<PTState, ShadowState>& scheduler, int max_path_len)
         : Integrator(scene, cam)
+        , camera_(cam)
         , scheduler_(scheduler)
         , max_path_len_(max_path_len)
     {}
 
     virtual void render(AtomicImage& out) override;
 
+    virtual void reset() override { scheduler_.reset(); }
+
+    virtual bool set_spp(int spp) override { return scheduler_.set_spp(spp); }
+    virtual bool set_max_path_len(int len) override { max_path_len_ = len; return true; }
+    virtual bool set_resolution(int w, int h) override {
+        if (!scheduler_.set_resolution(w, h)) return false;
+        camera_.resize(w, h);
+        return true;
+    }
+
+    virtual void report_memory(MemoryReport& report) const override {
+        Integrator::report_memory(report);
+        scheduler_.report_memory(report, "camera ray");
+    }
+
 private:
+    PerspectiveCamera& camera_;     ///< Same as cam_, resized along with the image
     RayScheduler<PTState, ShadowState>& scheduler_;
 
-    const int max_path_len_;
+    int max_path_len_;
 
-    void process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, AtomicImage& out);
+    void process_primary_rays(RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow, ContributionBuffer& out);
 
     void compute_direct_illum(const Intersection& isect, PTState& state, RayQueue<ShadowState>& ray_out_shadow, BSDF* bsdf);
     void bounce(const Intersection& isect, PTState& state_out, Ray& ray_out, BSDF* bsdf, float offset);
+
+    /// Computes the direct illumination and the continuation of up to BSDF_BATCH_SIZE hits on diffuse materials,
+    /// with the batched BSDF kernels. The ids are the indices of the hits in the queue.
+    void process_diffuse_hits(const Intersection* isects, const int* ids, int count,
+                              RayQueue<PTState>& ray_in, RayQueue<ShadowState>& ray_out_shadow);
+
+    void add_direct_illum(const Intersection& isect, const PTState& state, RayQueue<ShadowState>& ray_out_shadow,
+                          const Light::DirectIllumSample& sample, float pdf_lightpick, bool is_delta,
+                          const rgb& bsdf_value, float pdf_hit);
+
+    /// Applies the maximum path length and russian roulette. Terminates the path and returns false if it stops here.
+    bool continue_path(PTState& state_out, float& rr_pdf);
+    void scatter(const Intersection& isect, PTState& state_out, Ray& ray_out, const float3& sample_dir,
+                 const rgb& bsdf_value, float pdf, float rr_pdf, bool specular, float offset);
 };
 
 } // namespace imba
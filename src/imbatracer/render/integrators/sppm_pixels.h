@@ -0,0 +1,134 @@
+#ifndef IMBA_SPPM_PIXELS_H
+#define IMBA_SPPM_PIXELS_H
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/core/common.h"
+#include "imbatracer/core/memory_report.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace imba {
+
+/// Statistics of Stochastic Progressive Photon Mapping, see Hachisuka and Jensen, "Stochastic Progressive Photon
+/// Mapping". Every pixel has its own radius, which shrinks with the number of photons gathered by the pixel: the
+/// bright regions converge quickly, while the dark ones keep a large radius instead of getting noisy.
+/// The camera paths add the photons they gather during an iteration with add(), then end_iteration() updates the
+/// radii and writes the new estimates to the image.
+class SPPMPixels {
+public:
+    SPPMPixels() : max_radius_(0.0f), iterations_(0), emitted_(0) {}
+
+    SPPMPixels(const SPPMPixels&) = delete;
+    SPPMPixels& operator= (const SPPMPixels&) = delete;
+
+    /// Discards the statistics of all pixels, the next iteration starts them with the given radius.
+    void reset(int pixel_count, float radius) {
+        if (pixels_.size() != size_t(pixel_count)) {
+            std::vector<Pixel>(pixel_count).swap(pixels_);
+            std::vector<Gather>(pixel_count).swap(gathers_);
+        }
+
+        tbb::parallel_for(0, pixel_count, [&] (int i) {
+            pixels_[i] = Pixel{ radius, 0.0f, rgb(0.0f), rgb(0.0f) };
+            gathers_[i].photons = 0.0f;
+            gathers_[i].flux = rgb(0.0f);
+        });
+
+        max_radius_ = radius;
+        iterations_ = 0;
+        emitted_ = 0;
+    }
+
+    bool empty() const { return pixels_.empty(); }
+
+    float radius(int pixel_id) const { return pixels_[pixel_id].radius; }
+
+    /// Largest radius of all pixels, with which the photons have to be searched.
+    float max_radius() const { return max_radius_; }
+
+    /// Adds the photons gathered by a camera path of the pixel, the flux includes the throughput of the path.
+    /// Can be called by several threads at once.
+    void add(int pixel_id, float photons, const rgb& flux) {
+        Gather& g = gathers_[pixel_id];
+        float old = g.photons.load(std::memory_order_relaxed);
+        while (!g.photons.compare_exchange_weak(old, old + photons, std::memory_order_relaxed)) ;
+        g.flux.apply<std::plus<float>>(flux);
+    }
+
+    /// Ends an iteration that traced the given number of light paths and samples per pixel: shrinks the radii of the
+    /// pixels that gathered photons, and adds the change of the estimates to the image, which accumulates the samples
+    /// of all the iterations.
+    void end_iteration(AtomicImage& img, int light_path_count, int spp, float alpha) {
+        iterations_++;
+        emitted_ += light_path_count;
+
+        const float inv_spp = 1.0f / spp;
+        const float samples = float(iterations_) * spp;
+        const float inv_emitted = 1.0f / float(emitted_);
+
+        max_radius_ = tbb::parallel_reduce(tbb::blocked_range<int>(0, pixels_.size()), 0.0f,
+            [&] (const tbb::blocked_range<int>& range, float max_radius) {
+                for (int i = range.begin(); i != range.end(); ++i) {
+                    Pixel& p = pixels_[i];
+                    Gather& g = gathers_[i];
+
+                    // The camera samples of the pixel are averaged.
+                    const float m = g.photons.load(std::memory_order_relaxed) * inv_spp;
+                    if (m > 0.0f) {
+                        const float n = p.photons + alpha * m;
+                        const float radius = p.radius * std::sqrt(n / (p.photons + m));
+                        p.flux = (p.flux + rgb(g.flux) * inv_spp) * sqr(radius / p.radius);
+                        p.photons = n;
+                        p.radius = std::max(radius, 1e-7f); // ensure numerical stability
+
+                        g.photons.store(0.0f, std::memory_order_relaxed);
+                        g.flux = rgb(0.0f);
+                    }
+
+                    // The image contains the sum of the samples, so the estimate is scaled by their number.
+                    const rgb value = p.flux * (samples * inv_emitted / (pi * sqr(p.radius)));
+                    img.pixels()[i].apply<std::plus<float>>(value - p.written);
+                    p.written = value;
+
+                    max_radius = std::max(max_radius, p.radius);
+                }
+                return max_radius;
+            },
+            [] (float a, float b) { return std::max(a, b); });
+    }
+
+    size_t memory_bytes() const { return vector_bytes(pixels_) + vector_bytes(gathers_); }
+
+private:
+    struct Pixel {
+        float radius;
+        float photons;  ///< Accumulated number of photons, N in the paper
+        rgb flux;       ///< Accumulated flux within the radius, tau in the paper
+        rgb written;    ///< Value added to the image so far
+    };
+
+    /// Photons gathered by the camera paths during the current iteration, M and Phi in the paper.
+    struct Gather {
+        std::atomic<float> photons;
+        atomic_rgb flux;
+    };
+
+    std::vector<Pixel> pixels_;
+    std::vector<Gather> gathers_;
+
+    float max_radius_;
+    int iterations_;
+    int64_t emitted_;   ///< Number of light paths traced since the last reset
+};
+
+} // namespace imba
+
+#endif // IMBA_SPPM_PIXELS_H
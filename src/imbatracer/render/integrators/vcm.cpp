@@ -2,7 +2,9 @@
 #include "imbatracer/core/rgb.h"
 #include "imbatracer/core/common.h"
 #include "imbatracer/render/random.h"
+#include "imbatracer/render/scheduling/event_tracer.h"
 
+#include <algorithm>
 #include <cfloat>
 #include <cassert>
 #include <cmath>
@@ -17,121 +19,215 @@ using ThreadLocalMemArena =
         tbb::ets_key_per_instance>;
 static ThreadLocalMemArena bsdf_memory_arenas;
 
+// Number of light vertices that are chosen and sorted at once by connect().
+static constexpr int CONNECT_BATCH_SIZE = 32;
+
+NoMISWeight VCMMISWeights<true, false>::dVM;
+NoMISWeight VCMMISWeights<false, false>::dVC;
+NoMISWeight VCMMISWeights<false, false>::dVCM;
+NoMISWeight VCMMISWeights<false, false>::dVM;
+
 // Reduce ugliness from the template parameters.
 #define VCM_TEMPLATE template <VCMSubAlgorithm algo>
 
 #define VCM_INTEGRATOR VCMIntegrator<algo>
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::render(AtomicImage& img) {
+void VCM_INTEGRATOR::start_iteration(Iteration& it) {
     // TODO: add command line option for this!
     const float radius_alpha = 0.75f;
 
-    int frame = cur_iteration_;
-    light_path_dbg_.start_frame(frame, settings_.width * settings_.height, settings_.concurrent_spp);
-    techniques_dbg_.start_frame(settings_.width, settings_.height, settings_.concurrent_spp);
-
-    light_vertices_.clear();
+    it.light_vertices.clear();
 
     // Shrink the photon mapping radius for the next iteration. Every frame is an iteration of Progressive Photon Mapping.
     cur_iteration_++;
-    pm_radius_ = base_radius_ / powf(static_cast<float>(cur_iteration_), 0.5f * (1.0f - radius_alpha));
-    pm_radius_ = std::max(pm_radius_, 1e-7f); // ensure numerical stability
+    if (algo == ALGO_SPPM) {
+        // Every pixel shrinks its own radius, the photons are searched with the largest one.
+        if (sppm_pixels_.empty())
+            sppm_pixels_.reset(settings_.width * settings_.height, base_radius_);
+        it.radius = sppm_pixels_.max_radius();
+    } else {
+        it.radius = base_radius_ / powf(static_cast<float>(cur_iteration_), 0.5f * (1.0f - radius_alpha));
+        it.radius = std::max(it.radius, 1e-7f); // ensure numerical stability
+    }
+    it.light_path_count = light_path_count_;
 
     // Compute the partial MIS weights for vetex connection and vertex merging.
     // See technical report "Implementing Vertex Connection and Merging".
-    const float eta_vcm = pi * sqr(pm_radius_) * settings_.light_path_count;
-    mis_eta_vc_ = mis_pow(1.0f / eta_vcm);
-    mis_eta_vm_ = algo == ALGO_BPT ? 0.0f : mis_pow(eta_vcm);
+    const float eta_vcm = pi * sqr(it.radius) * it.light_path_count;
+    it.mis_eta_vc = mis_pow(1.0f / eta_vcm);
+    it.mis_eta_vm = algo == ALGO_BPT ? 0.0f : mis_pow(eta_vcm);
+}
+
+VCM_TEMPLATE
+void VCM_INTEGRATOR::discard_next_iteration() {
+    if (!next_traced_) return;
+
+    light_scheduler_.discard();
+    next_traced_ = false;
+    // The radius of the discarded iteration is computed again.
+    if (cur_iteration_ > 0) cur_iteration_--;
+}
+
+VCM_TEMPLATE
+void VCM_INTEGRATOR::render(AtomicImage& img) {
+    int frame = cur_iteration_;
+    light_path_dbg_.start_frame(frame, settings_.width * settings_.height, settings_.concurrent_spp);
+    techniques_dbg_.start_frame(settings_.width, settings_.height, settings_.concurrent_spp);
+
+    Iteration& cur = *iterations_[cur_];
+    if (!next_traced_) {
+        start_iteration(cur);
+        if (algo != ALGO_PT) {
+            EventTracer::Span span("light_paths");
+            trace_light_paths(cur, img);
+        }
+    }
+    next_traced_ = false;
+    light_scheduler_.flush(img);
+
+    // The light paths of the next iteration are traced by a thread of their own, on the threads of the light
+    // scheduler, while the camera paths use the threads of the main scheduler: the cores that one of the passes leaves
+    // idle, e.g. at the end of the light paths or while the photons are sorted into the grid, are used by the other one.
+    // Both passes are done when render() returns, so that the camera and the settings can be changed between frames.
+    // The debugging tools record the vertices and the contributions per frame, so they disable the pipelining.
+    // Both schedulers have their own GPU stream, and the runtime must not be called by two threads at once, so the
+    // pipelining requires CPU traversal.
+    const bool pipelined = settings_.pipeline_light_paths && algo != ALGO_PT && algo != ALGO_LT &&
+                           settings_.traversal_platform == UserSettings::cpu &&
+                           !LIGHT_PATH_DEBUG && !TECHNIQUES_DEBUG;
+    std::future<void> next_light_paths;
+    if (pipelined) {
+        Iteration& next = *iterations_[1 - cur_];
+        start_iteration(next);
+        next_light_paths = std::async(std::launch::async, [this, &next, &img] {
+            EventTracer::Span span("light_paths");
+            trace_light_paths(next, img);
+        });
+    }
+
+    if (algo != ALGO_LT) {
+        EventTracer::Span span("camera_paths");
+        trace_camera_paths(cur, img);
+    }
 
-    if (algo != ALGO_PT)
-        trace_light_paths(img);
+    // The photons gathered by the camera paths shrink the radii of their pixels.
+    if (algo == ALGO_SPPM) {
+        EventTracer::Span span("sppm_update");
+        sppm_pixels_.end_iteration(img, cur.light_path_count, settings_.concurrent_spp, settings_.sppm_alpha);
+    }
 
-    if (algo != ALGO_LT)
-        trace_camera_paths(img);
+    if (pipelined) {
+        next_light_paths.get();
+        next_traced_ = true;
+        cur_ = 1 - cur_;
+    }
 
     light_path_dbg_.end_frame(frame);
     techniques_dbg_.end_frame(frame);
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::trace_light_paths(AtomicImage& img) {
+void VCM_INTEGRATOR::trace_light_paths(Iteration& it, AtomicImage& img) {
     light_scheduler_.run_iteration(img,
-        [this] (RayQueue<VCMShadowState>& ray_in, AtomicImage& out) { process_shadow_rays_dbg(ray_in, out); },
-        [this] (RayQueue<VCMState>& ray_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& out) {
-            process_light_rays(ray_in, ray_out_shadow, out);
+        [this] (RayQueue<VCMShadowState>& ray_in, ContributionBuffer& out) { process_shadow_rays_dbg(ray_in, out); },
+        [this, &it] (RayQueue<State>& ray_in, RayQueue<VCMShadowState>& ray_out_shadow, ContributionBuffer& out) {
+            process_light_rays(it, ray_in, ray_out_shadow, out);
         },
-        [this] (int ray_id, int light_id, ::Ray& ray_out, VCMState& state_out) {
-            auto& l = scene_.light(light_id);
+        [this, &it] (int count, const int*, const int* light_ids, ::Ray* rays_out, State* states_out) {
+            for (int i = 0; i < count; ++i) {
+                const int light_id = light_ids[i];
+                ::Ray& ray_out = rays_out[i];
+                State& state_out = states_out[i];
 
-            // TODO: this pdf depends on the LightTileGen used!
-            float pdf_lightpick = 1.0f / scene_.light_count();
+                auto& l = scene_.light(light_id);
 
-            Light::EmitSample sample = l->sample_emit(state_out.rng);
-            ray_out.org.x = sample.pos.x;
-            ray_out.org.y = sample.pos.y;
-            ray_out.org.z = sample.pos.z;
-            ray_out.org.w = 1e-3f;
+                // The light paths are distributed uniformly among the lights (see UniformLightTileGen),
+                // whereas direct illumination selects the lights proportionally to their power.
+                const float pdf_lightpick = 1.0f / scene_.light_count();
 
-            ray_out.dir.x = sample.dir.x;
-            ray_out.dir.y = sample.dir.y;
-            ray_out.dir.z = sample.dir.z;
-            ray_out.dir.w = FLT_MAX;
+                Light::EmitSample sample = l->sample_emit(state_out.rng);
+                ray_out.org.x = sample.pos.x;
+                ray_out.org.y = sample.pos.y;
+                ray_out.org.z = sample.pos.z;
+                ray_out.org.w = 1e-3f;
 
-            state_out.throughput = sample.radiance / pdf_lightpick;
-            state_out.path_length = 1;
+                ray_out.dir.x = sample.dir.x;
+                ray_out.dir.y = sample.dir.y;
+                ray_out.dir.z = sample.dir.z;
+                ray_out.dir.w = FLT_MAX;
 
-            state_out.dVCM = mis_pow(sample.pdf_direct_a / sample.pdf_emit_w); // pdf_lightpick cancels out
+                state_out.throughput = sample.radiance / pdf_lightpick;
+                state_out.path_length = 1;
 
-            if (l->is_delta())
-                state_out.dVC = 0.0f;
-            else
-                state_out.dVC = mis_pow(sample.cos_out / (sample.pdf_emit_w * pdf_lightpick));
+                if (VCMTraits<algo>::mis) {
+                    state_out.dVCM = mis_pow(sample.pdf_direct_a * scene_.light_pdf(light_id) / (sample.pdf_emit_w * pdf_lightpick));
 
-            state_out.dVM = state_out.dVC * mis_eta_vc_;
+                    if (l->is_delta())
+                        state_out.dVC = 0.0f;
+                    else
+                        state_out.dVC = mis_pow(sample.cos_out / (sample.pdf_emit_w * pdf_lightpick));
+
+                    state_out.dVM = state_out.dVC * it.mis_eta_vc;
+                }
 
-            state_out.finite_light = l->is_finite();
+                state_out.finite_light = l->is_finite();
 
-            light_path_dbg_.add_vertex(sample.pos, sample.dir, state_out);
+                light_path_dbg_.add_vertex(sample.pos, sample.dir, state_out);
+            }
         });
 
-    if (algo != ALGO_LT) // Only build the hash grid when it is used.
-        light_vertices_.build(pm_radius_, algo != ALGO_BPT);
+    if (algo != ALGO_LT) { // Only build the hash grid when it is used.
+        EventTracer::Span span("light_vertices_build");
+        it.light_vertices.build(it.radius, algo != ALGO_BPT);
+    }
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::trace_camera_paths(AtomicImage& img) {
+void VCM_INTEGRATOR::trace_camera_paths(const Iteration& it, AtomicImage& img) {
     scheduler_.run_iteration(img,
-        [this] (RayQueue<VCMShadowState>& ray_in, AtomicImage& out) { process_shadow_rays_dbg(ray_in, out); },
-        [this] (RayQueue<VCMState>& ray_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& out) {
-            process_camera_rays(ray_in, ray_out_shadow, out);
+        [this] (RayQueue<VCMShadowState>& ray_in, ContributionBuffer& out) { process_shadow_rays_dbg(ray_in, out); },
+        [this, &it] (RayQueue<State>& ray_in, RayQueue<VCMShadowState>& ray_out_shadow, ContributionBuffer& out) {
+            process_camera_rays(it, ray_in, ray_out_shadow, out);
         },
-        [this] (int x, int y, ::Ray& ray_out, VCMState& state_out) {
-            // Sample a ray from the camera.
-            const float sample_x = static_cast<float>(x) + state_out.rng.random_float();
-            const float sample_y = static_cast<float>(y) + state_out.rng.random_float();
+        [this, &it] (int count, const int* xs, const int* ys, ::Ray* rays_out, State* states_out) {
+            // Sample the rays from the camera.
+            assert(count <= RayGen<State>::BATCH_SIZE);
+            float sample_x[RayGen<State>::BATCH_SIZE] = {};
+            float sample_y[RayGen<State>::BATCH_SIZE] = {};
+            for (int i = 0; i < count; ++i) {
+                sample_x[i] = static_cast<float>(xs[i]) + states_out[i].rng.random_float();
+                sample_y[i] = static_cast<float>(ys[i]) + states_out[i].rng.random_float();
+            }
 
-            ray_out = cam_.generate_ray(sample_x, sample_y);
+            cam_.generate_rays(count, sample_x, sample_y, rays_out);
 
-            state_out.throughput = rgb(1.0f);
-            state_out.path_length = 1;
+            const RayCone cone = cam_.pixel_cone();
+            for (int i = 0; i < count; ++i) {
+                State& state_out = states_out[i];
+                state_out.throughput = rgb(1.0f);
+                state_out.cone = cone;
+                state_out.path_length = 1;
 
-            const float3 dir(ray_out.dir.x, ray_out.dir.y, ray_out.dir.z);
+                if (VCMTraits<algo>::mis) {
+                    const float3 dir(rays_out[i].dir.x, rays_out[i].dir.y, rays_out[i].dir.z);
 
-            // PDF on image plane is 1. We need to convert this from image plane area to solid angle.
-            const float cos_theta_o = dot(dir, cam_.dir());
-            assert(cos_theta_o > 0.0f);
-            const float pdf_cam_w = sqr(cam_.image_plane_dist() / cos_theta_o) / cos_theta_o;
+                    // PDF on image plane is 1. We need to convert this from image plane area to solid angle.
+                    const float cos_theta_o = dot(dir, cam_.dir());
+                    assert(cos_theta_o > 0.0f);
+                    const float pdf_cam_w = sqr(cam_.image_plane_dist() / cos_theta_o) / cos_theta_o;
 
-            state_out.dVC = 0.0f;
-            state_out.dVM = 0.0f;
-            state_out.dVCM = mis_pow(settings_.light_path_count / pdf_cam_w);
+                    state_out.dVC = 0.0f;
+                    state_out.dVM = 0.0f;
+                    state_out.dVCM = mis_pow(it.light_path_count / pdf_cam_w);
+                }
+            }
         });
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::bounce(VCMState& state_out, const Intersection& isect, BSDF* bsdf, Ray& ray_out, bool adjoint, float offset) {
-    RNG& rng = state_out.rng;
+void VCM_INTEGRATOR::bounce(const Iteration& it, VCMHotState& state_out, MISState& mis_out, const Intersection& isect, BSDF* bsdf, Ray& ray_out, bool adjoint, float offset) {
+    Sampler& rng = state_out.rng;
 
     float rr_pdf;
     if (!russian_roulette(state_out.throughput, rng.random_float(), rr_pdf)) {
@@ -140,7 +236,7 @@ void VCM_INTEGRATOR::bounce(VCMState& state_out, const Intersection& isect, BSDF
     }
 
     BxDFFlags flags = BSDF_ALL;
-    if (algo == ALGO_PPM && !adjoint) // For PPM: only sample specular scattering on the camera path.
+    if (VCMTraits<algo>::photon_mapping && !adjoint) // For (S)PPM: only sample specular scattering on the camera path.
         flags = BxDFFlags(BSDF_SPECULAR | BSDF_REFLECTION | BSDF_TRANSMISSION);
 
     float pdf_dir_w;
@@ -155,30 +251,34 @@ void VCM_INTEGRATOR::bounce(VCMState& state_out, const Intersection& isect, BSDF
         return;
     }
 
-    float pdf_rev_w = pdf_dir_w;
-    if (!is_specular) // The reverse pdf of specular surfaces is the same as the forward pdf due to symmetry.
-        pdf_rev_w = bsdf->pdf(sample_dir, isect.out_dir);
-
     const float cos_theta_i = adjoint ? fabsf(shading_normal_adjoint(isect.normal, isect.geom_normal, isect.out_dir, sample_dir))
                                       : fabsf(dot(sample_dir, isect.normal));
 
-    if (is_specular) {
-        state_out.dVCM = 0.0f;
-        state_out.dVC *= mis_pow(cos_theta_i);
-        state_out.dVM *= mis_pow(cos_theta_i);
-    } else {
-        state_out.dVC = mis_pow(cos_theta_i / pdf_dir_w) *
-                (state_out.dVC * mis_pow(pdf_rev_w) + state_out.dVCM + mis_eta_vm_);
+    if (VCMTraits<algo>::mis) {
+        if (is_specular) {
+            mis_out.dVCM = 0.0f;
+            mis_out.dVC *= mis_pow(cos_theta_i);
+            mis_out.dVM *= mis_pow(cos_theta_i);
+        } else {
+            // Only needed here: the reverse pdf of specular surfaces is the same as the forward pdf due to symmetry.
+            const float pdf_rev_w = bsdf->pdf(sample_dir, isect.out_dir);
 
-        state_out.dVM = mis_pow(cos_theta_i / pdf_dir_w) *
-                (state_out.dVM * mis_pow(pdf_rev_w) + state_out.dVCM * mis_eta_vc_ + 1.0f);
+            mis_out.dVC = mis_pow(cos_theta_i / pdf_dir_w) *
+                    (mis_out.dVC * mis_pow(pdf_rev_w) + mis_out.dVCM + it.mis_eta_vm);
 
-        state_out.dVCM = mis_pow(1.0f / pdf_dir_w);
+            mis_out.dVM = mis_pow(cos_theta_i / pdf_dir_w) *
+                    (mis_out.dVM * mis_pow(pdf_rev_w) + mis_out.dVCM * it.mis_eta_vc + 1.0f);
+
+            mis_out.dVCM = mis_pow(1.0f / pdf_dir_w);
+        }
     }
 
     state_out.throughput *= bsdf_value * cos_theta_i / (rr_pdf * pdf_dir_w);
     state_out.path_length++;
 
+    // Light paths keep an empty cone: their footprint is not related to the pixels.
+    if (!adjoint) state_out.cone.scatter(is_specular, pdf_dir_w);
+
     ray_out = Ray {
         { isect.pos.x, isect.pos.y, isect.pos.z, offset },
         { sample_dir.x, sample_dir.y, sample_dir.z, FLT_MAX }
@@ -190,18 +290,10 @@ void VCM_INTEGRATOR::bounce(VCMState& state_out, const Intersection& isect, BSDF
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& img) {
-    VCMState* states = rays_in.states();
-    const Hit* hits = rays_in.hits();
-    Ray* rays = rays_in.rays();
-
+void VCM_INTEGRATOR::process_light_rays(Iteration& it, RayQueue<State>& rays_in, RayQueue<VCMShadowState>& ray_out_shadow, ContributionBuffer& img) {
     const int hit_count = rays_in.compact_hits();
     rays_in.sort_by_material([this](const Hit& hit){
-            const Mesh::Instance& inst = scene_.instance(hit.inst_id);
-            const Mesh& mesh = scene_.mesh(inst.id);
-            const int local_tri_id = scene_.local_tri_id(hit.tri_id, inst.id);
-            const int m = mesh.indices()[local_tri_id * 4 + 3];
-            return m;
+            return scene_.hit_material(hit);
         },
         scene_.material_count(), hit_count
     );
@@ -209,13 +301,14 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
     // During light tracing, we ignore rays that do not intersect anything (no point in considering the environment map here)
     rays_in.shrink(hit_count);
 
-    tbb::parallel_for(tbb::blocked_range<int>(0, rays_in.size()), [&] (const tbb::blocked_range<int>& range) {
+    rays_in.for_each_range(0, rays_in.size(), [&] (const tbb::blocked_range<int>& range) {
         auto& bsdf_mem_arena = bsdf_memory_arenas.local();
 
         for (auto i = range.begin(); i != range.end(); ++i) {
             bsdf_mem_arena.free_all();
 
-            VCMState& state = rays_in.state(i);
+            VCMHotState& state = rays_in.state(i);
+            MISState& mis = rays_in.cold_state(i);
             const auto isect = calculate_intersection(scene_, rays_in.hit(i), rays_in.ray(i));
             const float cos_theta_o = fabsf(dot(isect.out_dir, isect.normal));
 
@@ -225,32 +318,34 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
             }
 
             // Complete calculation of the partial weights.
-            if (state.path_length > 1 || state.finite_light)
-                state.dVCM *= mis_pow(sqr(rays_in.hit(i).tmax));
+            if (VCMTraits<algo>::mis) {
+                if (state.path_length > 1 || state.finite_light)
+                    mis.dVCM *= mis_pow(sqr(rays_in.hit(i).tmax));
 
-            state.dVCM *= 1.0f / mis_pow(cos_theta_o);
-            state.dVC  *= 1.0f / mis_pow(cos_theta_o);
-            state.dVM  *= 1.0f / mis_pow(cos_theta_o);
+                mis.dVCM *= 1.0f / mis_pow(cos_theta_o);
+                mis.dVC  *= 1.0f / mis_pow(cos_theta_o);
+                mis.dVM  *= 1.0f / mis_pow(cos_theta_o);
+            }
 
             auto bsdf = isect.mat->get_bsdf(isect, bsdf_mem_arena, true);
 
             if (!isect.mat->is_specular()){ // Do not store vertices on materials described by a delta distribution.
                 if (algo != ALGO_LT) {
-                    light_vertices_.add_vertex_to_cache(LightPathVertex(
+                    it.light_vertices.add_vertex_to_cache(LightPathVertex(
                         isect,
                         state.throughput,
-                        state.dVC,
-                        state.dVCM,
-                        state.dVM,
+                        mis.dVC,
+                        mis.dVCM,
+                        mis.dVM,
                         state.path_length + 1));
                 }
 
-                if (algo != ALGO_PPM)
-                    connect_to_camera(state, isect, bsdf, ray_out_shadow);
+                if (!VCMTraits<algo>::photon_mapping)
+                    connect_to_camera(it, state, mis, isect, bsdf, ray_out_shadow);
             }
 
             const float offset = rays_in.hit(i).tmax * 1e-4f;
-            bounce(state, isect, bsdf, rays_in.ray(i), true, offset);
+            bounce(it, state, mis, isect, bsdf, rays_in.ray(i), true, offset);
         }
     });
 
@@ -258,7 +353,7 @@ void VCM_INTEGRATOR::process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VC
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::connect_to_camera(const VCMState& light_state, const Intersection& isect,
+void VCM_INTEGRATOR::connect_to_camera(const Iteration& it, const VCMHotState& light_state, const MISState& light_mis, const Intersection& isect,
                                        const BSDF* bsdf, RayQueue<VCMShadowState>& ray_out_shadow) {
     float3 dir_to_cam = cam_.pos() - isect.pos;
 
@@ -292,17 +387,18 @@ void VCM_INTEGRATOR::connect_to_camera(const VCMState& light_state, const Inters
     // Compute conversion factor from surface area to image plane and vice versa.
     const float img_to_surf = (sqr(cam_.image_plane_dist()) * cos_theta_surf) /
                               (dist_to_cam_sqr * cos_theta_cam * sqr(cos_theta_cam));
-    const float surf_to_img = 1.0f / img_to_surf;
 
     // Compute the MIS weight.
-    const float pdf_cam = img_to_surf; // Pixel sampling pdf is one as pixel area is one by convention.
-    const float mis_weight_light = mis_pow(pdf_cam / settings_.light_path_count) * (mis_eta_vm_ + light_state.dVCM + light_state.dVC * mis_pow(pdf_rev_w));
-
-    const float mis_weight = algo == ALGO_LT ? 1.0f : (1.0f / (mis_weight_light + 1.0f));
+    float mis_weight = 1.0f;
+    if (VCMTraits<algo>::mis) {
+        const float pdf_cam = img_to_surf; // Pixel sampling pdf is one as pixel area is one by convention.
+        const float mis_weight_light = mis_pow(pdf_cam / it.light_path_count) * (it.mis_eta_vm + light_mis.dVCM + light_mis.dVC * mis_pow(pdf_rev_w));
+        mis_weight = 1.0f / (mis_weight_light + 1.0f);
+    }
 
-    // Contribution is divided by the number of samples (settings_.light_path_count) and the factor that converts the (divided) pdf from surface area to image plane area.
+    // Contribution is divided by the number of samples (light path count) and the factor that converts the (divided) pdf from surface area to image plane area.
     // The cosine term is already included in the img_to_surf term.
-    state.throughput *= mis_weight * bsdf_value * img_to_surf / settings_.light_path_count;
+    state.throughput *= mis_weight * bsdf_value * img_to_surf / it.light_path_count;
 
 #if TECHNIQUES_DEBUG
     state.sample_id = light_state.sample_id;
@@ -320,43 +416,48 @@ void VCM_INTEGRATOR::connect_to_camera(const VCMState& light_state, const Inters
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& ray_out_shadow, AtomicImage& img) {
-    VCMState* states = rays_in.states();
-    const Hit* hits = rays_in.hits();
-    Ray* rays = rays_in.rays();
-
+void VCM_INTEGRATOR::process_camera_rays(const Iteration& it, RayQueue<State>& rays_in, RayQueue<VCMShadowState>& ray_out_shadow, ContributionBuffer& img) {
     const int hit_count = rays_in.compact_hits();
     rays_in.sort_by_material([this](const Hit& hit){
-            const Mesh::Instance& inst = scene_.instance(hit.inst_id);
-            const Mesh& mesh = scene_.mesh(inst.id);
-            const int local_tri_id = scene_.local_tri_id(hit.tri_id, inst.id);
-            const int m = mesh.indices()[local_tri_id * 4 + 3];
-            return m;
+            return scene_.hit_material(hit);
         },
         scene_.material_count(), hit_count);
 
+    if ((VCMTraits<algo>::photon_mapping || algo == ALGO_VCM) && settings_.sort_merge_queries) {
+        // Process hit points that are close to each other consecutively, so that they access the same photons.
+        const BSphere& bounds = scene_.bounding_sphere();
+        const float3 lo = bounds.center - float3(bounds.radius);
+        const float scale = 1024.0f / (2.0f * bounds.radius);
+        rays_in.sort_bins_by_key([&] (const Ray& r, const Hit& hit) {
+            const float3 pos = float3(r.org.x, r.org.y, r.org.z) + hit.tmax * float3(r.dir.x, r.dir.y, r.dir.z);
+            return int(morton_code(clamp(int((pos.x - lo.x) * scale), 0, 1023),
+                                   clamp(int((pos.y - lo.y) * scale), 0, 1023),
+                                   clamp(int((pos.z - lo.z) * scale), 0, 1023)));
+        }, hit_count);
+    }
+
     // Process all rays that hit nothing, if there is an environment map.
     if (scene_.env_map() != nullptr) {
-        tbb::parallel_for(tbb::blocked_range<int>(hit_count, rays_in.size()),
+        rays_in.for_each_range(hit_count, rays_in.size(),
             [&] (const tbb::blocked_range<int>& range)
         {
             for (auto i = range.begin(); i != range.end(); ++i) {
                 if (algo == ALGO_PT)
                     break;
 
-                VCMState& state = rays_in.state(i);
+                VCMHotState& state = rays_in.state(i);
+                MISState& mis = rays_in.cold_state(i);
                 float3 out_dir(rays_in.ray(i).dir.x, rays_in.ray(i).dir.y, rays_in.ray(i).dir.z);
                 out_dir = normalize(out_dir);
 
                 float pdf_direct_w, pdf_emit_w;
                 const auto li = scene_.env_map()->radiance(out_dir, pdf_direct_w, pdf_emit_w);
 
-                const float pdf_lightpick = 1.0f / scene_.light_count();
-                const float pdf_di = pdf_direct_w * pdf_lightpick;
-                const float pdf_e = pdf_emit_w * pdf_lightpick;
+                const float pdf_di = pdf_direct_w * scene_.env_light_pdf();
+                const float pdf_e = pdf_emit_w / scene_.light_count();
 
-                const float mis_weight_camera = mis_pow(pdf_di) * state.dVCM + mis_pow(pdf_e) * state.dVC;
-                const float mis_weight = algo == ALGO_PPM ? 1.0f : (1.0f / (mis_weight_camera + 1.0f));
+                const float mis_weight_camera = mis_pow(pdf_di) * mis.dVCM + mis_pow(pdf_e) * mis.dVC;
+                const float mis_weight = VCMTraits<algo>::photon_mapping ? 1.0f : (1.0f / (mis_weight_camera + 1.0f));
 
                 add_contribution(img, state.pixel_id, state.throughput * li * mis_weight);
                 techniques_dbg_.record(light_hit, mis_weight, state.throughput * li, state.pixel_id, state.sample_id);
@@ -367,23 +468,29 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
     // Shrink the queue to only contain valid hits.
     rays_in.shrink(hit_count);
 
-    tbb::parallel_for(tbb::blocked_range<int>(0, rays_in.size()), [&] (const tbb::blocked_range<int>& range) {
+    rays_in.for_each_range(0, rays_in.size(), [&] (const tbb::blocked_range<int>& range) {
         auto& bsdf_mem_arena = bsdf_memory_arenas.local();
 
         for (auto i = range.begin(); i != range.end(); ++i) {
             bsdf_mem_arena.free_all();
 
-            VCMState& state = rays_in.state(i);
-            RNG& rng = state.rng;
-            const auto isect = calculate_intersection(scene_, rays_in.hit(i), rays_in.ray(i));
+            VCMHotState& state = rays_in.state(i);
+            MISState& mis = rays_in.cold_state(i);
+            state.cone.propagate(rays_in.hit(i).tmax);
+            const auto isect = calculate_intersection(scene_, rays_in.hit(i), rays_in.ray(i), state.cone.width);
             const float cos_theta_o = fabsf(dot(isect.out_dir, isect.normal));
 
+            if (state.path_length == 1)
+                add_first_hit(state, isect, rays_in.hit(i));
+
             auto bsdf = isect.mat->get_bsdf(isect, bsdf_mem_arena);
 
             // Complete computation of partial MIS weights.
-            state.dVCM *= mis_pow(sqr(rays_in.hit(i).tmax)) / mis_pow(cos_theta_o); // transform divided pdf from solid angle to area
-            state.dVC *= 1.0f / mis_pow(cos_theta_o);
-            state.dVM *= 1.0f / mis_pow(cos_theta_o);
+            if (VCMTraits<algo>::mis) {
+                mis.dVCM *= mis_pow(sqr(rays_in.hit(i).tmax)) / mis_pow(cos_theta_o); // transform divided pdf from solid angle to area
+                mis.dVC *= 1.0f / mis_pow(cos_theta_o);
+                mis.dVM *= 1.0f / mis_pow(cos_theta_o);
+            }
 
             if (cos_theta_o == 0.0f) { // Prevent NaNs
                 terminate_path(state);
@@ -392,16 +499,15 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
 
             if (auto emit = isect.mat->emitter()) {
                 // A light source was hit directly. Add the weighted contribution.
-                float pdf_lightpick = 1.0f / scene_.light_count();
                 float pdf_direct_a, pdf_emit_w;
 
                 rgb radiance = emit->radiance(isect.out_dir, isect.geom_normal, pdf_direct_a, pdf_emit_w);
 
-                const float pdf_di = pdf_direct_a * pdf_lightpick;
-                const float pdf_e = pdf_emit_w * pdf_lightpick;
+                const float pdf_di = pdf_direct_a * scene_.triangle_light_pdf(*emit, world_triangle_area(scene_, rays_in.hit(i)));
+                const float pdf_e = pdf_emit_w / scene_.light_count();
 
-                const float mis_weight_camera = mis_pow(pdf_di) * state.dVCM + mis_pow(pdf_e) * state.dVC;
-                const float mis_weight = (algo == ALGO_PPM || state.path_length == 1) ? 1.0f : (1.0f / (mis_weight_camera + 1.0f));
+                const float mis_weight_camera = mis_pow(pdf_di) * mis.dVCM + mis_pow(pdf_e) * mis.dVC;
+                const float mis_weight = (VCMTraits<algo>::photon_mapping || state.path_length == 1) ? 1.0f : (1.0f / (mis_weight_camera + 1.0f));
 
                 rgb color = state.throughput * radiance * mis_weight;
                 add_contribution(img, state.pixel_id, color);
@@ -412,26 +518,26 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
             }
 
             // Compute direct illumination.
-            if (state.path_length < settings_.max_path_len) {
-                if (algo != ALGO_PPM)
-                    direct_illum(state, isect, bsdf, ray_out_shadow);
+            if (state.path_length < max_path_len_) {
+                if (!VCMTraits<algo>::photon_mapping)
+                    direct_illum(it, state, mis, isect, bsdf, ray_out_shadow);
             } else {
                 terminate_path(state);
                 continue; // No point in continuing this path. It is too long already
             }
 
             // Connect to light path vertices.
-            if (algo != ALGO_PT && algo != ALGO_PPM && !isect.mat->is_specular())
-                connect(state, isect, bsdf, bsdf_mem_arena, ray_out_shadow);
+            if (algo != ALGO_PT && !VCMTraits<algo>::photon_mapping && !isect.mat->is_specular())
+                connect(it, state, mis, isect, bsdf, bsdf_mem_arena, ray_out_shadow);
 
             if (algo != ALGO_BPT && algo != ALGO_PT) {
                 if (!isect.mat->is_specular())
-                    vertex_merging(state, isect, bsdf, img);
+                    vertex_merging(it, state, mis, isect, bsdf, img);
             }
 
             // Continue the path using russian roulette.
             const float offset = rays_in.hit(i).tmax * 1e-4f;
-            bounce(state, isect, bsdf, rays_in.ray(i), false, offset);
+            bounce(it, state, mis, isect, bsdf, rays_in.ray(i), false, offset);
         }
     });
 
@@ -439,10 +545,13 @@ void VCM_INTEGRATOR::process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<V
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::direct_illum(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow) {
+void VCM_INTEGRATOR::direct_illum(const Iteration& it, VCMHotState& cam_state, const MISState& cam_mis, const Intersection& isect, BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow) {
     // Generate the shadow ray (sample one point on one lightsource)
-    const auto& ls = scene_.light(cam_state.rng.random_int(0, scene_.light_count()));
-    const float pdf_lightpick_inv = scene_.light_count();
+    float pdf_lightpick;
+    const auto& ls = scene_.light(scene_.sample_light(cam_state.rng.random_float(), pdf_lightpick));
+    const float pdf_lightpick_inv = 1.0f / pdf_lightpick;
+    // Probability of starting a light path on that light, which is uniform.
+    const float pdf_emit_lightpick = 1.0f / scene_.light_count();
     const auto sample = ls->sample_direct(isect.pos, cam_state.rng);
     const float cos_theta_o = sample.cos_out;
     assert_normalized(sample.dir);
@@ -467,8 +576,8 @@ void VCM_INTEGRATOR::direct_illum(VCMState& cam_state, const Intersection& isect
 
     // Compute full MIS weights for camera and light.
     const float mis_weight_light = mis_pow(pdf_forward * pdf_lightpick_inv / sample.pdf_direct_w);
-    const float mis_weight_camera = mis_pow(sample.pdf_emit_w * cos_theta_i / (sample.pdf_direct_w * cos_theta_o)) *
-                                    (mis_eta_vm_ + cam_state.dVCM + cam_state.dVC * mis_pow(pdf_rev_w));
+    const float mis_weight_camera = mis_pow(sample.pdf_emit_w * pdf_emit_lightpick * cos_theta_i * pdf_lightpick_inv / (sample.pdf_direct_w * cos_theta_o)) *
+                                    (it.mis_eta_vm + cam_mis.dVCM + cam_mis.dVC * mis_pow(pdf_rev_w));
 
     const float mis_weight = algo == ALGO_PT ? 1.0f : (1.0f / (mis_weight_camera + 1.0f + mis_weight_light));
 
@@ -486,136 +595,181 @@ void VCM_INTEGRATOR::direct_illum(VCMState& cam_state, const Intersection& isect
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::connect(VCMState& cam_state, const Intersection& isect, BSDF* bsdf_cam, MemoryArena& bsdf_arena, RayQueue<VCMShadowState>& rays_out_shadow) {
+void VCM_INTEGRATOR::connect(const Iteration& it, VCMHotState& cam_state, const MISState& cam_mis, const Intersection& isect, BSDF* bsdf_cam, MemoryArena& bsdf_arena, RayQueue<VCMShadowState>& rays_out_shadow) {
     // PDF conversion factor from using the vertex cache.
     // Vertex Cache is equivalent to randomly sampling a path with pdf ~ path length and uniformly sampling a vertex on this path.
-    const float vc_weight = light_vertices_.count() / (float(settings_.light_path_count) * float(settings_.num_connections));
-
-    // Connect to num_connections randomly chosen vertices from the cache.
-    for (int i = 0; i < settings_.num_connections; ++i) {
-        const auto& light_vertex = light_vertices_.get_connect(cam_state.rng);
-
-        // Ignore paths that are longer than the specified maximum length.
-        if (light_vertex.path_length + cam_state.path_length > settings_.max_path_len)
-            continue;
+    const float vc_weight = it.light_vertices.count() / (float(it.light_path_count) * float(settings_.num_connections));
+
+    // Connect to num_connections randomly chosen vertices from the cache. The vertices are chosen in batches, which are
+    // sorted by their index in the cache: the cache is read in ascending order, and a vertex that is chosen more than
+    // once per batch has its intersection and its BSDF built only once.
+    // The BSDF keeps a reference to the intersection, which has to stay alive until the connections are done.
+    int batch[CONNECT_BATCH_SIZE];
+    Intersection light_isect;
+    const BSDF* light_bsdf = nullptr;
+    int light_bsdf_index = -1;
+
+    for (int first = 0; first < settings_.num_connections; first += CONNECT_BATCH_SIZE) {
+        const int batch_size = std::min(CONNECT_BATCH_SIZE, int(settings_.num_connections) - first);
+        for (int i = 0; i < batch_size; ++i)
+            batch[i] = it.light_vertices.sample_connect(cam_state.rng);
+        std::sort(batch, batch + batch_size);
+
+        for (int i = 0; i < batch_size; ++i) {
+            const auto& light_vertex = it.light_vertices.vertex(batch[i]);
+
+            // Ignore paths that are longer than the specified maximum length.
+            if (light_vertex.path_length + cam_state.path_length > max_path_len_)
+                continue;
 
-        const auto light_bsdf = light_vertex.isect.mat->get_bsdf(light_vertex.isect, bsdf_arena, true);
+            if (batch[i] != light_bsdf_index) {
+                light_isect = light_vertex.intersection(scene_);
+                light_bsdf = light_isect.mat->get_bsdf(light_isect, bsdf_arena, true);
+                light_bsdf_index = batch[i];
+            }
 
-        // Compute connection direction and distance.
-        float3 connect_dir = light_vertex.isect.pos - isect.pos;
-        const float connect_dist_sq = lensqr(connect_dir);
-        const float connect_dist = std::sqrt(connect_dist_sq);
-        connect_dir *= 1.0f / connect_dist;
+            // Compute connection direction and distance.
+            float3 connect_dir = light_isect.pos - isect.pos;
+            const float connect_dist_sq = lensqr(connect_dir);
+            const float connect_dist = std::sqrt(connect_dist_sq);
+            connect_dir *= 1.0f / connect_dist;
 
-        if (connect_dist < base_radius_) {
-            // If two points are too close to each other, they are either occluded or have cosine terms
-            // that are close to zero. Numerical inaccuracies might yield an overly bright pixel.
-            // The correct result is usually black or close to black so we just ignore those connections.
-            continue;
-        }
+            if (connect_dist < base_radius_) {
+                // If two points are too close to each other, they are either occluded or have cosine terms
+                // that are close to zero. Numerical inaccuracies might yield an overly bright pixel.
+                // The correct result is usually black or close to black so we just ignore those connections.
+                continue;
+            }
 
-        // Evaluate the bsdf at the camera vertex.
-        const auto bsdf_value_cam = bsdf_cam->eval(isect.out_dir, connect_dir, BSDF_ALL);
-        const float pdf_dir_cam_w = bsdf_cam->pdf(isect.out_dir, connect_dir);
-        const float pdf_rev_cam_w = bsdf_cam->pdf(connect_dir, isect.out_dir);
+            // Evaluate the bsdf at the camera vertex.
+            const auto bsdf_value_cam = bsdf_cam->eval(isect.out_dir, connect_dir, BSDF_ALL);
+            const float pdf_dir_cam_w = bsdf_cam->pdf(isect.out_dir, connect_dir);
+            const float pdf_rev_cam_w = bsdf_cam->pdf(connect_dir, isect.out_dir);
 
-        // Evaluate the bsdf at the light vertex.
-        const auto bsdf_value_light = light_bsdf->eval(light_vertex.isect.out_dir, -connect_dir, BSDF_ALL);
-        const float pdf_dir_light_w = light_bsdf->pdf(light_vertex.isect.out_dir, -connect_dir);
-        const float pdf_rev_light_w = light_bsdf->pdf(-connect_dir, light_vertex.isect.out_dir);
+            // Evaluate the bsdf at the light vertex.
+            const auto bsdf_value_light = light_bsdf->eval(light_isect.out_dir, -connect_dir, BSDF_ALL);
+            const float pdf_dir_light_w = light_bsdf->pdf(light_isect.out_dir, -connect_dir);
+            const float pdf_rev_light_w = light_bsdf->pdf(-connect_dir, light_isect.out_dir);
 
-        if (pdf_dir_cam_w == 0.0f || pdf_dir_light_w == 0.0f ||
-            pdf_rev_cam_w == 0.0f || pdf_rev_light_w == 0.0f)
-            continue;  // A pdf value of zero means that there has to be zero contribution from this pair of directions as well.
+            if (pdf_dir_cam_w == 0.0f || pdf_dir_light_w == 0.0f ||
+                pdf_rev_cam_w == 0.0f || pdf_rev_light_w == 0.0f)
+                continue;  // A pdf value of zero means that there has to be zero contribution from this pair of directions as well.
 
-        // Compute the cosine terms. We need to use the adjoint for the light vertex BSDF.
-        const float cos_theta_cam   = fabsf(dot(isect.normal, connect_dir));
-        const float cos_theta_light = fabsf(shading_normal_adjoint(light_vertex.isect.normal, light_vertex.isect.geom_normal,
-                                                                   light_vertex.isect.out_dir, -connect_dir));
+            // Compute the cosine terms. We need to use the adjoint for the light vertex BSDF.
+            const float cos_theta_cam   = fabsf(dot(isect.normal, connect_dir));
+            const float cos_theta_light = fabsf(shading_normal_adjoint(light_isect.normal, light_isect.geom_normal,
+                                                                       light_isect.out_dir, -connect_dir));
 
-        const float geom_term = cos_theta_cam * cos_theta_light / connect_dist_sq;
-        if (geom_term <= 0.0f)
-            continue;
+            const float geom_term = cos_theta_cam * cos_theta_light / connect_dist_sq;
+            if (geom_term <= 0.0f)
+                continue;
 
-        // Compute and convert the pdfs
-        const float pdf_cam_a = pdf_dir_cam_w * cos_theta_light / connect_dist_sq;
-        const float pdf_light_a = pdf_dir_light_w * cos_theta_cam / connect_dist_sq;
+            // Compute and convert the pdfs
+            const float pdf_cam_a = pdf_dir_cam_w * cos_theta_light / connect_dist_sq;
+            const float pdf_light_a = pdf_dir_light_w * cos_theta_cam / connect_dist_sq;
 
-        // Compute the full MIS weight from the partial weights and pdfs.
-        const float mis_weight_light = mis_pow(pdf_cam_a) * (mis_eta_vm_ + light_vertex.dVCM + light_vertex.dVC * mis_pow(pdf_rev_light_w));
-        const float mis_weight_camera = mis_pow(pdf_light_a) * (mis_eta_vm_ + cam_state.dVCM + cam_state.dVC * mis_pow(pdf_rev_cam_w));
+            // Compute the full MIS weight from the partial weights and pdfs.
+            const float mis_weight_light = mis_pow(pdf_cam_a) * (it.mis_eta_vm + light_vertex.dVCM + light_vertex.dVC * mis_pow(pdf_rev_light_w));
+            const float mis_weight_camera = mis_pow(pdf_light_a) * (it.mis_eta_vm + cam_mis.dVCM + cam_mis.dVC * mis_pow(pdf_rev_cam_w));
 
-        const float mis_weight = 1.0f / (mis_weight_camera + 1.0f + mis_weight_light);
+            const float mis_weight = 1.0f / (mis_weight_camera + 1.0f + mis_weight_light);
 
-        VCMShadowState s;
-        s.pixel_id = cam_state.pixel_id;
-        s.throughput = cam_state.throughput * vc_weight * mis_weight * geom_term * bsdf_value_cam * bsdf_value_light * light_vertex.throughput;
+            VCMShadowState s;
+            s.pixel_id = cam_state.pixel_id;
+            s.throughput = cam_state.throughput * vc_weight * mis_weight * geom_term * bsdf_value_cam * bsdf_value_light * light_vertex.throughput;
 
 #if TECHNIQUES_DEBUG
-        s.sample_id = cam_state.sample_id;
-        s.technique = connecting;
-        s.weight = mis_weight;
+            s.sample_id = cam_state.sample_id;
+            s.technique = connecting;
+            s.weight = mis_weight;
 #endif
 
-        const float offset = 1e-3f * connect_dist;
+            const float offset = 1e-3f * connect_dist;
 
-        Ray ray {
-            { isect.pos.x, isect.pos.y, isect.pos.z, offset },
-            { connect_dir.x, connect_dir.y, connect_dir.z, connect_dist - offset }
-        };
+            Ray ray {
+                { isect.pos.x, isect.pos.y, isect.pos.z, offset },
+                { connect_dir.x, connect_dir.y, connect_dir.z, connect_dist - offset }
+            };
 
-        rays_out_shadow.push(ray, s);
+            rays_out_shadow.push(ray, s);
+        }
     }
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::vertex_merging(const VCMState& state, const Intersection& isect, const BSDF* bsdf, AtomicImage& img) {
-    const int k = settings_.num_knn;
-    auto photons = V_ARRAY(const VCMPhoton*, k);
-    int count = light_vertices_.get_merge(isect.pos, photons, k);
-    const float radius_sqr = (count == k) ? lensqr(photons[k - 1]->position - isect.pos) : (pm_radius_ * pm_radius_);
+void VCM_INTEGRATOR::vertex_merging(const Iteration& it, const VCMHotState& state, const MISState& mis, const Intersection& isect, const BSDF* bsdf, ContributionBuffer& img) {
+    if (algo == ALGO_SPPM) {
+        // Gather all the photons within the radius of the pixel, which is at most the one of the photon search.
+        // The estimate is computed from the statistics of the pixel at the end of the iteration.
+        const float radius_sqr = sqr(sppm_pixels_.radius(state.pixel_id));
+        float photons = 0.0f;
+        rgb flux(0.0f);
+        it.light_vertices.for_each_merge(isect.pos, [&] (const VCMPhoton& p, float dist_sqr) {
+            if (dist_sqr > radius_sqr) return;
+            photons += 1.0f;
+            flux += bsdf->eval(isect.out_dir, p.out_dir) * p.throughput;
+        });
+
+        if (photons > 0.0f) sppm_pixels_.add(state.pixel_id, photons, state.throughput * flux);
+        return;
+    }
 
     rgb contrib(0.0f);
-    for (int i = 0; i < count; ++i) {
-        auto p = photons[i];
-        const auto& photon_in_dir = p->out_dir;
+    auto merge = [&] (const VCMPhoton& p, float dist_sqr, float radius_sqr) {
+        const auto& photon_in_dir = p.out_dir;
 
         const auto& bsdf_value = bsdf->eval(isect.out_dir, photon_in_dir);
         const float pdf_dir_w = bsdf->pdf(isect.out_dir, photon_in_dir);
         const float pdf_rev_w = bsdf->pdf(photon_in_dir, isect.out_dir);
 
         if (pdf_dir_w == 0.0f || pdf_rev_w == 0.0f || is_black(bsdf_value))
-            continue;
+            return;
 
         // Compute MIS weight.
-        const float mis_weight_light = p->dVCM * mis_eta_vc_ + p->dVM * mis_pow(pdf_dir_w);
-        const float mis_weight_camera = state.dVCM * mis_eta_vc_ + state.dVM * mis_pow(pdf_rev_w);
+        const float mis_weight_light = p.dVCM * it.mis_eta_vc + p.dVM * mis_pow(pdf_dir_w);
+        const float mis_weight_camera = mis.dVCM * it.mis_eta_vc + mis.dVM * mis_pow(pdf_rev_w);
 
-        const float mis_weight = algo == ALGO_PPM ? 1.0f : (1.0f / (mis_weight_light + 1.0f + mis_weight_camera));
+        const float mis_weight = VCMTraits<algo>::photon_mapping ? 1.0f : (1.0f / (mis_weight_light + 1.0f + mis_weight_camera));
 
         // Epanechnikov filter
-        const float d = lensqr(p->position - isect.pos);
-        const float kernel = 1.0f - d / radius_sqr;
+        const float kernel = 1.0f - dist_sqr / radius_sqr;
 
-        contrib += mis_weight * bsdf_value * kernel * p->throughput;
+        contrib += mis_weight * bsdf_value * kernel * p.throughput;
 
         techniques_dbg_.record(merging, mis_weight,
-                               state.throughput * bsdf_value * kernel * p->throughput * 2.0f / (pi * radius_sqr * settings_.light_path_count),
+                               state.throughput * bsdf_value * kernel * p.throughput * 2.0f / (pi * radius_sqr * it.light_path_count),
                                state.pixel_id, state.sample_id);
+    };
+
+    float radius_sqr = it.radius * it.radius;
+    const int k = settings_.num_knn;
+    if (k > 0) {
+        // Use the k nearest photons, the radius is the distance to the farthest one if k photons were found.
+        auto photons = V_ARRAY(const VCMPhoton*, k);
+        int count = it.light_vertices.get_merge(isect.pos, photons, k);
+        if (count == k) radius_sqr = lensqr(photons[k - 1]->position - isect.pos);
+
+        for (int i = 0; i < count; ++i)
+            merge(*photons[i], lensqr(photons[i]->position - isect.pos), radius_sqr);
+    } else {
+        // Use all photons within the radius, they do not need to be sorted.
+        it.light_vertices.for_each_merge(isect.pos, [&] (const VCMPhoton& p, float dist_sqr) {
+            merge(p, dist_sqr, radius_sqr);
+        });
     }
 
     // Complete the Epanechnikov kernel
-    contrib *= 2.0f / (pi * radius_sqr * settings_.light_path_count);
+    contrib *= 2.0f / (pi * radius_sqr * it.light_path_count);
 
     add_contribution(img, state.pixel_id, state.throughput * contrib);
 }
 
 VCM_TEMPLATE
-void VCM_INTEGRATOR::process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, AtomicImage& out) {
+void VCM_INTEGRATOR::process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, ContributionBuffer& out) {
     VCMShadowState* states = ray_in.states();
     Hit* hits = ray_in.hits();
 
-    tbb::parallel_for(tbb::blocked_range<int>(0, ray_in.size()),
+    ray_in.for_each_range(0, ray_in.size(),
         [&] (const tbb::blocked_range<int>& range)
     {
         for (auto i = range.begin(); i != range.end(); ++i) {
@@ -637,5 +791,6 @@ template class VCMIntegrator<ALGO_PT >;
 template class VCMIntegrator<ALGO_LT >;
 template class VCMIntegrator<ALGO_BPT>;
 template class VCMIntegrator<ALGO_VCM>;
+template class VCMIntegrator<ALGO_SPPM>;
 
 } // namespace imba
@@ -8,12 +8,16 @@
 
 #include "imbatracer/rangesearch/rangesearch.h"
 #include "imbatracer/render/integrators/light_vertices.h"
+#include "imbatracer/render/integrators/sppm_pixels.h"
 
 #include "imbatracer/render/debug/path_debug.h"
 #include "imbatracer/render/debug/mis_debug.h"
 
 #include "imbatracer/frontend/cmd_line.h"
 
+#include <future>
+#include <memory>
+
 // Enable this to write light path information to a file after each frame (SLOW!)
 #define LIGHT_PATH_DEBUG false
 
@@ -22,16 +26,11 @@
 
 namespace imba {
 
-/// Stores the current state of a ray during VCM or any sub-algorithm of VCM.
-struct VCMState : RayState {
+/// Part of the state of a ray during VCM that is accessed in every shading pass.
+struct VCMHotState : RayState {
     rgb throughput;
     int path_length : 31;
     bool finite_light : 1;
-
-    // partial weights for MIS, see VCM technical report
-    float dVC;
-    float dVCM;
-    float dVM;
 };
 
 enum VCMSubAlgorithm {
@@ -39,9 +38,62 @@ enum VCMSubAlgorithm {
     ALGO_BPT,
     ALGO_PPM,
     ALGO_LT,
-    ALGO_PT
+    ALGO_PT,
+    ALGO_SPPM
+};
+
+/// Describes which partial weights for MIS a sub-algorithm of VCM reads.
+template <VCMSubAlgorithm algo>
+struct VCMTraits {
+    /// The photon mapping variants and LT use a single technique per path, so they do not weight their contributions.
+    static constexpr bool mis = algo == ALGO_VCM || algo == ALGO_BPT || algo == ALGO_PT;
+    /// Only VCM weights vertex merging against the other techniques, which requires dVM.
+    static constexpr bool mis_merging = algo == ALGO_VCM;
+    /// PPM and SPPM only merge at the first non-specular vertex of the camera paths, and never connect.
+    static constexpr bool photon_mapping = algo == ALGO_PPM || algo == ALGO_SPPM;
+};
+
+/// Partial weight for MIS that a sub-algorithm does not read: takes no space in the state, reads as zero and
+/// ignores the writes, so that the code computing the weights is shared by all the sub-algorithms.
+struct NoMISWeight {
+    operator float() const { return 0.0f; }
+    NoMISWeight& operator = (float) { return *this; }
+    NoMISWeight& operator *= (float) { return *this; }
+};
+
+/// Partial weights for MIS, see VCM technical report. Stored separately from the hot part of the state.
+/// Only the weights used by the sub-algorithm are stored, see VCMTraits.
+template <bool mis, bool mis_merging> struct VCMMISWeights;
+
+template <> struct VCMMISWeights<true, true> {
+    float dVC;
+    float dVCM;
+    float dVM;
+};
+
+template <> struct VCMMISWeights<true, false> {
+    float dVC;
+    float dVCM;
+    static NoMISWeight dVM;
+};
+
+template <> struct VCMMISWeights<false, false> {
+    static NoMISWeight dVC;
+    static NoMISWeight dVCM;
+    static NoMISWeight dVM;
 };
 
+template <VCMSubAlgorithm algo>
+using VCMMISState = VCMMISWeights<VCMTraits<algo>::mis, VCMTraits<algo>::mis_merging>;
+
+/// Stores the current state of a ray during VCM or any sub-algorithm of VCM.
+template <VCMSubAlgorithm algo>
+struct VCMState : VCMHotState, VCMMISState<algo> {};
+
+/// The ray queues store the MIS weights in a separate array, or not at all if the sub-algorithm does not use them.
+template <VCMSubAlgorithm algo>
+struct StateLayout<VCMState<algo> > : SplitStateLayout<VCMHotState, VCMMISState<algo> > {};
+
 struct VCMShadowState : ShadowState {
 #if TECHNIQUES_DEBUG
     int sample_id;
@@ -53,43 +105,92 @@ struct VCMShadowState : ShadowState {
 template <VCMSubAlgorithm algo>
 class VCMIntegrator : public Integrator {
 public:
-    VCMIntegrator(Scene& scene, PerspectiveCamera& cam, RayScheduler<VCMState, VCMShadowState>& scheduler, const UserSettings& settings)
+    typedef VCMState<algo> State;
+    typedef VCMMISState<algo> MISState;
+
+    VCMIntegrator(Scene& scene, PerspectiveCamera& cam, RayScheduler<State, VCMShadowState>& scheduler, const UserSettings& settings)
         : Integrator(scene, cam)
         , settings_(settings)
+        , max_path_len_(settings.max_path_len)
+        , light_path_count_(settings.light_path_count)
         , cur_iteration_(0)
+        , cur_(0)
+        , next_traced_(false)
+        , light_tile_gen_(scene.light_count(), settings.light_path_count, settings.tile_size * settings.tile_size, sample_sequence(settings),
+                          settings.sample_offset)
         , scheduler_(scheduler)
-        , light_vertices_(settings.light_path_count)
-        , light_tile_gen_(scene.light_count(), settings.light_path_count, settings.tile_size * settings.tile_size)
-        , light_scheduler_(light_tile_gen_, scene, 1, settings.thread_count, settings.tile_size * settings.tile_size * 1.75f,
-                           settings.traversal_platform == UserSettings::gpu) // TODO: make threshold explicit in TileGen
+        , light_scheduler_(light_tile_gen_, scene, 1, thread_devices(settings), settings.tile_size * settings.tile_size * 1.75f,
+                           settings.regen_threshold, settings.sort_rays) // TODO: make threshold explicit in TileGen
     {
+        const PhotonAccel accel = settings.photon_accel == UserSettings::kd_tree ? PHOTON_ACCEL_KD_TREE : PHOTON_ACCEL_HASH_GRID;
+        for (auto& it : iterations_)
+            it.reset(new Iteration(settings.light_path_count, accel));
+
+        // The splats of the light paths are added to the image when the camera paths of their iteration are traced.
+        light_scheduler_.set_deferred_flush(true);
+        // The light paths only contribute through their connections to the camera, which land anywhere in the image.
+        light_scheduler_.set_sparse_contributions(true);
     }
 
     virtual void render(AtomicImage& out) override;
     virtual void reset() override {
-        pm_radius_ = base_radius_;
         cur_iteration_ = 0;
+        discard_next_iteration();
+        sppm_pixels_.reset(0, 0.0f);
+    }
+
+    // The camera samples of a frame share its light paths, so the number of samples per pixel is fixed.
+    virtual bool set_max_path_len(int len) override { max_path_len_ = len; return true; }
+    virtual bool set_light_path_count(int count) override {
+        if (count < 1 || count > settings_.light_path_count) return false;
+        light_path_count_ = count;
+        light_tile_gen_.set_path_count(count);
+        discard_next_iteration();
+        return true;
     }
 
     virtual void preprocess() override {
         Integrator::preprocess();
 
         base_radius_ = pixel_size() * settings_.radius_factor;
+        sppm_pixels_.reset(0, 0.0f);
+    }
 
-        if (algo != ALGO_LT && algo != ALGO_PT)
-            light_vertices_.compute_cache_size(scene_, scheduler_.gpu_traversal);
+    virtual void report_memory(MemoryReport& report) const override {
+        Integrator::report_memory(report);
+        scheduler_.report_memory(report, "camera ray");
+        light_scheduler_.report_memory(report, "light ray");
+        for (auto& it : iterations_)
+            it->light_vertices.report_memory(report);
+        if (algo == ALGO_SPPM) report.add("sppm pixels", sppm_pixels_.memory_bytes());
     }
 
 private:
+    /// Data of an iteration that is shared by its light and camera paths. There are two iterations, so that the light
+    /// paths of the next iteration can be traced while the camera paths of the current one are (see render()).
+    struct Iteration {
+        LightVertices light_vertices;
+        float radius;           ///< Radius of the vertex merging
+        float mis_eta_vc;
+        float mis_eta_vm;
+        int light_path_count;
+
+        Iteration(int path_count, PhotonAccel accel) : light_vertices(path_count, accel) {}
+    };
+
     const UserSettings settings_;
 
-    // Data for the current iteration
-    int cur_iteration_;
-    float pm_radius_;
+    int max_path_len_;
+    int light_path_count_;  ///< Number of light paths of the next iterations
+
+    int cur_iteration_;     ///< Number of iterations started since the last reset
     float base_radius_;
-    float vm_normalization_;
-    float mis_eta_vc_;
-    float mis_eta_vm_;
+
+    std::unique_ptr<Iteration> iterations_[2];
+    int cur_;               ///< Index of the iteration of the next frame
+    bool next_traced_;      ///< True if the light paths of the iteration of the next frame have already been traced
+
+    SPPMPixels sppm_pixels_;    ///< Radius and photon statistics of every pixel, for SPPM only
 
     // Debugging tools
     enum SamplingTechniques {
@@ -101,14 +202,14 @@ private:
         technique_count
     };
 
-    PathDebugger<VCMState, LIGHT_PATH_DEBUG> light_path_dbg_;
+    PathDebugger<VCMHotState, LIGHT_PATH_DEBUG> light_path_dbg_;
     MISDebugger<technique_count, TECHNIQUES_DEBUG> techniques_dbg_;
 
-    // Scheduling
-    UniformLightTileGen<VCMState> light_tile_gen_;
-    RayScheduler<VCMState, VCMShadowState>& scheduler_;
-    TileScheduler<VCMState, VCMShadowState> light_scheduler_;
-    LightVertices light_vertices_;
+    // Scheduling. The splats of the light paths, which can reach any pixel, are accumulated in the contribution
+    // buffer of the light scheduler, separately from the pixel-local contributions of the camera paths.
+    UniformLightTileGen<State> light_tile_gen_;
+    RayScheduler<State, VCMShadowState>& scheduler_;
+    TileScheduler<State, VCMShadowState> light_scheduler_;
 
     /// Computes the power for the power heuristic.
     inline float mis_pow(float a) {
@@ -124,21 +225,26 @@ private:
         return dot(out_dir, normal) * dot(in_dir, geom_normal) / dot(out_dir, geom_normal);
     }
 
-    void process_light_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& rays_out_shadow, AtomicImage& img);
-    void process_camera_rays(RayQueue<VCMState>& rays_in, RayQueue<VCMShadowState>& shadow_rays, AtomicImage& img);
+    /// Starts a new iteration: shrinks the radius and computes the partial MIS weights.
+    void start_iteration(Iteration& it);
+    /// Discards the light paths traced ahead for the next frame, once they no longer match the settings or the camera.
+    void discard_next_iteration();
+
+    void process_light_rays(Iteration& it, RayQueue<State>& rays_in, RayQueue<VCMShadowState>& rays_out_shadow, ContributionBuffer& img);
+    void process_camera_rays(const Iteration& it, RayQueue<State>& rays_in, RayQueue<VCMShadowState>& shadow_rays, ContributionBuffer& img);
 
-    void trace_light_paths(AtomicImage& img);
-    void trace_camera_paths(AtomicImage& img);
+    void trace_light_paths(Iteration& it, AtomicImage& img);
+    void trace_camera_paths(const Iteration& it, AtomicImage& img);
 
-    void connect_to_camera(const VCMState& light_state, const Intersection& isect, const BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow);
+    void connect_to_camera(const Iteration& it, const VCMHotState& light_state, const MISState& light_mis, const Intersection& isect, const BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow);
 
-    void direct_illum(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow);
-    void connect(VCMState& cam_state, const Intersection& isect, BSDF* bsdf, MemoryArena& bsdf_arena, RayQueue<VCMShadowState>& rays_out_shadow);
-    void vertex_merging(const VCMState& state, const Intersection& isect, const BSDF* bsdf, AtomicImage& img);
+    void direct_illum(const Iteration& it, VCMHotState& cam_state, const MISState& cam_mis, const Intersection& isect, BSDF* bsdf, RayQueue<VCMShadowState>& rays_out_shadow);
+    void connect(const Iteration& it, VCMHotState& cam_state, const MISState& cam_mis, const Intersection& isect, BSDF* bsdf, MemoryArena& bsdf_arena, RayQueue<VCMShadowState>& rays_out_shadow);
+    void vertex_merging(const Iteration& it, const VCMHotState& state, const MISState& mis, const Intersection& isect, const BSDF* bsdf, ContributionBuffer& img);
 
-    void bounce(VCMState& state, const Intersection& isect, BSDF* bsdf, Ray& rays_out, bool adjoint, float offset);
+    void bounce(const Iteration& it, VCMHotState& state, MISState& mis, const Intersection& isect, BSDF* bsdf, Ray& rays_out, bool adjoint, float offset);
 
-    void process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, AtomicImage& out);
+    void process_shadow_rays_dbg(RayQueue<VCMShadowState>& ray_in, ContributionBuffer& out);
 };
 
 using VCM    = VCMIntegrator<ALGO_VCM>;
@@ -146,6 +252,7 @@ using BPT    = VCMIntegrator<ALGO_BPT>;
 using PPM    = VCMIntegrator<ALGO_PPM>;
 using LT     = VCMIntegrator<ALGO_LT >;
 using VCM_PT = VCMIntegrator<ALGO_PT >;
+using SPPM   = VCMIntegrator<ALGO_SPPM>;
 
 } // namespace imba
 
@@ -17,6 +17,9 @@ struct Intersection {
     float3 v_tangent;
 
     Material* mat;
+    int mat_id;
+
+    float uv_footprint; // Width of the footprint of the ray in texture space, zero if unknown
 };
 
 } // namespace imba
@@ -2,14 +2,24 @@
 #define IMBA_LIGHT_H
 
 #include "imbatracer/render/random.h"
+#include "imbatracer/render/sampler.h"
+#include "imbatracer/render/alias_table.h"
 #include "imbatracer/core/bsphere.h"
 #include "imbatracer/core/image.h"
 
 #include <cfloat>
 #include <memory>
+#include <algorithm>
+
+#include <tbb/parallel_for.h>
 
 namespace imba {
 
+/// Power of a triangle light with the given radiance and area. Also used to compute the probability of selecting a light from a hit point.
+inline float triangle_light_power(const rgb& intensity, float area) {
+    return luminance(intensity) * area * pi;
+}
+
 /// Utility class to describe a triangular surface that emits light.
 struct AreaEmitter {
     AreaEmitter() {}
@@ -79,14 +89,18 @@ public:
     virtual ~Light() {}
 
     /// Samples an outgoing ray from the light source.
-    virtual EmitSample sample_emit(RNG& rng) = 0;
+    virtual EmitSample sample_emit(Sampler& rng) = 0;
 
     /// Samples a point on the light source. Used for shadow rays.
-    virtual DirectIllumSample sample_direct(const float3& from, RNG& rng) = 0;
+    virtual DirectIllumSample sample_direct(const float3& from, Sampler& rng) = 0;
 
     /// Returns the area emitter associated with this light, or null if the light has no area.
     virtual const AreaEmitter* emitter() const { return nullptr; }
 
+    /// Returns an estimate of the power emitted by the light (luminance times area times solid angle).
+    /// Used to select the lights proportionally to their contribution.
+    virtual float power() const = 0;
+
     virtual bool is_delta() const { return false; }
     virtual bool is_finite() const { return true; }
 };
@@ -106,7 +120,7 @@ public:
         local_coordinates(normal_, tangent_, binormal_);
     }
 
-    EmitSample sample_emit(RNG& rng) override {
+    EmitSample sample_emit(Sampler& rng) override {
         EmitSample sample;
 
         // Sample a point on the light source
@@ -141,7 +155,7 @@ public:
         return sample;
     }
 
-    DirectIllumSample sample_direct(const float3& from, RNG& rng) override {
+    DirectIllumSample sample_direct(const float3& from, Sampler& rng) override {
         DirectIllumSample sample;
 
         // sample a point on the light source
@@ -178,6 +192,8 @@ public:
 
     const AreaEmitter* emitter() const override { return &emit_; }
 
+    float power() const override { return triangle_light_power(emit_.intensity, emit_.area); }
+
     const float3& vertex(int i) { return verts_[i]; }
 
 private:
@@ -198,7 +214,7 @@ public:
         local_coordinates(dir_, tangent_, binormal_);
     }
 
-    EmitSample sample_emit(RNG& rng) override {
+    EmitSample sample_emit(Sampler& rng) override {
         float2 disc_pos = sample_concentric_disc(rng.random_float(), rng.random_float());
 
         EmitSample sample;
@@ -214,7 +230,7 @@ public:
         return sample;
     }
 
-    DirectIllumSample sample_direct(const float3& from, RNG& rng) override {
+    DirectIllumSample sample_direct(const float3& from, Sampler& rng) override {
         DirectIllumSample sample;
 
         sample.dir      = -dir_;
@@ -228,6 +244,8 @@ public:
         return sample;
     }
 
+    float power() const override { return luminance(intensity_) * pi * sqr(bsphere_->radius); }
+
     bool is_delta() const override { return true; }
     bool is_finite() const override { return false; }
 
@@ -246,7 +264,7 @@ public:
         : pos_(pos), intensity_(intensity)
     {}
 
-    EmitSample sample_emit(RNG& rng) override {
+    EmitSample sample_emit(Sampler& rng) override {
         EmitSample sample;
 
         sample.pos      = pos_;
@@ -263,7 +281,7 @@ public:
         return sample;
     }
 
-    DirectIllumSample sample_direct(const float3& from, RNG& rng) override {
+    DirectIllumSample sample_direct(const float3& from, Sampler& rng) override {
         float3 dir = pos_ - from;
         const float sqdist = dot(dir, dir);
         const float dist   = sqrtf(sqdist);
@@ -282,6 +300,8 @@ public:
         return sample;
     }
 
+    float power() const override { return luminance(intensity_) * 4.0f * pi; }
+
     bool is_delta() const override { return true; }
 
 private:
@@ -301,7 +321,7 @@ public:
         local_coordinates(normal_, tangent_, binormal_);
     }
 
-    EmitSample sample_emit(RNG& rng) override {
+    EmitSample sample_emit(Sampler& rng) override {
         EmitSample sample;
 
         sample.pos      = pos_;
@@ -320,7 +340,7 @@ public:
         return sample;
     }
 
-    DirectIllumSample sample_direct(const float3& from, RNG& rng) override {
+    DirectIllumSample sample_direct(const float3& from, Sampler& rng) override {
         float3 dir = pos_ - from;
         const float sqdist = dot(dir, dir);
         const float dist   = sqrtf(sqdist);
@@ -346,6 +366,8 @@ public:
         return sample;
     }
 
+    float power() const override { return luminance(intensity_) * 2.0f * pi * (1.0f - cos_angle_); }
+
     bool is_delta() const override { return true; }
 
 private:
@@ -363,56 +385,34 @@ public:
     EnvMap(const Image& img, float intensity, const BSphere& bsphere)
     : img_(img), intensity_(intensity), bsphere_(bsphere)
     {
-        // Compute the piecewise constant pdf, marginal pdf, and corresponding cdfs for sampling.
+        // The pixels are sampled proportionally to their luminance, times the sine of their latitude, which is the
+        // area that they cover on the sphere. Every row has its own alias table, and a marginal table selects the row.
         const int w = img.width();
         const int h = img.height();
 
-        float total_value = 0.0f;
-
-        // Compute piecewise constant pdf, cdf, and marginals.
         func_.resize(w * h);
-        marginal_.resize(h);
-        cdf_.resize((w + 1) * h);
-        for (int row = 0; row < h; ++row) {
-            marginal_[row] = 0.0f;
-            for (int col = 0; col < w; ++col) {
-                // Average over four pixels (with repeat boundary handling)
-                func_[row * w + col] = luminance(img_(row,           col          )) +
-                                       luminance(img_(row,           (col + 1) % w)) +
-                                       luminance(img_((row + 1) % h, col          )) +
-                                       luminance(img_((row + 1) % h, (col + 1) % w));
-                func_[row * w + col] *= 0.25f;
-
-                const float sin_theta = 1.0f;
-                func_[row * w + col] *= sin_theta;
-
-                total_value += func_[row * w + col];
-
-                marginal_[row] += func_[row * w + col];
+        rows_.resize(w * h);
+        std::vector<float> row_weights(h);
+        tbb::parallel_for(tbb::blocked_range<int>(0, h), [&] (const tbb::blocked_range<int>& range) {
+            for (int row = range.begin(); row != range.end(); ++row) {
+                const float sin_theta = sinf(pi * (row + 0.5f) / h);
+                for (int col = 0; col < w; ++col)
+                    func_[row * w + col] = std::max(luminance(img_(col, row)), 0.0f) * sin_theta;
+
+                row_weights[row] = build_alias_table(func_.data() + row * w, w, rows_.data() + row * w);
             }
+        });
 
-            // Sum up values to compute cdf for this row
-            cdf_[row * (w + 1)] = 0.0f;
-            for (int col = 0; col < w; ++col)
-                cdf_[row * (w + 1) + col + 1] = cdf_[row * (w + 1) + col] + func_[row * w + col] / w;
-            for (int col = 0; col <= w; ++col)
-                cdf_[row * (w + 1) + col] /= cdf_[row * (w + 1) + w + 1];
-        }
-
-        // Compute marginal CDF for sampling
-        marginal_cdf_.resize(h + 1);
-        marginal_cdf_[0] = 0.0f;
-        for (int row = 0; row < h; ++row)
-            marginal_cdf_[row + 1] = marginal_cdf_[row] + marginal_[row] / h;
-        for (int row = 0; row <= h; ++row)
-            marginal_cdf_[row] /= marginal_cdf_.back();
-
-        // Compute the actual pdf values.
-        for (int row = 0; row < h; ++row) {
-            for (int col = 0; col < w; ++col) {
-                func_[row * w + col] /= total_value / (w * h);
-            }
-        }
+        marginal_.resize(h);
+        const double total = build_alias_table(row_weights.data(), h, marginal_.data());
+        integral_ = intensity * float(total * 2.0 * pi * pi / (w * double(h)));
+
+        // Turn the function into the pdf of the pixels, in image space.
+        const float norm = total > 0.0 ? float(w * double(h) / total) : 0.0f;
+        tbb::parallel_for(tbb::blocked_range<int>(0, h), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin() * w; i != range.end() * w; ++i)
+                func_[i] = norm > 0.0f ? func_[i] * norm : 1.0f;
+        });
     }
 
     /// Returns the amount of radiance due to environment map lighting from a certain direction.
@@ -424,18 +424,30 @@ public:
         const float s = phi / (2.0f * pi);
         const float t = acosf(out_dir.y) / pi;
 
-        pdf_direct_w = pdf(s, t) / (2.0f * pi * pi * sinf(t));
+        pdf_direct_w = pdf(s, t) / (2.0f * pi * pi * sinf(pi * t));
         pdf_emit_w   = concentric_disc_pdf() * bsphere_.inv_radius_sqr * pdf_direct_w;
 
-        return intensity_ * static_cast<rgb>(img_(s * (img_.width() - 1), t * (img_.height() - 1)));
+        return intensity_ * lookup(s, t);
+    }
+
+    const Image& image() const { return img_; }
+    float intensity() const { return intensity_; }
+
+    /// Number of bytes allocated for the image and the tables used to sample it.
+    size_t memory_bytes() const {
+        return img_.memory_bytes() + vector_bytes(func_) + vector_bytes(rows_) + vector_bytes(marginal_);
     }
 
+    /// Returns the integral of the luminance of the map over the sphere of directions.
+    float integral() const { return integral_; }
+
+    /// Returns the pdf of sampling the given point of the image, in image space.
     float pdf(float s, float t) const {
-        return 1.0f;// / float(img_.width() * img_.height());
+        return func_[pixel_row(t) * img_.width() + pixel_col(s)];
     }
 
     /// Samples a direction for incoming light from the environment map, using importance sampling.
-    float3 sample_dir(RNG& rng, float3& dir, float& pdf) const {
+    float3 sample_dir(Sampler& rng, float3& dir, float& pdf) const {
         float2 uv;
         const auto color = sample_uv(rng, uv, pdf);
 
@@ -456,29 +468,35 @@ public:
         return color;
     }
 
-    /// Importance samples a point on the environment map.
-    rgb sample_uv(RNG& rng, float2& uv, float& pdf) const {
-        pdf = 1.0f / float(img_.width() * img_.height());
-
-        uv.x = rng.random_float();
-        uv.y = rng.random_float();
+    /// Importance samples a point on the environment map, in constant time.
+    rgb sample_uv(Sampler& rng, float2& uv, float& pdf) const {
+        const int w = img_.width();
+        const int h = img_.height();
 
-        // TODO importance sample the image.
+        const int row = sample_alias_table(marginal_.data(), h, rng.random_float());
+        const int col = sample_alias_table(rows_.data() + row * w, w, rng.random_float());
 
-        // Transform pdf for transformation from pixel coordinates to uv
-        pdf *= float(img_.width() * img_.height());
+        // Pick a point uniformly within the pixel.
+        uv.x = std::min((col + rng.random_float()) / w, 1.0f);
+        uv.y = std::min((row + rng.random_float()) / h, 1.0f);
 
-        return intensity_ * static_cast<rgb>(img_(uv.x * (img_.width() - 1), uv.y * (img_.height() - 1)));
+        pdf = func_[row * w + col];
+        return intensity_ * static_cast<rgb>(img_(col, row));
     }
 
 private:
     Image img_;
     float intensity_;
+    float integral_;
+
+    std::vector<float> func_;           ///< Pdf of every pixel, in image space
+    std::vector<AliasEntry> rows_;      ///< Alias table of every row
+    std::vector<AliasEntry> marginal_;  ///< Alias table that selects the rows
 
-    std::vector<float> func_;
-    std::vector<float> cdf_;
-    std::vector<float> marginal_;
-    std::vector<float> marginal_cdf_;
+    int pixel_col(float s) const { return std::min(static_cast<int>(s * img_.width()),  img_.width()  - 1); }
+    int pixel_row(float t) const { return std::min(static_cast<int>(t * img_.height()), img_.height() - 1); }
+
+    rgb lookup(float s, float t) const { return static_cast<rgb>(img_(pixel_col(s), pixel_row(t))); }
 
     // The scene geometry is not yet known when the lights are created. Hence we store a reference to the bounding sphere which will be updated later on.
     const BSphere& bsphere_;
@@ -491,7 +509,7 @@ public:
     {}
 
     /// Samples an outgoing ray from the light source.
-    EmitSample sample_emit(RNG& rng) override {
+    EmitSample sample_emit(Sampler& rng) override {
         float pdf;
         float3 dir;
         auto radiance = map_->sample_dir(rng, dir, pdf);
@@ -516,7 +534,7 @@ public:
     }
 
     /// Samples a point on the light source. Used for shadow rays.
-    DirectIllumSample sample_direct(const float3& from, RNG& rng) override {
+    DirectIllumSample sample_direct(const float3& from, Sampler& rng) override {
         float pdf;
         float3 dir;
         auto radiance = map_->sample_dir(rng, dir, pdf);
@@ -534,6 +552,8 @@ public:
         return sample;
     }
 
+    float power() const override { return map_->integral() * pi * sqr(bsphere_.radius); }
+
     bool is_delta()  const override { return false; }
     bool is_finite() const override { return false; }
 
@@ -29,7 +29,7 @@ public:
         return rgb(0.0f);
     }
 
-    rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, float& pdf) const override {
+    rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, float& pdf) const override {
         in_dir = float3(-out_dir.x, -out_dir.y, out_dir.z); // Reflected direction in shading space (normal == z.)
         pdf = 1.0f;
 
@@ -62,7 +62,7 @@ public:
                 : rgb(0.0f);
     }
 
-    rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, float& pdf) const override {
+    rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, float& pdf) const override {
         // Sample a power weighted direction relative to the reflected direction
         auto dir_sample = sample_power_cos_hemisphere(exponent_, rng.random_float(), rng.random_float());
 
@@ -170,7 +170,7 @@ public:
                (4.0f * abs_cos_theta(in_dir) * abs_cos_theta(out_dir));
     }
 
-    rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, float& pdf) const override {
+    rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, float& pdf) const override {
         sample_blinn_distribution(out_dir, in_dir, rng.random_float(), rng.random_float(), pdf);
         return same_hemisphere(out_dir, in_dir) ? eval(out_dir, in_dir) : rgb(0.0f);
     }
@@ -5,6 +5,7 @@
 
 #include "imbatracer/render/mem_arena.h"
 #include "imbatracer/render/random.h"
+#include "imbatracer/render/sampler.h"
 #include "imbatracer/render/intersection.h"
 
 #include "imbatracer/render/materials/fresnel.h"
@@ -51,7 +52,7 @@ public:
     virtual rgb eval(const float3& out_dir, const float3& in_dir) const = 0;
 
     /// Default implementation cosine-samples the hemisphere.
-    virtual rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, float& pdf) const {
+    virtual rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, float& pdf) const {
         DirectionSample ds = sample_cos_hemisphere(rng.random_float(), rng.random_float());
         in_dir = ds.dir;
         pdf = ds.pdf;
@@ -81,7 +82,7 @@ public:
     }
 
     /// Default implementation cosine-samples the hemisphere.
-    rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, float& pdf) const override {
+    rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, float& pdf) const override {
         return (rng.random_float() < 0.5f ? a_ : b_)->sample(out_dir, in_dir, rng, pdf);
     }
 
@@ -144,7 +145,7 @@ public:
         return res;
     }
 
-    rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, BxDFFlags flags, BxDFFlags& sampled_flags, float& pdf) const {
+    rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, BxDFFlags flags, BxDFFlags& sampled_flags, float& pdf) const {
         float3 local_out = world_to_local(out_dir);
 
         // Select which to sample: BRDF or BTDF, based on importance specified by the BTDF.
@@ -0,0 +1,99 @@
+#ifndef IMBA_BSDF_BATCH_H
+#define IMBA_BSDF_BATCH_H
+
+#include "imbatracer/core/rgb.h"
+#include "imbatracer/core/common.h"
+
+#include "imbatracer/render/intersection.h"
+
+#include <cmath>
+
+namespace imba {
+
+/// Number of lanes of the batched BSDF kernels, which is the number of floats in an AVX register.
+static constexpr int BSDF_BATCH_SIZE = 8;
+
+/// Lambertian BSDFs of a batch of surface points, stored as a structure of arrays.
+/// Computes the same values as the BSDF created by a DiffuseMaterial, but for all the lanes at once, without any
+/// memory allocation or virtual call. The kernels have no branches, so that the compiler can vectorize them.
+/// All the lanes are always computed: unused lanes must be initialized, and their results ignored.
+struct DiffuseBSDFBatch {
+    static constexpr int N = BSDF_BATCH_SIZE;
+
+    // Shading frame: the local x axis is the v tangent, the local y axis the u tangent, and the normal is z.
+    float tx[N], ty[N], tz[N];
+    float bx[N], by[N], bz[N];
+    float nx[N], ny[N], nz[N];
+
+    float gx[N], gy[N], gz[N];  ///< Geometric normal
+    float ox[N], oy[N], oz[N];  ///< Outgoing direction, in world space
+    float cr[N], cg[N], cb[N];  ///< Color divided by pi
+
+    /// Sets the surface point and the color of one lane.
+    void set(int lane, const Intersection& isect, const rgb& color) {
+        tx[lane] = isect.v_tangent.x; ty[lane] = isect.v_tangent.y; tz[lane] = isect.v_tangent.z;
+        bx[lane] = isect.u_tangent.x; by[lane] = isect.u_tangent.y; bz[lane] = isect.u_tangent.z;
+        nx[lane] = isect.normal.x;    ny[lane] = isect.normal.y;    nz[lane] = isect.normal.z;
+
+        gx[lane] = isect.geom_normal.x; gy[lane] = isect.geom_normal.y; gz[lane] = isect.geom_normal.z;
+        ox[lane] = isect.out_dir.x;     oy[lane] = isect.out_dir.y;     oz[lane] = isect.out_dir.z;
+
+        cr[lane] = color.x * (1.0f / pi);
+        cg[lane] = color.y * (1.0f / pi);
+        cb[lane] = color.z * (1.0f / pi);
+    }
+
+    /// Evaluates the BSDFs for the given incoming directions in world space, and the pdf of sampling them.
+    /// Equivalent to BSDF::eval() and BSDF::pdf().
+    void eval(const float* dx, const float* dy, const float* dz,
+              float* r, float* g, float* b, float* pdf) const {
+        for (int i = 0; i < N; i++) {
+            const float in_z  = nx[i] * dx[i] + ny[i] * dy[i] + nz[i] * dz[i];
+            const float out_z = nx[i] * ox[i] + ny[i] * oy[i] + nz[i] * oz[i];
+            const float in_g  = gx[i] * dx[i] + gy[i] * dy[i] + gz[i] * dz[i];
+            const float out_g = gx[i] * ox[i] + gy[i] * oy[i] + gz[i] * oz[i];
+
+            // Directions on different sides of the geometry would select the (missing) BTDF.
+            const bool valid = in_g * out_g > 0.0f && in_z * out_z > 0.0f;
+            r[i]   = valid ? cr[i] : 0.0f;
+            g[i]   = valid ? cg[i] : 0.0f;
+            b[i]   = valid ? cb[i] : 0.0f;
+            pdf[i] = valid ? fabsf(in_z) * (1.0f / pi) : 0.0f;
+        }
+    }
+
+    /// Cosine-samples the incoming directions, given two random numbers per lane.
+    /// Equivalent to BSDF::sample(): the pdf and the value of a lane are zero when the sample is not valid.
+    void sample(const float* u1, const float* u2,
+                float* dx, float* dy, float* dz,
+                float* r, float* g, float* b, float* pdf) const {
+        for (int i = 0; i < N; i++) {
+            const float phi = 2.0f * pi * u1[i];
+            const float sin_t = sqrtf(1.0f - u2[i]);
+            const float cos_t = sqrtf(u2[i]);
+
+            // The sampled direction is on the same side as the outgoing direction.
+            const float out_z = nx[i] * ox[i] + ny[i] * oy[i] + nz[i] * oz[i];
+            const float lx = sin_t * cosf(phi);
+            const float ly = sin_t * sinf(phi);
+            const float lz = out_z < 0.0f ? -cos_t : cos_t;
+
+            dx[i] = tx[i] * lx + bx[i] * ly + nx[i] * lz;
+            dy[i] = ty[i] * lx + by[i] * ly + ny[i] * lz;
+            dz[i] = tz[i] * lx + bz[i] * ly + nz[i] * lz;
+
+            const float in_g  = gx[i] * dx[i] + gy[i] * dy[i] + gz[i] * dz[i];
+            const float out_g = gx[i] * ox[i] + gy[i] * oy[i] + gz[i] * oz[i];
+
+            const bool valid = in_g * out_g > 0.0f && lz * out_z > 0.0f;
+            r[i]   = valid ? cr[i] : 0.0f;
+            g[i]   = valid ? cg[i] : 0.0f;
+            b[i]   = valid ? cb[i] : 0.0f;
+            pdf[i] = valid ? cos_t * (1.0f / pi) : 0.0f;
+        }
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_BSDF_BATCH_H
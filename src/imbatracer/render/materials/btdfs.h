@@ -18,7 +18,7 @@ public:
         return rgb(0.0f);
     }
 
-    rgb sample(const float3& out_dir, float3& in_dir, RNG& rng, float& pdf) const override {
+    rgb sample(const float3& out_dir, float3& in_dir, Sampler& rng, float& pdf) const override {
         pdf = 1.0f;
 
         // Compute optical densities depending on whether the ray is coming from the outside or the inside.
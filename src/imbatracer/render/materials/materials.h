@@ -3,6 +3,7 @@
 
 #include "imbatracer/render/materials/brdfs.h"
 #include "imbatracer/render/materials/btdfs.h"
+#include "imbatracer/render/materials/bsdf_batch.h"
 
 #include "imbatracer/render/light.h"
 #include "imbatracer/render/texture_sampler.h"
@@ -22,6 +23,10 @@ public:
 
     virtual BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint = false) const = 0;
 
+    /// Returns the fraction of the light that is reflected or transmitted at the given surface point, in [0, 1].
+    /// Used as a guide for denoising, it does not need to match the BSDF exactly.
+    virtual rgb albedo(const Intersection& isect) const = 0;
+
     /// Associates the material with a light source.
     void set_emitter(const AreaEmitter* e) { emit_.reset(e); }
 
@@ -30,6 +35,9 @@ public:
 
     virtual bool is_specular() { return false; }
 
+    /// Returns true if the material is a DiffuseMaterial, whose BSDFs can be computed with a DiffuseBSDFBatch.
+    virtual bool is_diffuse() const { return false; }
+
     /// Updates the shading normal of the given intersection using bump mapping.
     void bump(Intersection& isect) {
         if (!bump_)
@@ -38,9 +46,9 @@ public:
         float du = 0.001f;
         float dv = 0.001f;
         float vscale = 0.02f;
-        auto u_displace = bump_->sample(float2(isect.uv.x + du, isect.uv.y));
-        auto v_displace = bump_->sample(float2(isect.uv.x, isect.uv.y + dv));
-        auto displace   = bump_->sample(isect.uv);
+        auto u_displace = bump_->sample(float2(isect.uv.x + du, isect.uv.y), isect.uv_footprint);
+        auto v_displace = bump_->sample(float2(isect.uv.x, isect.uv.y + dv), isect.uv_footprint);
+        auto displace   = bump_->sample(isect.uv, isect.uv_footprint);
 
         auto diff_u = vscale * (u_displace - displace)[0] / du;
         auto diff_v = vscale * (v_displace - displace)[0] / dv;
@@ -74,14 +82,19 @@ public:
     };
 
     BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint) const override {
-        rgb color = color_;
-        if (sampler_)
-            color = sampler_->sample(isect.uv);
-
-        auto brdf = mem_arena.alloc<Lambertian>(color);
+        auto brdf = mem_arena.alloc<Lambertian>(color(isect));
         return mem_arena.alloc<BSDF>(isect, brdf, nullptr);
     }
 
+    bool is_diffuse() const override { return true; }
+
+    rgb albedo(const Intersection& isect) const override { return color(isect); }
+
+    /// Returns the color of the material at the given surface point.
+    rgb color(const Intersection& isect) const {
+        return sampler_ ? sampler_->sample(isect.uv, isect.uv_footprint) : color_;
+    }
+
 private:
     rgb color_;
     const TextureSampler* sampler_;
@@ -106,6 +119,8 @@ public:
         return mem_arena.alloc<BSDF>(isect, brdf, nullptr);
     }
 
+    rgb albedo(const Intersection&) const override { return scale_; }
+
     bool is_specular() override { return true; }
 
 private:
@@ -139,6 +154,9 @@ public:
         return mem_arena.alloc<BSDF>(isect, brdf, btdf);
     }
 
+    /// Both the reflection and the transmission are visible through glass, but the scaling of each is unknown.
+    rgb albedo(const Intersection&) const override { return max(transmittance_, reflectance_); }
+
     bool is_specular() override { return true; }
 
 private:
@@ -170,7 +188,7 @@ public:
     BSDF* get_bsdf(const Intersection& isect, MemoryArena& mem_arena, bool adjoint) const override {
         rgb diff_color = diffuse_color_;
         if (diff_sampler_)
-            diff_color = diff_sampler_->sample(isect.uv);
+            diff_color = diff_sampler_->sample(isect.uv, isect.uv_footprint);
 
         auto fresnel = mem_arena.alloc<FresnelConductor>(1.0f, exponent_);
         auto spec_brdf = mem_arena.alloc<CookTorrance>(specular_color_, fresnel, exponent_);
@@ -181,6 +199,11 @@ public:
         return mem_arena.alloc<BSDF>(isect, brdf, nullptr);
     }
 
+    rgb albedo(const Intersection& isect) const override {
+        const rgb diff_color = diff_sampler_ ? diff_sampler_->sample(isect.uv, isect.uv_footprint) : diffuse_color_;
+        return min(diff_color + specular_color_, rgb(1.0f));
+    }
+
 private:
     float exponent_;
     rgb specular_color_;
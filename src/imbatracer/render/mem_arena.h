@@ -1,7 +1,11 @@
 #ifndef IMBA_MEM_ARENA_H
 #define IMBA_MEM_ARENA_H
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <new>
+#include <utility>
 #include <vector>
 #include <stdio.h>
 
@@ -11,21 +15,41 @@ namespace imba {
 
 /// Allocates large blocks of memory that can be used for "allocation" of many smaller chunks
 /// for example to allocate memory for BSDF objects.
-/// The blocks are kept in memory until the entire MemoryArena is destroyed.
+/// The blocks are kept in memory until the entire MemoryArena is destroyed. Every new block is twice as large as
+/// the previous one (up to a maximum), so that an arena that is used heavily only needs to allocate a few times.
+/// Objects that are larger than a quarter of the maximum block size are allocated separately, and freed by free_all().
 class MemoryArena {
+    static constexpr size_t MAX_BLOCK_SIZE = 64 * 1024;
+    static constexpr size_t LARGE_OBJECT_SIZE = MAX_BLOCK_SIZE / 4;
+
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
 public:
+    /// Statistics about the memory used by the arena.
+    struct Stats {
+        size_t block_count;      ///< Number of blocks currently allocated
+        size_t reserved_bytes;   ///< Total size of these blocks
+        size_t peak_bytes;       ///< Largest number of bytes in use between two calls to free_all()
+        size_t large_allocs;     ///< Number of objects that were too large for the blocks
+    };
+
     MemoryArena(size_t block_size = 512)
-        : block_size_(block_size), cur_block_(0)
+        : next_block_size_(block_size), cur_block_(0), cur_block_offset_(0)
+        , used_bytes_(0), peak_bytes_(0), large_allocs_(0)
     {
 #ifdef DEBUG_MEM_ARENA
-        printf("Memory arena created. Block size %d \n", block_size);
+        printf("Memory arena created. Block size %d \n", (int)block_size);
 #endif
-        allocate_block();
+        allocate_block(0);
     }
 
     ~MemoryArena() {
+        free_large();
         for (auto& b : blocks_) {
-            delete[] b;
+            delete[] b.data;
         }
         blocks_.clear();
 
@@ -39,54 +63,96 @@ public:
     MemoryArena(MemoryArena&) = delete;
     MemoryArena(MemoryArena&&) = delete;
 
-    void allocate_block() {
-        blocks_.emplace_back(new char[block_size_]);
-
-#ifdef DEBUG_MEM_ARENA
-        printf("Memory arena allocated a new block of size %d.\n", block_size_);
-#endif
-    }
-
     /// Releases all chunks and makes all memory in all blocks available for reusing.
-    /// Does not actually free any memory.
+    /// Only the memory of large objects is actually freed.
     void free_all() {
 #ifdef DEBUG_MEM_ARENA
-        printf("Freed %d blocks, current offset was %d \n", cur_block_ + 1, cur_block_offset_);
+        printf("Freed %d blocks, current offset was %d \n", (int)cur_block_ + 1, (int)cur_block_offset_);
 #endif
+        peak_bytes_ = std::max(peak_bytes_, used_bytes_);
+        used_bytes_ = 0;
         cur_block_ = 0;
         cur_block_offset_ = 0;
+        free_large();
     }
 
     /// Creates a new object of type T, using the memory blocks that were already allocated.
-    /// Memory is only allocated if there is not enough room in the last block. In that case, an entire new block is allocated and added.
+    /// Memory is only allocated if there is not enough room in the remaining blocks. In that case, a new, larger block is added.
     template <typename T, typename... Args>
     T* alloc(Args&&... args) {
-        // Round up chunk size for alignment
-        size_t size = sizeof(T);
-        size = (size + 0xf) & (~0xf); // 16 byte alignment
+        T* res = reinterpret_cast<T*>(alloc_bytes(sizeof(T), alignof(T)));
+        new (res) T(std::forward<Args>(args)...); // Use the placement operator new to call the constructor of T
+        return res;
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.block_count = blocks_.size();
+        s.reserved_bytes = 0;
+        for (auto& b : blocks_) s.reserved_bytes += b.size;
+        s.peak_bytes = std::max(peak_bytes_, used_bytes_);
+        s.large_allocs = large_allocs_;
+        return s;
+    }
+
+private:
+    size_t next_block_size_;
+    size_t cur_block_;
+    size_t cur_block_offset_;
+    std::vector<Block> blocks_;
+    std::vector<char*> large_;
 
-        if (cur_block_offset_ + size > block_size_) {
+    size_t used_bytes_;
+    size_t peak_bytes_;
+    size_t large_allocs_;
+
+    void allocate_block(size_t min_size) {
+        const size_t size = std::max(next_block_size_, min_size);
+        blocks_.push_back(Block{ new char[size], size });
+        next_block_size_ = size * 2 < MAX_BLOCK_SIZE ? size * 2 : MAX_BLOCK_SIZE;
+
+#ifdef DEBUG_MEM_ARENA
+        printf("Memory arena allocated a new block of size %d.\n", (int)size);
+#endif
+    }
+
+    /// Returns the padding that is needed to align the given address.
+    static size_t padding(const char* ptr, size_t align) {
+        const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+        return (align - addr % align) % align;
+    }
+
+    void* alloc_bytes(size_t size, size_t align) {
+        used_bytes_ += size;
+
+        if (size + align > LARGE_OBJECT_SIZE) {
+            // Large objects do not go into the blocks, they would waste most of the space.
+            char* mem = new char[size + align];
+            large_.push_back(mem);
+            large_allocs_++;
+            return mem + padding(mem, align);
+        }
+
+        size_t pad = padding(blocks_[cur_block_].data + cur_block_offset_, align);
+        while (cur_block_offset_ + pad + size > blocks_[cur_block_].size) {
             // Use the next block, allocate a new one if there are none left.
             ++cur_block_;
             if (cur_block_ >= blocks_.size())
-                allocate_block();
+                allocate_block(size + align);
 
             cur_block_offset_ = 0;
+            pad = padding(blocks_[cur_block_].data, align);
         }
 
-        size_t offset = cur_block_offset_;
-        cur_block_offset_ += size;
-
-        T* res = reinterpret_cast<T*>(blocks_[cur_block_] + offset);
-        new (res) T(std::forward<Args>(args)...); // Use the placement operator new to call the constructor of T
+        char* res = blocks_[cur_block_].data + cur_block_offset_ + pad;
+        cur_block_offset_ += pad + size;
         return res;
     }
 
-private:
-    const size_t block_size_;
-    size_t cur_block_;
-    size_t cur_block_offset_;
-    std::vector<char *> blocks_;
+    void free_large() {
+        for (auto ptr : large_) delete[] ptr;
+        large_.clear();
+    }
 };
 
 } // namespace imba
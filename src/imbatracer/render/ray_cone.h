@@ -0,0 +1,34 @@
+#ifndef IMBA_RAY_CONE_H
+#define IMBA_RAY_CONE_H
+
+#include <cmath>
+#include <algorithm>
+
+#include "imbatracer/core/common.h"
+
+namespace imba {
+
+/// Cone that bounds the footprint of a ray, used to select the level of detail of the textures.
+/// See "Texture Level of Detail Strategies for Real-Time Ray Tracing", Akenine-Moller et al., Ray Tracing Gems 2019.
+/// A cone of width zero disables texture filtering.
+struct RayCone {
+    float width = 0.0f;     ///< Width of the cone at the origin of the ray
+    float spread = 0.0f;    ///< Angle of the cone, in radians
+
+    RayCone() {}
+    RayCone(float w, float s) : width(w), spread(s) {}
+
+    /// Moves the origin of the cone along the ray, by the given distance.
+    void propagate(float t) { width += spread * t; }
+
+    /// Updates the angle of the cone after the ray is scattered with the given pdf (in solid angle measure).
+    /// Specular scattering keeps the angle (ignoring the curvature of the surface). Otherwise, the direction only
+    /// represents a region of about 1 / pdf steradians, so the angle is widened accordingly.
+    void scatter(bool specular, float pdf) {
+        if (!specular) spread = std::max(spread, std::min(1.0f / std::sqrt(pdf), pi));
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_RAY_CONE_H
@@ -0,0 +1,158 @@
+#ifndef IMBA_ADAPTIVE_TILE_GEN_H
+#define IMBA_ADAPTIVE_TILE_GEN_H
+
+#include "imbatracer/render/ray_gen/tile_gen.h"
+
+#include <tbb/parallel_for.h>
+
+#include <cmath>
+#include <vector>
+
+namespace imba {
+
+/// Generates the same tiles as the DefaultTileGen, but stops sampling the tiles that have converged.
+/// The variance of every pixel is estimated from the contributions of the individual frames to the accumulated image.
+/// A tile is skipped once the average relative standard error of its pixels drops below the given threshold.
+/// To keep the normalization of the accumulated image (by the total number of frames) valid, the current estimate is
+/// added to the skipped tiles at the end of every frame. Every skipped tile is still rendered once every few frames,
+/// to protect against a premature convergence estimate.
+/// This requires that only the rays of a tile contribute to its pixels, so it cannot be used for light tracing.
+template<typename StateType>
+class AdaptiveTileGen : public TileGen<StateType> {
+    using typename TileGen<StateType>::TilePtr;
+
+    // Minimum number of rendered frames before a tile can be considered converged.
+    static constexpr int MIN_FRAMES = 8;
+    // A converged tile is rendered again every RECHECK_INTERVAL frames.
+    static constexpr int RECHECK_INTERVAL = 16;
+
+    struct TileInfo {
+        int x, y, w, h;
+        int rendered;   ///< Number of frames in which the tile was rendered
+        bool skipped;   ///< True if the tile is not rendered in the current frame
+        bool converged;
+    };
+
+public:
+    AdaptiveTileGen(int w, int h, int spp, int tilesize, float max_error, TileOrder order = TILE_ORDER_ROW_MAJOR,
+                    SampleSequence sequence = SampleSequence::SOBOL, int first_sample = 0)
+        : tiles_(w, h, spp, tilesize, order, sequence, first_sample)
+        , width_(w)
+        , max_error_(max_error)
+        , prev_lum_(w * h)
+        , sum_sqr_(w * h)
+        , info_(tiles_.tile_count())
+    {
+        for (int i = 0; i < tiles_.tile_count(); ++i) {
+            auto& t = info_[i];
+            if (!tiles_.tile_rect(i, t.x, t.y, t.w, t.h))
+                t.w = t.h = 0;
+        }
+
+        reset();
+    }
+
+    TilePtr next_tile(uint8_t* mem) override final {
+        int tile_id;
+
+        while ((tile_id = cur_tile_++) < tile_count()) {
+            auto t = tile(tile_id, mem);
+            if (t) return t;
+        }
+
+        return nullptr;
+    }
+
+    TilePtr tile(int id, uint8_t* mem) override final {
+        if (info_[id].skipped) return nullptr;
+        return tiles_.tile(id, mem);
+    }
+
+    int tile_count() const override final { return tiles_.tile_count(); }
+
+    size_t sizeof_ray_gen() const override final {
+        return tiles_.sizeof_ray_gen();
+    }
+
+    void start_frame() override final {
+        cur_tile_ = 0;
+        tiles_.start_frame();
+
+        for (auto& t : info_)
+            t.skipped = t.converged && (frames_ % RECHECK_INTERVAL != 0);
+    }
+
+    void end_frame(AtomicImage& img) override final {
+        const int frames = ++frames_;
+
+        tbb::parallel_for(0, static_cast<int>(info_.size()), [&] (int id) {
+            auto& t = info_[id];
+            if (t.w == 0) return;
+
+            if (t.skipped) {
+                // Add the current estimate, i.e. the average over the previous frames, to the pixels of the tile.
+                const float scale = 1.0f / (frames - 1);
+                for_each_pixel(t, [&] (int p) {
+                    const rgb c = img.pixels()[p];
+                    img.pixels()[p].apply<std::plus<float> >(c * scale);
+                    prev_lum_[p] = luminance(rgb(img.pixels()[p]));
+                });
+                return;
+            }
+
+            // Update the variance estimates from the contribution of this frame.
+            t.rendered++;
+            float error = 0.0f;
+            for_each_pixel(t, [&] (int p) {
+                const float lum = luminance(rgb(img.pixels()[p]));
+                const float contrib = lum - prev_lum_[p];
+                prev_lum_[p] = lum;
+                sum_sqr_[p] += contrib * contrib;
+
+                const float mean = lum / frames;
+                const float var = std::max(0.0f, sum_sqr_[p] / t.rendered - mean * mean);
+                error += std::sqrt(var / t.rendered) / (mean + 1e-3f);
+            });
+
+            t.converged = t.rendered >= MIN_FRAMES && error / (t.w * t.h) < max_error_;
+        });
+    }
+
+    void reset() override final {
+        frames_ = 0;
+        std::fill(prev_lum_.begin(), prev_lum_.end(), 0.0f);
+        std::fill(sum_sqr_.begin(), sum_sqr_.end(), 0.0f);
+
+        for (auto& t : info_) {
+            t.rendered = 0;
+            t.skipped = false;
+            t.converged = false;
+        }
+    }
+
+private:
+    DefaultTileGen<StateType> tiles_;
+    int width_;
+    float max_error_;
+
+    // Luminance of every pixel after the previous frame, and sum of the squared luminance of the contributions of all frames.
+    std::vector<float> prev_lum_;
+    std::vector<float> sum_sqr_;
+
+    std::vector<TileInfo> info_;
+    int frames_;
+
+    std::atomic<int> cur_tile_;
+
+    template <typename F>
+    void for_each_pixel(const TileInfo& t, F f) const {
+        for (int y = t.y; y < t.y + t.h; ++y) {
+            for (int x = t.x; x < t.x + t.w; ++x)
+                f(y * width_ + x);
+        }
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_ADAPTIVE_TILE_GEN_H
@@ -7,6 +7,9 @@
 
 #include "imbatracer/core/float4x4.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace imba {
 
 class PerspectiveCamera {
@@ -25,6 +28,9 @@ public:
     }
 
     void move(float3 pos, float3 dir, float3 up) {
+        // The given up vector is kept, since the camera is moved again when it is resized.
+        up_ = up;
+
         dir = normalize(dir);
         float3 right = normalize(cross(dir, up));
         up = cross(dir, right);
@@ -54,6 +60,13 @@ public:
         img_plane_dist_ = width_ / (2.0f * tan_half);
     }
 
+    /// Changes the resolution of the image, keeping the field of view and the position of the camera.
+    void resize(float w, float h) {
+        width_ = w;
+        height_ = h;
+        move(pos_, forward_, up_);
+    }
+
     Ray generate_ray(const float2& raster_pos) const {
         const auto w = raster_to_world(raster_pos);
         const float3 dir = normalize(w - pos_);
@@ -68,6 +81,39 @@ public:
         return generate_ray(float2(x,y));
     }
 
+    /// Generates the rays through a batch of raster positions. Gives the same rays as generate_ray(), but the
+    /// projection and the normalization are done over arrays, which the compiler vectorizes.
+    void generate_rays(int count, const float* xs, const float* ys, Ray* rays) const {
+        constexpr int CHUNK = 64;
+        float dx[CHUNK], dy[CHUNK], dz[CHUNK];
+
+        const float4* m = raster_to_world_.rows;
+        for (int first = 0; first < count; first += CHUNK) {
+            const int n = std::min(CHUNK, count - first);
+            const float* x = xs + first;
+            const float* y = ys + first;
+
+            // The rows of the matrix are applied to (y, x, 0, 1), see raster_to_world().
+            for (int i = 0; i < n; ++i) {
+                const float inv_w = 1.0f / (m[3].x * y[i] + m[3].y * x[i] + m[3].w);
+                const float px = (m[0].x * y[i] + m[0].y * x[i] + m[0].w) * inv_w - pos_.x;
+                const float py = (m[1].x * y[i] + m[1].y * x[i] + m[1].w) * inv_w - pos_.y;
+                const float pz = (m[2].x * y[i] + m[2].y * x[i] + m[2].w) * inv_w - pos_.z;
+                const float inv_len = 1.0f / std::sqrt(px * px + py * py + pz * pz);
+                dx[i] = px * inv_len;
+                dy[i] = py * inv_len;
+                dz[i] = pz * inv_len;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                rays[first + i] = Ray {
+                    { pos_.x, pos_.y, pos_.z, 0.0f },
+                    { dx[i], dy[i], dz[i], FLT_MAX }
+                };
+            }
+        }
+    }
+
     float2 world_to_raster(const float3& world_pos) const {
         const auto t = world_to_raster_ * float4(world_pos, 1.0f);
         return float2(t.y, t.x) / t.w;
@@ -97,6 +143,16 @@ public:
 
     const float image_plane_dist() const { return img_plane_dist_; }
 
+    /// Returns true if both cameras have the same resolution, field of view and position, and thus generate the same rays.
+    bool same_view(const PerspectiveCamera& other) const {
+        auto same = [] (const float3& a, const float3& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+        return width_ == other.width_ && height_ == other.height_ && fov_ == other.fov_ && aspect_ == other.aspect_ &&
+               same(pos_, other.pos_) && same(forward_, other.forward_) && same(up_, other.up_);
+    }
+
+    /// Returns the cone of a primary ray, which covers one pixel.
+    RayCone pixel_cone() const { return RayCone(0.0f, 1.0f / img_plane_dist_); }
+
 private:
     float width_;
     float height_;
@@ -105,6 +161,7 @@ private:
 
     float3 pos_;
     float3 forward_;
+    float3 up_;
     float img_plane_dist_;
 
     float4x4 world_to_raster_;
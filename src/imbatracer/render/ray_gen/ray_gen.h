@@ -2,10 +2,10 @@
 #define IMBA_RAY_GEN_H
 
 #include "imbatracer/render/scheduling/ray_queue.h"
-#include "imbatracer/render/random.h"
+#include "imbatracer/render/sampler.h"
 
+#include <algorithm>
 #include <cfloat>
-#include <random>
 #include <functional>
 
 namespace imba {
@@ -15,21 +15,46 @@ class RayGen {
 public:
     virtual ~RayGen() {}
 
-    typedef std::function<void (int, int, ::Ray&, StateType&)> SamplePixelFn;
+    /// Number of rays that are passed at once to the sampling function.
+    static constexpr int BATCH_SIZE = 64;
+
+    /// Samples a batch of rays: takes the number of rays, the two coordinates of every ray (the pixel for camera
+    /// rays, the ray and the light for light rays), and fills the rays and their states, whose ids and samplers are
+    /// already set. Called once per batch, instead of once per ray.
+    typedef std::function<void (int, const int*, const int*, ::Ray*, StateType*)> SamplePixelFn;
     virtual void fill_queue(RayQueue<StateType>&, SamplePixelFn) = 0;
     virtual void start_frame() = 0;
     virtual bool is_empty() const = 0;
+
+    /// Changes the number of samples per pixel of the next frames. Returns false if it cannot be changed.
+    virtual bool set_spp(int) { return false; }
+    /// Changes the resolution of the image of the next frames. Returns false if it cannot be changed.
+    virtual bool set_resolution(int, int) { return false; }
 };
 
 /// Generates n primary rays per pixel in range [0,0] to [w,h]
+/// The samples of a pixel are consecutive points of the sequence of the pixel, over all the frames.
 template <typename StateType>
 class PixelRayGen : public RayGen<StateType> {
 public:
-    PixelRayGen(int w, int h, int spp)
+    /// The samples of the first frame start at the given index of the sequence of the pixels.
+    PixelRayGen(int w, int h, int spp, SampleSequence sequence = SampleSequence::SOBOL, int first_sample = 0)
         : width_(w), height_(h), n_samples_(spp), next_pixel_(0)
+        , sequence_(sequence), first_sample_(first_sample), next_sample_(first_sample)
+        , left_(0), top_(0), full_width_(w)
     {}
 
-    void start_frame() override { next_pixel_ = 0; }
+    void start_frame() override {
+        next_pixel_ = 0;
+        first_sample_ = next_sample_;
+        next_sample_ += n_samples_;
+    }
+
+    /// Must be called between two frames, i.e. before start_frame().
+    bool set_spp(int spp) override { n_samples_ = spp; return true; }
+
+    /// Must be called between two frames, i.e. before start_frame().
+    bool set_resolution(int w, int h) override { width_ = w; height_ = h; full_width_ = w; return true; }
 
     bool is_empty() const override { return next_pixel_ >= max_rays(); }
 
@@ -46,33 +71,38 @@ public:
             count = max_rays() - next_pixel_;
         }
 
-        static std::random_device rd;
-        uint64_t seed_base = rd();
-        for (int i = next_pixel_; i < next_pixel_ + count; ++i) {
-            // Compute coordinates, id etc.
-            int pixel_idx = i / n_samples_;
-            int sample_idx = i % n_samples_;
-            int y = pixel_idx / width_;
-            int x = pixel_idx % width_;
-
-            // Create the ray and its state.
-            StateType state;
-            ::Ray ray;
-
-            state.pixel_id = pixel_idx;
-            state.sample_id = sample_idx;
-
-            // Use Bernstein's hash function to scramble the seed base value
-            int seed = seed_base;
-            seed = 33 * seed ^ i;
-            seed = 33 * seed ^ i;
-            seed = 33 * seed ^ i;
-            seed = 33 * seed ^ i;
-            state.rng = RNG(seed);
-            state.rng.discard((seed % 5) + 16 + pixel_idx % 5);
-            sample_pixel(x, y, ray, state);
-
-            out.push(ray, state);
+        constexpr int BATCH_SIZE = RayGen<StateType>::BATCH_SIZE;
+        StateType states[BATCH_SIZE];
+        ::Ray rays[BATCH_SIZE];
+        int xs[BATCH_SIZE], ys[BATCH_SIZE];
+
+        const int end = next_pixel_ + count;
+        for (int first = next_pixel_; first < end; first += BATCH_SIZE) {
+            const int n = std::min(BATCH_SIZE, end - first);
+
+            for (int j = 0; j < n; ++j) {
+                // Compute coordinates, id etc.
+                const int i = first + j;
+                const int pixel_idx = i / n_samples_;
+                const int sample_idx = i % n_samples_;
+                const int x = pixel_idx % width_ + left_;
+                const int y = pixel_idx / width_ + top_;
+                const int pixel_id = y * full_width_ + x;
+
+                StateType& state = states[j];
+                state.pixel_id = pixel_id;
+                state.sample_id = sample_idx;
+
+                // The sequence of a pixel only depends on its position in the image.
+                const uint32_t sample_index = uint32_t(first_sample_ + sample_idx);
+                state.rng = Sampler(sequence_, sample_index, detail::hash_uint(pixel_id));
+
+                xs[j] = x;
+                ys[j] = y;
+            }
+
+            sample_pixel(n, xs, ys, rays, states);
+            out.push(rays, rays + n, states, states + n);
         }
 
         // store which pixel has to be sampled next
@@ -81,9 +111,17 @@ public:
 
 protected:
     int next_pixel_;
-    const int width_;
-    const int height_;
-    const int n_samples_;
+    int width_;
+    int height_;
+    int n_samples_;
+
+    const SampleSequence sequence_;
+    int first_sample_;  ///< Index of the first sample of the current frame in the sequence of the pixels
+    int next_sample_;   ///< Index of the first sample of the next frame
+
+    // Position of the generated pixels in the whole image, which is larger than width_ x height_ for tiles.
+    int left_, top_;
+    int full_width_;
 
     int max_rays() const { return width_ * height_ * n_samples_; }
 };
@@ -93,30 +131,23 @@ protected:
 template<typename StateType>
 class TiledRayGen : public PixelRayGen<StateType> {
 public:
-    TiledRayGen(int left, int top, int w, int h, int spp, int full_width, int full_height)
-        : PixelRayGen<StateType>(w, h, spp), top_(top), left_(left)
-        , full_height_(full_height), full_width_(full_width)
-    {}
-
-    void fill_queue(RayQueue<StateType>& out, typename RayGen<StateType>::SamplePixelFn sample_pixel) override {
-        PixelRayGen<StateType>::fill_queue(out,
-            [sample_pixel, this](int x, int y, ::Ray& r, StateType& s) {
-                s.pixel_id = (y + top_) * full_width_ + (x + left_);
-                sample_pixel(x + left_, y + top_, r, s);
-            });
+    TiledRayGen(int left, int top, int w, int h, int spp, int full_width, int full_height,
+                SampleSequence sequence = SampleSequence::SOBOL, int first_sample = 0)
+        : PixelRayGen<StateType>(w, h, spp, sequence, first_sample)
+    {
+        this->left_ = left;
+        this->top_ = top;
+        this->full_width_ = full_width;
     }
-
-private:
-    const int top_, left_;
-    const int full_width_, full_height_;
 };
 
 /// Generates rays starting from the light sources in the scene.
 template<typename StateType>
 class LightRayGen : public RayGen<StateType> {
 public:
-    LightRayGen(int light, int ray_count)
-        : light_(light), ray_count_(ray_count)
+    /// Every light ray generator of a frame must have a different seed.
+    LightRayGen(int light, int ray_count, SampleSequence sequence = SampleSequence::SOBOL, uint32_t seed = 0)
+        : light_(light), ray_count_(ray_count), sequence_(sequence), seed_(seed)
     {}
 
     virtual void fill_queue(RayQueue<StateType>& out, typename RayGen<StateType>::SamplePixelFn sample_light) override {
@@ -125,27 +156,28 @@ public:
         count = std::min(count, ray_count_ - generated_);
         if (count <= 0) return;
 
-        static std::random_device rd;
-        uint64_t seed_base = rd();
-        for (int i = generated_; i < generated_ + count; ++i) {
-            // Create the ray and its state.
-            StateType state;
-            ::Ray ray;
-
-            state.ray_id = i;
-            state.light_id = light_;
-
-            // Use Bernstein's hash function to scramble the seed base value
-            int seed = seed_base;
-            seed = 33 * seed ^ i;
-            seed = 33 * seed ^ i;
-            seed = 33 * seed ^ i;
-            seed = 33 * seed ^ i;
-            state.rng = RNG(seed);
-            state.rng.discard((seed % 5) + 16 + i % 5);
-            sample_light(i, light_, ray, state);
-
-            out.push(ray, state);
+        constexpr int BATCH_SIZE = RayGen<StateType>::BATCH_SIZE;
+        StateType states[BATCH_SIZE];
+        ::Ray rays[BATCH_SIZE];
+        int ray_ids[BATCH_SIZE], lights[BATCH_SIZE];
+
+        const int end = generated_ + count;
+        for (int first = generated_; first < end; first += BATCH_SIZE) {
+            const int n = std::min(BATCH_SIZE, end - first);
+
+            for (int j = 0; j < n; ++j) {
+                const int i = first + j;
+                StateType& state = states[j];
+                state.ray_id = i;
+                state.light_id = light_;
+                state.rng = Sampler(sequence_, i, detail::hash_uint(seed_));
+
+                ray_ids[j] = i;
+                lights[j] = light_;
+            }
+
+            sample_light(n, ray_ids, lights, rays, states);
+            out.push(rays, rays + n, states, states + n);
         }
 
         generated_ += count;
@@ -163,6 +195,9 @@ private:
     int light_;
     int ray_count_;
     int generated_;
+
+    const SampleSequence sequence_;
+    const uint32_t seed_;
 };
 
 } // namespace imba
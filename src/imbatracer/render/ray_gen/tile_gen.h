@@ -2,8 +2,11 @@
 #define IMBA_TILE_GEN_H
 
 #include "imbatracer/render/ray_gen/ray_gen.h"
+#include "imbatracer/core/image.h"
 
 #include <numeric>
+#include <algorithm>
+#include <cmath>
 
 // Macro for empty loop bodies to suppress compiler warnings
 #define NO_OP ((void)0)
@@ -27,72 +30,208 @@ public:
 
     /// Obtains a tile and creates a RayGen object for it. Uses the given pointer instead of allocating memory.
     virtual TilePtr next_tile(uint8_t*) = 0;
+    /// Creates the RayGen object for the tile with the given id, independently of the shared tile counter.
+    /// Returns nullptr if the id does not correspond to a tile (e.g. because it was merged with a neighbour).
+    virtual TilePtr tile(int id, uint8_t*) = 0;
+    /// Returns the number of tile ids in a frame. Valid ids are in [0, tile_count()).
+    virtual int tile_count() const = 0;
     /// Returns the size of the storage required to store a RayGen object.
     virtual size_t sizeof_ray_gen() const = 0;
     /// Restarts the frame.
     virtual void start_frame() = 0;
+    /// Called once all tiles of a frame have been rendered into the given image.
+    virtual void end_frame(AtomicImage&) {}
+    /// Called whenever the accumulated image is cleared, e.g. because the camera moved.
+    virtual void reset() {}
+    /// Changes the number of samples per pixel of the next frames. Must be called between two frames.
+    /// Returns false if the tile generator does not support it.
+    virtual bool set_spp(int) { return false; }
+    /// Changes the resolution of the image of the next frames. Must be called between two frames.
+    /// Returns false if the tile generator does not support it.
+    virtual bool set_resolution(int, int) { return false; }
+};
+
+/// Order in which the DefaultTileGen hands out its tiles.
+enum TileOrder {
+    TILE_ORDER_ROW_MAJOR,   ///< Row by row, from the top left corner.
+    TILE_ORDER_HILBERT,     ///< Along a Hilbert curve, consecutive tiles are always neighbours.
+    TILE_ORDER_SPIRAL,      ///< From the center of the image outwards.
+    TILE_ORDER_INTERLEAVED  ///< Every other tile in both directions first, then the tiles in between.
 };
 
 /// Generates quadratic tiles of a fixed size.
+/// The samples of the first frame start at the given index of the sequence of the pixels, so that processes that
+/// render the same image with disjoint ranges of samples can be merged.
 template<typename StateType>
 class DefaultTileGen : public TileGen<StateType> {
     using typename TileGen<StateType>::TilePtr;
 
 public:
-    DefaultTileGen(int w, int h, int spp, int tilesize)
-        : tile_size_(tilesize), spp_(spp), width_(w), height_(h)
+    DefaultTileGen(int w, int h, int spp, int tilesize, TileOrder order = TILE_ORDER_ROW_MAJOR,
+                   SampleSequence sequence = SampleSequence::SOBOL, int first_sample = 0)
+        : tile_size_(tilesize), spp_(spp), order_type_(order), sequence_(sequence)
+        , first_sample_(first_sample), next_sample_(first_sample)
     {
-        // Compute the number of tiles required to cover the entire image.
-        tiles_per_row_ = width_ / tile_size_ + (width_ % tile_size_ == 0 ? 0 : 1);
-        tiles_per_col_ = height_ / tile_size_ + (height_ % tile_size_ == 0 ? 0 : 1);
-        tile_count_ = tiles_per_row_ * tiles_per_col_;
+        set_resolution(w, h);
     }
 
     TilePtr next_tile(uint8_t* mem) override final {
         int tile_id;
 
         while ((tile_id = cur_tile_++) < tile_count_) {
-            // Get the next tile and compute its extents
-            int tile_pos_x  = (tile_id % tiles_per_row_) * tile_size_;
-            int tile_pos_y  = (tile_id / tiles_per_row_) * tile_size_;
-            int tile_width  = std::min(width_ - tile_pos_x, tile_size_);
-            int tile_height = std::min(height_ - tile_pos_y, tile_size_);
+            auto t = tile(tile_id, mem);
+            if (t) return t;
+        }
 
-            // If the next tile is smaller than half the size, acquire it as well.
-            // If this tile is smaller than half the size, skip it (was acquired by one of its neighbours)
-            if (tile_width < tile_size_ / 2 ||
-                tile_height < tile_size_ / 2)
-                continue;
+        return nullptr;
+    }
 
-            if (width_ - (tile_pos_x + tile_width) < tile_size_ / 2)
-                tile_width += width_ - (tile_pos_x + tile_width);
+    TilePtr tile(int id, uint8_t* mem) override final {
+        int tile_pos_x, tile_pos_y, tile_width, tile_height;
+        if (!tile_rect(id, tile_pos_x, tile_pos_y, tile_width, tile_height))
+            return nullptr;
 
-            if (height_ - (tile_pos_y + tile_height) < tile_size_ / 2)
-                tile_height += height_ - (tile_pos_y + tile_height);
+        return TilePtr(new (mem) TiledRayGen<StateType>(tile_pos_x, tile_pos_y, tile_width, tile_height, spp_, width_, height_,
+                                                        sequence_, first_sample_));
+    }
 
-            return TilePtr(new (mem) TiledRayGen<StateType>(tile_pos_x, tile_pos_y, tile_width, tile_height, spp_, width_, height_));
-        }
+    /// Computes the extents of the tile with the given id. Returns false if the id does not correspond to a tile.
+    bool tile_rect(int id, int& tile_pos_x, int& tile_pos_y, int& tile_width, int& tile_height) const {
+        // Compute the extents of the tile
+        const int tile_id = order_[id];
+        tile_pos_x  = (tile_id % tiles_per_row_) * tile_size_;
+        tile_pos_y  = (tile_id / tiles_per_row_) * tile_size_;
+        tile_width  = std::min(width_ - tile_pos_x, tile_size_);
+        tile_height = std::min(height_ - tile_pos_y, tile_size_);
 
-        return nullptr;
+        // If the next tile is smaller than half the size, acquire it as well.
+        // If this tile is smaller than half the size, skip it (was acquired by one of its neighbours)
+        if (tile_width < tile_size_ / 2 ||
+            tile_height < tile_size_ / 2)
+            return false;
+
+        if (width_ - (tile_pos_x + tile_width) < tile_size_ / 2)
+            tile_width += width_ - (tile_pos_x + tile_width);
+
+        if (height_ - (tile_pos_y + tile_height) < tile_size_ / 2)
+            tile_height += height_ - (tile_pos_y + tile_height);
+
+        return true;
     }
 
+    int tile_count() const override final { return tile_count_; }
+
     size_t sizeof_ray_gen() const override final {
         return sizeof(TiledRayGen<StateType>);
     }
 
     void start_frame() override final {
         cur_tile_ = 0;
+        first_sample_ = next_sample_;
+        next_sample_ += spp_;
+    }
+
+    bool set_spp(int spp) override final { spp_ = spp; return true; }
+
+    bool set_resolution(int w, int h) override final {
+        width_ = w;
+        height_ = h;
+
+        // Compute the number of tiles required to cover the entire image.
+        tiles_per_row_ = width_ / tile_size_ + (width_ % tile_size_ == 0 ? 0 : 1);
+        tiles_per_col_ = height_ / tile_size_ + (height_ % tile_size_ == 0 ? 0 : 1);
+        tile_count_ = tiles_per_row_ * tiles_per_col_;
+
+        compute_order(order_type_);
+        return true;
     }
 
 private:
     int tile_size_;
     int spp_, width_, height_;
+    TileOrder order_type_;
+
+    SampleSequence sequence_;
+    int first_sample_;  ///< Index of the first sample of the pixels in the current frame
+    int next_sample_;
 
     int tiles_per_row_;
     int tiles_per_col_;
     int tile_count_;
 
+    // Maps the tile ids to the row-major index of the tiles in the image.
+    std::vector<int> order_;
+
     std::atomic<int> cur_tile_;
+
+    void compute_order(TileOrder order) {
+        order_.resize(tile_count_);
+        std::iota(order_.begin(), order_.end(), 0);
+
+        switch (order) {
+        case TILE_ORDER_HILBERT: {
+                // Walk along the curve for the smallest power of two grid that covers all tiles, skipping the cells outside.
+                int n = 1;
+                while (n < tiles_per_row_ || n < tiles_per_col_) n *= 2;
+
+                int k = 0;
+                for (int d = 0; d < n * n; ++d) {
+                    int x, y;
+                    hilbert_to_xy(n, d, x, y);
+                    if (x < tiles_per_row_ && y < tiles_per_col_)
+                        order_[k++] = y * tiles_per_row_ + x;
+                }
+            }
+            break;
+
+        case TILE_ORDER_SPIRAL: {
+                // Sort by the distance of the tile center to the image center, and by the angle within each ring.
+                const float cx = tiles_per_row_ * 0.5f;
+                const float cy = tiles_per_col_ * 0.5f;
+                auto ring = [=] (int t) {
+                    return std::max(std::abs(t % tiles_per_row_ + 0.5f - cx), std::abs(t / tiles_per_row_ + 0.5f - cy));
+                };
+                auto angle = [=] (int t) {
+                    return std::atan2(t / tiles_per_row_ + 0.5f - cy, t % tiles_per_row_ + 0.5f - cx);
+                };
+                std::sort(order_.begin(), order_.end(), [=] (int a, int b) {
+                    const float ra = ring(a), rb = ring(b);
+                    return ra < rb || (ra == rb && angle(a) < angle(b));
+                });
+            }
+            break;
+
+        case TILE_ORDER_INTERLEAVED:
+            // Tiles that are processed at the same time are spread over the whole image.
+            std::stable_sort(order_.begin(), order_.end(), [this] (int a, int b) {
+                const int pa = (a % tiles_per_row_) % 2 + 2 * ((a / tiles_per_row_) % 2);
+                const int pb = (b % tiles_per_row_) % 2 + 2 * ((b / tiles_per_row_) % 2);
+                return pa < pb;
+            });
+            break;
+
+        default: break;
+        }
+    }
+
+    /// Converts a distance along the Hilbert curve that covers an n by n grid (n a power of two) into coordinates.
+    static void hilbert_to_xy(int n, int d, int& x, int& y) {
+        x = y = 0;
+        for (int s = 1; s < n; s *= 2) {
+            const int rx = 1 & (d / 2);
+            const int ry = 1 & (d ^ rx);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
+            d /= 4;
+        }
+    }
 };
 
 /// Generates "tiles" for ligth tracing: every tile corresponds to a set of samples drawn from one light source.
@@ -108,26 +247,39 @@ public:
     /// \param light_count      Number of light sources in the scene
     /// \param path_count       Total number of light paths for all lights combined
     /// \param desired_per_tile Target number of rays per tile, might generate slightly more or less (due to rounding)
-    UniformLightTileGen(int light_count, int path_count, int desired_per_tile)
+    /// \param sequence         Sequence used to sample the light paths
+    /// \param first_frame      Index of the first frame, which selects the light paths. Processes that render the same
+    ///                         image must use disjoint ranges of frames to trace independent light paths.
+    UniformLightTileGen(int light_count, int path_count, int desired_per_tile,
+                        SampleSequence sequence = SampleSequence::SOBOL, int first_frame = 0)
         : light_count_(light_count)
-        , path_count_(path_count)
         , desired_per_tile_(desired_per_tile)
-        , rays_per_light_(light_count, path_count / light_count)
-        , cumul_tiles_per_light_(light_count)
         , tile_threshold_(desired_per_tile / 2)
+        , sequence_(sequence)
+        , frame_(first_frame - 1)
     {
         assert(light_count > 0);
-        assert(path_count > 0);
         assert(desired_per_tile > 0);
 
+        set_path_count(path_count);
+    }
+
+    /// Changes the total number of light paths of the next frames. Must be called between two frames.
+    void set_path_count(int path_count) {
+        assert(path_count > 0);
+
+        path_count_ = path_count;
+        rays_per_light_.assign(light_count_, path_count / light_count_);
+        cumul_tiles_per_light_.resize(light_count_);
+
         // Number of paths might not be a multiple of the number of lights
         // To still generate exactly path_count paths, we assign the leftovers to the first light
-        rays_per_light_[0] += path_count % light_count;
+        rays_per_light_[0] += path_count % light_count_;
 
         // Compute the number of tiles for every light source
-        for (int i = 0; i < light_count; ++i) {
-            cumul_tiles_per_light_[i] = rays_per_light_[i] / desired_per_tile;
-            if ((rays_per_light_[i] % desired_per_tile) > tile_threshold_ || cumul_tiles_per_light_[i] == 0) {
+        for (int i = 0; i < light_count_; ++i) {
+            cumul_tiles_per_light_[i] = rays_per_light_[i] / desired_per_tile_;
+            if ((rays_per_light_[i] % desired_per_tile_) > tile_threshold_ || cumul_tiles_per_light_[i] == 0) {
                 // Only add another tile for the remainder if it is big enough or there is no tile yet
                 cumul_tiles_per_light_[i]++;
             }
@@ -136,9 +288,13 @@ public:
         std::partial_sum(cumul_tiles_per_light_.begin(), cumul_tiles_per_light_.end(), cumul_tiles_per_light_.begin());
     }
 
+    int path_count() const { return path_count_; }
+
     TilePtr next_tile(uint8_t* mem) override final {
-        int tile_id = cur_tile_++;
+        return tile(cur_tile_++, mem);
+    }
 
+    TilePtr tile(int tile_id, uint8_t* mem) override final {
         // Compute the light that this tile belongs to
         if (tile_id >= cumul_tiles_per_light_.back())
             return nullptr;
@@ -154,15 +310,20 @@ public:
             ray_count = rays_per_light_[light] - tiles * desired_per_tile_;
         }
 
-        return TilePtr(new (mem) LightRayGen<StateType>(light, ray_count));
+        // Every tile of every frame samples its light paths with a different sequence.
+        const uint32_t seed = detail::hash_combine(uint32_t(frame_), uint32_t(tile_id));
+        return TilePtr(new (mem) LightRayGen<StateType>(light, ray_count, sequence_, seed));
     }
 
+    int tile_count() const override final { return cumul_tiles_per_light_.back(); }
+
     size_t sizeof_ray_gen() const override final {
         return sizeof(LightRayGen<StateType>);
     }
 
     void start_frame() override final {
         cur_tile_ = 0;
+        frame_++;
     }
 
 private:
@@ -174,6 +335,9 @@ private:
     std::vector<int> rays_per_light_;
     std::vector<int> cumul_tiles_per_light_;
     std::atomic<int> cur_tile_;
+
+    SampleSequence sequence_;
+    int frame_;
 };
 
 } // namespace imba
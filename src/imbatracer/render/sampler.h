@@ -0,0 +1,135 @@
+#ifndef IMBA_SAMPLER_H
+#define IMBA_SAMPLER_H
+
+#include "imbatracer/render/random.h"
+
+#include <cstdint>
+
+namespace imba {
+
+/// Sequence of numbers generated by a Sampler.
+enum class SampleSequence : uint32_t {
+    RANDOM,     ///< Independent random numbers
+    SOBOL       ///< Owen-scrambled Sobol points
+};
+
+namespace detail {
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+/// Hash function with a good avalanche effect (from "Hash Prospector", by C. Wellons).
+inline uint32_t hash_uint(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash_uint(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+/// Computes the given dimension (0 or 1) of a point of the Sobol sequence.
+inline uint32_t sobol(uint32_t index, uint32_t dim) {
+    if (dim == 0) return reverse_bits(index);
+
+    // The direction numbers of the second dimension are given by v_{i+1} = v_i ^ (v_i >> 1).
+    uint32_t x = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) x ^= v;
+    }
+    return x;
+}
+
+/// Owen scrambling of the bits of x, from the most to the least significant bit, with a hash-based permutation.
+/// See "Practical Hash-based Owen Scrambling", by B. Burley.
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverse_bits(x);
+}
+
+} // namespace detail
+
+/// Generates the numbers used to sample one path. The generator is stored in the state of the rays.
+/// With the Sobol sequence, the n-th number is dimension n of the point with the index of the sample. The dimensions
+/// are padded with shuffled two-dimensional Sobol points, so that every pair of dimensions is stratified, and the
+/// points of all the samples of a pixel are scrambled with the same seed.
+class Sampler {
+public:
+    Sampler() : state_(0), dim_(0), sequence_(SampleSequence::RANDOM) {}
+
+    /// Creates the sampler for the sample with the given index, in the sequence that is identified by the seed.
+    Sampler(SampleSequence sequence, uint32_t index, uint32_t seed)
+        : dim_(0), sequence_(sequence)
+    {
+        if (sequence == SampleSequence::SOBOL) {
+            state_ = (uint64_t(seed) << 32) | index;
+        } else {
+            // The carry of MWC64X must be smaller than the multiplier.
+            const uint32_t x = detail::hash_combine(seed, index);
+            const uint32_t c = detail::hash_combine(x, seed) % MWC64X_A;
+            state_ = (uint64_t(c) << 32) | (x | 1);
+        }
+    }
+
+    float random_float(float min, float max) {
+        const float r = random_float();
+        return lerp(min, max, r);
+    }
+
+    /// Returns the next number, in [0, 1).
+    float random_float() {
+        return (next() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Random number from min (inclusive) to max (exclusive)
+    int random_int(int min, int max) {
+        return max == min ? min : std::min(min + static_cast<int>(random_float() * (max - min)), max - 1);
+    }
+
+    void discard(int n) {
+        for (int i = 0; i < n; ++i)
+            next();
+    }
+
+private:
+    static constexpr uint32_t MWC64X_A = 4294883355u;
+
+    uint64_t state_;    ///< Index and seed of the sample for the Sobol sequence, state of MWC64X otherwise
+    uint32_t dim_;
+    SampleSequence sequence_;
+
+    uint32_t next() {
+        if (sequence_ == SampleSequence::SOBOL) {
+            const uint32_t index = uint32_t(state_);
+            const uint32_t seed  = uint32_t(state_ >> 32);
+            const uint32_t dim   = dim_++;
+
+            const uint32_t shuffled = detail::nested_uniform_scramble(index, detail::hash_combine(seed, dim >> 1));
+            return detail::nested_uniform_scramble(detail::sobol(shuffled, dim & 1), detail::hash_combine(seed, dim | 0x80000000u));
+        }
+
+        // MWC64X, see RNG.
+        const uint32_t c = state_ >> 32;
+        const uint32_t x = state_ & 0xFFFFFFFF;
+        state_ = x * uint64_t(MWC64X_A) + c;
+        return x ^ c;
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_SAMPLER_H
@@ -1,23 +1,32 @@
+#include <atomic>
 #include <cassert>
+#include <string>
+
+#define NOMINMAX
+#include <tbb/tbb.h>
 
 #include "imbatracer/render/scene.h"
 #include "imbatracer/core/adapter.h"
+#include "imbatracer/core/bvh_layout.h"
 #include "imbatracer/loaders/loaders.h"
 
 namespace imba {
 
+// Last identifier given to the geometry of a scene, see Scene::traversal_id().
+static std::atomic<int> last_traversal_id(0);
+
 template <typename Node>
 void Scene::setup_traversal_buffers(BuildAccelData<Node>& build_data, TraversalData<Node>& traversal_data, anydsl::Platform plat) {
     // Make sure the buffers have the right size (using upper bound on number of BVH nodes)
     const int total_nodes = (2 * instances_.size() - 1) + build_data.node_count;
     if (traversal_data.nodes.size() < total_nodes) {
-        traversal_data.nodes = std::move(anydsl::Array<Node>(plat, anydsl::Device(0), total_nodes * sizeof(Node)));
+        traversal_data.nodes = std::move(anydsl::Array<Node>(plat, anydsl::Device(0), total_nodes));
     }
-    if (traversal_data.tris.size() < build_data.tris.size()) {
-        traversal_data.tris = std::move(anydsl::Array<Vec4>(plat, anydsl::Device(0), build_data.tris.size()));
+    if (traversal_data.tris.size() < build_data.tri_count) {
+        traversal_data.tris = std::move(anydsl::Array<Vec4>(plat, anydsl::Device(0), build_data.tri_count));
     }
-    if (traversal_data.instances.size() < instance_nodes_.size()) {
-        traversal_data.instances = std::move(anydsl::Array<InstanceNode>(plat, anydsl::Device(0), instance_nodes_.size()));
+    if (traversal_data.instances.size() < build_data.instance_nodes.size()) {
+        traversal_data.instances = std::move(anydsl::Array<InstanceNode>(plat, anydsl::Device(0), build_data.instance_nodes.size()));
     }
     if (traversal_data.indices.size() < index_buf_.size()) {
         traversal_data.indices = anydsl::Array<int>(plat, anydsl::Device(0), index_buf_.size());
@@ -34,44 +43,161 @@ void Scene::setup_traversal_buffers() {
         setup_traversal_buffers(build_gpu_, traversal_gpu_, anydsl::Platform::Cuda);
 }
 
+/// Moves the child indices of a node built in a separate buffer, once the nodes and triangles of that buffer are placed at the given offsets.
+static void offset_children(traversal_cpu::Node& node, int node_offset, int tris_offset) {
+    for (int j = 0; j < CPU_NODE_WIDTH; ++j) {
+        if (node.children[j] > 0)
+            node.children[j] += node_offset;
+        else if (node.children[j] < 0)
+            node.children[j] = ~(~node.children[j] + tris_offset);
+    }
+}
+
+static void offset_children(traversal_gpu::Node& node, int node_offset, int tris_offset) {
+    auto offset = [=] (int& child) {
+        if (child < 0)
+            child = ~(~child + tris_offset);
+        else if (child != 0x76543210) // Right child of the dummy parent of a single leaf
+            child += node_offset;
+    };
+    offset(node.left);
+    offset(node.right);
+}
+
+/// Calls f(index, bounding box) for every child of the node that is an inner node.
+template <typename F>
+static void for_each_inner_child(traversal_cpu::Node& node, F f) {
+    for (int j = 0; j < CPU_NODE_WIDTH; ++j) {
+        if (node.children[j] > 0)
+            f(node.children[j], BBox(float3(node.min_x[j], node.min_y[j], node.min_z[j]), float3(node.max_x[j], node.max_y[j], node.max_z[j])));
+    }
+}
+
+template <typename F>
+static void for_each_inner_child(traversal_gpu::Node& node, F f) {
+    if (node.left > 0)
+        f(node.left, BBox(float3(node.left_bb.lo_x, node.left_bb.lo_y, node.left_bb.lo_z), float3(node.left_bb.hi_x, node.left_bb.hi_y, node.left_bb.hi_z)));
+    if (node.right > 0 && node.right != 0x76543210)
+        f(node.right, BBox(float3(node.right_bb.lo_x, node.right_bb.lo_y, node.right_bb.lo_z), float3(node.right_bb.hi_x, node.right_bb.hi_y, node.right_bb.hi_z)));
+}
+
+struct ForEachInnerChild {
+    template <typename Node, typename F>
+    void operator() (Node& node, F f) const { for_each_inner_child(node, f); }
+};
+
 template <typename Node, typename NewAdapterFn, typename LoadAccelFn, typename StoreAccelFn>
 void Scene::build_mesh_accels(BuildAccelData<Node>& build_data,
                               const std::vector<std::string>& accel_filenames,
+                              const std::vector<BvhBuilderType>& builders,
                               NewAdapterFn new_adapter,
                               LoadAccelFn load_accel,
                               StoreAccelFn store_accel) {
-    build_data.layout.clear();
-    build_data.nodes.clear();
-    build_data.tris.clear();
+    struct MeshAccel {
+        std::vector<Node> nodes;
+        std::vector<Vec4> tris;
+        MappedAccel<Node> mapped;   ///< Used in place if the mesh was loaded from a file and its nodes are not reordered
+
+        const Node* node_data()  const { return nodes.empty() ? mapped.nodes : nodes.data(); }
+        size_t      node_count() const { return nodes.empty() ? mapped.node_count : nodes.size(); }
+        const Vec4* tri_data()   const { return tris.empty()  ? mapped.tris : tris.data(); }
+        size_t      tri_count()  const { return tris.empty()  ? mapped.tri_count : tris.size(); }
+    };
+
+    // Treelets fill a page of memory.
+    const int treelet_size = std::max(1, int(4096 / sizeof(Node)));
+
+    // Build (or load) the acceleration structure of every mesh concurrently, in a buffer of its own.
+    std::vector<MeshAccel> accels(meshes_.size());
+    build_data.mesh_stats.assign(meshes_.size(), BvhStats());
+    build_data.mesh_cached.assign(meshes_.size(), false);
+    tbb::parallel_for(0, static_cast<int>(meshes_.size()), [&] (int mesh_id) {
+        auto& accel = accels[mesh_id];
+        auto& filename = accel_filenames[mesh_id];
 
-    // Add the nodes for all meshes. Assumes that the adapter appends nodes to the array.
-    auto adapter = new_adapter(build_data.nodes, build_data.tris);
-    for (int mesh_id = 0; mesh_id < meshes_.size(); mesh_id++) {
-        auto& mesh = meshes_[mesh_id];
+        auto reorder = [&] () {
+            if (treelet_layout_) {
+                reorder_treelets(accel.nodes, treelet_size, ForEachInnerChild());
+            }
+        };
+
+        const uint64_t hash = filename != "" ? accel_hash(meshes_[mesh_id], builders[mesh_id]) : 0;
+        if (filename != "" && load_accel(filename, hash, accel.mapped, tri_layout_[mesh_id])) {
+            build_data.mesh_cached[mesh_id] = true;
+            // The mapping is read-only, the treelets are formed in a copy of the nodes.
+            if (treelet_layout_) {
+                accel.nodes.assign(accel.mapped.nodes, accel.mapped.nodes + accel.mapped.node_count);
+                reorder();
+            }
+            return;
+        }
 
-        build_data.layout.push_back(build_data.nodes.size());
-        auto tris_offset = build_data.tris.size();
-        auto& filename = accel_filenames[mesh_id];
+        // The builders are not reentrant: since a thread waiting for a nested task may pick up another mesh, every mesh uses its own adapter.
+        auto adapter = new_adapter(accel.nodes, accel.tris);
 
-        if (filename != "" && load_accel(filename, build_data.nodes, build_data.tris, tri_layout_[mesh_id]))
-            continue;
+        std::cout << "Rebuilding the acceleration structure for mesh " + std::to_string(mesh_id) + "...\n" << std::flush;
+        build_data.mesh_stats[mesh_id] = adapter->build_accel(meshes_[mesh_id], mesh_id, tri_layout_, builders[mesh_id]);
 
-        std::cout << "Rebuilding the acceleration structure for mesh " << mesh_id << "..." << std::flush;
-        adapter->build_accel(mesh, mesh_id, tri_layout_);
-        std::cout << std::endl;
+        if (filename != "" && !store_accel(filename, hash, accel.nodes, accel.tris, tri_layout_[mesh_id]))
+            std::cout << "The acceleration structure for mesh " + std::to_string(mesh_id) + " could not be stored.\n" << std::flush;
 
-#ifdef STATISTICS
-        adapter->print_stats();
-#endif
+        // The files are stored in build order, which is the same for every layout.
+        reorder();
+    });
 
-        if (filename != "" && !store_accel(filename, build_data.nodes, build_data.layout.back(), build_data.tris, tris_offset, tri_layout_[mesh_id]))
-            std::cout << "The acceleration structure for mesh " << mesh_id << " could not be stored." << std::endl;
+    // Concatenate the buffers, moving the child indices by the offsets of their mesh. The triangles of the meshes
+    // loaded from files are not copied: they are uploaded from the mapped files.
+    build_data.layout.resize(meshes_.size());
+    build_data.tri_blocks.resize(meshes_.size());
+    std::vector<int> built_tris_offsets(meshes_.size());
+    int node_count = 0, tris_count = 0, built_tris_count = 0;
+    for (int mesh_id = 0; mesh_id < meshes_.size(); mesh_id++) {
+        // The treelets are aligned to pages within the array. The padding nodes are never referenced.
+        if (treelet_layout_) node_count = (node_count + treelet_size - 1) / treelet_size * treelet_size;
+
+        build_data.layout[mesh_id] = node_count;
+        build_data.tri_blocks[mesh_id].offset = tris_count;
+        built_tris_offsets[mesh_id] = built_tris_count;
+        node_count += accels[mesh_id].node_count();
+        tris_count += accels[mesh_id].tri_count();
+        built_tris_count += accels[mesh_id].tris.size();
+    }
+
+    build_data.nodes.resize(node_count);
+    build_data.tris.resize(built_tris_count);
+    tbb::parallel_for(0, static_cast<int>(meshes_.size()), [&] (int mesh_id) {
+        const auto& accel = accels[mesh_id];
+        const int node_offset = build_data.layout[mesh_id];
+        const int tris_offset = build_data.tri_blocks[mesh_id].offset;
+
+        const Node* nodes = accel.node_data();
+        for (int i = 0; i < accel.node_count(); i++) {
+            Node node = nodes[i];
+            offset_children(node, node_offset, tris_offset);
+            build_data.nodes[node_offset + i] = node;
+        }
+
+        auto& block = build_data.tri_blocks[mesh_id];
+        block.count = accel.tri_count();
+        if (accel.tris.empty()) {
+            block.data = accel.tri_data();
+        } else {
+            std::copy(accel.tris.begin(), accel.tris.end(), build_data.tris.begin() + built_tris_offsets[mesh_id]);
+            block.data = build_data.tris.data() + built_tris_offsets[mesh_id];
+        }
+    });
+
+    // Moving keeps the mapped triangles, and the copies of the ones whose ids were rewritten, at the same address.
+    build_data.mapped.clear();
+    for (auto& accel : accels) {
+        if (accel.mapped.file) build_data.mapped.emplace_back(std::move(accel.mapped));
     }
 
     build_data.node_count = build_data.nodes.size();
+    build_data.tri_count = tris_count;
 }
 
-void Scene::build_mesh_accels(const std::vector<std::string>& accel_filenames) {
+void Scene::build_mesh_accels(const std::vector<std::string>& accel_filenames, const std::vector<BvhBuilderType>& builders) {
     // Copy all texture coordinates and indices into one huge array.
     tri_layout_.clear();
     int tri_offset = 0;
@@ -96,8 +222,11 @@ void Scene::build_mesh_accels(const std::vector<std::string>& accel_filenames) {
         tri_offset += mesh.triangle_count();
     }
 
-    if (cpu_buffers_) build_mesh_accels(build_cpu_, accel_filenames, new_mesh_adapter_cpu, load_accel_cpu, store_accel_cpu);
-    if (gpu_buffers_) build_mesh_accels(build_gpu_, accel_filenames, new_mesh_adapter_gpu, load_accel_gpu, store_accel_gpu);
+    if (packed_shading_) build_shading_triangles(tri_offset);
+
+    mesh_builders_ = builders;
+    if (cpu_buffers_) build_mesh_accels(build_cpu_, accel_filenames, builders, new_mesh_adapter_cpu, map_accel_cpu, store_accel_cpu);
+    if (gpu_buffers_) build_mesh_accels(build_gpu_, accel_filenames, builders, new_mesh_adapter_gpu, map_accel_gpu, store_accel_gpu);
 }
 
 template <typename Node, typename NewAdapterFn>
@@ -105,15 +234,66 @@ void Scene::build_top_level_accel(BuildAccelData<Node>& build_data, NewAdapterFn
     assert(!build_data.layout.empty() && instances_.size() > 0);
 
     build_data.top_nodes.clear();
-    instance_nodes_.clear();
+    build_data.instance_nodes.clear();
 
-    auto adapter = new_adapter(build_data.top_nodes, instance_nodes_);
-    adapter->build_accel(meshes_, instances_, build_data.layout, build_data.node_count);
+    auto adapter = new_adapter(build_data.top_nodes, build_data.instance_nodes);
+    build_data.top_level_stats = adapter->build_accel(meshes_, instances_, transforms_, build_data.layout, build_data.node_count);
 }
 
 void Scene::build_top_level_accel() {
     if (cpu_buffers_) build_top_level_accel(build_cpu_, new_top_level_adapter_cpu);
     if (gpu_buffers_) build_top_level_accel(build_gpu_, new_top_level_adapter_gpu);
+    moved_transforms_.clear();
+}
+
+void Scene::set_transform(int i, const float4x4& mat) {
+    transforms_[i] = Mesh::Transform(mat);
+    moved_transforms_.push_back(i);
+}
+
+template <typename Node, typename NewAdapterFn>
+void Scene::refit_top_level_accel(BuildAccelData<Node>& build_data, TraversalData<Node>& traversal_data,
+                                  NewAdapterFn new_adapter, const std::vector<int>& moved) {
+    assert(!build_data.top_nodes.empty());
+
+    ModifiedRange nodes, instance_nodes;
+    auto adapter = new_adapter(build_data.top_nodes, build_data.instance_nodes);
+    adapter->refit_accel(meshes_, instances_, transforms_, moved, build_data.node_count, nodes, instance_nodes);
+
+    // Only upload the nodes that were modified.
+    if (!nodes.empty()) {
+        anydsl_copy(0, build_data.top_nodes.data(), sizeof(Node) * nodes.begin,
+                    traversal_data.nodes.device(), traversal_data.nodes.data(), sizeof(Node) * (build_data.node_count + nodes.begin),
+                    sizeof(Node) * (nodes.end - nodes.begin));
+    }
+    if (!instance_nodes.empty()) {
+        anydsl_copy(0, build_data.instance_nodes.data(), sizeof(InstanceNode) * instance_nodes.begin,
+                    traversal_data.instances.device(), traversal_data.instances.data(), sizeof(InstanceNode) * instance_nodes.begin,
+                    sizeof(InstanceNode) * (instance_nodes.end - instance_nodes.begin));
+    }
+}
+
+void Scene::refit_top_level_accel() {
+    if (moved_transforms_.empty()) return;
+
+    if (!dynamic_instances_) {
+        std::cout << "The top level cannot be refitted: the scene was not built with dynamic instances." << std::endl;
+        moved_transforms_.clear();
+        return;
+    }
+
+    // Find the instances that use the transformations that changed.
+    std::vector<bool> is_moved(transforms_.size(), false);
+    for (auto i : moved_transforms_) is_moved[i] = true;
+    std::vector<int> moved;
+    for (int i = 0; i < instances_.size(); ++i) {
+        if (is_moved[instances_[i].transform]) moved.push_back(i);
+    }
+
+    if (cpu_buffers_) refit_top_level_accel(build_cpu_, traversal_cpu_, new_top_level_adapter_cpu, moved);
+    if (gpu_buffers_) refit_top_level_accel(build_gpu_, traversal_gpu_, new_top_level_adapter_gpu, moved);
+    moved_transforms_.clear();
+    traversal_id_ = ++last_traversal_id;
 }
 
 template <typename Node>
@@ -132,6 +312,7 @@ void Scene::upload_mask_buffer(TraversalData<Node>& traversal_data, anydsl::Plat
 void Scene::upload_mask_buffer(const MaskBuffer& masks) {
     if (cpu_buffers_) upload_mask_buffer(traversal_cpu_, anydsl::Platform::Host, masks);
     if (gpu_buffers_) upload_mask_buffer(traversal_gpu_, anydsl::Platform::Cuda, masks);
+    traversal_id_ = ++last_traversal_id;
 }
 
 template <typename Node>
@@ -139,9 +320,13 @@ void Scene::upload_mesh_accels(BuildAccelData<Node>& build_data, TraversalData<N
     anydsl_copy(0, build_data.nodes.data(), 0,
                 traversal_data.nodes.device(), traversal_data.nodes.data(), 0,
                 sizeof(Node) * build_data.nodes.size());
-    anydsl_copy(0, build_data.tris.data(), 0,
-                traversal_data.tris.device(), traversal_data.tris.data(), 0,
-                sizeof(Vec4) * build_data.tris.size());
+    // The triangles of the meshes loaded from files are copied straight from the mapping.
+    for (auto& block : build_data.tri_blocks) {
+        if (block.count == 0) continue;
+        anydsl_copy(0, block.data, 0,
+                    traversal_data.tris.device(), traversal_data.tris.data(), sizeof(Vec4) * block.offset,
+                    sizeof(Vec4) * block.count);
+    }
 
     anydsl_copy(0, index_buf_.data(), 0,
                 traversal_data.indices.device(), traversal_data.indices.data(), 0,
@@ -152,6 +337,8 @@ void Scene::upload_mesh_accels(BuildAccelData<Node>& build_data, TraversalData<N
 
     std::vector<Node>().swap(build_data.nodes);
     std::vector<Vec4>().swap(build_data.tris);
+    std::vector<typename BuildAccelData<Node>::TriBlock>().swap(build_data.tri_blocks);
+    std::vector<MappedAccel<Node>>().swap(build_data.mapped);
 }
 
 void Scene::upload_mesh_accels() {
@@ -169,13 +356,17 @@ void Scene::upload_top_level_accel(BuildAccelData<Node>& build_data, TraversalDa
     anydsl_copy(0, build_data.top_nodes.data(), 0,
                 traversal_data.nodes.device(), traversal_data.nodes.data(), sizeof(Node) * build_data.node_count,
                 sizeof(Node) * build_data.top_nodes.size());
-    anydsl_copy(0, instance_nodes_.data(), 0,
+    anydsl_copy(0, build_data.instance_nodes.data(), 0,
                 traversal_data.instances.device(), traversal_data.instances.data(), 0,
-                sizeof(InstanceNode) * instance_nodes_.size());
+                sizeof(InstanceNode) * build_data.instance_nodes.size());
     traversal_data.root = build_data.node_count;
 
-    // Keep the layout, as it is necessary to rebuild the top level
-    std::vector<Node>().swap(build_data.top_nodes);
+    // The layout and the top-level nodes are only necessary to rebuild or refit the top level
+    if (!dynamic_instances_) {
+        std::vector<Node>().swap(build_data.top_nodes);
+        std::vector<InstanceNode>().swap(build_data.instance_nodes);
+        std::vector<int>().swap(build_data.layout);
+    }
 }
 
 void Scene::upload_top_level_accel() {
@@ -184,14 +375,93 @@ void Scene::upload_top_level_accel() {
     if (cpu_buffers_) upload_top_level_accel(build_cpu_, traversal_cpu_);
     if (gpu_buffers_) upload_top_level_accel(build_gpu_, traversal_gpu_);
 
-    std::vector<InstanceNode>().swap(instance_nodes_);
+    if (!dynamic_instances_) std::vector<int>().swap(moved_transforms_);
+    traversal_id_ = ++last_traversal_id;
+}
+
+int Scene::release_mesh_data() {
+    if (!has_shading_triangles()) return 0;
+
+    int released = 0;
+    for (auto& mesh : meshes_) {
+        bool emissive = false;
+        for (int i = 0; i < mesh.triangle_count() && !emissive; ++i)
+            emissive = materials_[mesh.indices()[i * 4 + 3]]->emitter() != nullptr;
+        if (emissive) continue;
+
+        mesh.release_data();
+        released++;
+    }
+    return released;
+}
+
+template <typename Node>
+void Scene::write_accel_stats(const BuildAccelData<Node>& build_data, std::ostream& out) const {
+    out << "{\n    \"meshes\": [";
+    for (int i = 0; i < build_data.mesh_stats.size(); ++i) {
+        out << (i > 0 ? "," : "") << "\n        { \"mesh\": " << i
+            << ", \"builder\": \"" << (mesh_builders_[i] == BVH_BUILDER_FAST ? "fast" : "sbvh") << "\""
+            << ", \"cached\": " << (build_data.mesh_cached[i] ? "true" : "false");
+        if (!build_data.mesh_cached[i]) {
+            out << ", ";
+            build_data.mesh_stats[i].write_json(out);
+        }
+        out << " }";
+    }
+    out << "\n    ],\n    \"top_level\": { ";
+    build_data.top_level_stats.write_json(out);
+    out << " }\n}";
+}
+
+void Scene::report_memory(MemoryReport& report) const {
+    size_t geometry = 0, attributes = 0;
+    for (auto& mesh : meshes_) {
+        geometry += mesh.geometry_bytes();
+        attributes += mesh.attribute_bytes();
+    }
+    report.add("mesh geometry", geometry);
+    report.add("mesh attributes", attributes);
+    report.add("shading triangles", vector_bytes(shading_tris_));
+    report.add("instances", vector_bytes(instances_) + vector_bytes(transforms_));
+
+    size_t textures = env_map_ ? env_map_->memory_bytes() : 0;
+    for (auto& tex : textures_) textures += tex->memory_bytes();
+    report.add("textures", textures);
+
+    // The buffers of the CPU traversal are in host memory, the ones of the GPU traversal in device memory.
+    if (cpu_buffers_) {
+        report.add("BVH (CPU)", traversal_cpu_.accel_bytes());
+        report.add("BVH build data (CPU)", build_cpu_.memory_bytes());
+    }
+    if (gpu_buffers_) {
+        report.add("BVH (GPU)", 0, traversal_gpu_.accel_bytes());
+        report.add("BVH build data (GPU)", build_gpu_.memory_bytes());
+    }
+
+    // The indices and texture coordinates are only needed to look up the masks.
+    report.add("mask buffer",
+               (cpu_buffers_ ? traversal_cpu_.mask_bytes() : 0) + vector_bytes(index_buf_) + vector_bytes(texcoord_buf_),
+               gpu_buffers_ ? traversal_gpu_.mask_bytes() : 0);
+}
+
+void Scene::write_accel_stats(std::ostream& out) const {
+    out << "{";
+    if (cpu_buffers_) {
+        out << "\n\"cpu\": ";
+        write_accel_stats(build_cpu_, out);
+    }
+    if (gpu_buffers_) {
+        out << (cpu_buffers_ ? "," : "") << "\n\"gpu\": ";
+        write_accel_stats(build_gpu_, out);
+    }
+    out << "\n}" << std::endl;
 }
 
 void Scene::compute_bounding_sphere() {
     // We use a box as an approximation
     BBox scene_bb = BBox::empty();
     for (auto& inst : instances()) {
-        auto bb = transform(inst.mat, mesh(inst.id).bounding_box());
+        auto bb = transform(transforms_[inst.transform].mat, mesh(inst.id).bounding_box());
         scene_bb.extend(bb);
     }
     const float radius = length(scene_bb.max - scene_bb.min) * 0.5f;
@@ -200,4 +470,50 @@ void Scene::compute_bounding_sphere() {
     sphere_.center = (scene_bb.max + scene_bb.min) * 0.5f;
 }
 
+void Scene::build_shading_triangles(int tri_count) {
+    shading_tris_.resize(tri_count);
+    for (int mesh_id = 0; mesh_id < meshes_.size(); mesh_id++) {
+        const Mesh& mesh = meshes_[mesh_id];
+        const auto texcoords    = mesh.attribute<float2>(MeshAttributes::TEXCOORDS);
+        const auto normals      = mesh.attribute<float3>(MeshAttributes::NORMALS);
+        const auto geom_normals = mesh.attribute<float3>(MeshAttributes::GEOM_NORMALS);
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, mesh.triangle_count()), [&] (const tbb::blocked_range<int>& range) {
+            for (int i = range.begin(); i != range.end(); ++i) {
+                const int i0 = mesh.indices()[i * 4 + 0];
+                const int i1 = mesh.indices()[i * 4 + 1];
+                const int i2 = mesh.indices()[i * 4 + 2];
+                const int  m = mesh.indices()[i * 4 + 3];
+
+                shading_tris_[tri_layout_[mesh_id] + i] = make_shading_triangle(
+                    float3(mesh.vertices()[i0]), float3(mesh.vertices()[i1]), float3(mesh.vertices()[i2]),
+                    texcoords[i0], texcoords[i1], texcoords[i2],
+                    normals[i0], normals[i1], normals[i2],
+                    geom_normals[i], m);
+            }
+        });
+    }
+}
+
+void Scene::build_light_distribution() {
+    const int n = lights_.size();
+    std::vector<float> powers(n);
+    for (int i = 0; i < n; i++) {
+        const float p = lights_[i]->power();
+        powers[i] = p > 0.0f ? p : 0.0f;
+    }
+
+    // If no light has a positive power, the lights are selected uniformly.
+    light_table_.resize(n);
+    light_power_ = build_alias_table(powers.data(), n, light_table_.data());
+
+    light_pdfs_.resize(n);
+    env_light_pdf_ = 0.0f;
+    for (int i = 0; i < n; i++) {
+        light_pdfs_[i] = light_power_ > 0.0f ? powers[i] / light_power_ : 1.0f / n;
+        if (dynamic_cast<const EnvLight*>(lights_[i].get()))
+            env_light_pdf_ = light_pdfs_[i];
+    }
+}
+
 } // namespace imba
@@ -3,10 +3,15 @@
 
 #include "imbatracer/render/materials/materials.h"
 #include "imbatracer/render/light.h"
+#include "imbatracer/render/shading_triangle.h"
 #include "imbatracer/render/scheduling/ray_queue.h"
 
 #include "imbatracer/core/mesh.h"
+#include "imbatracer/core/adapter.h"
 #include "imbatracer/core/mask.h"
+#include "imbatracer/core/memory_report.h"
+
+#include "imbatracer/loaders/loaders.h"
 
 namespace imba {
 
@@ -24,6 +29,8 @@ using TextureContainer = std::vector<std::unique_ptr<TextureSampler>>;
 using MaterialContainer = std::vector<std::unique_ptr<Material>>;
 using MeshContainer = std::vector<Mesh>;
 using InstanceContainer = std::vector<Mesh::Instance>;
+using TransformContainer = std::vector<Mesh::Transform>;
+using ShadingTriangleContainer = std::vector<ShadingTriangle, tbb::cache_aligned_allocator<ShadingTriangle>>;
 
 /// Stores all data required to render a scene.
 class Scene {
@@ -31,6 +38,10 @@ public:
     Scene(bool cpu_buffers = false, bool gpu_buffers = true)
         : cpu_buffers_(cpu_buffers)
         , gpu_buffers_(gpu_buffers)
+        , treelet_layout_(false)
+        , packed_shading_(false)
+        , dynamic_instances_(false)
+        , traversal_id_(0)
     {
         if (!cpu_buffers && !gpu_buffers) {
             std::cout << "Neither CPU nor GPU traversal was enabled!" << std::endl;
@@ -38,12 +49,34 @@ public:
         }
     }
 
-    /// Builds an acceleration structure for every mesh in the scene.
-    void build_mesh_accels(const std::vector<std::string>& accel_filenames);
+    /// When enabled, the nodes of the mesh acceleration structures are grouped into treelets that fill a page of memory,
+    /// so that the nodes traversed together are close in memory. Otherwise, they are kept in depth-first order.
+    void set_treelet_layout(bool enable) { treelet_layout_ = enable; }
+
+    /// When enabled, the shading data of every triangle is packed into a ShadingTriangle when the mesh acceleration
+    /// structures are built, so that computing an intersection reads a single cache line. Uses 64 bytes per triangle.
+    void set_packed_shading(bool enable) { packed_shading_ = enable; }
+
+    /// When enabled, the data from which the top-level acceleration structure was built stays on the host after the
+    /// upload, so that it can be refitted or rebuilt when the instances move. Otherwise, upload_top_level_accel()
+    /// frees it, along with the layout of the meshes, and the top level can no longer be changed.
+    void set_dynamic_instances(bool enable) { dynamic_instances_ = enable; }
+
+    /// Builds an acceleration structure for every mesh in the scene, with the builder given for that mesh.
+    void build_mesh_accels(const std::vector<std::string>& accel_filenames, const std::vector<BvhBuilderType>& builders);
     /// Builds a top-level acceleration structure.
     /// All the mesh acceleration structures must have been built before this call.
     void build_top_level_accel();
 
+    /// Changes an entry of the table of transformations, which moves all the instances that share it.
+    /// The changes only become visible after refit_top_level_accel() or a rebuild.
+    void set_transform(int i, const float4x4& mat);
+    /// Refits the top-level acceleration structure to the instances that moved since the last build or refit,
+    /// and uploads the modified nodes on the device. Much faster than a rebuild, but the quality of the tree
+    /// degrades if the instances move far from their original position.
+    /// The top-level acceleration structure must have been built and uploaded with dynamic instances before this call.
+    void refit_top_level_accel();
+
     /// Uploads the mask buffer to use for traversal.
     void upload_mask_buffer(const MaskBuffer&);
     /// Uploads all mesh acceleration structures on the device.
@@ -52,9 +85,49 @@ public:
     /// The top-level acceleration structure must have been built before this call.
     void upload_top_level_accel();
 
+    /// Identifies the geometry seen by the traversal. Changes whenever the top level or the masks are uploaded or
+    /// refitted, and is unique among all the scenes, so that results computed by tracing rays can be cached with it.
+    int traversal_id() const { return traversal_id_; }
+
+    /// Frees the geometry of the meshes once it is only needed by the device, i.e. after upload_mesh_accels(), if the
+    /// shading data is packed in shading triangles. The meshes with emissive triangles are kept, since the area of
+    /// the triangle lights is computed from their vertices. Afterwards, the mesh acceleration structures cannot be
+    /// rebuilt and the scene cannot be stored in a cache. Returns the number of meshes that were freed.
+    int release_mesh_data();
+
     /// Computes the bounding sphere of the scene.
     void compute_bounding_sphere();
 
+    /// Builds the distribution used to select a light for direct illumination, proportional to the power of the lights.
+    /// Must be called after compute_bounding_sphere(), since the power of infinite lights depends on the size of the scene.
+    void build_light_distribution();
+
+    /// Selects a light for direct illumination, given a random number in [0, 1). Returns its index and probability.
+    int sample_light(float u, float& pdf) const {
+        const int i = sample_alias_table(light_table_.data(), light_table_.size(), u);
+        pdf = light_pdfs_[i];
+        return i;
+    }
+
+    /// Returns the probability of selecting the given light for direct illumination.
+    float light_pdf(int i) const { return light_pdfs_[i]; }
+
+    /// Returns the probability of selecting the triangle light that was hit, given its emitter and its area in world space.
+    float triangle_light_pdf(const AreaEmitter& emit, float area) const {
+        return light_power_ > 0.0f ? triangle_light_power(emit.intensity, area) / light_power_ : 1.0f / lights_.size();
+    }
+
+    /// Returns the probability of selecting the light of the environment map, or zero if there is none.
+    float env_light_pdf() const { return env_light_pdf_; }
+
+    /// Writes the statistics of the acceleration structures built for the scene, as a JSON object.
+    /// Meshes whose acceleration structure was loaded from a file have no statistics.
+    void write_accel_stats(std::ostream& out) const;
+
+    /// Adds the memory used by the scene to the report: the meshes, the textures, the acceleration structures and the
+    /// data from which they are built, and the masks. The buffers used for GPU traversal are counted as device memory.
+    void report_memory(MemoryReport& report) const;
+
 #define CONTAINER_ACCESSORS(name, names, Type, ContainerType) \
     const Type& name(int i) const { return names##_[i]; } \
     Type& name(int i) { return names##_[i]; } \
@@ -70,18 +143,47 @@ public:
 
 #undef CONTAINER_ACCESSORS
 
+    /// Table of the transformations of the instances, see Mesh::Instance.
+    const TransformContainer& transforms() const { return transforms_; }
+    TransformContainer& transforms() { return transforms_; }
+
+    /// Adds an entry to the table of transformations and returns its index.
+    int add_transform(const float4x4& mat) {
+        transforms_.emplace_back(mat);
+        return transforms_.size() - 1;
+    }
+
+    /// Returns the transformation of the given instance.
+    const Mesh::Transform& instance_transform(int i) const { return transforms_[instances_[i].transform]; }
+
     const TraversalData<traversal_gpu::Node>& traversal_data_gpu() const { assert(gpu_buffers_); return traversal_gpu_; }
     const TraversalData<traversal_cpu::Node>& traversal_data_cpu() const { assert(cpu_buffers_); return traversal_cpu_; }
 
+    /// Statistics of the acceleration structures built for the CPU or the GPU: one entry per mesh, and the top level.
+    const std::vector<BvhStats>& mesh_accel_stats(bool gpu) const { return gpu ? build_gpu_.mesh_stats : build_cpu_.mesh_stats; }
+    const BvhStats& top_level_accel_stats(bool gpu) const { return gpu ? build_gpu_.top_level_stats : build_cpu_.top_level_stats; }
+
     bool has_gpu_buffers() const { return gpu_buffers_; }
     bool has_cpu_buffers() const { return cpu_buffers_; }
 
     const BSphere& bounding_sphere() const { return sphere_; }
 
+    bool has_shading_triangles() const { return !shading_tris_.empty(); }
+    /// Returns the shading data of a triangle, given the triangle id of a hit. Only valid if has_shading_triangles().
+    const ShadingTriangle& shading_triangle(int tri_id) const { return shading_tris_[tri_id]; }
+
     int local_tri_id(int tri_id, int mesh_id) const {
         return tri_id - tri_layout_[mesh_id];
     }
 
+    /// Returns the material of the triangle that was hit.
+    int hit_material(const Hit& hit) const {
+        if (has_shading_triangles()) return shading_tris_[hit.tri_id].material;
+
+        const Mesh::Instance& inst = instances_[hit.inst_id];
+        return meshes_[inst.id].indices()[local_tri_id(hit.tri_id, inst.id) * 4 + 3];
+    }
+
     void set_env_map(EnvMap* map) {
         env_map_.reset(map);
     }
@@ -94,35 +196,65 @@ private:
     template <typename Node>
     struct BuildAccelData {
         std::vector<Node> top_nodes;
+        std::vector<InstanceNode> instance_nodes;
         std::vector<Node> nodes;
-        std::vector<Vec4> tris;
+        std::vector<Vec4> tris;         ///< Triangles of the meshes that were built, the ones loaded from files stay mapped
         std::vector<int>  layout;
         int node_count;
+        int tri_count;
+
+        /// Triangles of a mesh, uploaded at the given offset of the triangle array on the device.
+        struct TriBlock {
+            const Vec4* data;
+            size_t count;
+            size_t offset;
+        };
+        std::vector<TriBlock> tri_blocks;
+        std::vector<MappedAccel<Node>> mapped;  ///< Keeps the BVH files mapped until the triangles are uploaded
+
+        std::vector<BvhStats> mesh_stats;
+        std::vector<char> mesh_cached;   ///< True if the acceleration structure of the mesh was loaded from a file (not a vector<bool>, as it is written concurrently)
+        BvhStats top_level_stats;
+
+        size_t memory_bytes() const {
+            return vector_bytes(top_nodes) + vector_bytes(instance_nodes) + vector_bytes(nodes) +
+                   vector_bytes(tris) + vector_bytes(layout) + vector_bytes(tri_blocks);
+        }
     };
 
     bool cpu_buffers_;
     bool gpu_buffers_;
+    bool treelet_layout_;
+    bool packed_shading_;
+    bool dynamic_instances_;
+    int traversal_id_;
 
     template <typename Node>
     void setup_traversal_buffers(BuildAccelData<Node>&, TraversalData<Node>&, anydsl::Platform);
     template <typename Node, typename NewAdapterFn>
     void build_top_level_accel(BuildAccelData<Node>&, NewAdapterFn);
+    template <typename Node, typename NewAdapterFn>
+    void refit_top_level_accel(BuildAccelData<Node>&, TraversalData<Node>&, NewAdapterFn, const std::vector<int>& moved);
     template <typename Node, typename NewAdapterFn, typename LoadAccelFn, typename StoreAccelFn>
-    void build_mesh_accels(BuildAccelData<Node>&, const std::vector<std::string>&, NewAdapterFn, LoadAccelFn, StoreAccelFn);
+    void build_mesh_accels(BuildAccelData<Node>&, const std::vector<std::string>&, const std::vector<BvhBuilderType>&, NewAdapterFn, LoadAccelFn, StoreAccelFn);
     template <typename Node>
     void upload_mask_buffer(TraversalData<Node>&, anydsl::Platform, const MaskBuffer&);
     template <typename Node>
     void upload_mesh_accels(BuildAccelData<Node>&, TraversalData<Node>&);
     template <typename Node>
     void upload_top_level_accel(BuildAccelData<Node>&, TraversalData<Node>&);
+    template <typename Node>
+    void write_accel_stats(const BuildAccelData<Node>&, std::ostream&) const;
 
     void setup_traversal_buffers();
+    void build_shading_triangles(int tri_count);
 
     LightContainer     lights_;
     TextureContainer   textures_;
     MaterialContainer  materials_;
     MeshContainer      meshes_;
     InstanceContainer  instances_;
+    TransformContainer transforms_;
 
     TraversalData<traversal_gpu::Node> traversal_gpu_;
     TraversalData<traversal_cpu::Node> traversal_cpu_;
@@ -133,11 +265,18 @@ private:
     std::vector<Vec2> texcoord_buf_;
     std::vector<int>  index_buf_;
     std::vector<int>  tri_layout_;
-    std::vector<InstanceNode> instance_nodes_;
+    ShadingTriangleContainer shading_tris_;
+    std::vector<int>  moved_transforms_;
+    std::vector<BvhBuilderType> mesh_builders_;
 
     BSphere sphere_;
 
     std::unique_ptr<EnvMap> env_map_;
+
+    std::vector<AliasEntry> light_table_;
+    std::vector<float> light_pdfs_;
+    float light_power_;
+    float env_light_pdf_;
 };
 
 } // namespace imba
@@ -0,0 +1,255 @@
+#ifndef IMBA_CONTRIBUTION_BUFFER_H
+#define IMBA_CONTRIBUTION_BUFFER_H
+
+#include "imbatracer/core/image.h"
+#include "imbatracer/core/rgb.h"
+
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace imba {
+
+/// Accumulates the contributions of the paths to the pixels of an image, without atomic operations.
+/// Every thread adds its contributions to its own copy of the image. The copies are split in tiles of
+/// TILE_SIZE x TILE_SIZE pixels, which are taken from a pool shared by the threads once the thread contributes to them.
+/// A thread adds its tiles to the image with flush_local() once it is done with a tile of the image, which returns
+/// them to the pool, so that the memory of the copies is bounded by the tiles the threads work on at the same time.
+/// The splats of light paths can land anywhere: for those, the buffer is made sparse with set_sparse(), and every
+/// thread appends its contributions to a list instead, which flush() sorts by tile before adding it to the image.
+/// The remaining contributions of all the threads are added to the image by flush(), which must not run concurrently
+/// with add() or flush_local().
+class ContributionBuffer {
+public:
+    static constexpr int TILE_SIZE = 16;
+
+    ContributionBuffer() : width_(0), height_(0), tiles_x_(0), tile_count_(0), sparse_(false) {}
+
+    ContributionBuffer(const ContributionBuffer&) = delete;
+    ContributionBuffer& operator=(const ContributionBuffer&) = delete;
+
+    /// Sets the size of the image. Discards all the contributions if the size changes.
+    void resize(int width, int height) {
+        if (width == width_ && height == height_) return;
+
+        width_      = width;
+        height_     = height;
+        tiles_x_    = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tile_count_ = tiles_x_ * ((height + TILE_SIZE - 1) / TILE_SIZE);
+        release_all();
+        locals_.clear();
+    }
+
+    /// Stores the contributions of every thread as a list of (pixel, contribution) pairs, instead of copies of the
+    /// tiles. Discards all the contributions if the mode changes.
+    void set_sparse(bool sparse) {
+        if (sparse == sparse_) return;
+        sparse_ = sparse;
+        release_all();
+        locals_.clear();
+    }
+
+    /// Adds a contribution to the given pixel.
+    void add(int pixel_id, const rgb& contrib) {
+        if (sparse_) {
+            locals_.local().splats.push_back(Splat{ pixel_id, contrib });
+            return;
+        }
+
+        const int x = pixel_id % width_;
+        const int y = pixel_id / width_;
+        const int t = tile_of(pixel_id);
+
+        Local& local = locals_.local();
+        if (local.tiles.empty()) local.tiles.resize(tile_count_, nullptr);
+
+        rgb*& tile = local.tiles[t];
+        if (!tile) {
+            tile = acquire_tile();
+            local.used.push_back(t);
+        }
+
+        tile[(y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE] += contrib;
+    }
+
+    /// Adds the contributions of the calling thread to the image, and returns its tiles to the pool. The other threads
+    /// may add or flush their own contributions meanwhile, so the pixels are updated atomically.
+    /// Does nothing in sparse mode, where the splats are only added by flush().
+    void flush_local(AtomicImage& img) {
+        if (sparse_) return;
+
+        Local& local = locals_.local();
+        for (int t : local.used) {
+            const int x0 = (t % tiles_x_) * TILE_SIZE;
+            const int y0 = (t / tiles_x_) * TILE_SIZE;
+            const int w  = std::min(TILE_SIZE, width_  - x0);
+            const int h  = std::min(TILE_SIZE, height_ - y0);
+
+            rgb* tile = local.tiles[t];
+            for (int y = 0; y < h; ++y) {
+                for (int x = 0; x < w; ++x)
+                    img(x0 + x, y0 + y).apply<std::plus<float> >(tile[y * TILE_SIZE + x]);
+            }
+
+            release_tile(tile);
+            local.tiles[t] = nullptr;
+        }
+        local.used.clear();
+    }
+
+    /// Adds the contributions of all the threads to the image, and clears them.
+    /// Every pixel is written by a single task, so no atomic read-modify-write is required.
+    void flush(AtomicImage& img) {
+        if (sparse_) {
+            flush_sparse(img);
+            return;
+        }
+
+        tbb::parallel_for(0, tile_count_, [&] (int t) {
+            const int x0 = (t % tiles_x_) * TILE_SIZE;
+            const int y0 = (t / tiles_x_) * TILE_SIZE;
+            const int w  = std::min(TILE_SIZE, width_  - x0);
+            const int h  = std::min(TILE_SIZE, height_ - y0);
+
+            for (auto& local : locals_) {
+                if (local.tiles.empty() || !local.tiles[t]) continue;
+
+                rgb* tile = local.tiles[t];
+                for (int y = 0; y < h; ++y) {
+                    for (int x = 0; x < w; ++x) {
+                        auto& p = img(x0 + x, y0 + y);
+                        p = rgb(p) + tile[y * TILE_SIZE + x];
+                    }
+                }
+
+                release_tile(tile);
+                local.tiles[t] = nullptr;
+            }
+        });
+
+        for (auto& local : locals_) local.used.clear();
+    }
+
+    /// Discards all the contributions that were not flushed.
+    void clear() {
+        release_all();
+        locals_.clear();
+    }
+
+    /// Number of bytes allocated for the tiles of the pool and for the splats.
+    size_t memory_bytes() const {
+        size_t bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex_);
+            bytes += pool_.size() * sizeof(rgb) * TILE_SIZE * TILE_SIZE + vector_bytes(free_tiles_);
+        }
+        for (auto& local : locals_) {
+            bytes += vector_bytes(local.tiles) + vector_bytes(local.used) +
+                     vector_bytes(local.splats) + vector_bytes(local.sorted) + vector_bytes(local.tile_begin);
+        }
+        return bytes;
+    }
+
+private:
+    struct Splat {
+        int pixel_id;
+        rgb contrib;
+    };
+
+    struct Local {
+        std::vector<rgb*> tiles;        ///< Tile of the pool that holds the contributions to every tile, if any
+        std::vector<int> used;          ///< Indices of the tiles that have contributions since the last flush
+
+        std::vector<Splat> splats;      ///< Contributions of the thread in sparse mode, in the order of add()
+        std::vector<Splat> sorted;      ///< Splats sorted by tile during the flush
+        std::vector<int> tile_begin;    ///< Index of the first sorted splat of every tile, and the number of splats
+    };
+
+    /// Takes a tile filled with zeros from the pool, or allocates one if the pool is empty.
+    rgb* acquire_tile() {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        if (!free_tiles_.empty()) {
+            rgb* tile = free_tiles_.back();
+            free_tiles_.pop_back();
+            return tile;
+        }
+
+        rgb* tile = new rgb[TILE_SIZE * TILE_SIZE];
+        std::fill(tile, tile + TILE_SIZE * TILE_SIZE, rgb(0.0f));
+        pool_.emplace_back(tile);
+        return tile;
+    }
+
+    /// Clears a tile and returns it to the pool.
+    void release_tile(rgb* tile) {
+        std::fill(tile, tile + TILE_SIZE * TILE_SIZE, rgb(0.0f));
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        free_tiles_.push_back(tile);
+    }
+
+    /// Returns the tiles of all the threads to the pool, discarding their contributions.
+    void release_all() {
+        for (auto& local : locals_) {
+            for (int t : local.used) release_tile(local.tiles[t]);
+        }
+    }
+
+    int tile_of(int pixel_id) const {
+        const int x = pixel_id % width_;
+        const int y = pixel_id / width_;
+        return (y / TILE_SIZE) * tiles_x_ + x / TILE_SIZE;
+    }
+
+    /// Sorts the splats of every thread by tile with a counting sort, then adds the splats of every tile to the image.
+    /// Both passes run in parallel, over the threads and over the tiles, so no atomic operation is required either.
+    void flush_sparse(AtomicImage& img) {
+        std::vector<Local*> locals;
+        for (auto& local : locals_) {
+            if (!local.splats.empty()) locals.push_back(&local);
+        }
+        if (locals.empty()) return;
+
+        tbb::parallel_for(0, int(locals.size()), [&] (int i) {
+            Local& local = *locals[i];
+            local.tile_begin.assign(tile_count_ + 1, 0);
+            for (auto& s : local.splats) local.tile_begin[tile_of(s.pixel_id) + 1]++;
+            for (int t = 0; t < tile_count_; ++t) local.tile_begin[t + 1] += local.tile_begin[t];
+
+            local.sorted.resize(local.splats.size());
+            std::vector<int> next(local.tile_begin.begin(), local.tile_begin.end() - 1);
+            for (auto& s : local.splats) local.sorted[next[tile_of(s.pixel_id)]++] = s;
+            local.splats.clear();
+        });
+
+        tbb::parallel_for(0, tile_count_, [&] (int t) {
+            for (auto local : locals) {
+                for (int i = local->tile_begin[t], n = local->tile_begin[t + 1]; i < n; ++i) {
+                    const Splat& s = local->sorted[i];
+                    auto& p = img(s.pixel_id % width_, s.pixel_id / width_);
+                    p = rgb(p) + s.contrib;
+                }
+            }
+        });
+    }
+
+    int width_, height_;
+    int tiles_x_, tile_count_;
+    bool sparse_;
+
+    tbb::enumerable_thread_specific<Local, tbb::cache_aligned_allocator<Local>, tbb::ets_key_per_instance> locals_;
+
+    // Tiles shared by the threads: all the allocated tiles, and the ones that no thread holds.
+    std::vector<std::unique_ptr<rgb[]> > pool_;
+    std::vector<rgb*> free_tiles_;
+    mutable std::mutex pool_mutex_;
+};
+
+} // namespace imba
+
+#endif // IMBA_CONTRIBUTION_BUFFER_H
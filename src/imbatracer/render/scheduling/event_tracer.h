@@ -0,0 +1,141 @@
+#ifndef IMBA_EVENT_TRACER_H
+#define IMBA_EVENT_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <tbb/enumerable_thread_specific.h>
+
+namespace imba {
+
+/// Records the begin and end of the activities of every thread, e.g. the traversal or the shading of a queue, and
+/// exports them as a timeline in the JSON format of the Chrome tracing tools (chrome://tracing, or Perfetto).
+/// Every thread writes to its own ring buffer, without synchronization: when a buffer is full, the oldest spans of
+/// the thread are overwritten. The buffers must only be exported once the threads are done, see write().
+class EventTracer {
+    typedef std::chrono::high_resolution_clock clock_type;
+
+    struct Event {
+        const char* name;
+        int64_t begin_ns, end_ns;
+    };
+
+    struct ThreadEvents {
+        int tid;
+        uint64_t count;     ///< Number of events recorded so far, the last ones are in the ring buffer
+        std::vector<Event> ring;
+
+        ThreadEvents(int tid, int capacity) : tid(tid), count(0), ring(capacity) {}
+    };
+
+public:
+    // Number of events kept per thread.
+    static constexpr int RING_CAPACITY = 1 << 16;
+
+    /// Returns the tracer shared by all threads.
+    static EventTracer& instance() {
+        static EventTracer tracer;
+        return tracer;
+    }
+
+    /// Enables the tracer. The timeline starts with this call, and write() stores it in the given file.
+    void enable(const std::string& file) {
+        file_ = file;
+        start_ = clock_type::now();
+        enabled_ = true;
+    }
+
+    bool enabled() const { return enabled_; }
+
+    /// Records the enclosing scope as a span of the calling thread. The name must be a string literal.
+    /// Does nothing if the tracer is disabled.
+    class Span {
+    public:
+        Span(const char* name)
+            : name_(name), enabled_(EventTracer::instance().enabled())
+        {
+            if (enabled_) begin_ = clock_type::now();
+        }
+
+        ~Span() {
+            if (enabled_) EventTracer::instance().add(name_, begin_, clock_type::now());
+        }
+
+        Span(const Span&) = delete;
+        Span& operator= (const Span&) = delete;
+
+    private:
+        const char* name_;
+        bool enabled_;
+        clock_type::time_point begin_;
+    };
+
+    /// Writes the spans of all threads to the file given to enable(). Must be called while no thread records spans.
+    bool write() const {
+        if (!enabled_) return true;
+
+        std::ofstream out(file_);
+        if (!out) {
+            std::cout << "The trace could not be written to " << file_ << "." << std::endl;
+            return false;
+        }
+
+        // The timestamps and the durations are in microseconds.
+        out << "{\"traceEvents\": [";
+        bool first = true;
+        uint64_t dropped = 0;
+        for (auto& t : threads_) {
+            const uint64_t size = t.ring.size();
+            const uint64_t begin = t.count > size ? t.count - size : 0;
+            dropped += begin;
+            for (uint64_t i = begin; i < t.count; ++i) {
+                const Event& e = t.ring[i % size];
+                out << (first ? "\n" : ",\n")
+                    << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << t.tid
+                    << ", \"ts\": " << e.begin_ns * 1e-3 << ", \"dur\": " << (e.end_ns - e.begin_ns) * 1e-3 << "}";
+                first = false;
+            }
+        }
+        out << "\n]}" << std::endl;
+
+        if (dropped > 0)
+            std::cout << "The trace is missing the " << dropped << " oldest span(s), the buffers of the threads were full." << std::endl;
+
+        return bool(out);
+    }
+
+private:
+    EventTracer()
+        : enabled_(false), next_tid_(0)
+        , threads_([this] { return ThreadEvents(next_tid_++, RING_CAPACITY); })
+    {}
+
+    EventTracer(const EventTracer&) = delete;
+    EventTracer& operator= (const EventTracer&) = delete;
+
+    void add(const char* name, clock_type::time_point begin, clock_type::time_point end) {
+        auto& t = threads_.local();
+        t.ring[t.count % t.ring.size()] = Event {
+            name,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(begin - start_).count(),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(end - start_).count()
+        };
+        t.count++;
+    }
+
+    bool enabled_;
+    std::string file_;
+    clock_type::time_point start_;
+
+    std::atomic<int> next_tid_;
+    tbb::enumerable_thread_specific<ThreadEvents> threads_;
+};
+
+} // namespace imba
+
+#endif // IMBA_EVENT_TRACER_H
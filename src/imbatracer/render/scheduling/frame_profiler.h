@@ -0,0 +1,189 @@
+#ifndef IMBA_FRAME_PROFILER_H
+#define IMBA_FRAME_PROFILER_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <tbb/enumerable_thread_specific.h>
+
+#include "imbatracer/render/scheduling/event_tracer.h"
+
+namespace imba {
+
+/// Stages of the traversal-shading pipeline that are timed by the FrameProfiler.
+enum ProfileStage : int {
+    PROFILE_RAY_GEN,
+    PROFILE_TRAVERSAL,
+    PROFILE_SHADING,
+    PROFILE_SHADOW_TRAVERSAL,
+    PROFILE_SHADOW_SHADING,
+    PROFILE_STAGE_COUNT
+};
+
+/// Accumulates the time spent by the scheduler threads in each pipeline stage.
+/// Every thread writes to its own counters, which are only combined once per frame, in end_frame().
+/// The times are thread times, i.e. they are summed over all threads that run a stage concurrently.
+/// When a tile scheduler thread traverses its rays asynchronously on the GPU, the time spent waiting for the hits is recorded.
+/// The traversal stages also count the rays they traverse.
+class FrameProfiler {
+    typedef std::chrono::high_resolution_clock clock_type;
+
+    struct StageTimes {
+        std::array<int64_t, PROFILE_STAGE_COUNT> ns;
+        std::array<int64_t, PROFILE_STAGE_COUNT> calls;
+        std::array<int64_t, PROFILE_STAGE_COUNT> rays;
+
+        StageTimes() { clear(); }
+
+        void clear() {
+            ns.fill(0);
+            calls.fill(0);
+            rays.fill(0);
+        }
+    };
+
+public:
+    enum Output {
+        none,
+        summary,
+        csv,
+        totals      ///< Only accumulates the totals, which are queried by the caller
+    };
+
+    /// Returns the profiler shared by all schedulers.
+    static FrameProfiler& instance() {
+        static FrameProfiler profiler;
+        return profiler;
+    }
+
+    /// Enables the profiler. In csv mode, one line per frame is written to the given file.
+    void configure(Output output, const std::string& csv_file = "") {
+        output_ = output;
+        if (output_ == csv) {
+            csv_.open(csv_file);
+            if (!csv_) {
+                std::cout << "Cannot open the profiler output file " << csv_file << ", profiling disabled." << std::endl;
+                output_ = none;
+                return;
+            }
+
+            csv_ << "frame";
+            for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+                csv_ << "," << stage_name(i) << "_ms," << stage_name(i) << "_calls";
+            csv_ << std::endl;
+        }
+    }
+
+    bool enabled() const { return output_ != none; }
+
+    /// Times the enclosing scope as part of the given stage, which processes the given number of rays.
+    /// The scope is also recorded as a span by the EventTracer. The profiler and the tracer do nothing when disabled.
+    class Scope {
+    public:
+        Scope(ProfileStage stage, int64_t rays = 0)
+            : stage_(stage), rays_(rays), enabled_(FrameProfiler::instance().enabled())
+            , span_(stage_name(stage))
+        {
+            if (enabled_) start_ = clock_type::now();
+        }
+
+        ~Scope() {
+            if (enabled_) FrameProfiler::instance().add(stage_, clock_type::now() - start_, rays_);
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator= (const Scope&) = delete;
+
+    private:
+        ProfileStage stage_;
+        int64_t rays_;
+        bool enabled_;
+        clock_type::time_point start_;
+        EventTracer::Span span_;
+    };
+
+    /// Combines the counters of all threads into the totals of the frame. Must be called between frames.
+    void end_frame() {
+        if (!enabled()) return;
+
+        StageTimes frame;
+        for (auto& t : thread_times_) {
+            for (int i = 0; i < PROFILE_STAGE_COUNT; ++i) {
+                frame.ns[i]    += t.ns[i];
+                frame.calls[i] += t.calls[i];
+                frame.rays[i]  += t.rays[i];
+            }
+            t.clear();
+        }
+
+        for (int i = 0; i < PROFILE_STAGE_COUNT; ++i) {
+            total_.ns[i]    += frame.ns[i];
+            total_.calls[i] += frame.calls[i];
+            total_.rays[i]  += frame.rays[i];
+        }
+
+        if (output_ == csv) {
+            csv_ << frames_;
+            for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+                csv_ << "," << frame.ns[i] * 1e-6 << "," << frame.calls[i];
+            csv_ << std::endl;
+        }
+
+        frames_++;
+    }
+
+    /// Prints the average time per frame spent in every stage.
+    void print_summary() const {
+        if (output_ != summary || frames_ == 0) return;
+
+        int64_t sum = 0;
+        for (int i = 0; i < PROFILE_STAGE_COUNT; ++i)
+            sum += total_.ns[i];
+
+        std::cout << "Average thread time per frame over " << frames_ << " frame(s):" << std::endl;
+        for (int i = 0; i < PROFILE_STAGE_COUNT; ++i) {
+            std::cout << "  " << stage_name(i) << ": "
+                      << total_.ns[i] * 1e-6 / frames_ << "ms ("
+                      << (sum > 0 ? 100.0 * total_.ns[i] / sum : 0.0) << "%), "
+                      << double(total_.calls[i]) / frames_ << " call(s)" << std::endl;
+        }
+    }
+
+    /// Number of rays traversed in all the frames so far, primary and shadow rays.
+    int64_t total_rays() const { return total_.rays[PROFILE_TRAVERSAL] + total_.rays[PROFILE_SHADOW_TRAVERSAL]; }
+
+private:
+    FrameProfiler() : output_(none), frames_(0) {}
+
+    FrameProfiler(const FrameProfiler&) = delete;
+    FrameProfiler& operator= (const FrameProfiler&) = delete;
+
+    void add(ProfileStage stage, clock_type::duration d, int64_t rays) {
+        auto& t = thread_times_.local();
+        t.ns[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        t.calls[stage]++;
+        t.rays[stage] += rays;
+    }
+
+    static const char* stage_name(int stage) {
+        static const char* names[PROFILE_STAGE_COUNT] = {
+            "ray_gen", "traversal", "shading", "shadow_traversal", "shadow_shading"
+        };
+        return names[stage];
+    }
+
+    Output output_;
+    tbb::enumerable_thread_specific<StageTimes> thread_times_;
+
+    StageTimes total_;
+    int frames_;
+    std::ofstream csv_;
+};
+
+} // namespace imba
+
+#endif // IMBA_FRAME_PROFILER_H
@@ -0,0 +1,74 @@
+#ifndef IMBA_GPU_STREAM_H
+#define IMBA_GPU_STREAM_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <queue>
+
+namespace imba {
+
+/// Executes GPU commands (transfers and kernel launches) in submission order on a dedicated thread.
+/// The runtime only offers blocking copies and kernel calls, so this allows the submitting thread to continue
+/// with other work, e.g. shading another queue, while the transfers and the traversal of a queue are in flight.
+class GpuStream {
+public:
+    GpuStream()
+        : shutdown_(false)
+    {
+        worker_ = std::thread([this] () { run(); });
+    }
+
+    ~GpuStream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+        }
+        cv_.notify_one();
+        worker_.join();
+    }
+
+    GpuStream(const GpuStream&) = delete;
+    GpuStream& operator= (const GpuStream&) = delete;
+
+    /// Enqueues a command. The returned future becomes ready once the command has been executed.
+    std::future<void> submit(std::function<void ()> cmd) {
+        std::packaged_task<void ()> task(std::move(cmd));
+        auto future = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            commands_.push(std::move(task));
+        }
+        cv_.notify_one();
+        return future;
+    }
+
+private:
+    std::thread worker_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::queue<std::packaged_task<void ()> > commands_;
+    bool shutdown_;
+
+    void run() {
+        while (true) {
+            std::packaged_task<void ()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return shutdown_ || !commands_.empty(); });
+                // Pending commands are still executed when the stream is destroyed.
+                if (commands_.empty()) return;
+
+                task = std::move(commands_.front());
+                commands_.pop();
+            }
+            task();
+        }
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_GPU_STREAM_H
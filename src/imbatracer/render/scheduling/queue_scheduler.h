@@ -6,9 +6,12 @@
 #define NOMINMAX
 #include <tbb/tbb.h>
 #include <tbb/task_group.h>
+#include <tbb/concurrent_queue.h>
 
-#include <condition_variable>
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
 
 namespace imba {
 
@@ -52,20 +55,23 @@ enum QueueTag : int {
     QUEUE_EMPTY,
     QUEUE_IN_USE,
     QUEUE_READY_FOR_SHADING,
-    QUEUE_READY_FOR_TRAVERSAL
+    QUEUE_READY_FOR_TRAVERSAL,
+    QUEUE_TAG_COUNT
 };
 
+/// Set of ray queues, each of which is tagged with its current status.
+/// The indices of the queues that are not in use are kept in one concurrent list per tag,
+/// so that claiming or returning a queue never scans the pool or takes a lock.
 template <typename StateType>
 class RayQueuePool {
 public:
     RayQueuePool(size_t queue_size, size_t count, bool gpu_traversal = true)
-        : queues_(count), queue_flags_(count)
+        : queues_(count)
     {
-        for (auto iter = queue_flags_.begin(); iter != queue_flags_.end(); ++iter)
-            iter->store(QUEUE_EMPTY);
-
-        for (auto& q : queues_)
-            q = new RayQueue<StateType>(queue_size, gpu_traversal);
+        for (size_t i = 0; i < count; ++i) {
+            queues_[i] = new RayQueue<StateType>(queue_size, gpu_traversal);
+            lists_[QUEUE_EMPTY].push(i);
+        }
 
         nonempty_count_ = 0;
     }
@@ -75,44 +81,43 @@ public:
             delete q;
     }
 
-    /// Finds the next queue that matches the given tag, sets its tag to QUEUE_IN_USE and returns it.
+    /// Claims a queue that matches the given tag, which is in use until it is returned.
     QueueReference<StateType> claim_queue_with_tag(QueueTag tag) {
-        for (size_t i = 0; i < queues_.size(); ++i) {
-            QueueTag expected = tag;
-            if (queue_flags_[i].compare_exchange_strong(expected, QUEUE_IN_USE)) {
-                // We found a matching queue.
-                if (tag == QUEUE_EMPTY)
-                    nonempty_count_++;
-                return QueueReference<StateType>(*queues_[i], i);
-            }
-        }
+        assert(tag != QUEUE_IN_USE);
 
-        return QueueReference<StateType>();
+        size_t i;
+        if (!lists_[tag].try_pop(i))
+            return QueueReference<StateType>();
+
+        if (tag == QUEUE_EMPTY)
+            nonempty_count_++;
+        return QueueReference<StateType>(*queues_[i], i);
     }
 
-    /// Finds the next queue that matches the given tag and that,
-    /// has a smaller fill factor than the given value,
-    /// sets its tag to QUEUE_IN_USE and returns it.
+    /// Claims a queue that matches the given tag and that has a smaller fill factor than the given value.
+    /// Only the queues that are currently in the list for that tag are considered.
     QueueReference<StateType> claim_queue_for_regen(QueueTag tag, float fill_factor) {
-        for (size_t i = 0; i < queues_.size(); ++i) {
-            QueueTag expected = tag;
-            if (queue_flags_[i].compare_exchange_strong(expected, QUEUE_IN_USE)) {
-                if (queues_[i]->size() < queues_[i]->capacity() * fill_factor) {
-                    // We found a matching queue.
-                    if (tag == QUEUE_EMPTY)
-                        nonempty_count_++;
-                    return QueueReference<StateType>(*queues_[i], i);
-                }
+        assert(tag != QUEUE_IN_USE);
 
-                // Restore the tag
-                queue_flags_[i].store(tag);
+        size_t i;
+        for (size_t n = lists_[tag].unsafe_size(); n > 0 && lists_[tag].try_pop(i); --n) {
+            if (queues_[i]->size() < queues_[i]->capacity() * fill_factor) {
+                // We found a matching queue.
+                if (tag == QUEUE_EMPTY)
+                    nonempty_count_++;
+                return QueueReference<StateType>(*queues_[i], i);
             }
+
+            // Put the queue back at the end of the list
+            lists_[tag].push(i);
         }
 
         return QueueReference<StateType>();
     }
 
     void return_queue(QueueReference<StateType> ref, QueueTag new_tag) {
+        assert(new_tag != QUEUE_IN_USE);
+
         // Tag all returned queues that are empty as QUEUE_EMPTY.
         if (ref->size() <= 0)
             new_tag = QUEUE_EMPTY;
@@ -123,7 +128,7 @@ public:
             nonempty_count_--;
         }
 
-        queue_flags_[ref.index()] = new_tag;
+        lists_[new_tag].push(ref.index());
     }
 
     /// Checks if there are still any non-empty queues left.
@@ -133,15 +138,28 @@ public:
 
     size_t size() { return queues_.size(); }
 
+    /// Number of bytes allocated by all the queues of the pool, in host and in device memory.
+    size_t host_bytes() const {
+        size_t bytes = 0;
+        for (auto q : queues_) bytes += q->host_bytes();
+        return bytes;
+    }
+    size_t device_bytes() const {
+        size_t bytes = 0;
+        for (auto q : queues_) bytes += q->device_bytes();
+        return bytes;
+    }
+
 private:
     std::vector<RayQueue<StateType>*> queues_;
-    std::vector<std::atomic<QueueTag> > queue_flags_;
+    tbb::concurrent_queue<size_t> lists_[QUEUE_TAG_COUNT];
 
     std::atomic<size_t> nonempty_count_;
 };
 
 /// Uses a fixed number of queues, and multiple shading threads.
-/// Traversal runs in the main thread and some other optimizations have been made for the GPU traversal.
+/// Traversal is issued by the main thread and some other optimizations have been made for the GPU traversal:
+/// GPU transfers and kernels run asynchronously, so that the next queue is traversed while the previous one is shaded.
 /// Thus, the QueueScheduler should never be used with the CPU traversal.
 template <typename StateType, typename ShadowStateType>
 class QueueScheduler : public RayScheduler<StateType, ShadowStateType> {
@@ -152,10 +170,14 @@ class QueueScheduler : public RayScheduler<StateType, ShadowStateType> {
 
     static constexpr int DEFAULT_QUEUE_SIZE = 1 << 16;
     static constexpr int DEFAULT_QUEUE_COUNT = 12;
+    // The shadow queues initially hold this many rays per primary ray, and grow when more rays are pushed.
+    static constexpr int INITIAL_SHADOW_RAYS_PER_HIT = 1;
 
 protected:
     using BaseType::scene_;
     using BaseType::gpu_traversal;
+    using BaseType::contribs_;
+    using BaseType::deferred_flush_;
 
 public:
     QueueScheduler(RayGen<StateType>& ray_gen,
@@ -168,9 +190,13 @@ public:
         : BaseType(scene, gpu_traversal)
         , ray_gen_(ray_gen)
         , primary_queue_pool_(queue_size, queue_count, gpu_traversal)
-        , shadow_queue_pool_(queue_size * max_shadow_rays_per_hit, 2 * queue_count / 3 + 1, gpu_traversal)
+        , shadow_queue_pool_(queue_size * std::min(max_shadow_rays_per_hit, int(INITIAL_SHADOW_RAYS_PER_HIT)), 2 * queue_count / 3 + 1, gpu_traversal)
+        , done_processing_(0)
         , regen_threshold_(regen_threshold)
-    {}
+    {
+        if (gpu_traversal)
+            gpu_stream_.reset(new GpuStream);
+    }
 
     ~QueueScheduler() noexcept(true) {}
 
@@ -178,6 +204,7 @@ public:
                        ProcessShadowFn process_shadow_rays, ProcessPrimaryFn process_primary_rays,
                        SamplePixelFn sample_fn) override final {
         ray_gen_.start_frame();
+        contribs_.resize(out.width(), out.height());
 
         done_processing_ = 0;
         while (!ray_gen_.is_empty() ||
@@ -185,57 +212,83 @@ public:
                shadow_queue_pool_.nonempty_count()) {
             bool idle = true;
 
-            // Traverse a shadow queue and process it in parallel
-            auto q_shadow = shadow_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
-            if (q_shadow) {
+            // Traverse a shadow queue. On the GPU, this happens asynchronously and the queue
+            // is tagged as ready for shading once the hits have been copied back.
+            auto q_shadow_trav = shadow_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
+            if (q_shadow_trav) {
                 idle = false;
 
-                if (gpu_traversal)
-                    q_shadow->traverse_occluded_gpu(scene_.traversal_data_gpu());
-                else
-                    q_shadow->traverse_occluded_cpu(scene_.traversal_data_cpu());
+                if (gpu_traversal) {
+                    gpu_stream_->submit([this, q_shadow_trav] {
+                        {
+                            FrameProfiler::Scope profile(PROFILE_SHADOW_TRAVERSAL, q_shadow_trav->size());
+                            q_shadow_trav->traverse_occluded_gpu(scene_.traversal_data_gpu());
+                        }
+                        shadow_queue_pool_.return_queue(q_shadow_trav, QUEUE_READY_FOR_SHADING);
+                        notify_done();
+                    });
+                } else {
+                    FrameProfiler::Scope profile(PROFILE_SHADOW_TRAVERSAL, q_shadow_trav->size());
+                    q_shadow_trav->traverse_occluded_cpu(scene_.traversal_data_cpu());
+                    shadow_queue_pool_.return_queue(q_shadow_trav, QUEUE_READY_FOR_SHADING);
+                }
+            }
+
+            // Process a traversed shadow queue in parallel
+            auto q_shadow = shadow_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_SHADING);
+            if (q_shadow) {
+                idle = false;
 
-                shading_tasks_.run([this, process_shadow_rays, q_shadow, &out] {
-                    process_shadow_rays(*q_shadow, out);
+                shading_tasks_.run([this, process_shadow_rays, q_shadow] {
+                    {
+                        FrameProfiler::Scope profile(PROFILE_SHADOW_SHADING);
+                        process_shadow_rays(*q_shadow, contribs_);
+                    }
                     shadow_queue_pool_.return_queue(q_shadow, QUEUE_EMPTY);
 
                     // Notify the scheduler that one shadow queue has been processed
-                    {
-                        std::lock_guard<std::mutex> lock(mutex_);
-                        done_processing_++;
-                    }
-                    cv_.notify_all();
+                    notify_done();
                 });
             }
 
-            // Traverse a primary ray queue
-            auto q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
-            if (q_primary) {
+            // Traverse a primary ray queue, asynchronously on the GPU.
+            auto q_trav = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_TRAVERSAL);
+            if (q_trav) {
                 idle = false;
-                if (gpu_traversal)
-                    q_primary->traverse_gpu(scene_.traversal_data_gpu());
-                else
-                    q_primary->traverse_cpu(scene_.traversal_data_cpu());
-            } else {
-                q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_SHADING);
+
+                if (gpu_traversal) {
+                    gpu_stream_->submit([this, q_trav] {
+                        {
+                            FrameProfiler::Scope profile(PROFILE_TRAVERSAL, q_trav->size());
+                            q_trav->traverse_gpu(scene_.traversal_data_gpu());
+                        }
+                        primary_queue_pool_.return_queue(q_trav, QUEUE_READY_FOR_SHADING);
+                        notify_done();
+                    });
+                } else {
+                    FrameProfiler::Scope profile(PROFILE_TRAVERSAL, q_trav->size());
+                    q_trav->traverse_cpu(scene_.traversal_data_cpu());
+                    primary_queue_pool_.return_queue(q_trav, QUEUE_READY_FOR_SHADING);
+                }
             }
 
+            auto q_primary = primary_queue_pool_.claim_queue_with_tag(QUEUE_READY_FOR_SHADING);
+
             // Try to shade a queue of rays
             auto q_shadow_out = shadow_queue_pool_.claim_queue_with_tag(QUEUE_EMPTY);
             if (q_primary && q_shadow_out) {
                 idle = false;
-                shading_tasks_.run([this, process_primary_rays, &out, q_primary, q_shadow_out] () {
-                    process_primary_rays(*q_primary, *q_shadow_out, out);
+                shading_tasks_.run([this, process_primary_rays, q_primary, q_shadow_out] () {
+                    {
+                        FrameProfiler::Scope profile(PROFILE_SHADING);
+                        process_primary_rays(*q_primary, *q_shadow_out, contribs_);
+                    }
 
                     primary_queue_pool_.return_queue(q_primary, QUEUE_READY_FOR_TRAVERSAL);
                     shadow_queue_pool_.return_queue(q_shadow_out, QUEUE_READY_FOR_TRAVERSAL);
 
                     // Notify the scheduler that one primary queue has been processed
-                    {
-                        std::lock_guard<std::mutex> lock(mutex_);
-                        done_processing_++;
-                    }
-                    cv_.notify_all();
+                    notify_done();
                 });
             } else {
                 // We cannot shade the rays in the queue, so we postpone them for the next iteration
@@ -249,6 +302,7 @@ public:
                 auto q_empty = primary_queue_pool_.claim_queue_with_tag(QUEUE_EMPTY);
                 if (!q_empty) break;
                 idle = false;
+                FrameProfiler::Scope profile(PROFILE_RAY_GEN);
                 ray_gen_.fill_queue(*q_empty, sample_fn);
                 primary_queue_pool_.return_queue(q_empty, QUEUE_READY_FOR_TRAVERSAL);
                 n++;
@@ -259,19 +313,26 @@ public:
                 auto q_regen = primary_queue_pool_.claim_queue_for_regen(QUEUE_READY_FOR_TRAVERSAL, regen_threshold_);
                 if (!q_regen) break;
                 idle = false;
+                FrameProfiler::Scope profile(PROFILE_RAY_GEN);
                 ray_gen_.fill_queue(*q_regen, sample_fn);
                 primary_queue_pool_.return_queue(q_regen, QUEUE_READY_FOR_TRAVERSAL);
             }
 
-            // If nothing happened this iteration, wait for the next shading task
-            if (idle) {
-                std::unique_lock<std::mutex> lock(mutex_);
-                while (done_processing_ <= 0) cv_.wait(lock);
-                done_processing_--;
-            }
+            // If nothing happened this iteration, wait for the next shading task or traversal to finish
+            if (idle) wait_done();
         }
 
         shading_tasks_.wait();
+        if (!deferred_flush_) contribs_.flush(out);
+    }
+
+    bool set_spp(int spp) override final { return ray_gen_.set_spp(spp); }
+    bool set_resolution(int w, int h) override final { return ray_gen_.set_resolution(w, h); }
+
+    void report_memory(MemoryReport& report, const std::string& prefix) const override final {
+        report.add(prefix + " primary queues", primary_queue_pool_.host_bytes(), primary_queue_pool_.device_bytes());
+        report.add(prefix + " shadow queues", shadow_queue_pool_.host_bytes(), shadow_queue_pool_.device_bytes());
+        report.add(prefix + " contributions", contribs_.memory_bytes());
     }
 
 private:
@@ -281,11 +342,40 @@ private:
     RayQueuePool<ShadowStateType> shadow_queue_pool_;
     tbb::task_group shading_tasks_;
 
-    std::condition_variable cv_;
-    std::mutex mutex_;
-    int done_processing_;
+    // Number of shading tasks and traversals that have finished and that the main loop has not waited for yet.
+    std::atomic<int> done_processing_;
+
+    // Backoff of the main loop while it waits: it spins first, then yields, and only sleeps after a long wait.
+    static constexpr int WAIT_SPIN_ROUNDS = 64;
+    static constexpr int WAIT_YIELD_ROUNDS = 1024;
+    static constexpr int WAIT_SLEEP_US = 50;
 
     float regen_threshold_;
+
+    // Transfers and traversal kernels run asynchronously on this stream, overlapping with shading.
+    std::unique_ptr<GpuStream> gpu_stream_;
+
+    /// Notifies the scheduler that a shading task or an asynchronous traversal has finished.
+    void notify_done() { done_processing_.fetch_add(1, std::memory_order_release); }
+
+    /// Waits until a shading task or an asynchronous traversal has finished. Never takes a lock, so that the main
+    /// loop resumes as soon as possible, and backs off to a sleep only if nothing finishes for a long time.
+    void wait_done() {
+        for (int round = 0; ; ++round) {
+            int done = done_processing_.load(std::memory_order_acquire);
+            while (done > 0) {
+                if (done_processing_.compare_exchange_weak(done, done - 1, std::memory_order_acq_rel))
+                    return;
+            }
+
+            if (round < WAIT_SPIN_ROUNDS)
+                continue;
+            else if (round < WAIT_SPIN_ROUNDS + WAIT_YIELD_ROUNDS)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(WAIT_SLEEP_US));
+        }
+    }
 };
 
 } // namespace imba
@@ -8,12 +8,22 @@
 #include <atomic>
 #include <mutex>
 #include <memory>
+#include <numeric>
+#include <type_traits>
 
 #include <tbb/parallel_sort.h>
+#include <tbb/parallel_for.h>
 #include <anydsl_runtime.hpp>
 
 #include "imbatracer/core/traversal_interface.h"
+#include "imbatracer/core/counting_sort.h"
+#include "imbatracer/core/bsphere.h"
+#include "imbatracer/core/common.h"
+#include "imbatracer/core/memory_report.h"
 #include "imbatracer/render/random.h"
+#include "imbatracer/render/sampler.h"
+#include "imbatracer/render/ray_cone.h"
+#include "imbatracer/render/scheduling/gpu_stream.h"
 
 namespace imba {
 
@@ -29,7 +39,9 @@ struct RayState {
         int light_id;
     };
 
-    RNG rng;
+    Sampler rng;
+
+    RayCone cone;
 };
 
 /// State associated with a shadow ray
@@ -38,6 +50,35 @@ struct ShadowState {
     rgb throughput;
 };
 
+/// Placeholder for the cold part of states that are stored as a single array.
+struct NoColdState {};
+
+/// Describes how a RayQueue stores the states of its rays. By default, every state is stored as a whole, in one array.
+/// States can be split into a hot part, which is accessed in every shading pass, and a cold part, which holds
+/// rarely used data, by specializing this template (see SplitStateLayout). The two parts are then stored in separate arrays.
+template <typename StateType>
+struct StateLayout {
+    typedef StateType HotState;
+    typedef NoColdState ColdState;
+
+    static const HotState& hot(const StateType& s) { return s; }
+    static ColdState cold(const StateType&) { return ColdState(); }
+};
+
+/// Layout for states that derive from both a hot and a cold part.
+template <typename Hot, typename Cold>
+struct SplitStateLayout {
+    typedef Hot HotState;
+    typedef Cold ColdState;
+
+    static const HotState& hot(const HotState& s) { return s; }
+    static const ColdState& cold(const ColdState& s) { return s; }
+};
+
+/// Returns the number of bytes allocated by an array of the AnyDSL runtime.
+template <typename T>
+size_t array_bytes(const anydsl::Array<T>& array) { return array.size() * sizeof(T); }
+
 /// Structure that contains the traversal data, such as the BVH nodes or opacity masks.
 template <typename Node>
 struct TraversalData {
@@ -51,27 +92,58 @@ struct TraversalData {
     anydsl::Array<int> indices;
     anydsl::Array<TransparencyMask> masks;
     anydsl::Array<char> mask_buffer;
+
+    /// Number of bytes allocated for the acceleration structures: the nodes, the instances and the triangles.
+    size_t accel_bytes() const { return array_bytes(nodes) + array_bytes(instances) + array_bytes(tris); }
+    /// Number of bytes allocated for the masks, with the indices and texture coordinates used to look them up.
+    size_t mask_bytes() const {
+        return array_bytes(masks) + array_bytes(mask_buffer) + array_bytes(indices) + array_bytes(texcoords);
+    }
 };
 
 /// Stores a set of rays for traversal along with their state.
+/// The states are pushed as a whole, but stored according to their StateLayout:
+/// state(i) gives access to the hot part, cold_state(i) to the cold part (if any).
 template <typename StateType>
 class RayQueue {
+public:
+    typedef typename StateLayout<StateType>::HotState HotState;
+    typedef typename StateLayout<StateType>::ColdState ColdState;
+
+private:
+    static constexpr bool has_cold = !std::is_empty<ColdState>::value;
+
     static int align_cpu(int v) { return v %  8 == 0 ? v : v +  8 - v %  8; }
     static int align_gpu(int v) { return v % 64 == 0 ? v : v + 64 - v % 64; }
     static int align(int v) { return std::max(align_cpu(v), align_gpu(v)); }
 
+    // Number of consecutive rays processed by one task during compaction.
+    static constexpr int COMPACT_BLOCK_SIZE = 2048;
+
+    // Number of grid cells along each axis used to compute the Morton code of the ray origins for coherence sorting.
+    static constexpr int COHERENCE_GRID_BITS = 3;
+    static constexpr int COHERENCE_BINS = 8 << (3 * COHERENCE_GRID_BITS);
+
 public:
-    RayQueue() { }
+    RayQueue() : parallel_(true) { }
 
     RayQueue(int capacity, bool gpu_buffers)
         : ray_buffer_     (align(capacity))
         , hit_buffer_     (align(capacity))
+        , gpu_buffers_(gpu_buffers)
         , state_buffer_   (align(capacity))
-        , sorted_indices_ (align(capacity))
+        , cold_buffer_    (has_cold ? align(capacity) : 0)
         , last_(-1)
-        , gpu_buffers_(gpu_buffers)
+        , sorted_indices_ (align(capacity))
+        , ray_back_       (align(capacity))
+        , hit_back_       (align(capacity))
+        , state_back_     (align(capacity))
+        , cold_back_      (has_cold ? align(capacity) : 0)
+        , high_water_(0)
+        , parallel_(true)
     {
         memset(ray_buffer_.data(), 0, sizeof(Ray) * align(capacity));
+        memset(ray_back_.data(), 0, sizeof(Ray) * align(capacity));
 
         // Create buffers on the GPU if necessary.
         if (gpu_buffers) {
@@ -87,46 +159,114 @@ public:
         : ray_buffer_(std::move(rhs.ray_buffer_))
         , hit_buffer_(std::move(rhs.hit_buffer_))
         , state_buffer_(std::move(rhs.state_buffer_))
-        , sorted_indices_(std::move(rhs.sorted_indices_))
+        , cold_buffer_(std::move(rhs.cold_buffer_))
         , last_(rhs.last_.load())
+        , sorted_indices_(std::move(rhs.sorted_indices_))
+        , ray_back_(std::move(rhs.ray_back_))
+        , hit_back_(std::move(rhs.hit_back_))
+        , state_back_(std::move(rhs.state_back_))
+        , cold_back_(std::move(rhs.cold_back_))
+        , spill_rays_(std::move(rhs.spill_rays_))
+        , spill_states_(std::move(rhs.spill_states_))
+        , spill_cold_(std::move(rhs.spill_cold_))
+        , high_water_(rhs.high_water_)
+        , parallel_(rhs.parallel_)
     {}
 
     RayQueue& operator= (RayQueue<StateType>&& rhs) {
         ray_buffer_ = std::move(rhs.ray_buffer_);
         hit_buffer_ = std::move(rhs.hit_buffer_);
         state_buffer_ = std::move(rhs.state_buffer_);
+        cold_buffer_ = std::move(rhs.cold_buffer_);
         sorted_indices_ = std::move(rhs.sorted_indices_);
+        ray_back_ = std::move(rhs.ray_back_);
+        hit_back_ = std::move(rhs.hit_back_);
+        state_back_ = std::move(rhs.state_back_);
+        cold_back_ = std::move(rhs.cold_back_);
         last_ = rhs.last_.load();
+        spill_rays_ = std::move(rhs.spill_rays_);
+        spill_states_ = std::move(rhs.spill_states_);
+        spill_cold_ = std::move(rhs.spill_cold_);
+        high_water_ = rhs.high_water_;
+        parallel_ = rhs.parallel_;
 
         return *this;
     }
 
     int size() const { return last_ + 1; }
     int capacity() const { return state_buffer_.size(); }
+    /// Returns the largest number of rays that have been traversed at once since the queue was created.
+    int high_water_mark() const { return high_water_; }
+
+    /// Number of bytes allocated by the queue in host memory, including the back buffers and the spilled rays.
+    size_t host_bytes() const {
+        return array_bytes(ray_buffer_) + array_bytes(hit_buffer_) + array_bytes(ray_back_) + array_bytes(hit_back_) +
+               vector_bytes(state_buffer_) + vector_bytes(cold_buffer_) + vector_bytes(state_back_) + vector_bytes(cold_back_) +
+               vector_bytes(sorted_indices_) + vector_bytes(mat_ids_) + vector_bytes(mat_offsets_) + key_sort_.memory_bytes() +
+               vector_bytes(block_offsets_) + vector_bytes(compact_scratch_) + vector_bytes(coherence_keys_) +
+               vector_bytes(spill_rays_) + vector_bytes(spill_states_) + vector_bytes(spill_cold_);
+    }
+    /// Number of bytes allocated by the queue in device memory, for the GPU traversal.
+    size_t device_bytes() const { return array_bytes(dev_ray_buffer_) + array_bytes(dev_hit_buffer_); }
+
+    /// Selects whether the loops over the rays of the queue run in parallel. Schedulers whose threads already occupy
+    /// all the cores disable it, so that a queue is processed by the thread that owns it, without nested parallelism.
+    void set_parallel(bool parallel) { parallel_ = parallel; }
+    bool parallel() const { return parallel_; }
+
+    /// Calls body on subranges of [begin, end), in parallel if the queue is parallel, otherwise on the whole range.
+    template <typename Body>
+    void for_each_range(int begin, int end, const Body& body) const {
+        if (parallel_)
+            tbb::parallel_for(tbb::blocked_range<int>(begin, end), body);
+        else if (begin < end)
+            body(tbb::blocked_range<int>(begin, end));
+    }
+
+    /// Calls body(i) for every i in [begin, end), in parallel if the queue is parallel.
+    template <typename Body>
+    void for_each_index(int begin, int end, const Body& body) const {
+        if (parallel_)
+            tbb::parallel_for(begin, end, body);
+        else {
+            for (int i = begin; i < end; ++i) body(i);
+        }
+    }
 
     // Shrinks the queue to the given size.
     void shrink(int size) { last_ = size - 1; }
 
     Ray* rays() { return ray_buffer_.data(); }
-    StateType* states() { return state_buffer_.data(); }
+    HotState* states() { return state_buffer_.data(); }
+    ColdState* cold_states() { return cold_buffer_.data(); }
     Hit* hits() { return hit_buffer_.data(); }
 
     Ray& ray(int idx) { return ray_buffer_[sorted_indices_[idx]]; }
     Hit& hit(int idx) { return hit_buffer_[sorted_indices_[idx]]; }
-    StateType& state(int idx) { return state_buffer_[sorted_indices_[idx]]; }
+    HotState& state(int idx) { return state_buffer_[sorted_indices_[idx]]; }
+    /// Returns the cold part of the state, or an empty placeholder if the states have no cold part.
+    ColdState& cold_state(int idx) { return has_cold ? cold_buffer_[sorted_indices_[idx]] : no_cold_; }
 
     void clear() {
         last_ = -1;
+        spill_rays_.clear();
+        spill_states_.clear();
+        spill_cold_.clear();
     }
 
     /// Adds a single secondary or shadow ray to the queue. Thread-safe
+    /// If the queue is full, the ray is spilled to an overflow buffer, see flush_spill().
     void push(const Ray& ray, const StateType& state) {
         int id = ++last_; // atomic inc. of last_
 
-        assert(id < ray_buffer_.size() && "ray queue full");
+        if (id >= capacity()) {
+            std::lock_guard<std::mutex> lock(spill_mutex_);
+            spill(ray, StateLayout<StateType>::hot(state), StateLayout<StateType>::cold(state));
+            return;
+        }
 
         ray_buffer_[id] = ray;
-        state_buffer_[id] = state;
+        store_state(id, state);
     }
 
     /// Adds a set of camera rays to the queue. Thread-safe
@@ -137,11 +277,18 @@ public:
         int end_idx = last_ += count; // atomic add to last_
         int start_idx = end_idx - (count - 1);
 
-        assert(end_idx < ray_buffer_.size() && "ray queue full");
+        // Copy ray and state data, spilling whatever does not fit.
+        int i = start_idx;
+        for (; i < capacity() && rays_begin != rays_end; ++rays_begin, ++states_begin, ++i) {
+            ray_buffer_[i] = *rays_begin;
+            store_state(i, *states_begin);
+        }
 
-        // Copy ray and state data.
-        std::copy(rays_begin, rays_end, ray_buffer_.begin() + start_idx);
-        std::copy(states_begin, states_end, state_buffer_.begin() + start_idx);
+        if (rays_begin != rays_end) {
+            std::lock_guard<std::mutex> lock(spill_mutex_);
+            for (; rays_begin != rays_end; ++rays_begin, ++states_begin)
+                spill(*rays_begin, StateLayout<StateType>::hot(*states_begin), StateLayout<StateType>::cold(*states_begin));
+        }
     }
 
     // Appends the rays and state data from another queue to this queue. Hits are not copied.
@@ -150,101 +297,158 @@ public:
         int end_idx = last_ += count; // atomic add to last_
         int start_idx = end_idx - (count - 1);
 
-        assert(end_idx < ray_buffer_.size() && "ray queue full");
+        // Copy ray and state data, spilling whatever does not fit.
+        const int fit = std::max(0, std::min(count, capacity() - start_idx));
+        std::copy(other.ray_buffer_.begin(), other.ray_buffer_.begin() + fit, ray_buffer_.begin() + start_idx);
+        std::copy(other.state_buffer_.begin(), other.state_buffer_.begin() + fit, state_buffer_.begin() + start_idx);
+        if (has_cold)
+            std::copy(other.cold_buffer_.begin(), other.cold_buffer_.begin() + fit, cold_buffer_.begin() + start_idx);
+
+        if (fit < count) {
+            std::lock_guard<std::mutex> lock(spill_mutex_);
+            for (int i = fit; i < count; ++i)
+                spill(other.ray_buffer_[i], other.state_buffer_[i], has_cold ? other.cold_buffer_[i] : ColdState());
+        }
+    }
+
+    /// Moves the rays that were spilled because the queue was full into the queue, growing it as needed.
+    /// Must not be called while rays are pushed. Called automatically before sorting and traversal.
+    void flush_spill() {
+        const int count = size();
+        high_water_ = std::max(high_water_, count);
+
+        if (spill_rays_.empty())
+            return;
 
-        // Copy ray and state data.
-        std::copy(other.ray_buffer_.begin(), other.ray_buffer_.end(), ray_buffer_.begin() + start_idx);
-        std::copy(other.state_buffer_.begin(), other.state_buffer_.end(), state_buffer_.begin() + start_idx);
+        const int start_idx = capacity();
+        assert(start_idx + static_cast<int>(spill_rays_.size()) == count);
+        grow(count);
+
+        std::copy(spill_rays_.begin(), spill_rays_.end(), ray_buffer_.begin() + start_idx);
+        std::copy(spill_states_.begin(), spill_states_.end(), state_buffer_.begin() + start_idx);
+        if (has_cold)
+            std::copy(spill_cold_.begin(), spill_cold_.end(), cold_buffer_.begin() + start_idx);
+
+        spill_rays_.clear();
+        spill_states_.clear();
+        spill_cold_.clear();
     }
 
     /// Compact the queue by moving all rays that hit something (and their associated states and hits) to the front.
-    inline int compact_hits() {
-        auto hits   = this->hits();
-        auto states = this->states();
-        auto rays   = this->rays();
-
-        int last_empty = -1;
-        for (int i = 0; i < size(); ++i) {
-            if (hits[i].tri_id < 0 && last_empty == -1) {
-                last_empty = i;
-            } else if (hits[i].tri_id >= 0 && last_empty != -1) {
-                std::swap(hits[last_empty],   hits[i]);
-                std::swap(states[last_empty], states[i]);
-                std::swap(rays[last_empty],   rays[i]);
-                last_empty++;
-            }
-        }
+    /// The rays that did not hit anything are moved to the back. Returns the number of hits.
+    /// If stable is true, the order of the rays within both groups is preserved, which keeps coherent rays together.
+    inline int compact_hits(bool stable = true) {
+        auto has_hit = [this] (int i) { return hit_buffer_[i].tri_id >= 0; };
+        const int hit_count = stable ? partition_stable(has_hit, true, true)
+                                     : partition_unstable(has_hit, true, true);
 
-        for (int i = 0; i <= last_; ++i)
-            sorted_indices_[i] = i;
+        for_each_index(0, size(), [this] (int i) { sorted_indices_[i] = i; });
 
-        if (last_empty != -1)
-            return last_empty;
-        else
-            return size();
+        return hit_count;
     }
 
     /// Compacts the queue by moving all continued rays to the front. Does not move the hits.
-    inline void compact_rays() {
-        auto states = this->states();
-        auto rays   = this->rays();
-
-        int last_empty = -1;
-        for (int i = 0; i < size(); ++i) {
-            if (states[i].pixel_id < 0 && last_empty == -1) {
-                last_empty = i;
-            } else if (states[i].pixel_id >= 0 && last_empty != -1) {
-                states[last_empty] = states[i];
-                rays[last_empty]   = rays[i];
-                last_empty++;
-            }
-        }
-
-        // If at least one empty ray was replaced, shrink the queue.
-        // last_empty corresponds to the new queue size.
-        if (last_empty != -1)
-            shrink(last_empty);
+    /// If stable is true, the order of the continued rays is preserved.
+    inline void compact_rays(bool stable = true) {
+        auto is_alive = [this] (int i) { return state_buffer_[i].pixel_id >= 0; };
+        const int alive = stable ? partition_stable(is_alive, false, false)
+                                 : partition_unstable(is_alive, false, false);
+        shrink(alive);
     }
 
-    typedef std::function<int (const Hit&)> GetMatIDFn;
-
-    inline void sort_by_material(GetMatIDFn get_mat_id, int num_mats, int count) {
-        if (matcount_.size() < num_mats)
-            matcount_ = std::vector<std::atomic<int> >(num_mats);
-        std::fill(matcount_.begin(), matcount_.end(), 0);
+    /// Sorts the first count hits by material, using the given function to obtain the material id of a hit.
+    /// Afterwards, ray(i), hit(i) and state(i) access the hits in sorted order.
+    /// Returns the boundaries of the material bins: the hits with material m are at indices [offsets[m], offsets[m + 1]).
+    template <typename GetMatIDFn>
+    inline const std::vector<int>& sort_by_material(GetMatIDFn get_mat_id, int num_mats, int count) {
+        if (mat_ids_.size() < count)
+            mat_ids_.resize(count);
 
-        // Count the number of hit points per material.
-        tbb::parallel_for(tbb::blocked_range<int>(0, count),
+        for_each_range(0, count,
             [&] (const tbb::blocked_range<int>& range)
         {
             for (auto i = range.begin(); i != range.end(); ++i) {
-                const int mat_id = get_mat_id(hit_buffer_[i]);
-                ray_buffer_[i].dir.w = int_as_float(mat_id);
-                matcount_[mat_id]++;
+                mat_ids_[i] = get_mat_id(hit_buffer_[i]);
+                sorted_indices_[i] = i;
             }
         });
 
-        // Compute the starting index of every bin.
-        int accum = 0;
-        for (int i = 0; i < num_mats; ++i) {
-            const int tmp = matcount_[i];
-            matcount_[i] = accum;
-            accum += tmp;
-        }
+        // The material ids usually fit in one digit, so this is a single stable counting pass.
+        key_sort_.sort(mat_ids_.data(), sorted_indices_.data(), count, key_bits(std::max(num_mats - 1, 0)), parallel_);
 
-        // Distribute the indices according to their material ids.
-        tbb::parallel_for(tbb::blocked_range<int>(0, count),
+        // Compute the starting index of every bin from the sorted ids.
+        mat_offsets_.resize(num_mats + 1);
+        for (int m = 0; m <= num_mats; ++m)
+            mat_offsets_[m] = std::lower_bound(mat_ids_.begin(), mat_ids_.begin() + count, uint32_t(m)) - mat_ids_.begin();
+
+        return mat_offsets_;
+    }
+
+    /// Sorts the hits within every material bin computed by the last call to sort_by_material.
+    /// The given function computes the sorting key of a hit from the ray and the hit.
+    template <typename GetKeyFn>
+    inline void sort_bins_by_key(GetKeyFn get_key, int count) {
+        if (coherence_keys_.size() < count)
+            coherence_keys_.resize(count);
+
+        for_each_range(0, count,
             [&] (const tbb::blocked_range<int>& range)
         {
+            for (auto i = range.begin(); i != range.end(); ++i)
+                coherence_keys_[i] = get_key(ray_buffer_[i], hit_buffer_[i]);
+        });
+
+        for_each_index(0, int(mat_offsets_.size()) - 1, [&] (int m) {
+            std::sort(sorted_indices_.begin() + mat_offsets_[m], sorted_indices_.begin() + mat_offsets_[m + 1],
+                [this] (int a, int b) { return coherence_keys_[a] < coherence_keys_[b]; });
+        });
+    }
+
+    /// Reorders the rays (and their states) such that rays with similar origins and directions are next to each other.
+    /// Rays are sorted by the octant of their direction first and then by the Morton code of their origin within the given bounds.
+    /// Invalidates the hits and the order computed by sort_by_material.
+    void sort_by_coherence(const BSphere& bounds) {
+        flush_spill();
+        const int n = size();
+        const float3 lo = bounds.center - float3(bounds.radius);
+        const float scale = (1 << COHERENCE_GRID_BITS) / (2.0f * bounds.radius);
+        const int max_cell = (1 << COHERENCE_GRID_BITS) - 1;
+
+        if (coherence_keys_.size() < n)
+            coherence_keys_.resize(n);
+
+        for_each_range(0, n, [&] (const tbb::blocked_range<int>& range) {
             for (auto i = range.begin(); i != range.end(); ++i) {
-                const int mat = float_as_int(ray_buffer_[i].dir.w);
-                sorted_indices_[matcount_[mat]++] = i;
+                const Ray& r = ray_buffer_[i];
+                const int octant = (r.dir.x < 0.0f ? 1 : 0) | (r.dir.y < 0.0f ? 2 : 0) | (r.dir.z < 0.0f ? 4 : 0);
+                const int x = clamp(int((r.org.x - lo.x) * scale), 0, max_cell);
+                const int y = clamp(int((r.org.y - lo.y) * scale), 0, max_cell);
+                const int z = clamp(int((r.org.z - lo.z) * scale), 0, max_cell);
+                coherence_keys_[i] = (octant << (3 * COHERENCE_GRID_BITS)) | morton_code(x, y, z);
             }
         });
+
+        // The sorted indices are recomputed after traversal, so they can be used to store the permutation.
+        for_each_index(0, n, [this] (int i) { sorted_indices_[i] = i; });
+        key_sort_.sort(coherence_keys_.data(), sorted_indices_.data(), n, key_bits(COHERENCE_BINS - 1), parallel_);
+
+        for_each_range(0, n, [&] (const tbb::blocked_range<int>& range) {
+            for (auto i = range.begin(); i != range.end(); ++i) {
+                const int src = sorted_indices_[i];
+                ray_back_[i]   = ray_buffer_[src];
+                state_back_[i] = state_buffer_[src];
+                if (has_cold) cold_back_[i] = cold_buffer_[src];
+            }
+        });
+
+        std::swap(ray_buffer_, ray_back_);
+        std::swap(state_buffer_, state_back_);
+        if (has_cold) std::swap(cold_buffer_, cold_back_);
     }
 
     /// Traverses all rays currently in the queue on the CPU.
     void traverse_cpu(const TraversalData<traversal_cpu::Node>& c_data) {
+        flush_spill();
         assert(size() != 0);
 
         int count = align_cpu(size());
@@ -267,6 +471,7 @@ public:
 
     // Traverses all rays currently in the queue on the GPU.
     void traverse_gpu(const TraversalData<traversal_gpu::Node>& c_data) {
+        flush_spill();
         assert(size() != 0);
         assert(gpu_buffers_);
 
@@ -294,6 +499,7 @@ public:
 
     /// Traverses all rays currently in the queue on the CPU. For shadow rays.
     void traverse_occluded_cpu(const TraversalData<traversal_cpu::Node>& c_data) {
+        flush_spill();
         assert(size() != 0);
 
         int count = align_cpu(size());
@@ -317,6 +523,7 @@ public:
 
     // Traverses all rays currently in the queue on the GPU. For shadow rays.
     void traverse_occluded_gpu(const TraversalData<traversal_gpu::Node>& c_data) {
+        flush_spill();
         assert(size() != 0);
         assert(gpu_buffers_);
 
@@ -342,7 +549,182 @@ public:
         anydsl::copy(dev_hit_buffer_, hit_buffer_, size());
     }
 
+    /// Enqueues the traversal of all rays currently in the queue on the given GPU stream and returns immediately.
+    /// The queue must not be modified or read until the returned future is ready.
+    std::future<void> traverse_gpu_async(const TraversalData<traversal_gpu::Node>& data, GpuStream& stream) {
+        return stream.submit([this, &data] () { traverse_gpu(data); });
+    }
+
+    /// Enqueues the traversal of all rays currently in the queue on the given GPU stream and returns immediately. For shadow rays.
+    /// The queue must not be modified or read until the returned future is ready.
+    std::future<void> traverse_occluded_gpu_async(const TraversalData<traversal_gpu::Node>& data, GpuStream& stream) {
+        return stream.submit([this, &data] () { traverse_occluded_gpu(data); });
+    }
+
 private:
+    /// Splits the state according to its layout and stores it at the given index.
+    void store_state(int idx, const StateType& state) {
+        state_buffer_[idx] = StateLayout<StateType>::hot(state);
+        if (has_cold) cold_buffer_[idx] = StateLayout<StateType>::cold(state);
+    }
+
+    /// Stores a ray that did not fit into the queue. The caller must hold spill_mutex_.
+    void spill(const Ray& ray, const HotState& hot, const ColdState& cold) {
+        spill_rays_.push_back(ray);
+        spill_states_.push_back(hot);
+        if (has_cold) spill_cold_.push_back(cold);
+    }
+
+    template <typename T>
+    static void resize_array(anydsl::Array<T>& array, int size, int keep) {
+        anydsl::Array<T> resized(size);
+        std::copy(array.begin(), array.begin() + keep, resized.begin());
+        array = std::move(resized);
+    }
+
+    /// Grows all buffers such that the queue can hold at least the given number of rays.
+    /// The rays, hits and states that are currently stored are preserved.
+    void grow(int min_capacity) {
+        const int old_capacity = capacity();
+        if (min_capacity <= old_capacity)
+            return;
+
+        // Grow geometrically, so that a queue that keeps overflowing is only reallocated a few times.
+        const int new_capacity = align(std::max(min_capacity, old_capacity + old_capacity / 2));
+
+        resize_array(ray_buffer_, new_capacity, old_capacity);
+        resize_array(hit_buffer_, new_capacity, old_capacity);
+        state_buffer_.resize(new_capacity);
+        if (has_cold) cold_buffer_.resize(new_capacity);
+        sorted_indices_.resize(new_capacity);
+
+        // The padding rays are traversed as well, they must not contain garbage.
+        memset(ray_buffer_.data() + old_capacity, 0, sizeof(Ray) * (new_capacity - old_capacity));
+
+        ray_back_ = anydsl::Array<Ray>(new_capacity);
+        hit_back_ = anydsl::Array<Hit>(new_capacity);
+        memset(ray_back_.data(), 0, sizeof(Ray) * new_capacity);
+        state_back_.resize(new_capacity);
+        if (has_cold) cold_back_.resize(new_capacity);
+
+        if (gpu_buffers_) {
+            dev_ray_buffer_ = anydsl::Array<Ray>(anydsl::Platform::Cuda, anydsl::Device(0), align_gpu(new_capacity));
+            dev_hit_buffer_ = anydsl::Array<Hit>(anydsl::Platform::Cuda, anydsl::Device(0), align_gpu(new_capacity));
+        }
+    }
+
+    /// Computes, for every block of COMPACT_BLOCK_SIZE rays, the number of rays before it that satisfy the predicate.
+    /// The result is stored in block_offsets_, the last element is the total count, which is returned.
+    template <typename Pred>
+    int count_blocks(Pred pred, int n) {
+        const int num_blocks = (n + COMPACT_BLOCK_SIZE - 1) / COMPACT_BLOCK_SIZE;
+        block_offsets_.resize(num_blocks + 1);
+        block_offsets_[0] = 0;
+
+        for_each_index(0, num_blocks, [&] (int b) {
+            const int end = std::min(n, (b + 1) * COMPACT_BLOCK_SIZE);
+            int count = 0;
+            for (int i = b * COMPACT_BLOCK_SIZE; i < end; ++i)
+                count += pred(i) ? 1 : 0;
+            block_offsets_[b + 1] = count;
+        });
+
+        std::partial_sum(block_offsets_.begin(), block_offsets_.end(), block_offsets_.begin());
+        return block_offsets_[num_blocks];
+    }
+
+    /// Moves all rays that satisfy the predicate to the front, preserving their order, by scattering into the back buffers.
+    /// The remaining rays are moved behind them (also in order) if keep_rest is true, and discarded otherwise.
+    template <typename Pred>
+    int partition_stable(Pred pred, bool move_hits, bool keep_rest) {
+        const int n = size();
+        const int count = count_blocks(pred, n);
+        const int num_blocks = block_offsets_.size() - 1;
+
+        for_each_index(0, num_blocks, [&] (int b) {
+            const int begin = b * COMPACT_BLOCK_SIZE;
+            const int end   = std::min(n, begin + COMPACT_BLOCK_SIZE);
+            int front = block_offsets_[b];
+            int back  = count + begin - block_offsets_[b];
+
+            for (int i = begin; i < end; ++i) {
+                int dst;
+                if (pred(i))        dst = front++;
+                else if (keep_rest) dst = back++;
+                else continue;
+
+                ray_back_[dst]   = ray_buffer_[i];
+                state_back_[dst] = state_buffer_[i];
+                if (has_cold)  cold_back_[dst] = cold_buffer_[i];
+                if (move_hits) hit_back_[dst] = hit_buffer_[i];
+            }
+        });
+
+        std::swap(ray_buffer_, ray_back_);
+        std::swap(state_buffer_, state_back_);
+        if (has_cold)  std::swap(cold_buffer_, cold_back_);
+        if (move_hits) std::swap(hit_buffer_, hit_back_);
+
+        return count;
+    }
+
+    /// Moves all rays that satisfy the predicate to the front, in place. Only the rays that are in the wrong
+    /// part of the queue are moved, the j-th hole at the front is filled with the j-th valid ray from the back.
+    /// The displaced rays are swapped to the back if keep_rest is true, and overwritten otherwise.
+    template <typename Pred>
+    int partition_unstable(Pred pred, bool move_hits, bool keep_rest) {
+        const int n = size();
+        const int count = count_blocks(pred, n);
+        const int num_blocks = block_offsets_.size() - 1;
+
+        // Number of rays within [0, count) that already satisfy the predicate.
+        const int split_block = count / COMPACT_BLOCK_SIZE;
+        int front_count = block_offsets_[split_block];
+        for (int i = split_block * COMPACT_BLOCK_SIZE; i < count; ++i)
+            front_count += pred(i) ? 1 : 0;
+
+        if (compact_scratch_.size() < count - front_count)
+            compact_scratch_.resize(count - front_count);
+
+        // Find the positions of the valid rays in [count, n), ordered by their rank.
+        for_each_index(split_block, num_blocks, [&] (int b) {
+            const int begin = b * COMPACT_BLOCK_SIZE;
+            const int end   = std::min(n, begin + COMPACT_BLOCK_SIZE);
+            int rank = block_offsets_[b];
+            for (int i = begin; i < end; ++i) {
+                if (!pred(i)) continue;
+                if (i >= count) compact_scratch_[rank - front_count] = i;
+                rank++;
+            }
+        });
+
+        // Fill the holes in [0, count) with them.
+        const int front_blocks = (count + COMPACT_BLOCK_SIZE - 1) / COMPACT_BLOCK_SIZE;
+        for_each_index(0, front_blocks, [&] (int b) {
+            const int begin = b * COMPACT_BLOCK_SIZE;
+            const int end   = std::min(count, begin + COMPACT_BLOCK_SIZE);
+            int hole = begin - block_offsets_[b];
+            for (int i = begin; i < end; ++i) {
+                if (pred(i)) continue;
+
+                const int j = compact_scratch_[hole++];
+                if (keep_rest) {
+                    std::swap(ray_buffer_[i], ray_buffer_[j]);
+                    std::swap(state_buffer_[i], state_buffer_[j]);
+                    if (has_cold)  std::swap(cold_buffer_[i], cold_buffer_[j]);
+                    if (move_hits) std::swap(hit_buffer_[i], hit_buffer_[j]);
+                } else {
+                    ray_buffer_[i]   = ray_buffer_[j];
+                    state_buffer_[i] = state_buffer_[j];
+                    if (has_cold)  cold_buffer_[i] = cold_buffer_[j];
+                    if (move_hits) hit_buffer_[i] = hit_buffer_[j];
+                }
+            }
+        });
+
+        return count;
+    }
+
     anydsl::Array<Ray> ray_buffer_;
     anydsl::Array<Hit> hit_buffer_;
 
@@ -351,12 +733,33 @@ private:
     anydsl::Array<Ray> dev_ray_buffer_;
     anydsl::Array<Hit> dev_hit_buffer_;
 
-    std::vector<StateType> state_buffer_;
+    std::vector<HotState> state_buffer_;
+    std::vector<ColdState> cold_buffer_;
+    ColdState no_cold_;     ///< Returned by cold_state() if the states have no cold part
     std::atomic<int> last_;
 
-    // Used for sorting the hit points with counting sort
+    // Used for sorting the hit points by material
     std::vector<int> sorted_indices_;
-    std::vector<std::atomic<int> > matcount_;
+    std::vector<uint32_t> mat_ids_;
+    std::vector<int> mat_offsets_;
+    RadixSort<uint32_t, int> key_sort_;
+
+    // Back buffers and temporary storage for the compaction
+    anydsl::Array<Ray> ray_back_;
+    anydsl::Array<Hit> hit_back_;
+    std::vector<HotState> state_back_;
+    std::vector<ColdState> cold_back_;
+    std::vector<int> block_offsets_;
+    std::vector<int> compact_scratch_;
+    std::vector<uint32_t> coherence_keys_;
+
+    // Overflow storage for the rays that are pushed while the queue is full
+    std::mutex spill_mutex_;
+    std::vector<Ray> spill_rays_;
+    std::vector<HotState> spill_states_;
+    std::vector<ColdState> spill_cold_;
+    int high_water_;
+    bool parallel_;
 };
 
 } // namespace imba
@@ -2,6 +2,9 @@
 #define IMBA_RAY_SCHEDULER_H
 
 #include "imbatracer/render/ray_gen/ray_gen.h"
+#include "imbatracer/render/scheduling/frame_profiler.h"
+#include "imbatracer/render/scheduling/contribution_buffer.h"
+#include "imbatracer/core/memory_report.h"
 
 #include <array>
 #include <atomic>
@@ -15,26 +18,54 @@ template <typename StateType, typename ShadowStateType>
 class RayScheduler {
 protected:
     using SamplePixelFn = typename RayGen<StateType>::SamplePixelFn;
-    typedef std::function<void (RayQueue<StateType>&, RayQueue<ShadowStateType>&, AtomicImage&)> ProcessPrimaryFn;
-    typedef std::function<void (RayQueue<ShadowStateType>&, AtomicImage&)> ProcessShadowFn;
+    typedef std::function<void (RayQueue<StateType>&, RayQueue<ShadowStateType>&, ContributionBuffer&)> ProcessPrimaryFn;
+    typedef std::function<void (RayQueue<ShadowStateType>&, ContributionBuffer&)> ProcessShadowFn;
 
 public:
     RayScheduler(Scene& scene, bool gpu_traversal)
         : scene_(scene)
         , gpu_traversal(gpu_traversal)
+        , deferred_flush_(false)
     {}
 
     virtual ~RayScheduler() {}
 
+    /// Renders a frame. The processing functions add their contributions to a buffer, which is added to the image
+    /// at the end of the frame, unless the flush is deferred.
     virtual void run_iteration(AtomicImage& out,
                                ProcessShadowFn process_shadow_rays,
                                ProcessPrimaryFn process_primary_rays,
                                SamplePixelFn sample_fn) = 0;
 
+    /// Called whenever the accumulated image is cleared, e.g. because the camera moved.
+    virtual void reset() {}
+
+    /// Changes the number of samples per pixel of the next frames. Returns false if the ray generator does not support it.
+    virtual bool set_spp(int) { return false; }
+
+    /// Changes the resolution of the image of the next frames. Returns false if the ray generator does not support it.
+    virtual bool set_resolution(int, int) { return false; }
+
+    /// When enabled, the contributions of the frames are kept until flush() is called, instead of being added to the
+    /// image at the end of run_iteration(). A frame can then be rendered ahead of the image that it belongs to.
+    void set_deferred_flush(bool enable) { deferred_flush_ = enable; }
+    /// Adds the contributions that were kept since the last flush to the image. Must be called between two frames.
+    void flush(AtomicImage& out) { contribs_.flush(out); }
+    /// Discards the contributions that were kept since the last flush. Must be called between two frames.
+    void discard() { contribs_.clear(); }
+    /// Stores the contributions as sparse lists of splats instead of copies of the image tiles, which suits
+    /// contributions that land on random pixels, e.g. the connections of the light paths to the camera.
+    void set_sparse_contributions(bool enable) { contribs_.set_sparse(enable); }
+
+    /// Adds the memory used by the ray queues to the report, in entries whose names start with the given prefix.
+    virtual void report_memory(MemoryReport&, const std::string&) const {}
+
     const bool gpu_traversal;
 
 protected:
     Scene& scene_;
+    ContributionBuffer contribs_;
+    bool deferred_flush_;
 };
 
 } // namespace imba
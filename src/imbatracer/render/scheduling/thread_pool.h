@@ -0,0 +1,145 @@
+#ifndef IMBA_THREAD_POOL_H
+#define IMBA_THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <cassert>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace imba {
+
+/// Set of worker threads that stay alive for the whole lifetime of the pool.
+/// Every call to run() executes the same job once on every thread and blocks until all of them are done.
+/// The calling thread participates as thread 0, so a pool of size n only creates n - 1 threads.
+/// If pinning is enabled, thread i always runs on the i-th core the process may use (modulo their count), so that
+/// the memory it allocates and touches first stays on its NUMA node. The calling thread is only pinned during run().
+/// Pinning is only supported on Linux, and does nothing elsewhere.
+class ThreadPool {
+public:
+    typedef std::function<void (int)> JobFn;
+
+    ThreadPool(int num_threads, bool pin_threads = false)
+        : num_threads_(num_threads), job_(nullptr), generation_(0), running_(0), shutdown_(false)
+    {
+        assert(num_threads > 0);
+#ifdef __linux__
+        if (pin_threads) {
+            cpu_set_t allowed;
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (CPU_ISSET(cpu, &allowed)) cpus_.push_back(cpu);
+                }
+            }
+        }
+#endif
+        for (int i = 1; i < num_threads; ++i)
+            workers_.emplace_back([this, i] () { pin(i); worker(i); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+        }
+        wake_.notify_all();
+
+        for (auto& t : workers_)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    int size() const { return num_threads_; }
+
+    /// Runs job(i) on every thread i in [0, size()) and waits until all of them have returned.
+    void run(const JobFn& job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &job;
+            running_ = num_threads_ - 1;
+            generation_++;
+        }
+        wake_.notify_all();
+
+        {
+            // The calling thread creates other threads (e.g. the TBB workers), which inherit its affinity.
+            RestoreAffinity restore(!cpus_.empty());
+            pin(0);
+            job(0);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return running_ == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    int num_threads_;
+    std::vector<std::thread> workers_;
+    std::vector<int> cpus_;     ///< Cores the threads are pinned to, empty if pinning is disabled
+
+    /// Pins the calling thread to the core of the given thread, if pinning is enabled.
+    void pin(int thread_idx) const {
+#ifdef __linux__
+        if (cpus_.empty()) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus_[thread_idx % cpus_.size()], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    /// Restores the affinity that the calling thread had on construction.
+    struct RestoreAffinity {
+#ifdef __linux__
+        bool enabled;
+        cpu_set_t set;
+        RestoreAffinity(bool enable) : enabled(enable && pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {}
+        ~RestoreAffinity() { if (enabled) pthread_setaffinity_np(pthread_self(), sizeof(set), &set); }
+#else
+        RestoreAffinity(bool) {}
+#endif
+    };
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+
+    const JobFn* job_;
+    uint64_t generation_;
+    int running_;
+    bool shutdown_;
+
+    void worker(int thread_idx) {
+        uint64_t last_generation = 0;
+        while (true) {
+            const JobFn* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this, last_generation] { return shutdown_ || generation_ != last_generation; });
+                if (shutdown_) return;
+
+                last_generation = generation_;
+                job = job_;
+            }
+
+            (*job)(thread_idx);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--running_ == 0)
+                done_.notify_one();
+        }
+    }
+};
+
+} // namespace imba
+
+#endif // IMBA_THREAD_POOL_H
@@ -2,15 +2,29 @@
 #define IMBA_TILE_SCHEDULER_H
 
 #include "imbatracer/render/scheduling/ray_scheduler.h"
+#include "imbatracer/render/scheduling/thread_pool.h"
 #include "imbatracer/render/ray_gen/tile_gen.h"
 
-#include <thread>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 namespace imba {
 
 /// Launches multiple threads, each running an entire traversal-shading pipeline.
 /// Thus, there can be multiple calls to traversal at the same time.
+/// The threads are kept alive across iterations. Every thread owns a contiguous range of tiles
+/// and steals tiles from the other threads once its own range is exhausted.
+/// If regeneration is enabled, the primary queue of a thread is refilled with samples from the next tile
+/// whenever it drops below the threshold, so that traversal is always called on (almost) full queues.
+/// In hybrid mode, some threads traverse on the GPU and the others on the CPU. The tiles are then distributed
+/// according to the throughput (in rays per second) that was measured for every device during the previous frame.
+/// Threads that traverse on the GPU keep two primary queues in flight, so that shading overlaps with the transfers and traversal.
+/// The threads can be pinned to cores, see ThreadPool. Every thread allocates its own queues, so that they are local to
+/// the NUMA node of its core.
 template <typename StateType, typename ShadowStateType, bool enable_stats = true>
 class TileScheduler : public RayScheduler<StateType, ShadowStateType> {
     using BaseType = RayScheduler<StateType, ShadowStateType>;
@@ -19,45 +33,104 @@ class TileScheduler : public RayScheduler<StateType, ShadowStateType> {
     using ProcessShadowFn = typename BaseType::ProcessShadowFn;
 
     static constexpr int MIN_QUEUE_SIZE = 0;
+    // The shadow queues initially hold this many rays per primary ray, and grow when more rays are pushed.
+    static constexpr int INITIAL_SHADOW_RAYS_PER_HIT = 1;
 
 protected:
     using BaseType::scene_;
-    using BaseType::gpu_traversal;
+    using BaseType::contribs_;
+    using BaseType::deferred_flush_;
 
 public:
     TileScheduler(TileGen<StateType>& tile_gen,
                   Scene& scene,
                   int max_shadow_rays_per_hit,
                   int num_threads, int q_size,
-                  bool gpu_traversal)
-        : BaseType(scene, gpu_traversal)
+                  bool gpu_traversal,
+                  float regen_threshold = 0.0f,
+                  bool sort_rays = false,
+                  bool pin_threads = false)
+        : TileScheduler(tile_gen, scene, max_shadow_rays_per_hit, std::vector<bool>(num_threads, gpu_traversal), q_size, regen_threshold, sort_rays, pin_threads)
+    {}
+
+    /// Creates a scheduler with one thread per element in thread_on_gpu. Every thread traverses its rays
+    /// on the GPU if the corresponding element is true, and on the CPU otherwise.
+    TileScheduler(TileGen<StateType>& tile_gen,
+                  Scene& scene,
+                  int max_shadow_rays_per_hit,
+                  const std::vector<bool>& thread_on_gpu, int q_size,
+                  float regen_threshold = 0.0f,
+                  bool sort_rays = false,
+                  bool pin_threads = false)
+        : BaseType(scene, std::all_of(thread_on_gpu.begin(), thread_on_gpu.end(), [] (bool b) { return b; }))
         , tile_gen_(tile_gen)
-        , num_threads_(num_threads), q_size_(q_size)
-        , thread_local_prim_queues_(num_threads)
-        , thread_local_shadow_queues_(num_threads)
-        , thread_local_ray_gen_(num_threads)
+        , num_threads_(thread_on_gpu.size()), q_size_(q_size)
+        , regen_threshold_(regen_threshold)
+        , sort_rays_(sort_rays)
+        , thread_on_gpu_(thread_on_gpu)
+        , thread_local_prim_queues_(thread_on_gpu.size() * 2)
+        , thread_local_shadow_queues_(thread_on_gpu.size())
+        , thread_local_ray_gen_(thread_on_gpu.size())
+        , thread_rays_(thread_on_gpu.size())
+        , thread_time_(thread_on_gpu.size())
+        , tile_ranges_(thread_on_gpu.size())
+        , pool_(thread_on_gpu.size(), pin_threads)
     {
-        for (auto& q : thread_local_prim_queues_)
-            q = new RayQueue<StateType>(q_size, gpu_traversal);
+        // The queues are allocated by the thread that uses them, so that their memory is first touched there.
+        // The allocations go through the AnyDSL runtime, which is not thread-safe.
+        std::mutex alloc_mutex;
+        pool_.run([this, q_size, max_shadow_rays_per_hit, &alloc_mutex] (int i) {
+            std::lock_guard<std::mutex> lock(alloc_mutex);
+            thread_local_prim_queues_[i * 2] = new RayQueue<StateType>(q_size, thread_on_gpu_[i]);
+            thread_local_shadow_queues_[i] = new RayQueue<ShadowStateType>(q_size * std::min(max_shadow_rays_per_hit, int(INITIAL_SHADOW_RAYS_PER_HIT)), thread_on_gpu_[i]);
+
+            // Threads that traverse on the GPU use a second primary queue for double buffering.
+            thread_local_prim_queues_[i * 2 + 1] = thread_on_gpu_[i] ? new RayQueue<StateType>(q_size, true) : nullptr;
+        });
+
+        // When there is a thread per core, every thread processes its queues serially, since nested parallel loops
+        // would only oversubscribe the cores. With fewer threads, the loops still use the idle cores.
+        const bool parallel_queues = num_threads_ < int(std::thread::hardware_concurrency());
+        for (auto q : thread_local_prim_queues_) {
+            if (q) q->set_parallel(parallel_queues);
+        }
+        for (auto q : thread_local_shadow_queues_)
+            q->set_parallel(parallel_queues);
 
-        for (auto& q : thread_local_shadow_queues_)
-            q = new RayQueue<ShadowStateType>(q_size * max_shadow_rays_per_hit, gpu_traversal);
+        if (std::find(thread_on_gpu_.begin(), thread_on_gpu_.end(), true) != thread_on_gpu_.end())
+            gpu_stream_.reset(new GpuStream);
 
-        for (auto& ptr : thread_local_ray_gen_)
-            ptr = new uint8_t[tile_gen_.sizeof_ray_gen()];
+        pool_.run([this] (int i) { thread_local_ray_gen_[i] = new uint8_t[tile_gen_.sizeof_ray_gen()]; });
+
+        device_rate_[0] = device_rate_[1] = 0.0;
 
         total_prim_rays_   = 0;
         total_shadow_rays_ = 0;
+        total_prim_traversals_ = 0;
     }
 
     ~TileScheduler() {
+        if (enable_stats) {
+            std::cout << total_prim_rays_ << " primary ray(s), " << total_shadow_rays_ << " shadow ray(s)" << std::endl;
+            if (total_prim_traversals_ > 0) {
+                const double avg = double(total_prim_rays_) / double(total_prim_traversals_);
+                std::cout << "Average primary queue occupancy: " << avg << " ray(s) per traversal call ("
+                          << 100.0 * avg / double(q_size_) << "% of capacity)" << std::endl;
+            }
+            int shadow_high_water = 0;
+            for (auto q : thread_local_shadow_queues_)
+                shadow_high_water = std::max(shadow_high_water, q->high_water_mark());
+            std::cout << "Shadow queue high-water mark: " << shadow_high_water << " ray(s)" << std::endl;
+            if (is_hybrid()) {
+                std::cout << "Throughput per thread: CPU " << device_rate_[0] * 1e-6 << " MRays/s, GPU "
+                          << device_rate_[1] * 1e-6 << " MRays/s" << std::endl;
+            }
+        }
+
         for (auto q : thread_local_prim_queues_) delete q;
         for (auto q : thread_local_shadow_queues_) delete q;
 
         for (auto ptr : thread_local_ray_gen_) delete [] ptr;
-
-        if (enable_stats)
-            std::cout << total_prim_rays_ << " primary ray(s), " << total_shadow_rays_ << " shadow ray(s)" << std::endl;
     }
 
     void run_iteration(AtomicImage& image,
@@ -65,26 +138,66 @@ public:
                        ProcessPrimaryFn process_primary_rays,
                        SamplePixelFn sample_fn) override final {
         tile_gen_.start_frame();
+        contribs_.resize(image.width(), image.height());
 
-        std::vector<std::thread> threads;
-        for (int i = 0; i < num_threads_; ++i) {
-            threads.emplace_back([this, i, &image, process_shadow_rays, process_primary_rays, sample_fn]()
-                {
-                    render_thread(i, image, process_shadow_rays, process_primary_rays, sample_fn);
-                });
+        distribute_tiles();
+
+        pool_.run([this, &image, &process_shadow_rays, &process_primary_rays, &sample_fn] (int i) {
+            auto start = std::chrono::high_resolution_clock::now();
+            thread_rays_[i] = 0;
+
+            render_thread(i, image, process_shadow_rays, process_primary_rays, sample_fn);
+
+            auto end = std::chrono::high_resolution_clock::now();
+            thread_time_[i] = std::chrono::duration<double>(end - start).count();
+        });
+
+        if (is_hybrid())
+            update_device_rates();
+
+        if (!deferred_flush_) contribs_.flush(image);
+        tile_gen_.end_frame(image);
+    }
+
+    void reset() override final { tile_gen_.reset(); }
+    bool set_spp(int spp) override final { return tile_gen_.set_spp(spp); }
+    bool set_resolution(int w, int h) override final { return tile_gen_.set_resolution(w, h); }
+
+    void report_memory(MemoryReport& report, const std::string& prefix) const override final {
+        size_t host = 0, device = 0;
+        for (auto q : thread_local_prim_queues_) {
+            if (!q) continue;
+            host += q->host_bytes();
+            device += q->device_bytes();
         }
+        report.add(prefix + " primary queues", host, device);
 
-        for (auto& t : threads)
-            t.join();
+        host = device = 0;
+        for (auto q : thread_local_shadow_queues_) {
+            host += q->host_bytes();
+            device += q->device_bytes();
+        }
+        report.add(prefix + " shadow queues", host, device);
+        report.add(prefix + " contributions", contribs_.memory_bytes());
     }
 
 private:
     int num_threads_;
     int q_size_;
 
+    // Fraction of the primary queue capacity below which the queue is refilled from the next tile (0 disables regeneration).
+    float regen_threshold_;
+
+    // If true, rays are sorted by origin and direction before CPU traversal.
+    bool sort_rays_;
+
+    // Device used for traversal by every thread.
+    std::vector<bool> thread_on_gpu_;
+
     TileGen<StateType>& tile_gen_;
 
     // Every thread has two primary queues. Thread i owns queue[i * 2] and queue[i * 2 + 1].
+    // The second one is only allocated for threads that traverse on the GPU.
     std::vector<RayQueue<StateType>*> thread_local_prim_queues_;
 
     // Every thread has one shadow queue.
@@ -94,52 +207,259 @@ private:
     // To prevent reallocation every time a new tile is needed, we use a memory pool.
     std::vector<uint8_t*> thread_local_ray_gen_;
 
+    // Number of rays traced and time spent by every thread during the last frame.
+    std::vector<uint64_t> thread_rays_;
+    std::vector<double> thread_time_;
+
+    // Measured throughput of a single thread, in rays per second, on the CPU (0) and the GPU (1).
+    double device_rate_[2];
+
+    /// Range of tile ids owned by one thread. The owner takes tiles from the front,
+    /// other threads steal from the back. Both bounds are packed into one word so that they can be updated atomically.
+    struct TileRange {
+        std::atomic<uint64_t> bounds;
+        uint8_t pad[64 - sizeof(std::atomic<uint64_t>)]; // Prevents false sharing between the threads
+
+        TileRange() : bounds(0) {}
+
+        void reset(int begin, int end) { bounds = pack(begin, end); }
+
+        bool pop_front(int& id) {
+            uint64_t old = bounds;
+            int begin, end;
+            do {
+                unpack(old, begin, end);
+                if (begin >= end) return false;
+            } while (!bounds.compare_exchange_weak(old, pack(begin + 1, end)));
+            id = begin;
+            return true;
+        }
+
+        bool pop_back(int& id) {
+            uint64_t old = bounds;
+            int begin, end;
+            do {
+                unpack(old, begin, end);
+                if (begin >= end) return false;
+            } while (!bounds.compare_exchange_weak(old, pack(begin, end - 1)));
+            id = end - 1;
+            return true;
+        }
+
+        static uint64_t pack(int begin, int end) { return uint64_t(uint32_t(begin)) | (uint64_t(uint32_t(end)) << 32); }
+        static void unpack(uint64_t b, int& begin, int& end) { begin = int(uint32_t(b)); end = int(uint32_t(b >> 32)); }
+    };
+
+    std::vector<TileRange> tile_ranges_;
+
+    ThreadPool pool_;
+
+    // Transfers and traversal kernels of the GPU threads run asynchronously on this stream.
+    std::unique_ptr<GpuStream> gpu_stream_;
+
     std::atomic<uint64_t> total_prim_rays_;
     std::atomic<uint64_t> total_shadow_rays_;
+    std::atomic<uint64_t> total_prim_traversals_;
 
-    void render_thread(int thread_idx, AtomicImage& image,
-                       ProcessShadowFn process_shadow_rays,
-                       ProcessPrimaryFn process_primary_rays,
-                       SamplePixelFn sample_fn) {
-        auto cur_tile = tile_gen_.next_tile(thread_local_ray_gen_[thread_idx]);
-        while (cur_tile != nullptr) {
-            // Get the ray queues for this thread.
-            auto prim_q   = thread_local_prim_queues_  [thread_idx];
-            auto shadow_q = thread_local_shadow_queues_[thread_idx];
+    bool is_hybrid() const {
+        return std::find(thread_on_gpu_.begin(), thread_on_gpu_.end(), !thread_on_gpu_[0]) != thread_on_gpu_.end();
+    }
+
+    /// Splits the tiles into one contiguous range per thread. The size of each range is proportional to
+    /// the throughput of the device that the thread uses, so that all threads finish at roughly the same time.
+    void distribute_tiles() {
+        const int tile_count = tile_gen_.tile_count();
 
-            // Traverse and shade until there are no more rays left.
-            cur_tile->start_frame();
-            while(!cur_tile->is_empty() || prim_q->size() > MIN_QUEUE_SIZE) {
-                cur_tile->fill_queue(*prim_q, sample_fn);
+        // Use an even distribution until both devices have been measured.
+        const bool use_rates = device_rate_[0] > 0.0 && device_rate_[1] > 0.0;
 
-                // TODO Add regeneration again (minor performance increase)
+        double total = 0.0;
+        for (int i = 0; i < num_threads_; ++i)
+            total += use_rates ? device_rate_[thread_on_gpu_[i]] : 1.0;
 
-                if (enable_stats)
-                    total_prim_rays_ += prim_q->size();
+        double sum = 0.0;
+        int begin = 0;
+        for (int i = 0; i < num_threads_; ++i) {
+            sum += use_rates ? device_rate_[thread_on_gpu_[i]] : 1.0;
+            const int end = i == num_threads_ - 1 ? tile_count : std::min(tile_count, int(tile_count * sum / total + 0.5));
+            tile_ranges_[i].reset(begin, end);
+            begin = end;
+        }
+    }
+
+    /// Updates the throughput estimates of both devices with the rays traced during the last frame.
+    void update_device_rates() {
+        uint64_t rays[2] = { 0, 0 };
+        double time[2] = { 0.0, 0.0 };
+        for (int i = 0; i < num_threads_; ++i) {
+            rays[thread_on_gpu_[i]] += thread_rays_[i];
+            time[thread_on_gpu_[i]] += thread_time_[i];
+        }
 
-                if (gpu_traversal) prim_q->traverse_gpu(scene_.traversal_data_gpu());
-                else               prim_q->traverse_cpu(scene_.traversal_data_cpu());
+        for (int d = 0; d < 2; ++d) {
+            if (rays[d] == 0 || time[d] <= 0.0) continue;
 
-                process_primary_rays(*prim_q, *shadow_q, image);
+            // Smooth the estimate over several frames to avoid oscillations.
+            const double rate = double(rays[d]) / time[d];
+            device_rate_[d] = device_rate_[d] > 0.0 ? 0.5 * (device_rate_[d] + rate) : rate;
+        }
+    }
 
-                if (shadow_q->size() > MIN_QUEUE_SIZE) {
-                    if (enable_stats)
-                        total_shadow_rays_ += shadow_q->size();
+    /// Obtains the next tile for the given thread, stealing from the other threads if its own range is empty.
+    typename TileGen<StateType>::TilePtr next_tile(int thread_idx) {
+        EventTracer::Span span("next_tile");
+        uint8_t* mem = thread_local_ray_gen_[thread_idx];
 
-                    if (gpu_traversal)
-                        shadow_q->traverse_occluded_gpu(scene_.traversal_data_gpu());
-                    else
-                        shadow_q->traverse_occluded_cpu(scene_.traversal_data_cpu());
-                    process_shadow_rays(*shadow_q, image);
-                }
+        int id;
+        while (tile_ranges_[thread_idx].pop_front(id)) {
+            auto tile = tile_gen_.tile(id, mem);
+            if (tile) return tile;
+        }
 
-                shadow_q->clear();
+        for (int i = 1; i < num_threads_; ++i) {
+            auto& victim = tile_ranges_[(thread_idx + i) % num_threads_];
+            while (victim.pop_back(id)) {
+                auto tile = tile_gen_.tile(id, mem);
+                if (tile) return tile;
             }
+        }
 
-            // We are using the same memory for the new ray generation, so we
-            // have to delete the old one first!
+        return nullptr;
+    }
+
+    typedef typename TileGen<StateType>::TilePtr TilePtr;
+
+    /// Fills the queue with samples from the current tile. Once the tile has generated all its samples, the queue is
+    /// refilled from the next tiles of this thread until it is at least regen_size full.
+    /// Returns false if there are no rays left to trace.
+    bool fill_queue(int thread_idx, AtomicImage& image, TilePtr& cur_tile, RayQueue<StateType>& q, int regen_size, SamplePixelFn& sample_fn) {
+        FrameProfiler::Scope profile(PROFILE_RAY_GEN);
+
+        if (cur_tile) cur_tile->fill_queue(q, sample_fn);
+
+        // We are using the same memory for the new ray generation, so we have to delete the old one first!
+        while (cur_tile && cur_tile->is_empty() && q.size() < regen_size) {
             cur_tile.reset(nullptr);
-            cur_tile = tile_gen_.next_tile(thread_local_ray_gen_[thread_idx]);
+            // The contributions of the finished tile are added to the image, so that the copies of the tiles that
+            // this thread holds are returned to the pool. Deferred contributions must stay in the buffer.
+            if (!deferred_flush_) contribs_.flush_local(image);
+            cur_tile = next_tile(thread_idx);
+            if (cur_tile) {
+                cur_tile->start_frame();
+                cur_tile->fill_queue(q, sample_fn);
+            }
+        }
+
+        if (q.size() <= MIN_QUEUE_SIZE)
+            return false;
+
+        if (enable_stats) {
+            total_prim_rays_ += q.size();
+            total_prim_traversals_++;
+        }
+
+        thread_rays_[thread_idx] += q.size();
+        return true;
+    }
+
+    /// Traverses and processes the shadow rays in the queue, then clears it.
+    void trace_shadow_rays(int thread_idx, RayQueue<ShadowStateType>& shadow_q, ProcessShadowFn& process_shadow_rays) {
+        if (shadow_q.size() > MIN_QUEUE_SIZE) {
+            if (enable_stats)
+                total_shadow_rays_ += shadow_q.size();
+
+            thread_rays_[thread_idx] += shadow_q.size();
+
+            {
+                FrameProfiler::Scope profile(PROFILE_SHADOW_TRAVERSAL, shadow_q.size());
+                if (thread_on_gpu_[thread_idx]) {
+                    // The runtime must only be called from the stream, which may be traversing a primary queue.
+                    shadow_q.traverse_occluded_gpu_async(scene_.traversal_data_gpu(), *gpu_stream_).get();
+                } else {
+                    if (sort_rays_) shadow_q.sort_by_coherence(scene_.bounding_sphere());
+                    shadow_q.traverse_occluded_cpu(scene_.traversal_data_cpu());
+                }
+            }
+
+            FrameProfiler::Scope profile(PROFILE_SHADOW_SHADING);
+            process_shadow_rays(shadow_q, contribs_);
+        }
+
+        shadow_q.clear();
+    }
+
+    void render_thread(int thread_idx, AtomicImage& image,
+                       ProcessShadowFn& process_shadow_rays,
+                       ProcessPrimaryFn& process_primary_rays,
+                       SamplePixelFn& sample_fn) {
+        if (thread_on_gpu_[thread_idx]) {
+            render_thread_gpu(thread_idx, image, process_shadow_rays, process_primary_rays, sample_fn);
+            return;
+        }
+
+        // Get the ray queues for this thread.
+        auto prim_q   = thread_local_prim_queues_  [thread_idx * 2];
+        auto shadow_q = thread_local_shadow_queues_[thread_idx];
+
+        // Without regeneration, the next tile is only started once all paths of the current one are terminated.
+        const int regen_size = std::max(int(regen_threshold_ * prim_q->capacity()), MIN_QUEUE_SIZE + 1);
+
+        auto cur_tile = next_tile(thread_idx);
+        if (cur_tile) cur_tile->start_frame();
+
+        // Traverse and shade until there are no more rays left.
+        while (fill_queue(thread_idx, image, cur_tile, *prim_q, regen_size, sample_fn)) {
+            {
+                FrameProfiler::Scope profile(PROFILE_TRAVERSAL, prim_q->size());
+                if (sort_rays_) prim_q->sort_by_coherence(scene_.bounding_sphere());
+                prim_q->traverse_cpu(scene_.traversal_data_cpu());
+            }
+            {
+                FrameProfiler::Scope profile(PROFILE_SHADING);
+                process_primary_rays(*prim_q, *shadow_q, contribs_);
+            }
+            trace_shadow_rays(thread_idx, *shadow_q, process_shadow_rays);
+        }
+    }
+
+    /// Double-buffered version of the render loop for GPU traversal:
+    /// One primary queue is shaded while the other one is being transferred and traversed on the GPU stream.
+    void render_thread_gpu(int thread_idx, AtomicImage& image,
+                           ProcessShadowFn& process_shadow_rays,
+                           ProcessPrimaryFn& process_primary_rays,
+                           SamplePixelFn& sample_fn) {
+        RayQueue<StateType>* prim_q[2] = { thread_local_prim_queues_[thread_idx * 2],
+                                           thread_local_prim_queues_[thread_idx * 2 + 1] };
+        auto shadow_q = thread_local_shadow_queues_[thread_idx];
+
+        const int regen_size = std::max(int(regen_threshold_ * prim_q[0]->capacity()), MIN_QUEUE_SIZE + 1);
+
+        auto cur_tile = next_tile(thread_idx);
+        if (cur_tile) cur_tile->start_frame();
+
+        // A future is valid as long as the traversal of the corresponding queue is pending.
+        std::future<void> traversal[2];
+        auto launch = [&] (int i) {
+            if (fill_queue(thread_idx, image, cur_tile, *prim_q[i], regen_size, sample_fn))
+                traversal[i] = prim_q[i]->traverse_gpu_async(scene_.traversal_data_gpu(), *gpu_stream_);
+        };
+
+        launch(0);
+        launch(1);
+
+        for (int cur = 0; traversal[0].valid() || traversal[1].valid(); cur = 1 - cur) {
+            if (!traversal[cur].valid()) continue;
+            {
+                FrameProfiler::Scope profile(PROFILE_TRAVERSAL, prim_q[cur]->size());
+                traversal[cur].get();
+            }
+            {
+                FrameProfiler::Scope profile(PROFILE_SHADING);
+                process_primary_rays(*prim_q[cur], *shadow_q, contribs_);
+            }
+            trace_shadow_rays(thread_idx, *shadow_q, process_shadow_rays);
+
+            launch(cur);
         }
     }
 };
@@ -0,0 +1,93 @@
+#ifndef IMBA_SHADING_TRIANGLE_H
+#define IMBA_SHADING_TRIANGLE_H
+
+#include <cstdint>
+#include <cmath>
+
+#include "imbatracer/core/float4.h"
+#include "imbatracer/core/common.h"
+
+namespace imba {
+
+/// Encodes a unit vector with the octahedral mapping, using 16 bits per coordinate.
+inline uint32_t encode_octahedral(const float3& n) {
+    const float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float px = l1 > 0.0f ? n.x / l1 : 0.0f;
+    float py = l1 > 0.0f ? n.y / l1 : 0.0f;
+    if (n.z < 0.0f) {
+        const float tx = (1.0f - fabsf(py)) * (px >= 0.0f ? 1.0f : -1.0f);
+        const float ty = (1.0f - fabsf(px)) * (py >= 0.0f ? 1.0f : -1.0f);
+        px = tx;
+        py = ty;
+    }
+
+    const int16_t qx = static_cast<int16_t>(std::round(clamp(px, -1.0f, 1.0f) * 32767.0f));
+    const int16_t qy = static_cast<int16_t>(std::round(clamp(py, -1.0f, 1.0f) * 32767.0f));
+    return uint32_t(uint16_t(qx)) | (uint32_t(uint16_t(qy)) << 16);
+}
+
+/// Decodes a unit vector encoded with encode_octahedral().
+inline float3 decode_octahedral(uint32_t e) {
+    const float px = int16_t(e & 0xFFFF) / 32767.0f;
+    const float py = int16_t(e >> 16)    / 32767.0f;
+    float3 n(px, py, 1.0f - fabsf(px) - fabsf(py));
+    if (n.z < 0.0f) {
+        n.x = (1.0f - fabsf(py)) * (px >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(px)) * (py >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
+/// Shading data of a triangle, in object space, packed in one cache line so that computing an intersection only needs
+/// one memory access besides the instance. The triangles are indexed with the triangle id of the hits.
+struct ShadingTriangle {
+    /// Second barycentric coordinate of the points of the triangle: v = dot(p, v_plane.xyz) + v_plane.w.
+    /// The traversal only returns the first coordinate.
+    float4   v_plane;
+    float2   uv[3];
+    uint32_t normals[3];        ///< Vertex normals, see encode_octahedral()
+    uint32_t geom_normal;
+    int      material;
+    float    texel_density;     ///< Square root of the ratio between the area in texture space and in object space
+};
+
+static_assert(sizeof(ShadingTriangle) == 64, "The shading data of a triangle must fit in a cache line");
+
+/// Computes the shading data of a triangle.
+inline ShadingTriangle make_shading_triangle(const float3& v0, const float3& v1, const float3& v2,
+                                             const float2& t0, const float2& t1, const float2& t2,
+                                             const float3& n0, const float3& n1, const float3& n2,
+                                             const float3& geom_normal, int material) {
+    ShadingTriangle tri;
+
+    // The dual of the second edge is orthogonal to the first edge, within the plane of the triangle.
+    const float3 e1 = v1 - v0;
+    const float3 e2 = v2 - v0;
+    const float3 n  = cross(e1, e2);
+    float3 dual = cross(n, e1);
+    const float d = dot(dual, e2);
+    dual = d != 0.0f ? dual * (1.0f / d) : float3(0.0f);
+    tri.v_plane = float4(dual.x, dual.y, dual.z, -dot(dual, v0));
+
+    tri.uv[0] = t0;
+    tri.uv[1] = t1;
+    tri.uv[2] = t2;
+
+    tri.normals[0] = encode_octahedral(normalize(n0));
+    tri.normals[1] = encode_octahedral(normalize(n1));
+    tri.normals[2] = encode_octahedral(normalize(n2));
+    tri.geom_normal = encode_octahedral(normalize(geom_normal));
+    tri.material = material;
+
+    const float2 dt1 = t1 - t0;
+    const float2 dt2 = t2 - t0;
+    const float uv_area  = fabsf(dt1.x * dt2.y - dt1.y * dt2.x);
+    const float obj_area = length(n);
+    tri.texel_density = obj_area > 0.0f ? std::sqrt(uv_area / obj_area) : 0.0f;
+
+    return tri;
+}
+
+} // namespace imba
+
+#endif // IMBA_SHADING_TRIANGLE_H
@@ -3,52 +3,292 @@
 
 #include "imbatracer/core/image.h"
 
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 #include <memory>
 #include <vector>
 
 namespace imba {
 
+/// Format of the texels stored by a TextureSampler.
+enum class TexelFormat : int32_t {
+    R8,         ///< One 8-bit channel, replicated on the three color channels
+    RGBA8,      ///< Four 8-bit channels
+    RGBA32F     ///< Four floats, for images that cannot be represented with 8 bits per channel
+};
+
+namespace detail {
+
+/// Converts 8-bit values to floats in [0, 1], giving the same result as the image loaders.
+inline float unorm8_to_float(uint8_t v) {
+    struct Table {
+        float values[256];
+        Table() { for (int i = 0; i < 256; i++) values[i] = i / 255.0f; }
+    };
+    static const Table table;
+    return table.values[v];
+}
+
+/// Converts a float in [0, 1] to the nearest 8-bit value.
+inline uint8_t float_to_unorm8(float v) {
+    return static_cast<uint8_t>(std::round(clamp(v, 0.0f, 1.0f) * 255.0f));
+}
+
+struct TexelR8 {
+    static constexpr int size = 1;
+
+    static rgb fetch(const uint8_t* data, int i) {
+        const float v = unorm8_to_float(data[i]);
+        return rgb(v, v, v);
+    }
+
+    static void store(uint8_t* data, int i, const rgba& c) {
+        data[i] = float_to_unorm8(c.x);
+    }
+};
+
+struct TexelRGBA8 {
+    static constexpr int size = 4;
+
+    static rgb fetch(const uint8_t* data, int i) {
+        const uint8_t* t = data + i * 4;
+        return rgb(unorm8_to_float(t[0]), unorm8_to_float(t[1]), unorm8_to_float(t[2]));
+    }
+
+    static void store(uint8_t* data, int i, const rgba& c) {
+        uint8_t* t = data + i * 4;
+        t[0] = float_to_unorm8(c.x);
+        t[1] = float_to_unorm8(c.y);
+        t[2] = float_to_unorm8(c.z);
+        t[3] = float_to_unorm8(c.w);
+    }
+};
+
+struct TexelRGBA32F {
+    static constexpr int size = sizeof(rgba);
+
+    static rgb fetch(const uint8_t* data, int i) {
+        return rgb(reinterpret_cast<const rgba*>(data)[i]);
+    }
+
+    static void store(uint8_t* data, int i, const rgba& c) {
+        memcpy(data + i * sizeof(rgba), &c, sizeof(rgba));
+    }
+};
+
+} // namespace detail
+
+/// Mipmapped texture with trilinear filtering. The texels are stored in the most compact format that represents the
+/// top level exactly. Every level is stored in tiles of TILE_SIZE x TILE_SIZE texels, so that the four texels of a
+/// bilinear lookup are usually in the same cache line.
 class TextureSampler {
 public:
-    TextureSampler(Image&& img) : img_(std::move(img)) {}
+    static constexpr int TILE_SIZE = 4;
+
+    /// Creates a texture from an image, and computes its mip levels. Grayscale images only keep one channel.
+    TextureSampler(Image&& img)
+        : width_(img.width()), height_(img.height())
+    {
+        const int count = width_ * height_;
+        const rgba* pixels = img.pixels();
+
+        // The alpha channel is never sampled, so it does not affect the format.
+        bool unorm8 = true, gray = true;
+        for (int i = 0; i < count && unorm8; i++) {
+            unorm8 = is_unorm8(pixels[i].x) && is_unorm8(pixels[i].y) && is_unorm8(pixels[i].z);
+            gray &= pixels[i].x == pixels[i].y && pixels[i].x == pixels[i].z;
+        }
+
+        format_ = unorm8 ? (gray ? TexelFormat::R8 : TexelFormat::RGBA8) : TexelFormat::RGBA32F;
+        texels_.resize(compute_levels(format_, width_, height_, levels_));
+
+        switch (format_) {
+            case TexelFormat::R8:    build_levels<detail::TexelR8>(std::move(img));      break;
+            case TexelFormat::RGBA8: build_levels<detail::TexelRGBA8>(std::move(img));   break;
+            default:                 build_levels<detail::TexelRGBA32F>(std::move(img)); break;
+        }
+    }
+
+    /// Creates a texture from the texels of all its levels, as returned by texel_data().
+    /// The number of bytes must be texel_data_size(format, width, height).
+    TextureSampler(TexelFormat format, int width, int height, std::vector<uint8_t>&& texels)
+        : format_(format), width_(width), height_(height), texels_(std::move(texels))
+    {
+        compute_levels(format_, width_, height_, levels_);
+    }
 
     TextureSampler(const TextureSampler&) = delete;
     TextureSampler& operator=(const TextureSampler&) = delete;
 
-    inline rgb sample(float2 uv) const {
-        float u = clamp(uv.x - (int)uv.x, -1.0f, 1.0f);
-        float v = clamp(uv.y - (int)uv.y, -1.0f, 1.0f);
-        u += u < 0.0f ? 1.0f : 0.0f;
-        v += v < 0.0f ? 1.0f : 0.0f;
-        v = 1.0f - v;
+    /// Samples the texture at the top level, with bilinear filtering.
+    inline rgb sample(float2 uv) const { return sample(uv, 0.0f); }
 
-        const float kx = u * (img_.width()  - 1);
-        const float ky = v * (img_.height() - 1);
+    /// Samples the texture with trilinear filtering, given the width of the footprint of the lookup in texture space.
+    /// A width of one covers the whole texture, a width of zero samples the top level.
+    inline rgb sample(float2 uv, float footprint) const {
+        switch (format_) {
+            case TexelFormat::R8:    return sample<detail::TexelR8>(uv, footprint);
+            case TexelFormat::RGBA8: return sample<detail::TexelRGBA8>(uv, footprint);
+            default:                 return sample<detail::TexelRGBA32F>(uv, footprint);
+        }
+    }
+
+    /// Returns the color of a texel of the top level, without filtering.
+    rgb operator () (int x, int y) const {
+        switch (format_) {
+            case TexelFormat::R8:    return fetch<detail::TexelR8>(levels_[0], x, y);
+            case TexelFormat::RGBA8: return fetch<detail::TexelRGBA8>(levels_[0], x, y);
+            default:                 return fetch<detail::TexelRGBA32F>(levels_[0], x, y);
+        }
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int level_count() const { return levels_.size(); }
+
+    TexelFormat format() const { return format_; }
+    const std::vector<uint8_t>& texel_data() const { return texels_; }
+
+    /// Number of bytes allocated for the texels of all the levels.
+    size_t memory_bytes() const { return vector_bytes(texels_) + vector_bytes(levels_); }
+
+    /// Returns the number of bytes needed to store all the levels of a texture.
+    static size_t texel_data_size(TexelFormat format, int width, int height) {
+        std::vector<Level> levels;
+        return compute_levels(format, width, height, levels);
+    }
+
+private:
+    struct Level {
+        int width, height;
+        int tiles_x;
+        size_t offset;  ///< Offset of the first texel of the level in the texel array, in bytes
+    };
+
+    static bool is_unorm8(float v) {
+        return v >= 0.0f && v <= 1.0f && detail::float_to_unorm8(v) / 255.0f == v;
+    }
+
+    static int texel_size(TexelFormat format) {
+        switch (format) {
+            case TexelFormat::R8:    return detail::TexelR8::size;
+            case TexelFormat::RGBA8: return detail::TexelRGBA8::size;
+            default:                 return detail::TexelRGBA32F::size;
+        }
+    }
+
+    /// Computes the layout of the levels, down to a single texel, and returns the total size in bytes.
+    static size_t compute_levels(TexelFormat format, int width, int height, std::vector<Level>& levels) {
+        levels.clear();
+        size_t offset = 0;
+        while (true) {
+            Level level;
+            level.width   = width;
+            level.height  = height;
+            level.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+            level.offset  = offset;
+            levels.push_back(level);
+
+            const int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+            offset += size_t(level.tiles_x) * tiles_y * TILE_SIZE * TILE_SIZE * texel_size(format);
+
+            if (width <= 1 && height <= 1) break;
+            width  = std::max(width  / 2, 1);
+            height = std::max(height / 2, 1);
+        }
+        return offset;
+    }
+
+    static int texel_index(const Level& level, int x, int y) {
+        const int tile = (y / TILE_SIZE) * level.tiles_x + x / TILE_SIZE;
+        return tile * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+    }
+
+    template <typename Texel>
+    rgb fetch(const Level& level, int x, int y) const {
+        return Texel::fetch(texels_.data() + level.offset, texel_index(level, x, y));
+    }
+
+    /// Stores the levels of the image, each level being the 2x2 box-filtered version of the previous one.
+    /// The filtering is done on the original values, so that 8-bit levels are only rounded once.
+    template <typename Texel>
+    void build_levels(Image&& img) {
+        Image cur(std::move(img));
+        for (size_t l = 0; l < levels_.size(); l++) {
+            const Level& level = levels_[l];
+            uint8_t* data = texels_.data() + level.offset;
+            for (int y = 0; y < level.height; y++) {
+                for (int x = 0; x < level.width; x++)
+                    Texel::store(data, texel_index(level, x, y), cur(x, y));
+            }
+
+            if (l + 1 == levels_.size()) break;
+
+            const Level& next_level = levels_[l + 1];
+            Image next(next_level.width, next_level.height);
+            for (int y = 0; y < next_level.height; y++) {
+                const int y0 = std::min(2 * y, level.height - 1), y1 = std::min(2 * y + 1, level.height - 1);
+                for (int x = 0; x < next_level.width; x++) {
+                    const int x0 = std::min(2 * x, level.width - 1), x1 = std::min(2 * x + 1, level.width - 1);
+                    next(x, y) = (cur(x0, y0) + cur(x1, y0) + cur(x0, y1) + cur(x1, y1)) * 0.25f;
+                }
+            }
+            cur = std::move(next);
+        }
+    }
+
+    template <typename Texel>
+    rgb sample_level(const Level& level, float u, float v) const {
+        const float kx = u * (level.width  - 1);
+        const float ky = v * (level.height - 1);
 
         const int x0 = (int)kx;
         const int y0 = (int)ky;
 
-        const int x1 = (x0 + 1) % img_.width();
-        const int y1 = (y0 + 1) % img_.height();
+        const int x1 = (x0 + 1) % level.width;
+        const int y1 = (y0 + 1) % level.height;
 
         const float gx = kx - floorf(kx);
         const float gy = ky - floorf(ky);
         const float hx = 1.0f - gx;
         const float hy = 1.0f - gy;
 
-        const rgb i00 = rgb(img_(x0, y0));
-        const rgb i10 = rgb(img_(x1, y0));
-        const rgb i01 = rgb(img_(x0, y1));
-        const rgb i11 = rgb(img_(x1, y1));
+        const rgb i00 = fetch<Texel>(level, x0, y0);
+        const rgb i10 = fetch<Texel>(level, x1, y0);
+        const rgb i01 = fetch<Texel>(level, x0, y1);
+        const rgb i11 = fetch<Texel>(level, x1, y1);
 
         return hy * (hx * i00 + gx * i10) +
                gy * (hx * i01 + gx * i11);
     }
 
-    const Image& image() const { return img_; }
+    template <typename Texel>
+    rgb sample(float2 uv, float footprint) const {
+        float u = clamp(uv.x - (int)uv.x, -1.0f, 1.0f);
+        float v = clamp(uv.y - (int)uv.y, -1.0f, 1.0f);
+        u += u < 0.0f ? 1.0f : 0.0f;
+        v += v < 0.0f ? 1.0f : 0.0f;
+        v = 1.0f - v;
+
+        // The level is chosen so that the footprint covers about one texel.
+        const float texels = footprint * std::sqrt(float(width_) * float(height_));
+        const float lod = texels > 1.0f ? std::min(std::log2(texels), float(levels_.size() - 1)) : 0.0f;
 
-private:
-    Image img_;
+        const int l0 = (int)lod;
+        const float t = lod - l0;
+        const rgb c0 = sample_level<Texel>(levels_[l0], u, v);
+        if (t <= 0.0f) return c0;
+
+        const rgb c1 = sample_level<Texel>(levels_[l0 + 1], u, v);
+        return (1.0f - t) * c0 + t * c1;
+    }
+
+    TexelFormat format_;
+    int width_, height_;
+    std::vector<Level> levels_;
+    std::vector<uint8_t> texels_;
 };
 
 } // namespace imba
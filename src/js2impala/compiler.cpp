@@ -138,7 +138,8 @@ private:
 
     void compile_var(const js::Value& var, bool top_level = false) {
         if (expect_object(var)) {
-            write(top_level ? "static" : "let", " ");
+            // Local variables can be assigned later on, and are therefore mutable
+            write(top_level ? "static" : "let mut", " ");
 
             if (expect_member(var, "id"))
                 compile_id(var["id"]);
@@ -188,6 +189,8 @@ private:
                         compile_if(stmt);
                     else if (!strcmp(type.GetString(), "VariableDeclaration"))
                         compile_variable_decl(stmt);
+                    else if (!strcmp(type.GetString(), "ExpressionStatement"))
+                        compile_expr_stmt(stmt);
                     else
                         error("unsupported statement");
 
@@ -215,6 +218,12 @@ private:
         write("}");
     }
 
+    void compile_expr_stmt(const js::Value& stmt) {
+        if (expect_member(stmt, "expression"))
+            compile_expr(stmt["expression"]);
+        write(";");
+    }
+
     void compile_return(const js::Value& ret) {
         write("return(");
         if (expect_member(ret, "argument"))
@@ -249,6 +258,16 @@ private:
                     compile_call(expr);
                 else if (!strcmp(type.GetString(), "BinaryExpression"))
                     compile_binop(expr);
+                else if (!strcmp(type.GetString(), "LogicalExpression"))
+                    compile_logical(expr);
+                else if (!strcmp(type.GetString(), "UnaryExpression"))
+                    compile_unop(expr);
+                else if (!strcmp(type.GetString(), "MemberExpression"))
+                    compile_member(expr);
+                else if (!strcmp(type.GetString(), "AssignmentExpression"))
+                    compile_assign(expr);
+                else if (!strcmp(type.GetString(), "ConditionalExpression"))
+                    compile_conditional(expr);
                 else if (!strcmp(type.GetString(), "NewExpression"))
                     compile_new(expr);
                 else
@@ -280,20 +299,7 @@ private:
                 if (expect_member(binop, "right")) compile_expr(binop["right"]);
             } else {
                 // For other types, we need to create function calls
-                std::string prefix;
-                if (expect_member(extra, "kind")) {
-                    const js::Value& kind = extra["kind"];
-                    if (expect_string(kind)) {
-                        if (!strcmp(kind.GetString(), "float2"))
-                            prefix = "vec2";
-                        else if (!strcmp(kind.GetString(), "float3"))
-                            prefix = "vec3";
-                        else if (!strcmp(kind.GetString(), "float4"))
-                            prefix = "vec4";
-                        else
-                            error("unsupported kind for binop");
-                    }
-                }
+                const std::string prefix = vector_prefix(extra);
 
                 std::string suffix;
                 if (expect_member(binop, "operator")) {
@@ -321,6 +327,92 @@ private:
         }
     }
 
+    void compile_logical(const js::Value& logical) {
+        // Both operands are booleans, the expression can be translated as-is
+        write("(");
+        if (expect_member(logical, "left")) compile_expr(logical["left"]);
+        if (expect_member(logical, "operator")) {
+            const js::Value& op = logical["operator"];
+            if (expect_string(op)) write(" ", op.GetString(), " ");
+        }
+        if (expect_member(logical, "right")) compile_expr(logical["right"]);
+        write(")");
+    }
+
+    void compile_unop(const js::Value& unop) {
+        if (expect_object(unop) &&
+            expect_member(unop, "operator") &&
+            expect_member(unop, "argument")) {
+            const js::Value& op = unop["operator"];
+            if (!expect_string(op)) return;
+
+            if (strcmp(op.GetString(), "-") && strcmp(op.GetString(), "!")) {
+                error("unsupported operator for unop");
+                return;
+            }
+
+            const js::Value& arg = unop["argument"];
+            if (!strcmp(op.GetString(), "-") && unop.HasMember("extra") && !is_builtin_type(unop["extra"])) {
+                // Vectors are negated with a function call, like the binary operators
+                const std::string prefix = vector_prefix(unop["extra"]);
+                write(prefix, " neg(");
+                compile_expr(arg);
+                write(")");
+            } else {
+                write(op.GetString(), "(");
+                compile_expr(arg);
+                write(")");
+            }
+        }
+    }
+
+    void compile_member(const js::Value& member) {
+        if (expect_member(member, "object") && expect_member(member, "property")) {
+            if (member.HasMember("computed") && member["computed"].IsBool() && member["computed"].GetBool()) {
+                compile_expr(member["object"]);
+                write("(");
+                compile_expr(member["property"]);
+                write(")");
+            } else {
+                compile_expr(member["object"]);
+                write(".");
+                compile_id(member["property"]);
+            }
+        }
+    }
+
+    void compile_assign(const js::Value& assign) {
+        if (expect_member(assign, "left") &&
+            expect_member(assign, "operator") &&
+            expect_member(assign, "right")) {
+            const js::Value& op = assign["operator"];
+            if (!expect_string(op)) return;
+
+            if (strcmp(op.GetString(), "=")) {
+                error("unsupported operator for assignment");
+                return;
+            }
+
+            compile_expr(assign["left"]);
+            write(" = ");
+            compile_expr(assign["right"]);
+        }
+    }
+
+    void compile_conditional(const js::Value& cond) {
+        if (expect_member(cond, "test") &&
+            expect_member(cond, "consequent") &&
+            expect_member(cond, "alternate")) {
+            write("if ");
+            compile_expr(cond["test"]);
+            write(" { ");
+            compile_expr(cond["consequent"]);
+            write(" } else { ");
+            compile_expr(cond["alternate"]);
+            write(" }");
+        }
+    }
+
     void compile_literal(const js::Value& lit) {
         if (expect_member(lit, "value") && expect_member(lit, "extra")) {
             const js::Value& value = lit["value"];
@@ -392,6 +484,24 @@ private:
         }
     }
 
+    /// Returns the prefix of the functions that implement the operators on the given vector type.
+    std::string vector_prefix(const js::Value& extra) {
+        if (expect_member(extra, "kind")) {
+            const js::Value& kind = extra["kind"];
+            if (expect_string(kind)) {
+                if (!strcmp(kind.GetString(), "float2"))
+                    return "vec2";
+                else if (!strcmp(kind.GetString(), "float3"))
+                    return "vec3";
+                else if (!strcmp(kind.GetString(), "float4"))
+                    return "vec4";
+                else
+                    error("unsupported kind for operator");
+            }
+        }
+        return std::string();
+    }
+
     bool is_builtin_type(const js::Value& extra) {
         if (expect_object_member(extra, "type")) {
             const js::Value& type = extra["type"];